@@ -36,6 +36,34 @@
 #include <atomic>
 #include <mutex>
 
+#if defined(ASHARED_PTR_LOCK_STATS)
+#include <chrono>
+
+// Global stats of the internal mutex of all `ashared_ptr` instances.
+struct ashared_ptr_lock_stats {
+    // Number of lock acquisitions.
+    static std::atomic<uint64_t>& numLocks() {
+        static std::atomic<uint64_t> val(0);
+        return val;
+    }
+    // Number of acquisitions that had to wait for other threads.
+    static std::atomic<uint64_t>& numContended() {
+        static std::atomic<uint64_t> val(0);
+        return val;
+    }
+    // Total time spent waiting for the mutex, in nanoseconds.
+    static std::atomic<uint64_t>& waitNs() {
+        static std::atomic<uint64_t> val(0);
+        return val;
+    }
+    static void reset() {
+        numLocks() = 0;
+        numContended() = 0;
+        waitNs() = 0;
+    }
+};
+#endif
+
 template<typename T>
 class ashared_ptr {
 public:
@@ -52,7 +80,7 @@ public:
     }
 
     void reset() {
-        std::lock_guard<std::mutex> l(lock);
+        LockGuard l(lock);
         PtrWrapper<T>* ptr = object.load(MO);
         // Unlink pointer first, destroy object next.
         object.store(nullptr, MO);
@@ -72,7 +100,7 @@ public:
     }
 
     void operator=(const ashared_ptr<T>& src) {
-        std::lock_guard<std::mutex> l(lock);
+        LockGuard l(lock);
 
         ashared_ptr<T>& writable_src = const_cast<ashared_ptr<T>&>(src);
         PtrWrapper<T>* src_object = writable_src.shareCurObject();
@@ -89,6 +117,13 @@ public:
     T& operator*() const { return *object.load(MO)->ptr.load(MO); }
     T* get() const { return object.load(MO)->ptr.load(MO); }
 
+    // Number of `ashared_ptr` instances sharing the current object.
+    uint64_t use_count() const {
+        LockGuard l(lock);
+        PtrWrapper<T>* ptr = object.load(MO);
+        return (ptr) ? ptr->refCount.load(MO) : 0;
+    }
+
     inline bool compare_exchange_strong(ashared_ptr<T>& expected,
                                         ashared_ptr<T> src,
                                         std::memory_order order)
@@ -111,7 +146,7 @@ public:
         PtrWrapper<T>* val_ptr = src.shareCurObject();
 
         { // Lock for `object`
-            std::lock_guard<std::mutex> l(lock);
+            LockGuard l(lock);
             if (object.compare_exchange_weak(expected_ptr, val_ptr)) {
                 // Succeeded.
                 // Release old object.
@@ -127,6 +162,28 @@ public:
     }
 
 private:
+#if defined(ASHARED_PTR_LOCK_STATS)
+    // Same as `std::lock_guard`, but measures the waiting time.
+    struct LockGuard {
+        LockGuard(std::mutex& _m) : m(_m) {
+            ashared_ptr_lock_stats::numLocks().fetch_add(1, MO);
+            if (m.try_lock()) return;
+
+            auto start = std::chrono::steady_clock::now();
+            m.lock();
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            ashared_ptr_lock_stats::numContended().fetch_add(1, MO);
+            ashared_ptr_lock_stats::waitNs().fetch_add
+                ( std::chrono::duration_cast<std::chrono::nanoseconds>
+                      (elapsed).count(), MO );
+        }
+        ~LockGuard() { m.unlock(); }
+        std::mutex& m;
+    };
+#else
+    using LockGuard = std::lock_guard<std::mutex>;
+#endif
+
     template<typename T2>
     struct PtrWrapper {
         PtrWrapper() : ptr(nullptr), refCount(0) {}
@@ -138,7 +195,7 @@ private:
 
     // Atomically increase ref count and then return.
     PtrWrapper<T>* shareCurObject() {
-        std::lock_guard<std::mutex> l(lock);
+        LockGuard l(lock);
         if (!object.load(MO)) return nullptr;
 
         // Now no one can change `object`.
@@ -161,5 +218,5 @@ private:
     const static std::memory_order MO = std::memory_order_relaxed;
 
     std::atomic<PtrWrapper<T>*> object;
-    std::mutex lock;
+    mutable std::mutex lock;
 };
@@ -0,0 +1,484 @@
+/**
+ * Copyright (C) 2017-present Jung-Sang Ahn <jungsang.ahn@gmail.com>
+ * All rights reserved.
+ *
+ * https://github.com/greensky00
+ *
+ * Compact Histogram
+ * Version: 0.1.0
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+
+/**
+ * Memory-efficient version of `Histogram`, for a large number of stats.
+ *
+ * It has the same power-of-two bins as `Histogram` and gives the same
+ * estimates, but only keeps the bins actually used:
+ *
+ *   * Sparse: up to `NUM_SLOTS` bins, each packed into a 64-bit slot
+ *     (bin index and count), embedded in the object. Cold stats stay here.
+ *   * Window: 32-bit counters for a contiguous range of bins, allocated
+ *     once the sparse slots are full. It grows on demand, by publishing a
+ *     wider window; the previous ones are kept, as other threads may still
+ *     be updating them, and their counts are added up on read.
+ *   * Wide: 64-bit counters for all bins, allocated once a 32-bit counter
+ *     reaches `NARROW_LIMIT`. The counter then moves `NARROW_LIMIT` to it.
+ *
+ * Recording is lock-free, and O(1) once the window covers the latency
+ * range of the stat. Like `Histogram`, copy and merge are not supposed to
+ * run concurrently with `add` on the destination.
+ */
+class CompactHistogram {
+public:
+    // Same as `Histogram`.
+    static const size_t MAX_BINS = 65;
+
+    /**
+     * Iterates the bins, merged once when the iterator is created
+     * by `begin()`, as reading a bin has to visit all representations.
+     */
+    class Iterator {
+    public:
+        Iterator() : idx(MAX_BINS), bins() {}
+
+        Iterator& operator++() {
+            if (idx < MAX_BINS) idx++;
+            return *this;
+        }
+
+        Iterator& operator*() { return *this; }
+
+        bool operator==(const Iterator& val) const { return idx == val.idx; }
+        bool operator!=(const Iterator& val) const { return idx != val.idx; }
+
+        size_t getIdx() const { return idx; }
+
+        uint64_t getCount() const { return (idx < MAX_BINS) ? bins[idx] : 0; }
+
+        // Same bounds as `HistItr`.
+        uint64_t getLowerBound() const {
+            size_t idx_rev = MAX_BINS - idx - 1;
+            return (idx_rev) ? ( (uint64_t)1 << (idx_rev - 1) ) : 0;
+        }
+
+        uint64_t getUpperBound() const {
+            if (!idx) return std::numeric_limits<uint64_t>::max();
+            return (uint64_t)1 << (MAX_BINS - idx - 1);
+        }
+
+    private:
+        friend class CompactHistogram;
+
+        size_t idx;
+        uint64_t bins[MAX_BINS];
+    };
+
+    using iterator = Iterator;
+
+    // Number of sparse slots.
+    static const size_t NUM_SLOTS = 4;
+    // A 32-bit counter moves its count to the 64-bit one at this value.
+    static const uint32_t NARROW_LIMIT = (uint32_t)1 << 31;
+
+    CompactHistogram()
+        : window(nullptr)
+        , wide(nullptr)
+        , count(0)
+        , sum(0)
+        , max(0)
+    {
+        for (size_t ii = 0; ii < NUM_SLOTS; ++ii) slots[ii] = 0;
+    }
+
+    CompactHistogram(const CompactHistogram& src)
+        : CompactHistogram()
+    {
+        *this = src;
+    }
+
+    ~CompactHistogram() {
+        clearBins();
+    }
+
+    // this = src
+    CompactHistogram& operator=(const CompactHistogram& src) {
+        if (this == &src) return *this;
+        uint64_t bins[MAX_BINS];
+        src.getBins(bins);
+        clearBins();
+        count = src.getTotal();
+        sum = src.getSum();
+        max = src.getMax();
+        // Re-packed into the smallest form, regardless of `src`'s history.
+        addBins(bins);
+        return *this;
+    }
+
+    // this += rhs
+    CompactHistogram& operator+=(const CompactHistogram& rhs) {
+        uint64_t bins[MAX_BINS];
+        rhs.getBins(bins);
+        count += rhs.getTotal();
+        sum += rhs.getSum();
+        if (max < rhs.getMax()) {
+            max = rhs.getMax();
+        }
+        addBins(bins);
+        return *this;
+    }
+
+    // returning lhs + rhs
+    friend CompactHistogram operator+(CompactHistogram lhs,
+                                      const CompactHistogram& rhs) {
+        lhs += rhs;
+        return lhs;
+    }
+
+    void add(uint64_t val) {
+        addToBin(getBinIdx(val), 1);
+        count.fetch_add(1, MO);
+        sum.fetch_add(val, MO);
+
+        size_t num_trial = 0;
+        while (num_trial++ < MAX_TRIAL && max.load(MO) < val) {
+            // 'max' may not be updated properly under race condition.
+            max.store(val, MO);
+        }
+    }
+
+    // Only for the histograms updated by a single thread. Bins still use
+    // atomic adds, as they are shared with the window growth logic.
+    void addNonAtomic(uint64_t val) {
+        addToBin(getBinIdx(val), 1);
+        count.store(count.load(MO) + 1, MO);
+        sum.store(sum.load(MO) + val, MO);
+        if (max.load(MO) < val) max.store(val, MO);
+    }
+
+    // Add `num` values at once, binned locally first.
+    void addBatch(const uint64_t* vals, size_t num) {
+        if (!num) return;
+        uint64_t local[MAX_BINS] = {0};
+        uint64_t local_sum = 0;
+        uint64_t local_max = 0;
+        for (size_t ii = 0; ii < num; ++ii) {
+            uint64_t val = vals[ii];
+            local[getBinIdx(val)]++;
+            local_sum += val;
+            if (local_max < val) local_max = val;
+        }
+        addBins(local);
+        count.fetch_add(num, MO);
+        sum.fetch_add(local_sum, MO);
+
+        size_t num_trial = 0;
+        while (num_trial++ < MAX_TRIAL && max.load(MO) < local_max) {
+            max.store(local_max, MO);
+        }
+    }
+
+    uint64_t getTotal() const { return count; }
+    uint64_t getSum() const { return sum; }
+    uint64_t getAverage() const { return ( (count) ? (sum / count) : 0 ); }
+    uint64_t getMax() const { return max; }
+
+    // Memory consumed by this histogram, in bytes.
+    size_t getMemoryUsage() const {
+        size_t ret = sizeof(*this);
+        for (Window* w = window.load(MO_ACQ); w; w = w->prev) {
+            ret += sizeof(Window) + w->width * sizeof(std::atomic<uint32_t>);
+        }
+        if (wide.load(MO_ACQ)) {
+            ret += MAX_BINS * sizeof(std::atomic<uint64_t>);
+        }
+        return ret;
+    }
+
+    // True if no window has been allocated yet.
+    bool isSparse() const { return !window.load(MO_ACQ); }
+
+    // Range of bins covered by the current window, [first, last).
+    size_t getWindowBegin() const {
+        Window* w = window.load(MO_ACQ);
+        return (w) ? w->lo : 0;
+    }
+    size_t getWindowEnd() const {
+        Window* w = window.load(MO_ACQ);
+        return (w) ? w->lo + w->width : 0;
+    }
+
+    // True if 64-bit counters have been allocated.
+    bool hasWideBins() const { return wide.load(MO_ACQ) != nullptr; }
+
+    // Same as `Histogram::estimate()`.
+    uint64_t estimate(double percentile) const {
+        uint64_t bins[MAX_BINS];
+        getBins(bins);
+        return estimateBins(bins, percentile);
+    }
+
+    // Estimate `num` percentiles at once, merging the bins only once.
+    void estimate(const double* percentiles, uint64_t* dst, size_t num) const {
+        uint64_t bins[MAX_BINS];
+        getBins(bins);
+        for (size_t ii = 0; ii < num; ++ii) {
+            dst[ii] = estimateBins(bins, percentiles[ii]);
+        }
+    }
+
+    iterator begin() const {
+        Iterator ret;
+        getBins(ret.bins);
+        ret.idx = 0;
+        while (ret.idx < MAX_BINS && !ret.bins[ret.idx]) ret.idx++;
+        return ret;
+    }
+
+    iterator end() const { return Iterator(); }
+
+private:
+    struct Window {
+        Window(size_t _lo, size_t _width, Window* _prev)
+            : lo(_lo), width(_width), prev(_prev)
+            , bins(new std::atomic<uint32_t>[_width])
+        {
+            for (size_t ii = 0; ii < width; ++ii) bins[ii] = 0;
+        }
+        ~Window() { delete[] bins; }
+
+        bool covers(size_t idx) const { return idx >= lo && idx < lo + width; }
+
+        size_t lo;
+        size_t width;
+        // Previous (narrower) window, still counted.
+        Window* prev;
+        std::atomic<uint32_t>* bins;
+    };
+
+    static const size_t MAX_TRIAL = 3;
+    // Extra bins added on both sides when a window is created or grown,
+    // so that the window rarely grows again.
+    static const size_t WINDOW_SLACK = 2;
+    // Counts of at least this much (from batch or merge) go directly to
+    // the 64-bit counters, so that the 32-bit ones cannot wrap around.
+    static const uint64_t DIRECT_WIDE_COUNT = (uint64_t)1 << 24;
+    // Slot layout: (bin index + 1) in the top 8 bits, and the count.
+    static const size_t SLOT_IDX_SHIFT = 56;
+    static const uint64_t SLOT_COUNT_MASK = ((uint64_t)1 << SLOT_IDX_SHIFT) - 1;
+    static const std::memory_order MO = std::memory_order_relaxed;
+    static const std::memory_order MO_ACQ = std::memory_order_acquire;
+
+    static size_t getBinIdx(uint64_t val) {
+        // Same as `Histogram`: the number of leading zeros, 64 for 0.
+        if (!val) return MAX_BINS - 1;
+#if defined(__GNUC__)
+        return __builtin_clzll(val);
+#else
+        size_t ret = 0;
+        while ( !(val & ((uint64_t)1 << 63)) ) {
+            val <<= 1;
+            ret++;
+        }
+        return ret;
+#endif
+    }
+
+    void addToBin(size_t idx, uint64_t n) {
+        if (n >= DIRECT_WIDE_COUNT) {
+            getWide()[idx].fetch_add(n, MO);
+            return;
+        }
+
+        // Hot path: the window covers it.
+        Window* w = window.load(MO_ACQ);
+        if (w && w->covers(idx)) {
+            addToNarrow(w->bins[idx - w->lo], idx, n);
+            return;
+        }
+
+        // Sparse slots, until the window is created. After that, existing
+        // slots are still updated, but no new slot is taken.
+        uint64_t tag = (uint64_t)(idx + 1) << SLOT_IDX_SHIFT;
+        for (size_t ii = 0; ii < NUM_SLOTS; ++ii) {
+            uint64_t slot = slots[ii].load(MO);
+            while (!slot && !w) {
+                if (slots[ii].compare_exchange_weak(slot, tag | n)) return;
+                // `slot` is updated, check it again.
+            }
+            if ((slot & ~SLOT_COUNT_MASK) == tag) {
+                slots[ii].fetch_add(n, MO);
+                return;
+            }
+        }
+
+        w = growWindow(idx);
+        addToNarrow(w->bins[idx - w->lo], idx, n);
+    }
+
+    void addToNarrow(std::atomic<uint32_t>& bin, size_t idx, uint64_t n) {
+        uint32_t prev = bin.fetch_add((uint32_t)n, MO);
+        if (prev < NARROW_LIMIT && prev + n >= NARROW_LIMIT) {
+            // Only the thread crossing the limit moves it. The counter has
+            // another 2^31 of headroom until then.
+            bin.fetch_sub(NARROW_LIMIT, MO);
+            getWide()[idx].fetch_add(NARROW_LIMIT, MO);
+        }
+    }
+
+    // Publish a window covering both the current one and `idx`.
+    Window* growWindow(size_t idx) {
+        Window* cur = window.load(MO_ACQ);
+        while (true) {
+            if (cur && cur->covers(idx)) return cur;
+
+            size_t lo = idx, hi = idx + 1;
+            if (cur) {
+                if (lo > cur->lo) lo = cur->lo;
+                if (hi < cur->lo + cur->width) hi = cur->lo + cur->width;
+            } else {
+                // Include the bins in the sparse slots.
+                for (size_t ii = 0; ii < NUM_SLOTS; ++ii) {
+                    uint64_t slot = slots[ii].load(MO);
+                    if (!slot) continue;
+                    size_t s_idx = (slot >> SLOT_IDX_SHIFT) - 1;
+                    if (lo > s_idx) lo = s_idx;
+                    if (hi < s_idx + 1) hi = s_idx + 1;
+                }
+            }
+            lo = (lo > WINDOW_SLACK) ? lo - WINDOW_SLACK : 0;
+            hi = (hi + WINDOW_SLACK < MAX_BINS) ? hi + WINDOW_SLACK : MAX_BINS;
+
+            Window* new_w = new Window(lo, hi - lo, cur);
+            if (window.compare_exchange_strong(cur, new_w,
+                                               std::memory_order_acq_rel)) {
+                return new_w;
+            }
+            // Other thread published one, `cur` is updated.
+            new_w->prev = nullptr;
+            delete new_w;
+        }
+    }
+
+    std::atomic<uint64_t>* getWide() {
+        std::atomic<uint64_t>* cur = wide.load(MO_ACQ);
+        if (cur) return cur;
+
+        std::atomic<uint64_t>* new_wide = new std::atomic<uint64_t>[MAX_BINS];
+        for (size_t ii = 0; ii < MAX_BINS; ++ii) new_wide[ii] = 0;
+        if (wide.compare_exchange_strong(cur, new_wide,
+                                         std::memory_order_acq_rel)) {
+            return new_wide;
+        }
+        // Other thread allocated it at the same time, `cur` is updated.
+        delete[] new_wide;
+        return cur;
+    }
+
+    void addBins(const uint64_t* bins) {
+        for (size_t ii = 0; ii < MAX_BINS; ++ii) {
+            if (bins[ii]) addToBin(ii, bins[ii]);
+        }
+    }
+
+    // Sum of all representations, for each bin.
+    void getBins(uint64_t* dst) const {
+        std::atomic<uint64_t>* w64 = wide.load(MO_ACQ);
+        for (size_t ii = 0; ii < MAX_BINS; ++ii) {
+            dst[ii] = (w64) ? w64[ii].load(MO) : 0;
+        }
+        for (size_t ii = 0; ii < NUM_SLOTS; ++ii) {
+            uint64_t slot = slots[ii].load(MO);
+            if (!slot) continue;
+            dst[(slot >> SLOT_IDX_SHIFT) - 1] += slot & SLOT_COUNT_MASK;
+        }
+        for (Window* w = window.load(MO_ACQ); w; w = w->prev) {
+            for (size_t ii = 0; ii < w->width; ++ii) {
+                dst[w->lo + ii] += w->bins[ii].load(MO);
+            }
+        }
+    }
+
+    // Same as `Histogram::estimate()`, on the bins given by `getBins()`.
+    uint64_t estimateBins(const uint64_t* bins, double percentile) const {
+        if (percentile <= 0 || percentile >= 100) {
+            return 0;
+        }
+
+        double rev = 100 - percentile;
+        uint64_t total = getTotal();
+        uint64_t threshold = (uint64_t)( (double)total * rev / 100.0 );
+        uint64_t cur_max = getMax();
+
+        if (!threshold) {
+            // No samples between the given percentile and the max number.
+            return cur_max;
+        }
+
+        uint64_t acc = 0;
+        for (size_t ii = 0; ii < MAX_BINS; ++ii) {
+            uint64_t n_entries = bins[ii];
+            acc += n_entries;
+            if (acc < threshold) continue;
+
+            uint64_t gap = acc - threshold;
+            // Same as `Iterator::getUpperBound()`.
+            uint64_t u_bound = (ii) ? (uint64_t)1 << (MAX_BINS - ii - 1)
+                                    : std::numeric_limits<uint64_t>::max();
+            double base = 2.0;
+            if (cur_max < u_bound) {
+                base = (double)cur_max / (u_bound / 2.0);
+            }
+            return (uint64_t)
+                   ( std::pow(base, (double)gap / n_entries) * u_bound / 2 );
+        }
+        return 0;
+    }
+
+    void clearBins() {
+        Window* w = window.exchange(nullptr);
+        while (w) {
+            Window* prev = w->prev;
+            delete w;
+            w = prev;
+        }
+        delete[] wide.exchange(nullptr);
+        for (size_t ii = 0; ii < NUM_SLOTS; ++ii) slots[ii] = 0;
+    }
+
+    std::atomic<uint64_t> slots[NUM_SLOTS];
+    std::atomic<Window*> window;
+    std::atomic<std::atomic<uint64_t>*> wide;
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+};
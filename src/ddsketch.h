@@ -0,0 +1,339 @@
+/**
+ * Copyright (C) 2017-present Jung-Sang Ahn <jungsang.ahn@gmail.com>
+ * All rights reserved.
+ *
+ * https://github.com/greensky00
+ *
+ * DDSketch (relative-error quantile sketch)
+ * Version: 0.1.0
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cmath>
+#include <limits>
+
+/**
+ * Log-indexed histogram whose quantile estimates have a bounded
+ * relative error `alpha` (DDSketch, Masson et al., VLDB 2019).
+ *
+ * Bin `i` (>= 1) covers (gamma^(i-2), gamma^(i-1)], where
+ * gamma = (1 + alpha) / (1 - alpha). Value 0 has its own bin, `0`.
+ * Bins are grouped into pages which are allocated on the first sample,
+ * so that only the range actually used consumes memory.
+ *
+ * Since the bin boundaries depend only on `alpha`, two sketches with the
+ * same `ALPHA_BP` are merged exactly by adding their bins.
+ *
+ * It provides the same interface as `Histogram`, so that it can be used
+ * as `Hist` of a collector policy.
+ *
+ * @tparam ALPHA_BP Relative accuracy in basis points (1/100 of a percent),
+ *                  e.g., 100 means 1%.
+ */
+template<uint32_t ALPHA_BP = 100>
+class DDSketchT {
+public:
+    class Iterator {
+    public:
+        Iterator() : idx(0), owner(nullptr) {}
+        Iterator(size_t _idx, const DDSketchT* _owner)
+            : idx(_idx), owner(_owner) { skipEmptyPage(); }
+
+        Iterator& operator++() {
+            idx++;
+            skipEmptyPage();
+            return *this;
+        }
+
+        Iterator& operator*() { return *this; }
+
+        bool operator==(const Iterator& val) const { return idx == val.idx; }
+        bool operator!=(const Iterator& val) const { return idx != val.idx; }
+
+        size_t getIdx() const { return idx; }
+
+        uint64_t getCount() const { return owner->getBinCount(idx); }
+
+        uint64_t getLowerBound() const {
+            if (idx == 0) return 0;
+            return (uint64_t)std::floor( owner->binBound(idx - 1) );
+        }
+
+        uint64_t getUpperBound() const {
+            if (idx == 0) return 0;
+            return (uint64_t)std::floor( owner->binBound(idx) );
+        }
+
+    private:
+        // Jump over the pages not allocated yet.
+        void skipEmptyPage() {
+            if (!owner) return;
+            while (idx < owner->numBins &&
+                   !owner->pages[idx / PAGE_SIZE].load(MO_ACQ)) {
+                idx = (idx / PAGE_SIZE + 1) * PAGE_SIZE;
+            }
+            if (idx > owner->numBins) idx = owner->numBins;
+        }
+
+        size_t idx;
+        const DDSketchT* owner;
+    };
+
+    using iterator = Iterator;
+
+    // Relative accuracy.
+    static constexpr double ALPHA = ALPHA_BP / 10000.0;
+
+    DDSketchT()
+        : count(0)
+        , sum(0)
+        , max(0)
+    {
+        init();
+    }
+
+    DDSketchT(const DDSketchT& src)
+        : count(0)
+        , sum(0)
+        , max(0)
+    {
+        init();
+        *this = src;
+    }
+
+    ~DDSketchT() {
+        freePages();
+        delete[] pages;
+    }
+
+    // this = src
+    DDSketchT& operator=(const DDSketchT& src) {
+        if (this == &src) return *this;
+        freePages();
+        count = src.getTotal();
+        sum = src.getSum();
+        max = src.getMax();
+        mergeBins(src);
+        return *this;
+    }
+
+    // this += rhs
+    DDSketchT& operator+=(const DDSketchT& rhs) {
+        count += rhs.getTotal();
+        sum += rhs.getSum();
+        if (max < rhs.getMax()) {
+            max = rhs.getMax();
+        }
+        mergeBins(rhs);
+        return *this;
+    }
+
+    // returning lhs + rhs
+    friend DDSketchT operator+(DDSketchT lhs, const DDSketchT& rhs) {
+        lhs += rhs;
+        return lhs;
+    }
+
+    void add(uint64_t val) {
+        size_t idx = getIdx(val);
+        getPage(idx)[idx % PAGE_SIZE].fetch_add(1, MO);
+        count.fetch_add(1, MO);
+        sum.fetch_add(val, MO);
+
+        size_t num_trial = 0;
+        while (num_trial++ < MAX_TRIAL && max.load(MO) < val) {
+            // 'max' may not be updated properly under race condition.
+            max.store(val, MO);
+        }
+    }
+
+    // Same as `add`, but using plain loads and stores instead of atomic
+    // read-modify-write. Only for the sketches updated by a single thread.
+    void addNonAtomic(uint64_t val) {
+        size_t idx = getIdx(val);
+        std::atomic<uint64_t>& bin = getPage(idx)[idx % PAGE_SIZE];
+        bin.store(bin.load(MO) + 1, MO);
+        count.store(count.load(MO) + 1, MO);
+        sum.store(sum.load(MO) + val, MO);
+        if (max.load(MO) < val) max.store(val, MO);
+    }
+
+    // Add `num` values at once: binned into a local sketch first,
+    // and then merged with a single atomic add for each non-empty bin.
+    void addBatch(const uint64_t* vals, size_t num) {
+        if (!num) return;
+        DDSketchT local;
+        for (size_t ii = 0; ii < num; ++ii) local.addNonAtomic(vals[ii]);
+        *this += local;
+    }
+
+    uint64_t getTotal() const { return count; }
+    uint64_t getSum() const { return sum; }
+    uint64_t getAverage() const { return ( (count) ? (sum / count) : 0 ); }
+    uint64_t getMax() const { return max; }
+
+    // Memory consumed by this sketch, in bytes.
+    size_t getMemoryUsage() const {
+        size_t ret = sizeof(*this) + numPages * sizeof(pages[0]);
+        for (size_t ii = 0; ii < numPages; ++ii) {
+            if (pages[ii].load(MO_ACQ)) {
+                ret += PAGE_SIZE * sizeof(std::atomic<uint64_t>);
+            }
+        }
+        return ret;
+    }
+
+    /**
+     * Estimate the value at the given percentile, within the relative
+     * error `ALPHA` of the actual sample at that rank.
+     *
+     * @param percentile Percentile in (0, 100).
+     * @return Estimated value, or 0 if `percentile` is out of range.
+     */
+    uint64_t estimate(double percentile) const {
+        if (percentile <= 0 || percentile >= 100) {
+            return 0;
+        }
+
+        uint64_t total = getTotal();
+        if (!total) return 0;
+
+        // 0-based rank of the target sample.
+        uint64_t rank = (uint64_t)( (double)(total - 1) * percentile / 100.0 );
+        uint64_t cum = 0;
+        for (size_t ii = 0; ii < numPages; ++ii) {
+            std::atomic<uint64_t>* page = pages[ii].load(MO_ACQ);
+            if (!page) continue;
+            for (size_t jj = 0; jj < PAGE_SIZE; ++jj) {
+                cum += page[jj].load(MO);
+                if (cum <= rank) continue;
+
+                size_t idx = ii * PAGE_SIZE + jj;
+                if (idx == 0) return 0;
+                // Mid-point in terms of the relative error.
+                double val = 2.0 * binBound(idx) / (gamma + 1.0);
+                uint64_t ret = (uint64_t)std::llround(val);
+                uint64_t cur_max = getMax();
+                return (ret > cur_max) ? cur_max : ret;
+            }
+        }
+        return getMax();
+    }
+
+    // Estimate `num` percentiles at once.
+    void estimate(const double* percentiles, uint64_t* dst, size_t num) const {
+        for (size_t ii = 0; ii < num; ++ii) dst[ii] = estimate(percentiles[ii]);
+    }
+
+    iterator begin() const { return Iterator(0, this); }
+    iterator end() const { return Iterator(numBins, this); }
+
+private:
+    // Number of bins per page.
+    static const size_t PAGE_SIZE = 128;
+    static const size_t MAX_TRIAL = 3;
+    static const std::memory_order MO = std::memory_order_relaxed;
+    static const std::memory_order MO_ACQ = std::memory_order_acquire;
+
+    void init() {
+        gamma = (1.0 + ALPHA) / (1.0 - ALPHA);
+        invLogGamma = 1.0 / std::log(gamma);
+        // Zero bin + bins covering [1, 2^64).
+        numBins = 1 + (size_t)std::ceil(64 * std::log(2.0) * invLogGamma) + 1;
+        numPages = (numBins + PAGE_SIZE - 1) / PAGE_SIZE;
+        pages = new std::atomic<std::atomic<uint64_t>*>[numPages];
+        for (size_t ii = 0; ii < numPages; ++ii) pages[ii] = nullptr;
+    }
+
+    void freePages() {
+        for (size_t ii = 0; ii < numPages; ++ii) {
+            delete[] pages[ii].exchange(nullptr);
+        }
+    }
+
+    size_t getIdx(uint64_t val) const {
+        if (!val) return 0;
+        size_t idx = 1 + (size_t)std::ceil( std::log((double)val) *
+                                            invLogGamma );
+        return (idx < numBins) ? idx : numBins - 1;
+    }
+
+    // Upper bound of the bin `idx` (>= 1).
+    double binBound(size_t idx) const {
+        return std::pow(gamma, (double)(idx - 1));
+    }
+
+    uint64_t getBinCount(size_t idx) const {
+        std::atomic<uint64_t>* page = pages[idx / PAGE_SIZE].load(MO_ACQ);
+        return (page) ? page[idx % PAGE_SIZE].load(MO) : 0;
+    }
+
+    std::atomic<uint64_t>* getPage(size_t idx) {
+        std::atomic<std::atomic<uint64_t>*>& slot = pages[idx / PAGE_SIZE];
+        std::atomic<uint64_t>* page = slot.load(MO_ACQ);
+        if (page) return page;
+
+        std::atomic<uint64_t>* new_page = new std::atomic<uint64_t>[PAGE_SIZE];
+        for (size_t ii = 0; ii < PAGE_SIZE; ++ii) new_page[ii] = 0;
+        if (slot.compare_exchange_strong(page, new_page,
+                                         std::memory_order_acq_rel)) {
+            return new_page;
+        }
+        // Other thread allocated it at the same time, `page` is updated.
+        delete[] new_page;
+        return page;
+    }
+
+    void mergeBins(const DDSketchT& src) {
+        for (size_t ii = 0; ii < numPages; ++ii) {
+            std::atomic<uint64_t>* src_page = src.pages[ii].load(MO_ACQ);
+            if (!src_page) continue;
+            std::atomic<uint64_t>* dst_page = getPage(ii * PAGE_SIZE);
+            for (size_t jj = 0; jj < PAGE_SIZE; ++jj) {
+                uint64_t cnt = src_page[jj].load(MO);
+                if (cnt) dst_page[jj].fetch_add(cnt, MO);
+            }
+        }
+    }
+
+    double gamma;
+    double invLogGamma;
+    size_t numBins;
+    size_t numPages;
+    std::atomic<std::atomic<uint64_t>*>* pages;
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+    std::atomic<uint64_t> max;
+};
+
+template<uint32_t ALPHA_BP>
+constexpr double DDSketchT<ALPHA_BP>::ALPHA;
+
+// 1% relative accuracy.
+using DDSketch = DDSketchT<100>;
@@ -31,17 +31,21 @@
 
 #pragma once
 
+#include "histogram_simd.h"
+
 #include <stdint.h>
 
 #include <atomic>
 #include <cstddef>
 #include <cstdint>
 #include <cmath>
+#include <cstring>
 #include <limits>
 
 using HistBin = std::atomic<uint64_t>;
 
 class Histogram;
+class HistogramSnapshot;
 class HistItr {
 public:
     HistItr() : idx(0), maxBins(0), owner(nullptr) { }
@@ -130,6 +134,7 @@ private:
 
 class Histogram {
     friend class HistItr;
+    friend class HistogramSnapshot;
 
 public:
     using iterator = HistItr;
@@ -171,6 +176,9 @@ public:
     }
 
     // this += rhs
+    // This histogram may be updated at the same time, so that bins are
+    // still added atomically, but only the non-empty ones of `rhs`.
+    // To merge many histograms, use `HistogramSnapshot` instead.
     Histogram& operator+=(const Histogram& rhs) {
         count += rhs.getTotal();
         sum += rhs.getSum();
@@ -179,7 +187,8 @@ public:
         }
 
         for (size_t i=0; i<MAX_BINS; ++i) {
-            bins[i] += rhs.bins[i];
+            uint64_t cnt = rhs.bins[i].load(std::memory_order_relaxed);
+            if (cnt) bins[i].fetch_add(cnt, std::memory_order_relaxed);
         }
 
         return *this;
@@ -188,16 +197,7 @@ public:
     // returning lhs + rhs
     friend Histogram operator+(Histogram lhs,
                                const Histogram& rhs) {
-        lhs.count += rhs.getTotal();
-        lhs.sum += rhs.getSum();
-        if (lhs.max < rhs.getMax()) {
-            lhs.max = rhs.getMax();
-        }
-
-        for (size_t i=0; i<MAX_BINS; ++i) {
-            lhs.bins[i] += rhs.bins[i];
-        }
-
+        lhs += rhs;
         return lhs;
     }
 
@@ -224,15 +224,7 @@ public:
         // so we should handle `val` == 0 as a special case (`idx` = 64),
         // that's the reason why num bins is 65.
 
-        int idx = MAX_BINS - 1;
-        if (val) {
-#if defined(__linux__) || defined(__APPLE__)
-            idx = __builtin_clzl(val);
-
-#elif defined(WIN32) || defined(_WIN32)
-            idx = getIdx(val);
-#endif
-        }
+        int idx = getBinIdx(val);
         bins[idx].fetch_add(1, std::memory_order_relaxed);
         count.fetch_add(1, std::memory_order_relaxed);
         sum.fetch_add(val, std::memory_order_relaxed);
@@ -245,11 +237,74 @@ public:
         }
     }
 
+    // Same as `add`, but using plain loads and stores instead of atomic
+    // read-modify-write. Only for the histograms updated by a single thread.
+    void addNonAtomic(uint64_t val) {
+        int idx = getBinIdx(val);
+        const std::memory_order MO = std::memory_order_relaxed;
+        bins[idx].store(bins[idx].load(MO) + 1, MO);
+        count.store(count.load(MO) + 1, MO);
+        sum.store(sum.load(MO) + val, MO);
+        if (max.load(MO) < val) max.store(val, MO);
+    }
+
+    /**
+     * Add `num` values at once. They are binned locally first, and then
+     * published with a single atomic add for each non-empty bin.
+     */
+    void addBatch(const uint64_t* vals, size_t num) {
+        if (!num) return;
+        uint64_t local[MAX_BINS] = {0};
+        uint64_t local_sum = 0;
+        uint64_t local_max = 0;
+        for (size_t i=0; i<num; ++i) {
+            uint64_t val = vals[i];
+            local[getBinIdx(val)]++;
+            local_sum += val;
+            if (local_max < val) local_max = val;
+        }
+
+        for (size_t i=0; i<MAX_BINS; ++i) {
+            if (local[i]) bins[i].fetch_add(local[i], std::memory_order_relaxed);
+        }
+        count.fetch_add(num, std::memory_order_relaxed);
+        sum.fetch_add(local_sum, std::memory_order_relaxed);
+
+        size_t num_trial = 0;
+        while (num_trial++ < MAX_TRIAL &&
+               max.load(std::memory_order_relaxed) < local_max) {
+            max.store(local_max, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Add `num` samples to the bin that `val` belongs to at once, whose
+     * sum and max are `val_sum` and `val_max`. For rebuilding a histogram
+     * only from its bins and totals, e.g., of a saved snapshot.
+     */
+    void addBin(uint64_t val, uint64_t num,
+                uint64_t val_sum, uint64_t val_max) {
+        bins[getBinIdx(val)].fetch_add(num, std::memory_order_relaxed);
+        count.fetch_add(num, std::memory_order_relaxed);
+        sum.fetch_add(val_sum, std::memory_order_relaxed);
+
+        size_t num_trial = 0;
+        while (num_trial++ < MAX_TRIAL &&
+               max.load(std::memory_order_relaxed) < val_max) {
+            max.store(val_max, std::memory_order_relaxed);
+        }
+    }
+
     uint64_t getTotal() const { return count; }
     uint64_t getSum() const { return sum; }
     uint64_t getAverage() const { return ( (count) ? (sum / count) : 0 ); }
     uint64_t getMax() const { return max; }
 
+    // Memory consumed by this histogram, in bytes.
+    size_t getMemoryUsage() const {
+        return sizeof(*this) + MAX_BINS * sizeof(HistBin);
+    }
+
     iterator find(double percentile) {
         if (percentile <= 0 || percentile >= 100) {
             return end();
@@ -270,7 +325,7 @@ public:
         return end();
     }
 
-    uint64_t estimate(double percentile) {
+    uint64_t estimate(double percentile) const {
         if (percentile <= 0 || percentile >= 100) {
             return 0;
         }
@@ -280,11 +335,12 @@ public:
         uint64_t sum = 0;
         uint64_t total = getTotal();
         uint64_t threshold = (uint64_t)( (double)total * rev / 100.0 );
+        uint64_t cur_max = getMax();
 
         if (!threshold) {
             // No samples between the given percentile and the max number.
             // Return max number.
-            return max;
+            return cur_max;
         }
 
         for (i=0; i<MAX_BINS; ++i) {
@@ -295,8 +351,8 @@ public:
             uint64_t gap = sum - threshold;
             uint64_t u_bound = HistItr(i, MAX_BINS, this).getUpperBound();
             double base = EXP_BASE;
-            if (max < u_bound) {
-                base = (double)max / (u_bound / 2.0);
+            if (cur_max < u_bound) {
+                base = (double)cur_max / (u_bound / 2.0);
             }
 
             return (uint64_t)
@@ -305,6 +361,14 @@ public:
         return 0;
     }
 
+    /**
+     * Estimate `num` percentiles at once, building the cumulative
+     * distribution only once.
+     */
+    inline void estimate(const double* percentiles,
+                         uint64_t* dst,
+                         size_t num) const;
+
     iterator begin() const {
         size_t i;
         for (i=0; i<MAX_BINS; ++i) {
@@ -318,6 +382,20 @@ public:
     }
 
 private:
+    int getBinIdx(uint64_t val) {
+        // See the comment in `add()`.
+        int idx = MAX_BINS - 1;
+        if (val) {
+#if defined(__linux__) || defined(__APPLE__)
+            idx = __builtin_clzl(val);
+
+#elif defined(WIN32) || defined(_WIN32)
+            idx = getIdx(val);
+#endif
+        }
+        return idx;
+    }
+
     static const size_t MAX_BINS = 65;
     static const size_t MAX_TRIAL = 3;
     double EXP_BASE;
@@ -333,3 +411,163 @@ uint64_t HistItr::getCount() {
     return owner->bins[idx];
 }
 
+/**
+ * Plain copy of `Histogram`, for aggregating a large number of histograms
+ * and then querying percentiles, e.g., in reports.
+ *
+ * Unlike `Histogram`, merge does not need atomic read-modify-write,
+ * and `estimate()` runs on a cumulative distribution built once,
+ * both by `HistogramSimd` kernels.
+ */
+class HistogramSnapshot {
+public:
+    HistogramSnapshot()
+        : expBase(2.0), count(0), sum(0), max(0), cdfValid(false)
+    {
+        memset(bins, 0, sizeof(bins));
+    }
+
+    HistogramSnapshot(const Histogram& src) : HistogramSnapshot() {
+        *this = src;
+    }
+
+    HistogramSnapshot& operator=(const Histogram& src) {
+        load(src, bins);
+        expBase = src.EXP_BASE;
+        count = src.getTotal();
+        sum = src.getSum();
+        max = src.getMax();
+        cdfValid = false;
+        return *this;
+    }
+
+    HistogramSnapshot& operator+=(const Histogram& rhs) {
+        uint64_t tmp[NUM_BINS];
+        load(rhs, tmp);
+        HistogramSimd::merge(bins, tmp, NUM_BINS);
+        addStats(rhs.getTotal(), rhs.getSum(), rhs.getMax());
+        return *this;
+    }
+
+    HistogramSnapshot& operator+=(const HistogramSnapshot& rhs) {
+        HistogramSimd::merge(bins, rhs.bins, NUM_BINS);
+        addStats(rhs.count, rhs.sum, rhs.max);
+        return *this;
+    }
+
+    /**
+     * Add the bins of a histogram with the same layout, e.g., a shard of
+     * `PerCpuHistogram` or `NumaHistogram`, and its totals.
+     */
+    HistogramSnapshot& addBins(const HistBin* src_bins,
+                               uint64_t r_count,
+                               uint64_t r_sum,
+                               uint64_t r_max) {
+        uint64_t tmp[NUM_BINS];
+        load(src_bins, tmp);
+        HistogramSimd::merge(bins, tmp, NUM_BINS);
+        addStats(r_count, r_sum, r_max);
+        return *this;
+    }
+
+    // Same as `Histogram::addBin()`.
+    void addBin(uint64_t val, uint64_t num,
+                uint64_t val_sum, uint64_t val_max) {
+        bins[getBinIdx(val)] += num;
+        addStats(num, val_sum, val_max);
+    }
+
+    uint64_t getTotal() const { return count; }
+    uint64_t getSum() const { return sum; }
+    uint64_t getAverage() const { return ( (count) ? (sum / count) : 0 ); }
+    uint64_t getMax() const { return max; }
+    uint64_t getBinCount(size_t idx) const { return bins[idx]; }
+
+    /**
+     * Same as `Histogram::estimate()`, and gives the same result.
+     * The first call after merge builds the cumulative distribution.
+     */
+    uint64_t estimate(double percentile) {
+        if (percentile <= 0 || percentile >= 100) {
+            return 0;
+        }
+
+        double rev = 100 - percentile;
+        uint64_t threshold = (uint64_t)( (double)count * rev / 100.0 );
+        if (!threshold) {
+            // No samples between the given percentile and the max number.
+            return max;
+        }
+
+        if (!cdfValid) {
+            HistogramSimd::prefixSum(cdf, bins, NUM_BINS);
+            cdfValid = true;
+        }
+        size_t idx = HistogramSimd::lowerBound(cdf, NUM_BINS, threshold);
+        if (idx >= NUM_BINS) return 0;
+
+        uint64_t gap = cdf[idx] - threshold;
+        uint64_t u_bound = HistItr(idx, NUM_BINS, nullptr).getUpperBound();
+        double base = expBase;
+        if (max < u_bound) {
+            base = (double)max / (u_bound / 2.0);
+        }
+        return (uint64_t)
+               ( std::pow(base, (double)gap / bins[idx]) * u_bound / 2 );
+    }
+
+    // Same bins as `Histogram`.
+    static const size_t NUM_BINS = 65;
+
+    // Estimate `num` percentiles at once.
+    void estimate(const double* percentiles, uint64_t* dst, size_t num) {
+        for (size_t ii = 0; ii < num; ++ii) dst[ii] = estimate(percentiles[ii]);
+    }
+
+private:
+    static void load(const Histogram& src, uint64_t* dst) {
+        load(src.bins, dst);
+    }
+
+    static void load(const HistBin* src, uint64_t* dst) {
+        for (size_t ii = 0; ii < NUM_BINS; ++ii) {
+            dst[ii] = src[ii].load(std::memory_order_relaxed);
+        }
+    }
+
+    static size_t getBinIdx(uint64_t val) {
+        // Same as `Histogram`: the number of leading zeros, 64 for 0.
+        if (!val) return NUM_BINS - 1;
+#if defined(__GNUC__)
+        return __builtin_clzll(val);
+#else
+        size_t ret = 0;
+        while ( !(val & ((uint64_t)1 << 63)) ) {
+            val <<= 1;
+            ret++;
+        }
+        return ret;
+#endif
+    }
+
+    void addStats(uint64_t r_count, uint64_t r_sum, uint64_t r_max) {
+        count += r_count;
+        sum += r_sum;
+        if (max < r_max) max = r_max;
+        cdfValid = false;
+    }
+
+    uint64_t bins[NUM_BINS];
+    uint64_t cdf[NUM_BINS];
+    double expBase;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    bool cdfValid;
+};
+
+void Histogram::estimate(const double* percentiles,
+                         uint64_t* dst,
+                         size_t num) const {
+    HistogramSnapshot(*this).estimate(percentiles, dst, num);
+}
@@ -0,0 +1,247 @@
+/**
+ * Copyright (C) 2017-present Jung-Sang Ahn <jungsang.ahn@gmail.com>
+ * All rights reserved.
+ *
+ * https://github.com/greensky00
+ *
+ * Histogram SIMD Kernels
+ * Version: 0.1.0
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <cstddef>
+#include <limits>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    #define HIST_SIMD_X86 (1)
+    #include <immintrin.h>
+#endif
+
+/**
+ * Vectorized kernels over plain (non-atomic) `uint64_t` bin arrays,
+ * selected at runtime by the CPU features: AVX2, SSE2, or scalar.
+ *
+ * Each kernel is compiled with its own `target` attribute, so that the
+ * library does not require any global compiler flag.
+ */
+class HistogramSimd {
+public:
+    enum Isa {
+        SCALAR = 0,
+        SSE2 = 1,
+        AVX2 = 2,
+    };
+
+    // The best instruction set supported by this CPU.
+    static Isa getSupportedIsa() {
+        static const Isa supported = detectIsa();
+        return supported;
+    }
+
+    // The instruction set currently in use.
+    static Isa getIsa() { return curIsa(); }
+
+    /**
+     * Force the given instruction set, for tests and benchmarks.
+     * It is lowered to the supported one if needed.
+     *
+     * @return Instruction set actually set.
+     */
+    static Isa setIsa(Isa isa) {
+        Isa supported = getSupportedIsa();
+        if (isa > supported) isa = supported;
+        curIsaRef().store(isa, std::memory_order_relaxed);
+        return isa;
+    }
+
+    static const char* getIsaName(Isa isa) {
+        switch (isa) {
+        case AVX2:  return "avx2";
+        case SSE2:  return "sse2";
+        default:    return "scalar";
+        }
+    }
+
+    // dst[i] += src[i], for i in [0, n).
+    static void merge(uint64_t* dst, const uint64_t* src, size_t n) {
+#ifdef HIST_SIMD_X86
+        switch (curIsa()) {
+        case AVX2:  return mergeAvx2(dst, src, n);
+        case SSE2:  return mergeSse2(dst, src, n);
+        default:    break;
+        }
+#endif
+        mergeScalar(dst, src, n, 0);
+    }
+
+    // dst[i] = src[0] + ... + src[i], for i in [0, n). In-place is allowed.
+    static void prefixSum(uint64_t* dst, const uint64_t* src, size_t n) {
+#ifdef HIST_SIMD_X86
+        switch (curIsa()) {
+        case AVX2:  return prefixSumAvx2(dst, src, n);
+        case SSE2:  return prefixSumSse2(dst, src, n);
+        default:    break;
+        }
+#endif
+        prefixSumScalar(dst, src, n, 0, 0);
+    }
+
+    /**
+     * Find the first element not less than `val`, in the given
+     * non-decreasing array (e.g., the result of `prefixSum`).
+     *
+     * @return Index of the element, or `n` if not found.
+     */
+    static size_t lowerBound(const uint64_t* arr, size_t n, uint64_t val) {
+#ifdef HIST_SIMD_X86
+        // 64-bit comparison needs AVX2 (SSE4.2), SSE2 uses the scalar one.
+        if (curIsa() == AVX2) return lowerBoundAvx2(arr, n, val);
+#endif
+        return lowerBoundScalar(arr, n, val, 0);
+    }
+
+private:
+    static std::atomic<Isa>& curIsaRef() {
+        static std::atomic<Isa> isa( getSupportedIsa() );
+        return isa;
+    }
+
+    static Isa curIsa() {
+        return curIsaRef().load(std::memory_order_relaxed);
+    }
+
+    static Isa detectIsa() {
+#ifdef HIST_SIMD_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) return AVX2;
+        if (__builtin_cpu_supports("sse2")) return SSE2;
+#endif
+        return SCALAR;
+    }
+
+    static void mergeScalar(uint64_t* dst, const uint64_t* src,
+                            size_t n, size_t begin) {
+        for (size_t ii = begin; ii < n; ++ii) dst[ii] += src[ii];
+    }
+
+    static void prefixSumScalar(uint64_t* dst, const uint64_t* src,
+                                size_t n, size_t begin, uint64_t carry) {
+        for (size_t ii = begin; ii < n; ++ii) {
+            carry += src[ii];
+            dst[ii] = carry;
+        }
+    }
+
+    static size_t lowerBoundScalar(const uint64_t* arr, size_t n,
+                                   uint64_t val, size_t begin) {
+        size_t ii = begin;
+        while (ii < n && arr[ii] < val) ++ii;
+        return ii;
+    }
+
+#ifdef HIST_SIMD_X86
+    __attribute__((target("sse2")))
+    static void mergeSse2(uint64_t* dst, const uint64_t* src, size_t n) {
+        size_t ii = 0;
+        for (; ii + 2 <= n; ii += 2) {
+            __m128i a = _mm_loadu_si128( (const __m128i*)(dst + ii) );
+            __m128i b = _mm_loadu_si128( (const __m128i*)(src + ii) );
+            _mm_storeu_si128( (__m128i*)(dst + ii), _mm_add_epi64(a, b) );
+        }
+        mergeScalar(dst, src, n, ii);
+    }
+
+    __attribute__((target("avx2")))
+    static void mergeAvx2(uint64_t* dst, const uint64_t* src, size_t n) {
+        size_t ii = 0;
+        for (; ii + 4 <= n; ii += 4) {
+            __m256i a = _mm256_loadu_si256( (const __m256i*)(dst + ii) );
+            __m256i b = _mm256_loadu_si256( (const __m256i*)(src + ii) );
+            _mm256_storeu_si256( (__m256i*)(dst + ii), _mm256_add_epi64(a, b) );
+        }
+        mergeScalar(dst, src, n, ii);
+    }
+
+    __attribute__((target("sse2")))
+    static void prefixSumSse2(uint64_t* dst, const uint64_t* src, size_t n) {
+        __m128i carry = _mm_setzero_si128();
+        size_t ii = 0;
+        for (; ii + 2 <= n; ii += 2) {
+            // [a, b] -> [a, a + b]
+            __m128i x = _mm_loadu_si128( (const __m128i*)(src + ii) );
+            x = _mm_add_epi64( x, _mm_slli_si128(x, 8) );
+            x = _mm_add_epi64(x, carry);
+            _mm_storeu_si128( (__m128i*)(dst + ii), x );
+            // Broadcast the last one.
+            carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 2, 3, 2));
+        }
+        prefixSumScalar( dst, src, n, ii,
+                         (uint64_t)_mm_cvtsi128_si64(carry) );
+    }
+
+    __attribute__((target("avx2")))
+    static void prefixSumAvx2(uint64_t* dst, const uint64_t* src, size_t n) {
+        const __m256i zero = _mm256_setzero_si256();
+        __m256i carry = zero;
+        size_t ii = 0;
+        for (; ii + 4 <= n; ii += 4) {
+            // [a, b, c, d] -> [a, a + b, b + c, c + d]
+            __m256i x = _mm256_loadu_si256( (const __m256i*)(src + ii) );
+            __m256i sh = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(2, 1, 0, 0));
+            x = _mm256_add_epi64( x, _mm256_blend_epi32(sh, zero, 0x03) );
+            // -> [a, a + b, a + b + c, a + b + c + d]
+            sh = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(1, 0, 0, 0));
+            x = _mm256_add_epi64( x, _mm256_blend_epi32(sh, zero, 0x0f) );
+            x = _mm256_add_epi64(x, carry);
+            _mm256_storeu_si256( (__m256i*)(dst + ii), x );
+            // Broadcast the last one.
+            carry = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 3, 3, 3));
+        }
+        prefixSumScalar( dst, src, n, ii,
+                         (uint64_t)_mm256_extract_epi64(carry, 0) );
+    }
+
+    __attribute__((target("avx2")))
+    static size_t lowerBoundAvx2(const uint64_t* arr, size_t n,
+                                 uint64_t val) {
+        // Unsigned comparison by signed one, flipping the sign bits.
+        const __m256i sign = _mm256_set1_epi64x
+                             ( std::numeric_limits<int64_t>::min() );
+        const __m256i v = _mm256_xor_si256( _mm256_set1_epi64x(val), sign );
+        size_t ii = 0;
+        for (; ii + 4 <= n; ii += 4) {
+            __m256i x = _mm256_loadu_si256( (const __m256i*)(arr + ii) );
+            __m256i lt = _mm256_cmpgt_epi64( v, _mm256_xor_si256(x, sign) );
+            int mask = _mm256_movemask_pd( _mm256_castsi256_pd(lt) );
+            // Non-decreasing, so that `lt` is set for a prefix of the lanes.
+            if (mask != 0xf) return ii + __builtin_popcount(mask);
+        }
+        return lowerBoundScalar(arr, n, val, ii);
+    }
+#endif
+};
@@ -0,0 +1,542 @@
+/**
+ * Copyright (C) 2017-present Jung-Sang Ahn <jungsang.ahn@gmail.com>
+ * All rights reserved.
+ *
+ * https://github.com/greensky00
+ *
+ * Latency Collector Aggregator Module
+ * Version: 0.1.0
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "latency_dump.h"
+#include "latency_dump_json.h"
+#include "latency_reporter.h"
+#include "latency_snapshot.h"
+#include "latency_socket.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct LatencyAggregatorOptions {
+    LatencyAggregatorOptions()
+        : bucket_ms(10000)
+        , num_buckets(6)
+        {}
+
+    // Pushes are merged into time buckets of this length.
+    uint64_t bucket_ms;
+
+    // The window covers this number of the latest buckets,
+    // i.e., one minute by default.
+    size_t num_buckets;
+};
+
+/**
+ * Merges the stats pushed by many processes (see `LatencyAggregatorClient`)
+ * by name, over a rolling window, and serves the merged dump.
+ *
+ * Pushes are serialized `LatencySnapshot`s of the samples since the
+ * previous push of each process, over a Unix datagram socket. Dumps are
+ * requested over a Unix stream socket, with a line of the format
+ * ("default", "json", or "snapshot") optionally followed by "flat".
+ * Requests are served by a separate thread, so that neither rendering
+ * nor slow clients delay the pushes.
+ */
+class LatencyAggregator {
+public:
+    enum Format {
+        DEFAULT,
+        JSON,
+        SNAPSHOT
+    };
+
+    // Max size of a push, in bytes.
+    static const size_t MAX_PUSH_SIZE = 65536;
+
+    LatencyAggregator(const LatencyAggregatorOptions& _opt
+                          = LatencyAggregatorOptions())
+        : opt(_opt)
+        , buckets(_opt.num_buckets ? _opt.num_buckets : 1)
+        , pushSock(-1)
+        , querySock(-1)
+        , stopQueries(false)
+        , numPushes(0)
+        , numMalformed(0)
+        {}
+
+    ~LatencyAggregator() {
+        close();
+    }
+
+    /**
+     * Merge a pushed snapshot into the bucket of `now_ms`.
+     *
+     * @return `false` if the data is malformed.
+     */
+    bool addPush(const std::string& data, uint64_t now_ms = nowMs()) {
+        LatencySnapshot snapshot;
+        std::lock_guard<std::mutex> l(lock);
+        if (!snapshot.deserialize(data)) {
+            numMalformed++;
+            return false;
+        }
+        uint64_t bucket_id = now_ms / opt.bucket_ms;
+        Bucket& bucket = buckets[bucket_id % buckets.size()];
+        if (bucket.id != bucket_id) {
+            // Expired.
+            bucket.id = bucket_id;
+            bucket.stats = LatencySnapshot();
+        }
+        bucket.stats.merge(snapshot);
+        numPushes++;
+        return true;
+    }
+
+    // Merged stats of the window ending at `now_ms`.
+    LatencySnapshot getWindow(uint64_t now_ms = nowMs()) {
+        uint64_t bucket_id = now_ms / opt.bucket_ms;
+        LatencySnapshot ret;
+        std::lock_guard<std::mutex> l(lock);
+        for (const Bucket& bucket: buckets) {
+            if ( bucket.id <= bucket_id &&
+                 bucket.id + buckets.size() > bucket_id ) {
+                ret.merge(bucket.stats);
+            }
+        }
+        return ret;
+    }
+
+    // Render the window ending at `now_ms`.
+    std::string dump(Format format = DEFAULT,
+                     const LatencyCollectorDumpOptions& dump_opt
+                         = LatencyCollectorDumpOptions(),
+                     uint64_t now_ms = nowMs())
+    {
+        LatencySnapshot window = getWindow(now_ms);
+        if (format == SNAPSHOT) return window.serialize();
+
+        LatencyCollectorT<LatencySingleThreadPolicy> lat;
+        window.restore(lat);
+        if (format == JSON) {
+            LatencyDumpJsonImplT<Histogram> dump_inst;
+            return lat.dump(&dump_inst, dump_opt);
+        }
+        LatencyDumpDefaultImplT<Histogram> dump_inst;
+        return lat.dump(&dump_inst, dump_opt);
+    }
+
+    /**
+     * Listen for pushes on the Unix datagram socket at `push_path`, and
+     * for dump requests on the Unix stream socket at `query_path`.
+     * Existing files at the paths are replaced. Requests are served by
+     * a thread started here, until `close()`.
+     */
+    bool listen(const std::string& push_path, const std::string& query_path) {
+        close();
+        pushSock = bindUnix(push_path, SOCK_DGRAM);
+        querySock = bindUnix(query_path, SOCK_STREAM);
+        if ( pushSock < 0 || querySock < 0 ||
+             ::listen(querySock, SOMAXCONN) != 0 ) {
+            close();
+            return false;
+        }
+        // Absorb bursts of pushes from many processes.
+        int rcv_buf = 4 * 1024 * 1024;
+        setsockopt(pushSock, SOL_SOCKET, SO_RCVBUF,
+                   &rcv_buf, sizeof(rcv_buf));
+        setNonBlocking(querySock);
+        stopQueries = false;
+        queryThread = std::thread(&LatencyAggregator::serveQueries, this);
+        return true;
+    }
+
+    // Wait up to `timeout_ms` for pushes, and merge them.
+    void poll(int timeout_ms) {
+        struct pollfd pfd;
+        pfd.fd = pushSock;
+        pfd.events = POLLIN;
+        if (::poll(&pfd, 1, timeout_ms) <= 0) return;
+        if ( !(pfd.revents & POLLIN) ) return;
+
+        // Drain all pending pushes.
+        std::string buf(MAX_PUSH_SIZE, '\0');
+        ssize_t len = 0;
+        while ( (len = recv( pushSock, &buf[0], buf.size(),
+                             MSG_DONTWAIT )) > 0 ) {
+            addPush( buf.substr(0, len) );
+        }
+    }
+
+    void close() {
+        if (queryThread.joinable()) {
+            stopQueries = true;
+            queryThread.join();
+        }
+        if (pushSock >= 0) ::close(pushSock);
+        if (querySock >= 0) ::close(querySock);
+        pushSock = querySock = -1;
+    }
+
+    /**
+     * Request a dump from the aggregator listening at `query_path`.
+     *
+     * @return `false` if the aggregator is not reachable.
+     */
+    static bool query(const std::string& query_path,
+                      const std::string& request,
+                      std::string& response)
+    {
+        int fd = connectUnix(query_path);
+        if (fd < 0) return false;
+        setTimeout(fd, QUERY_TIMEOUT_MS);
+        bool ok = sendAll(fd, request + "\n");
+        response.clear();
+        char buf[4096];
+        ssize_t len = 0;
+        while ( ok && (len = recv(fd, buf, sizeof(buf), 0)) > 0 ) {
+            response.append(buf, len);
+        }
+        ::close(fd);
+        return ok && len == 0;
+    }
+
+    // Return `false` if the given format name is unknown.
+    static bool parseFormat(const std::string& name, Format& dst) {
+        if (name == "default") dst = DEFAULT;
+        else if (name == "json") dst = JSON;
+        else if (name == "snapshot") dst = SNAPSHOT;
+        else return false;
+        return true;
+    }
+
+    // Number of pushes merged.
+    uint64_t getNumPushes() const { return numPushes.load(); }
+
+    // Number of pushes dropped as malformed.
+    uint64_t getNumMalformed() const { return numMalformed.load(); }
+
+private:
+    static const int QUERY_TIMEOUT_MS = 5000;
+    // Interval of checking `stopQueries`.
+    static const int QUERY_POLL_MS = 100;
+
+    using SteadyClock = std::chrono::steady_clock;
+
+    // Request being read, or response being sent.
+    struct QueryConn {
+        QueryConn(int _fd)
+            : fd(_fd)
+            , deadline( SteadyClock::now() +
+                        std::chrono::milliseconds((int64_t)QUERY_TIMEOUT_MS) )
+            , responding(false)
+            , sent(0) {}
+        int fd;
+        // Whole request and response, so that a slow client cannot hold
+        // the connection for long.
+        SteadyClock::time_point deadline;
+        std::string request;
+        bool responding;
+        std::string response;
+        size_t sent;
+    };
+
+    struct Bucket {
+        Bucket() : id(NO_BUCKET) {}
+        static const uint64_t NO_BUCKET = (uint64_t)-1;
+        uint64_t id;
+        LatencySnapshot stats;
+    };
+
+    static uint64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>
+               ( std::chrono::system_clock::now().time_since_epoch() )
+               .count();
+    }
+
+    /**
+     * Serves requests until `close()`. Connections are non-blocking and
+     * handled at the same time, each with its own deadline.
+     */
+    void serveQueries() {
+        std::vector<QueryConn> conns;
+        std::vector<struct pollfd> fds;
+        while (!stopQueries.load()) {
+            fds.resize(conns.size() + 1);
+            fds[0].fd = querySock;
+            fds[0].events = POLLIN;
+            int timeout_ms = QUERY_POLL_MS;
+            SteadyClock::time_point now = SteadyClock::now();
+            for (size_t ii = 0; ii < conns.size(); ++ii) {
+                fds[ii + 1].fd = conns[ii].fd;
+                fds[ii + 1].events = (conns[ii].responding) ? POLLOUT : POLLIN;
+                int remaining_ms = (int)
+                    std::chrono::duration_cast<std::chrono::milliseconds>
+                    (conns[ii].deadline - now).count();
+                timeout_ms = std::max(0, std::min(timeout_ms, remaining_ms));
+            }
+            for (struct pollfd& pfd: fds) pfd.revents = 0;
+            ::poll(fds.data(), fds.size(), timeout_ms);
+
+            now = SteadyClock::now();
+            size_t num_alive = 0;
+            for (size_t ii = 0; ii < conns.size(); ++ii) {
+                QueryConn& conn = conns[ii];
+                bool alive = now < conn.deadline;
+                if (alive && fds[ii + 1].revents) alive = handleQuery(conn);
+                if (alive) {
+                    conns[num_alive++] = conn;
+                } else {
+                    ::close(conn.fd);
+                }
+            }
+            conns.erase(conns.begin() + num_alive, conns.end());
+
+            if (fds[0].revents & POLLIN) {
+                int fd = -1;
+                while ( (fd = accept(querySock, nullptr, nullptr)) >= 0 ) {
+                    setNonBlocking(fd);
+                    conns.push_back(QueryConn(fd));
+                }
+            }
+        }
+        for (QueryConn& conn: conns) ::close(conn.fd);
+    }
+
+    /**
+     * Read the request or send the response, as much as possible without
+     * blocking.
+     *
+     * @return `false` if the connection is done.
+     */
+    bool handleQuery(QueryConn& conn) {
+        if (!conn.responding) {
+            char buf[MAX_REQUEST_LEN];
+            ssize_t len = recv(conn.fd, buf, sizeof(buf), 0);
+            if (len < 0) return (errno == EAGAIN || errno == EWOULDBLOCK);
+            conn.request.append(buf, len);
+            size_t pos = conn.request.find('\n');
+            if ( len && pos == std::string::npos &&
+                 conn.request.size() < MAX_REQUEST_LEN ) {
+                return true;
+            }
+            // Line is complete, too long, or the client stopped writing.
+            conn.response = render( conn.request.substr(0, pos) );
+            conn.responding = true;
+        }
+
+        while (conn.sent < conn.response.size()) {
+            ssize_t sent = send( conn.fd, conn.response.data() + conn.sent,
+                                 conn.response.size() - conn.sent,
+                                 MSG_NOSIGNAL );
+            if (sent < 0) return (errno == EAGAIN || errno == EWOULDBLOCK);
+            conn.sent += sent;
+        }
+        return false;
+    }
+
+    // Dump for the given request line.
+    std::string render(const std::string& request) {
+        std::istringstream words(request);
+        std::string word;
+        Format format = DEFAULT;
+        LatencyCollectorDumpOptions dump_opt;
+        if (words >> word) parseFormat(word, format);
+        while (words >> word) {
+            if (word == "flat") {
+                dump_opt.view_type = LatencyCollectorDumpOptions::FLAT;
+            }
+        }
+        return dump(format, dump_opt);
+    }
+
+    static void setNonBlocking(int fd) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags >= 0) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    static int bindUnix(const std::string& path, int type) {
+        struct sockaddr_un addr;
+        if (!getUnixAddr(path, addr)) return -1;
+        int fd = socket(AF_UNIX, type, 0);
+        if (fd < 0) return -1;
+        unlink(path.c_str());
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    static int connectUnix(const std::string& path) {
+        struct sockaddr_un addr;
+        if (!getUnixAddr(path, addr)) return -1;
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) return -1;
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            ::close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    static bool getUnixAddr(const std::string& path,
+                            struct sockaddr_un& addr) {
+        memset(&addr, 0, sizeof(addr));
+        if (path.size() >= sizeof(addr.sun_path)) return false;
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.data(), path.size());
+        return true;
+    }
+
+    // Not to be stuck by a peer that stops reading or writing.
+    static void setTimeout(int fd, int timeout_ms) {
+        struct timeval tv;
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    }
+
+    static bool sendAll(int fd, const std::string& data) {
+        size_t pos = 0;
+        while (pos < data.size()) {
+            ssize_t sent = send(fd, data.data() + pos, data.size() - pos,
+                                MSG_NOSIGNAL);
+            if (sent <= 0) return false;
+            pos += sent;
+        }
+        return true;
+    }
+
+    static const size_t MAX_REQUEST_LEN = 256;
+
+    LatencyAggregatorOptions opt;
+
+    // Guards the buckets.
+    std::mutex lock;
+    // Ring of the latest buckets, by `id % size`.
+    std::vector<Bucket> buckets;
+
+    int pushSock;
+    int querySock;
+
+    // Serves the requests on `querySock`, see `serveQueries()`.
+    std::thread queryThread;
+    std::atomic<bool> stopQueries;
+
+    std::atomic<uint64_t> numPushes;
+    std::atomic<uint64_t> numMalformed;
+};
+
+/**
+ * Pushes the samples of a collector since the previous push to
+ * a `LatencyAggregator`, split into datagrams of up to
+ * `LatencyAggregator::MAX_PUSH_SIZE`. Sends never block: if the
+ * aggregator cannot keep up, the samples of the push are dropped
+ * (see `LatencyDatagramSocket`).
+ */
+class LatencyAggregatorClient {
+public:
+    LatencyAggregatorClient() {}
+
+    ~LatencyAggregatorClient() {
+        stop();
+    }
+
+    // Return `false` if the path is too long.
+    bool connect(const std::string& push_path) {
+        return sock.connectUnix(push_path);
+    }
+
+    /**
+     * Push the samples of the given collector since the previous push.
+     *
+     * @return Number of datagrams sent.
+     */
+    template<typename Policy>
+    size_t push(LatencyCollectorT<Policy>& lat) {
+        return push( LatencySnapshot::take(lat) );
+    }
+
+    // Same as above, with a snapshot taken by the caller.
+    size_t push(const LatencySnapshot& cur) {
+        std::lock_guard<std::mutex> l(pushLock);
+        LatencySnapshot delta = cur;
+        delta -= prev;
+        prev = cur;
+
+        size_t ret = 0;
+        for (const std::string& chunk:
+                 delta.serializeChunks(LatencyAggregator::MAX_PUSH_SIZE)) {
+            ret += sock.send(chunk);
+        }
+        return ret;
+    }
+
+    /**
+     * Push the given collector every `interval_ms` on a background
+     * thread, until `stop()` is called.
+     */
+    template<typename Policy>
+    void start(LatencyCollectorT<Policy>& lat, uint64_t interval_ms) {
+        reporter.start([this, &lat]() { push(lat); }, interval_ms);
+    }
+
+    // Push the last interval and stop the background thread.
+    void stop() {
+        reporter.stop();
+    }
+
+    // See `LatencyDatagramSocket`.
+    uint64_t getNumPackets() const { return sock.getNumPackets(); }
+    uint64_t getNumDropped() const { return sock.getNumDropped(); }
+
+private:
+    LatencyDatagramSocket sock;
+
+    // Serializes pushes, and guards `prev`.
+    std::mutex pushLock;
+    // Snapshot of the previous push.
+    LatencySnapshot prev;
+
+    LatencyReporterThread reporter;
+};
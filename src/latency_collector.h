@@ -32,19 +32,32 @@
 #pragma once
 
 #include "ashared_ptr.h"
+#include "compact_histogram.h"
+#include "ddsketch.h"
 #include "histogram.h"
+#include "latency_slow_scope.h"
+#include "numa_histogram.h"
+#include "percpu_histogram.h"
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
+#include <cstddef>
 #include <ctime>
+#include <initializer_list>
 #include <iomanip>
-#include <list>
+#include <limits>
 #include <map>
 #include <memory>
 #include <mutex>
+#include <set>
 #include <sstream>
 #include <string>
+#if __cplusplus >= 201703L
+#include <string_view>
+#endif
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
 #include <vector>
 
@@ -53,6 +66,308 @@
 #include <stdint.h>
 #include <string.h>
 
+// List of `key`-`value` dimension labels attached to a latency sample,
+// e.g. {{"status", "hit"}, {"op", "get"}}.
+using LatencyLabels = std::vector< std::pair<std::string, std::string> >;
+
+// Interned ID of a label set, unique within a collector.
+using LatencyLabelId = uint32_t;
+
+class LatencyLabelRegistry {
+public:
+    // No label is attached.
+    static const LatencyLabelId NO_LABEL = 0;
+
+    // All label sets beyond the cardinality limit fall into this one.
+    static const LatencyLabelId OVERFLOW_LABEL = 1;
+
+    // Max number of distinct label sets (including above two).
+    static const size_t MAX_LABEL_SETS = 64;
+
+    LatencyLabelRegistry() : numIds(2) {
+        names[NO_LABEL] = "";
+        names[OVERFLOW_LABEL] = "__overflow__";
+    }
+
+    /**
+     * Get the ID of the given label set, or assign a new one.
+     * The order of labels does not matter.
+     *
+     * Note: it involves a lookup under the lock, so that it is
+     *       recommended to intern frequently used label sets once,
+     *       and then reuse their IDs in the hot path.
+     */
+    LatencyLabelId intern(const LatencyLabels& labels) {
+        if (labels.empty()) return NO_LABEL;
+        std::string canonical = toString(labels);
+
+        std::lock_guard<std::mutex> l(lock);
+        auto entry = ids.find(canonical);
+        if (entry != ids.end()) return entry->second;
+
+        size_t new_id = numIds.load(std::memory_order_relaxed);
+        if (new_id >= MAX_LABEL_SETS) return OVERFLOW_LABEL;
+
+        names[new_id] = canonical;
+        ids.insert( std::make_pair(canonical, (LatencyLabelId)new_id) );
+        // Publish the name first, and then the ID.
+        numIds.store(new_id + 1, std::memory_order_release);
+        return (LatencyLabelId)new_id;
+    }
+
+    size_t getNumLabelSets() const {
+        return numIds.load(std::memory_order_acquire);
+    }
+
+    // Canonical `key=value,...` string of the given ID.
+    std::string getName(LatencyLabelId id) const {
+        if (id >= getNumLabelSets()) return std::string();
+        return names[id];
+    }
+
+    /**
+     * Check if the label set of the given ID contains all `key=value`
+     * pairs in the `filter` (comma separated, e.g. "status=hit,op=get").
+     */
+    bool match(LatencyLabelId id, const std::string& filter) const {
+        if (filter.empty()) return true;
+        if (id == NO_LABEL || id >= getNumLabelSets()) return false;
+
+        std::string name = "," + names[id] + ",";
+        size_t pos = 0;
+        while (pos <= filter.size()) {
+            size_t next = filter.find(',', pos);
+            if (next == std::string::npos) next = filter.size();
+            std::string token = filter.substr(pos, next - pos);
+            if ( !token.empty() &&
+                 name.find("," + token + ",") == std::string::npos ) {
+                return false;
+            }
+            pos = next + 1;
+        }
+        return true;
+    }
+
+    static std::string toString(const LatencyLabels& labels) {
+        LatencyLabels sorted = labels;
+        std::sort(sorted.begin(), sorted.end());
+        std::string ret;
+        for (auto& entry: sorted) {
+            if (!ret.empty()) ret += ",";
+            ret += entry.first + "=" + entry.second;
+        }
+        return ret;
+    }
+
+private:
+    std::mutex lock;
+    std::map<std::string, LatencyLabelId> ids;
+    std::string names[MAX_LABEL_SETS];
+    std::atomic<size_t> numIds;
+};
+
+#if __cplusplus >= 201703L
+using LatencyStringView = std::string_view;
+#else
+/**
+ * Minimal `std::string_view` for C++11, pointing to a part of a stat name
+ * owned by its `LatencyItemT`.
+ */
+class LatencyStringView {
+public:
+    LatencyStringView() : ptr(nullptr), len(0) {}
+    LatencyStringView(const char* _ptr, size_t _len) : ptr(_ptr), len(_len) {}
+    LatencyStringView(const std::string& str)
+        : ptr(str.data()), len(str.size()) {}
+
+    const char* data() const { return ptr; }
+    size_t size() const { return len; }
+    bool empty() const { return !len; }
+    const char* begin() const { return ptr; }
+    const char* end() const { return ptr + len; }
+
+    int compare(const LatencyStringView& rhs) const {
+        int ret = (len && rhs.len)
+                  ? memcmp(ptr, rhs.ptr, std::min(len, rhs.len)) : 0;
+        if (ret) return ret;
+        return (len < rhs.len) ? -1 : ( (len > rhs.len) ? 1 : 0 );
+    }
+
+    friend bool operator==(const LatencyStringView& a,
+                           const LatencyStringView& b) {
+        return a.len == b.len && a.compare(b) == 0;
+    }
+    friend bool operator!=(const LatencyStringView& a,
+                           const LatencyStringView& b) {
+        return !(a == b);
+    }
+    friend bool operator<(const LatencyStringView& a,
+                          const LatencyStringView& b) {
+        return a.compare(b) < 0;
+    }
+    friend std::ostream& operator<<(std::ostream& os,
+                                    const LatencyStringView& sv) {
+        return os.write(sv.ptr, sv.len);
+    }
+
+private:
+    const char* ptr;
+    size_t len;
+};
+#endif
+
+/**
+ * One of the slowest samples of a stat.
+ */
+struct LatencyExemplar {
+    LatencyExemplar() : latency(0), timestamp(0), threadId(0), tag(0) {}
+    // Latency in microseconds.
+    uint64_t latency;
+    // Wall-clock time when the sample was recorded,
+    // in microseconds since the epoch.
+    uint64_t timestamp;
+    // Sequential ID of the recording thread, see `latencyThreadId()`.
+    uint32_t threadId;
+    // User-supplied tag (e.g., request ID), 0 if not given.
+    uint64_t tag;
+};
+
+/**
+ * Sequential ID of the current thread, starting from 1.
+ * Unlike `std::thread::id`, it is small and stable within a process.
+ */
+inline uint32_t latencyThreadId() {
+    static std::atomic<uint32_t> next_id(1);
+    thread_local uint32_t id = next_id.fetch_add(1);
+    return id;
+}
+
+// Interned ID of a thread name, unique within a process.
+using LatencyThreadKey = uint32_t;
+
+/**
+ * Names of the threads recording samples, for the per-thread breakdown
+ * of stats. Shared by all collectors, as a thread may record samples
+ * to any of them.
+ *
+ * Threads of the same name (e.g., a thread pool) share the same key, and
+ * unnamed threads are named "thread N" where N is the smallest number not
+ * used by other live unnamed threads. N is released when the thread exits,
+ * so that short-lived threads reuse the same keys instead of exhausting
+ * them.
+ */
+class LatencyThreadRegistry {
+public:
+    // All thread names beyond the limit fall into this one.
+    static const LatencyThreadKey OVERFLOW_KEY = 0;
+
+    // Max number of distinct thread names (including above one).
+    static const size_t MAX_KEYS = 128;
+
+    // Not assigned yet.
+    static const LatencyThreadKey NO_KEY = (LatencyThreadKey)-1;
+
+    static LatencyThreadRegistry& get() {
+        static LatencyThreadRegistry instance;
+        return instance;
+    }
+
+    // Get the key of the given thread name, or assign a new one.
+    LatencyThreadKey intern(const std::string& name) {
+        std::lock_guard<std::mutex> l(lock);
+        auto entry = keys.find(name);
+        if (entry != keys.end()) return entry->second;
+
+        size_t new_key = numKeys.load(std::memory_order_relaxed);
+        if (new_key >= MAX_KEYS) return OVERFLOW_KEY;
+
+        names[new_key] = name;
+        keys.insert( std::make_pair(name, (LatencyThreadKey)new_key) );
+        // Publish the name first, and then the key.
+        numKeys.store(new_key + 1, std::memory_order_release);
+        return (LatencyThreadKey)new_key;
+    }
+
+    size_t getNumKeys() const {
+        return numKeys.load(std::memory_order_acquire);
+    }
+
+    std::string getName(LatencyThreadKey key) const {
+        if (key >= getNumKeys()) return std::string();
+        return names[key];
+    }
+
+    // Key of the current thread, assigned on the first call.
+    static LatencyThreadKey getCurrentKey() {
+        CurrentThread& cur = current();
+        if (cur.key == NO_KEY) {
+            LatencyThreadRegistry& registry = get();
+            cur.slot = registry.acquireSlot();
+            cur.key = registry.intern("thread " + std::to_string(cur.slot));
+        }
+        return cur.key;
+    }
+
+    // Name the current thread. Samples recorded before keep the old name.
+    static void setCurrentName(const std::string& name) {
+        current().key = get().intern(name);
+    }
+
+private:
+    LatencyThreadRegistry() : numKeys(1), numSlots(0) {
+        names[OVERFLOW_KEY] = "__overflow__";
+    }
+
+    // Key of a thread, and its "thread N" number if it was unnamed.
+    struct CurrentThread {
+        CurrentThread() : key(NO_KEY), slot(0) {}
+        ~CurrentThread() {
+            if (slot) get().releaseSlot(slot);
+        }
+        LatencyThreadKey key;
+        uint32_t slot;
+    };
+
+    static CurrentThread& current() {
+        thread_local CurrentThread cur;
+        return cur;
+    }
+
+    uint32_t acquireSlot() {
+        std::lock_guard<std::mutex> l(lock);
+        if (freeSlots.empty()) return ++numSlots;
+        uint32_t ret = *freeSlots.begin();
+        freeSlots.erase(freeSlots.begin());
+        return ret;
+    }
+
+    void releaseSlot(uint32_t slot) {
+        std::lock_guard<std::mutex> l(lock);
+        freeSlots.insert(slot);
+    }
+
+    std::mutex lock;
+    std::map<std::string, LatencyThreadKey> keys;
+    std::string names[MAX_KEYS];
+    std::atomic<size_t> numKeys;
+    // Numbers of "thread N" given so far, and the ones released.
+    uint32_t numSlots;
+    std::set<uint32_t> freeSlots;
+};
+
+/**
+ * Name the current thread, shown in the per-thread breakdown of stats
+ * instead of "thread N". Threads of the same name are merged.
+ */
+inline void latencySetThreadName(const std::string& name) {
+    LatencyThreadRegistry::setCurrentName(name);
+}
+
+inline std::string latencyThreadName() {
+    LatencyThreadRegistry& registry = LatencyThreadRegistry::get();
+    return registry.getName(LatencyThreadRegistry::getCurrentKey());
+}
+
 struct LatencyCollectorDumpOptions {
     enum SortBy {
         NAME,
@@ -69,59 +384,657 @@ struct LatencyCollectorDumpOptions {
     LatencyCollectorDumpOptions()
         : sort_by(SortBy::NAME)
         , view_type(ViewType::TREE)
+        , group_by_label(false)
+        , show_overhead(false)
+        , show_health(false)
+        , show_exemplars(false)
+        , show_threads(false)
         {}
 
     SortBy sort_by;
     ViewType view_type;
+
+    // If true, each stat is followed by its per-label-set breakdown.
+    bool group_by_label;
+
+    // If not empty, only the samples whose label set contains all the
+    // given `key=value` pairs (comma separated) will be dumped.
+    std::string label_filter;
+
+    // If true, the estimated instrumentation cost of each stat is shown.
+    // Valid only when the overhead mode of the collector is not `NONE`.
+    bool show_overhead;
+
+    // If true, the internal state of the collector is appended.
+    bool show_health;
+
+    // If true, each stat is followed by its slowest samples.
+    bool show_exemplars;
+
+    // If true, each stat with the per-thread breakdown is followed by
+    // its threads and the p99 skew among them, see
+    // `LatencyCollectorT::addThreadBreakdown()`.
+    bool show_threads;
+};
+
+/**
+ * Snapshot of the internal state of a collector,
+ * returned by `LatencyCollectorT::getHealth()`.
+ */
+struct LatencyCollectorHealth {
+    struct Tracker {
+        Tracker() : bufferBytes(0), maxDepth(0) {}
+        std::string threadId;
+        // Memory consumed by the call path buffers, in bytes.
+        size_t bufferBytes;
+        // Deepest nested scopes seen so far.
+        size_t maxDepth;
+    };
+
+    LatencyCollectorHealth()
+        : numCasRetries(0)
+        , numDroppedSamples(0)
+        , numMapVersionsCreated(0)
+        , numMapVersionsAlive(0)
+        , numLatestMapRefs(0)
+        , numItems(0)
+        , itemBytes(0)
+        , histogramBytes(0)
+        , numEvictedStats(0)
+        , numOverflowLookups(0)
+        , numThreadBuffers(0)
+        , numPooledTrackerBuffers(0)
+        , numReusedTrackerBuffers(0)
+        , numNumaFallbackShards(0)
+        , numDumps(0)
+        , dumpTimeNs(0)
+        , lastDumpTimeNs(0)
+        {}
+
+    // Failed CAS attempts of the map while adding new stats.
+    uint64_t numCasRetries;
+    // Samples dropped as new stats could not be added.
+    uint64_t numDroppedSamples;
+    // Map versions created so far, including the ones failed to be
+    // installed, and the ones not freed yet.
+    uint64_t numMapVersionsCreated;
+    uint64_t numMapVersionsAlive;
+    // Number of readers (other than the collector itself) holding
+    // the latest map version.
+    uint64_t numLatestMapRefs;
+    // Number of stats, and their memory usage in bytes.
+    // `itemBytes` includes `histogramBytes`.
+    uint64_t numItems;
+    uint64_t itemBytes;
+    uint64_t histogramBytes;
+    // Stats evicted as idle, and lookups of new stats folded into
+    // `__overflow__` due to the cap.
+    uint64_t numEvictedStats;
+    uint64_t numOverflowLookups;
+    // Threads having a sample buffer for this collector,
+    // see `setThreadBufferSize()`.
+    uint64_t numThreadBuffers;
+    // Call path trackers of all live threads. They are shared by
+    // all collectors in the process.
+    std::vector<Tracker> trackers;
+    // Buffers of exited threads' trackers kept for new threads,
+    // and the number of trackers that reused them so far.
+    uint64_t numPooledTrackerBuffers;
+    uint64_t numReusedTrackerBuffers;
+    // `NumaHistogram` shards allocated on the heap, as their node was out
+    // of memory. Shared by all collectors in the process.
+    uint64_t numNumaFallbackShards;
+    // Number of `dump()` calls and the time spent for them.
+    uint64_t numDumps;
+    uint64_t dumpTimeNs;
+    uint64_t lastDumpTimeNs;
+};
+
+// How the collector deals with its own instrumentation cost.
+enum class LatencyOverheadMode {
+    // Do nothing.
+    NONE,
+    // Estimate the instrumentation cost included in each stat.
+    TRACK,
+    // Same as `TRACK`, and also subtract the cost of nested scopes
+    // from the latency of their parent scope.
+    COMPENSATE,
+};
+
+// === Policies ===
+
+// Histogram counters are updated by atomic operations.
+struct LatencyAtomicConcurrency {
+    static const bool THREAD_SAFE = true;
+};
+
+// Histogram counters are updated by plain loads and stores, and the map is
+// updated in place. Only for the collectors used by a single thread.
+struct LatencySingleThreadConcurrency {
+    static const bool THREAD_SAFE = false;
+};
+
+/**
+ * Compile-time configuration of `LatencyCollectorT` and
+ * `LatencyCollectWrapperT`.
+ */
+struct LatencyStandardPolicy {
+    // If false, all collecting macros become no-op.
+    static const bool ENABLED = true;
+    // Clock used for measuring latencies.
+    using Clock = std::chrono::system_clock;
+    // Histogram type of each stat, `Histogram`, `CompactHistogram`,
+    // `PerCpuHistogram`, `NumaHistogram`, or `DDSketchT`.
+    using Hist = Histogram;
+    // Atomic or single-thread counters.
+    using Concurrency = LatencyAtomicConcurrency;
+};
+
+struct LatencySingleThreadPolicy : public LatencyStandardPolicy {
+    using Concurrency = LatencySingleThreadConcurrency;
+};
+
+struct LatencyDisabledPolicy : public LatencyStandardPolicy {
+    static const bool ENABLED = false;
+};
+
+// Percentiles with bounded (1%) relative error, instead of power-of-two bins.
+struct LatencyDDSketchPolicy : public LatencyStandardPolicy {
+    using Hist = DDSketch;
 };
 
-class LatencyItem;
-class MapWrapper;
-class LatencyDump {
+// Same bins as the standard policy, but only the ones in use take memory.
+struct LatencyCompactPolicy : public LatencyStandardPolicy {
+    using Hist = CompactHistogram;
+};
+
+// Each stat is sharded by CPU, for hot stats updated by many threads.
+struct LatencyPerCpuPolicy : public LatencyStandardPolicy {
+    using Hist = PerCpuHistogram;
+};
+
+// Each stat is sharded by NUMA node, on the memory of that node.
+struct LatencyNumaPolicy : public LatencyStandardPolicy {
+    using Hist = NumaHistogram;
+};
+
+#if defined(LATENCY_COLLECTOR_DISABLED)
+    using LatencyDefaultPolicy = LatencyDisabledPolicy;
+#else
+    using LatencyDefaultPolicy = LatencyStandardPolicy;
+#endif
+
+template<typename HistT> class LatencyItemT;
+template<typename HistT> class MapWrapperT;
+template<typename HistT>
+class LatencyDumpT {
 public:
-    virtual std::string dump(MapWrapper* map_w,
+    using Item = LatencyItemT<HistT>;
+    using MapW = MapWrapperT<HistT>;
+
+    virtual ~LatencyDumpT() {}
+
+    virtual std::string dump(MapW* map_w,
                              const LatencyCollectorDumpOptions& opt) = 0;
-    virtual std::string dumpTree(MapWrapper* map_w,
+    virtual std::string dumpTree(MapW* map_w,
                                  const LatencyCollectorDumpOptions& opt) = 0;
 
+    // Section appended when `LatencyCollectorDumpOptions::show_health` is set.
+    virtual std::string dumpHealth(const LatencyCollectorHealth& health) {
+        (void)health;
+        return std::string();
+    }
+
     // To make child class be able to access internal map.
-    std::unordered_map<std::string, LatencyItem*>& getMap(MapWrapper* map_w);
+    std::unordered_map<std::string, Item*>& getMap(MapW* map_w);
+
+    // To make child class be able to resolve label names.
+    const LatencyLabelRegistry* getLabels(MapW* map_w);
 };
 
-class LatencyItem {
+template<typename HistT>
+class LatencyItemT {
 public:
-    LatencyItem() {}
-    LatencyItem(const std::string& _name) : statName(_name) {}
-    LatencyItem(const LatencyItem& src)
+    static const size_t DEFAULT_MAX_LABEL_SETS = 16;
+    // Exemplars are disabled by default.
+    static const size_t DEFAULT_MAX_EXEMPLARS = 0;
+
+    LatencyItemT()
+        : maxLabelSets(DEFAULT_MAX_LABEL_SETS)
+        , labelHists(nullptr)
+        , threadHists(nullptr)
+        , overheadNs(0)
+        , maxExemplars(DEFAULT_MAX_EXEMPLARS)
+        , exemplarThreshold(NO_EXEMPLAR)
+        , exemplars(nullptr)
+        , slowThreshold(NO_SLOW_THRESHOLD)
+        , slowRule(LatencySlowScopeNotifier::NO_RULE)
+        , parentItem(nullptr)
+        , pinState(0)
+        , mapRefs(0)
+        , lastSeenCalls(0)
+        , idleSinceMs(0) { parsePath(); }
+    LatencyItemT(const std::string& _name,
+                 size_t max_label_sets = DEFAULT_MAX_LABEL_SETS,
+                 size_t max_exemplars = DEFAULT_MAX_EXEMPLARS)
+        : statName(_name)
+        , maxLabelSets(max_label_sets)
+        , labelHists(nullptr)
+        , threadHists(nullptr)
+        , overheadNs(0)
+        , maxExemplars(max_exemplars)
+        , exemplarThreshold( (max_exemplars) ? 0 : NO_EXEMPLAR )
+        , exemplars(nullptr)
+        , slowThreshold(NO_SLOW_THRESHOLD)
+        , slowRule(LatencySlowScopeNotifier::NO_RULE)
+        , parentItem(nullptr)
+        , pinState(0)
+        , mapRefs(0)
+        , lastSeenCalls(0)
+        , idleSinceMs(0) { parsePath(); }
+    LatencyItemT(const std::string& _name, const HistT& _hist)
+        : statName(_name)
+        , hist(_hist)
+        , maxLabelSets(DEFAULT_MAX_LABEL_SETS)
+        , labelHists(nullptr)
+        , threadHists(nullptr)
+        , overheadNs(0)
+        , maxExemplars(DEFAULT_MAX_EXEMPLARS)
+        , exemplarThreshold(NO_EXEMPLAR)
+        , exemplars(nullptr)
+        , slowThreshold(NO_SLOW_THRESHOLD)
+        , slowRule(LatencySlowScopeNotifier::NO_RULE)
+        , parentItem(nullptr)
+        , pinState(0)
+        , mapRefs(0)
+        , lastSeenCalls(0)
+        , idleSinceMs(0) { parsePath(); }
+    LatencyItemT(const LatencyItemT& src)
         : statName(src.statName)
-        , hist(src.hist) {}
+        , hist(src.hist)
+        , maxLabelSets(src.maxLabelSets)
+        , labelHists(nullptr)
+        , threadHists(nullptr)
+        , overheadNs(src.getOverheadNs())
+        , maxExemplars(src.maxExemplars)
+        , exemplarThreshold( (src.maxExemplars) ? 0 : NO_EXEMPLAR )
+        , exemplars(nullptr)
+        , slowThreshold(NO_SLOW_THRESHOLD)
+        , slowRule(LatencySlowScopeNotifier::NO_RULE)
+        , parentItem(nullptr)
+        , pinState(0)
+        , mapRefs(0)
+        , lastSeenCalls(0)
+        , idleSinceMs(0) {
+        parsePath();
+        addLabelHists(src);
+        addThreadHists(src);
+        addExemplars(src);
+    }
+
+    ~LatencyItemT() {
+        freeLabelHists();
+        freeThreadHists();
+        freeExemplars();
+    }
 
     // this = src
-    LatencyItem& operator=(const LatencyItem& src) {
+    LatencyItemT& operator=(const LatencyItemT& src) {
+        if (this == &src) return *this;
         statName = src.statName;
+        parsePath();
         hist = src.hist;
+        maxLabelSets = src.maxLabelSets;
+        overheadNs = src.getOverheadNs();
+        freeLabelHists();
+        addLabelHists(src);
+        freeThreadHists();
+        addThreadHists(src);
+        freeExemplars();
+        maxExemplars = src.maxExemplars;
+        exemplarThreshold = (maxExemplars) ? 0 : NO_EXEMPLAR;
+        addExemplars(src);
         return *this;
     }
 
     // this += rhs
-    LatencyItem& operator+=(const LatencyItem& rhs) {
+    LatencyItemT& operator+=(const LatencyItemT& rhs) {
         hist += rhs.hist;
+        overheadNs += rhs.getOverheadNs();
+        addLabelHists(rhs);
+        addThreadHists(rhs);
+        addExemplars(rhs);
         return *this;
     }
 
     // returning lhs + rhs
-    friend LatencyItem operator+(LatencyItem lhs,
-                                 const LatencyItem& rhs)
+    friend LatencyItemT operator+(LatencyItemT lhs,
+                                  const LatencyItemT& rhs)
     {
-        lhs.hist += rhs.hist;
+        lhs += rhs;
         return lhs;
     }
 
-    std::string getName() const {
+    const std::string& getName() const {
         return statName;
     }
 
-    void addLatency(uint64_t latency) { hist.add(latency); }
+    void setName(const std::string& name) {
+        statName = name;
+        parsePath();
+    }
+
+    void addLatency(uint64_t latency,
+                    LatencyLabelId label = LatencyLabelRegistry::NO_LABEL,
+                    uint64_t exemplar_tag = 0) {
+        hist.add(latency);
+        if (label != LatencyLabelRegistry::NO_LABEL) {
+            getLabelHist(label).add(latency);
+        }
+        ThreadHists* th = threadHists.load(std::memory_order_acquire);
+        if (th) {
+            getThreadHist(th, LatencyThreadRegistry::getCurrentKey())
+                .add(latency);
+        }
+        if (latency > exemplarThreshold.load(std::memory_order_relaxed)) {
+            addExemplar(latency, exemplar_tag);
+        }
+    }
+
+    // Same as `addLatency`, but without atomic read-modify-write.
+    // Only for the items that are updated by a single thread.
+    void addLatencyNonAtomic(uint64_t latency,
+                             LatencyLabelId label
+                                 = LatencyLabelRegistry::NO_LABEL,
+                             uint64_t exemplar_tag = 0) {
+        hist.addNonAtomic(latency);
+        if (label != LatencyLabelRegistry::NO_LABEL) {
+            getLabelHist(label).addNonAtomic(latency);
+        }
+        ThreadHists* th = threadHists.load(std::memory_order_acquire);
+        if (th) {
+            getThreadHist(th, LatencyThreadRegistry::getCurrentKey())
+                .addNonAtomic(latency);
+        }
+        if (latency > exemplarThreshold.load(std::memory_order_relaxed)) {
+            addExemplar(latency, exemplar_tag);
+        }
+    }
+
+    /**
+     * Add `num` latencies of the same label set at once.
+     * See `HistT::addBatch()`.
+     *
+     * @param thread_key Thread that recorded the latencies, for the
+     *                   per-thread breakdown. The current thread if
+     *                   `NO_KEY`.
+     */
+    void addLatencyBatch(const uint64_t* latencies,
+                         size_t num,
+                         LatencyLabelId label = LatencyLabelRegistry::NO_LABEL,
+                         LatencyThreadKey thread_key
+                             = LatencyThreadRegistry::NO_KEY) {
+        addBufferedBatch(latencies, num, label, thread_key);
+        for (size_t ii = 0; ii < num; ++ii) {
+            uint64_t latency = latencies[ii];
+            if (latency > exemplarThreshold.load(std::memory_order_relaxed)) {
+                addExemplar(latency, 0);
+            }
+        }
+    }
+
+    /**
+     * Same as `addLatencyBatch`, but for the samples buffered by a thread:
+     * they are only added to the histograms, as the samples that could be
+     * exemplars were not buffered, see `isNotable()`.
+     */
+    void addBufferedBatch(const uint64_t* latencies,
+                          size_t num,
+                          LatencyLabelId label,
+                          LatencyThreadKey thread_key) {
+        hist.addBatch(latencies, num);
+        if (label != LatencyLabelRegistry::NO_LABEL) {
+            getLabelHist(label).addBatch(latencies, num);
+        }
+        ThreadHists* th = threadHists.load(std::memory_order_acquire);
+        if (th) {
+            if (thread_key == LatencyThreadRegistry::NO_KEY) {
+                thread_key = LatencyThreadRegistry::getCurrentKey();
+            }
+            getThreadHist(th, thread_key).addBatch(latencies, num);
+        }
+    }
+
+    /**
+     * Attach a slow scope rule of `LatencySlowScopeNotifier`.
+     * Not copied to other items.
+     */
+    void setSlowScopeRule(uint32_t rule_id, uint64_t threshold) {
+        slowRule.store(rule_id, std::memory_order_relaxed);
+        slowThreshold.store(threshold, std::memory_order_release);
+    }
+
+    // Return the rule ID if the given latency exceeds its threshold,
+    // or `NO_RULE` otherwise.
+    uint32_t checkSlowScope(uint64_t latency) const {
+        if (latency <= slowThreshold.load(std::memory_order_relaxed)) {
+            return LatencySlowScopeNotifier::NO_RULE;
+        }
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slowRule.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * True if the given latency would be kept as an exemplar, or exceeds
+     * the slow scope threshold. Such samples need the time and thread of
+     * their recording, so that they are not buffered.
+     */
+    bool isNotable(uint64_t latency) const {
+        return latency > exemplarThreshold.load(std::memory_order_relaxed) ||
+               latency > slowThreshold.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Pin this stat so that it is not evicted while being used.
+     *
+     * @return `false` if it has been evicted already.
+     */
+    bool tryPin() {
+        uint64_t prev = pinState.fetch_add(1, std::memory_order_acq_rel);
+        if (prev & EVICTED) {
+            pinState.fetch_sub(1, std::memory_order_acq_rel);
+            return false;
+        }
+        return true;
+    }
+
+    void unpin() { pinState.fetch_sub(1, std::memory_order_acq_rel); }
+
+    // Same as `tryPin`, but never unpinned.
+    bool pinForever() {
+        uint64_t prev = pinState.fetch_or( PINNED_FOREVER,
+                                           std::memory_order_acq_rel );
+        return !(prev & EVICTED);
+    }
+
+    // Mark this stat evicted, only if it is not pinned.
+    bool tryEvict() {
+        uint64_t expected = 0;
+        return pinState.compare_exchange_strong
+               ( expected, EVICTED, std::memory_order_acq_rel );
+    }
+
+    // Mark this stat evicted regardless of pins, e.g., at destruction.
+    void retire() { pinState.fetch_or(EVICTED, std::memory_order_acq_rel); }
+
+    bool isEvicted() const {
+        return pinState.load(std::memory_order_acquire) & EVICTED;
+    }
+
+    // Called when a map version starts to contain this stat.
+    void addMapRef() { mapRefs.fetch_add(1, std::memory_order_relaxed); }
+
+    /**
+     * Called when a map version containing this stat is destroyed, or
+     * this stat is removed from it.
+     *
+     * @return `true` if the caller should delete this stat: it is evicted
+     *         and no map version contains it anymore.
+     */
+    bool releaseMapRef() {
+        return mapRefs.fetch_sub(1, std::memory_order_acq_rel) == 1 &&
+               isEvicted();
+    }
+
+    /**
+     * Return the slowest samples kept so far, the slowest first.
+     * At most `max_exemplars` given at construction.
+     */
+    std::vector<LatencyExemplar> getExemplars() const {
+        std::vector<LatencyExemplar> ret;
+        Exemplars* ex = exemplars.load(std::memory_order_acquire);
+        if (!ex) return ret;
+        {
+            std::lock_guard<std::mutex> l(ex->lock);
+            ret = ex->samples;
+        }
+        std::sort( ret.begin(), ret.end(),
+                   [](const LatencyExemplar& a, const LatencyExemplar& b) {
+                       return a.latency > b.latency;
+                   } );
+        return ret;
+    }
+
+    /**
+     * Return the histogram of the given label set, or `nullptr`
+     * if no sample has been recorded with it.
+     */
+    const HistT* getLabelHistogram(LatencyLabelId label) const {
+        LabelHists* lh = labelHists.load(std::memory_order_acquire);
+        if (!lh || label >= LatencyLabelRegistry::MAX_LABEL_SETS) {
+            return nullptr;
+        }
+        return lh->hists[label].load(std::memory_order_acquire);
+    }
+
+    /**
+     * Return a new item containing the samples whose label set
+     * matches the given `filter` only.
+     */
+    LatencyItemT filterByLabel(const LatencyLabelRegistry& labels,
+                               const std::string& filter) const {
+        LatencyItemT ret(statName, maxLabelSets);
+        for (size_t ii = 0; ii < LatencyLabelRegistry::MAX_LABEL_SETS; ++ii) {
+            const HistT* src = getLabelHistogram(ii);
+            if (!src || !labels.match(ii, filter)) continue;
+            ret.hist += *src;
+            ret.getLabelHist(ii) += *src;
+        }
+        return ret;
+    }
+
+    // Keep a histogram for each thread (by name) from now on.
+    void enableThreadBreakdown() {
+        getThreadHists();
+    }
+
+    bool hasThreadBreakdown() const {
+        return threadHists.load(std::memory_order_acquire) != nullptr;
+    }
+
+    /**
+     * Return the histogram of the given thread, or `nullptr`
+     * if no sample has been recorded by it.
+     */
+    const HistT* getThreadHistogram(LatencyThreadKey key) const {
+        ThreadHists* th = threadHists.load(std::memory_order_acquire);
+        if (!th || key >= LatencyThreadRegistry::MAX_KEYS) return nullptr;
+        return th->hists[key].load(std::memory_order_acquire);
+    }
+
+    /**
+     * Ratio of the p99 latency of the slowest thread to that of the
+     * fastest one, among the threads in the per-thread breakdown.
+     * p99 below 1 us counts as 1 us.
+     *
+     * @param slowest If given, set to the key of the slowest thread.
+     * @param fastest If given, set to the key of the fastest thread.
+     * @return Skew, or 0 if less than two threads have samples.
+     */
+    double getThreadSkew(LatencyThreadKey* slowest = nullptr,
+                         LatencyThreadKey* fastest = nullptr) const {
+        ThreadHists* th = threadHists.load(std::memory_order_acquire);
+        if (!th) return 0;
+
+        size_t num_threads = 0;
+        uint64_t max_p99 = 0, min_p99 = 0;
+        LatencyThreadKey max_key = 0, min_key = 0;
+        for (size_t ii = 0; ii < LatencyThreadRegistry::MAX_KEYS; ++ii) {
+            HistT* h = th->hists[ii].load(std::memory_order_acquire);
+            if (!h || !h->getTotal()) continue;
+            uint64_t p99 = std::max((uint64_t)1, h->estimate(99));
+            if (!num_threads++ || p99 > max_p99) {
+                max_p99 = p99;
+                max_key = ii;
+            }
+            if (num_threads == 1 || p99 < min_p99) {
+                min_p99 = p99;
+                min_key = ii;
+            }
+        }
+        if (num_threads < 2) return 0;
+        if (slowest) *slowest = max_key;
+        if (fastest) *fastest = min_key;
+        return (double)max_p99 / min_p99;
+    }
+
+    // Add the estimated instrumentation cost included in this stat.
+    void addOverhead(uint64_t ns) {
+        overheadNs.fetch_add(ns, std::memory_order_relaxed);
+    }
+
+    uint64_t getOverheadNs() const {
+        return overheadNs.load(std::memory_order_relaxed);
+    }
+
+    // Memory consumed by the histograms of this stat, in bytes.
+    size_t getHistogramBytes() const {
+        size_t ret = hist.getMemoryUsage();
+        LabelHists* lh = labelHists.load(std::memory_order_acquire);
+        if (lh) {
+            for (auto& entry: lh->hists) {
+                HistT* label_hist = entry.load(std::memory_order_acquire);
+                if (label_hist) ret += label_hist->getMemoryUsage();
+            }
+        }
+        ThreadHists* th = threadHists.load(std::memory_order_acquire);
+        if (th) {
+            for (auto& entry: th->hists) {
+                HistT* thread_hist = entry.load(std::memory_order_acquire);
+                if (thread_hist) ret += thread_hist->getMemoryUsage();
+            }
+        }
+        return ret;
+    }
+
+    // Memory consumed by this stat, including its histograms, in bytes.
+    size_t getMemoryUsage() const {
+        size_t ret = sizeof(*this) - sizeof(hist) + statName.capacity();
+        if (labelHists.load(std::memory_order_acquire)) {
+            ret += sizeof(LabelHists);
+        }
+        if (threadHists.load(std::memory_order_acquire)) {
+            ret += sizeof(ThreadHists);
+        }
+        Exemplars* ex = exemplars.load(std::memory_order_acquire);
+        if (ex) {
+            std::lock_guard<std::mutex> l(ex->lock);
+            ret += sizeof(Exemplars) +
+                   ex->samples.capacity() * sizeof(LatencyExemplar);
+        }
+        return ret + getHistogramBytes();
+    }
+
     uint64_t getAvgLatency() const { return hist.getAverage(); }
     uint64_t getTotalTime() const { return hist.getSum(); }
     uint64_t getNumCalls() const { return hist.getTotal(); }
@@ -129,165 +1042,1559 @@ public:
     uint64_t getMinLatency() { return hist.estimate(1); }
     uint64_t getPercentile(double percentile) { return hist.estimate(percentile); }
 
-    size_t getNumStacks() const {
-        size_t pos = 0;
-        size_t str_size = statName.size();
-        size_t ret = 0;
-        while (pos < str_size) {
-            pos = statName.find(" ## ", pos);
-            if (pos == std::string::npos) break;
-            pos += 4;
-            ret++;
+    // `num` percentiles at once, e.g., for dumps.
+    void getPercentiles(const double* percentiles, uint64_t* dst, size_t num) {
+        hist.estimate(percentiles, dst, num);
+    }
+
+    // Depth of the call path, e.g., 2 for " ## a ## b", 0 if not a path.
+    size_t getNumStacks() const { return pathDepth; }
+
+    std::string getActualFunction() const {
+        return statName.substr(leafOffset);
+    }
+
+    const std::string& getStatName() const { return statName; }
+
+    // Leaf function of the call path (or the whole name if not a path),
+    // valid while this item is alive and not renamed.
+    LatencyStringView getLeafView() const {
+        return LatencyStringView( statName.data() + leafOffset,
+                                  statName.size() - leafOffset );
+    }
+
+    // Call path of the caller, empty if this is not a path or at the top.
+    LatencyStringView getParentPathView() const {
+        if (pathDepth < 2) return LatencyStringView();
+        return LatencyStringView( statName.data(), leafOffset - PATH_SEP_LEN );
+    }
+
+    /**
+     * Stat of the caller, linked by the collector once both are registered.
+     * `nullptr` if not linked (yet), at the top, or a copied item.
+     */
+    LatencyItemT* getParent() const {
+        return parentItem.load(std::memory_order_acquire);
+    }
+
+    void setParent(LatencyItemT* parent) {
+        parentItem.store(parent, std::memory_order_release);
+    }
+
+    /**
+     * Call `func(lower_bound, upper_bound, count)` for each non-empty bin
+     * of the histogram, in the order of its iterator.
+     */
+    template<typename Func>
+    void forEachBin(Func func) const {
+        for (auto& itr: hist) {
+            uint64_t cnt = itr.getCount();
+            if (cnt) func(itr.getLowerBound(), itr.getUpperBound(), cnt);
+        }
+    }
+
+    std::map<double, uint64_t> dumpHistogram() const {
+        std::map<double, uint64_t> ret;
+        for (auto& itr: hist) {
+            uint64_t cnt = itr.getCount();
+            if (cnt) {
+                ret.insert( std::make_pair(itr.getUpperBound(), cnt) );
+            }
+        }
+        return ret;
+    }
+
+private:
+    // Length of " ## ", the separator of call path.
+    static const size_t PATH_SEP_LEN = 4;
+
+    // Find the depth and the leaf function of the call path, once.
+    void parsePath() {
+        pathDepth = 0;
+        leafOffset = 0;
+        size_t pos = statName.find(" ## ");
+        while (pos != std::string::npos) {
+            pathDepth++;
+            leafOffset = pos + PATH_SEP_LEN;
+            pos = statName.find(" ## ", leafOffset);
+        }
+    }
+
+    // Threshold that no sample can beat.
+    static const uint64_t NO_EXEMPLAR = std::numeric_limits<uint64_t>::max();
+    static const uint64_t NO_SLOW_THRESHOLD =
+        std::numeric_limits<uint64_t>::max();
+
+    // Min-heap of the slowest samples, by latency.
+    struct Exemplars {
+        std::mutex lock;
+        std::vector<LatencyExemplar> samples;
+    };
+
+    static bool exemplarGreater(const LatencyExemplar& a,
+                                const LatencyExemplar& b) {
+        return a.latency > b.latency;
+    }
+
+    // Slow path: the given sample beats the current K-th slowest one.
+    void addExemplar(uint64_t latency, uint64_t tag) {
+        LatencyExemplar sample;
+        sample.latency = latency;
+        sample.timestamp = std::chrono::duration_cast<std::chrono::microseconds>
+                           ( std::chrono::system_clock::now()
+                                 .time_since_epoch() ).count();
+        sample.threadId = latencyThreadId();
+        sample.tag = tag;
+        insertExemplar(sample);
+    }
+
+    void insertExemplar(const LatencyExemplar& sample) {
+        if (!maxExemplars) return;
+
+        Exemplars* ex = exemplars.load(std::memory_order_acquire);
+        if (!ex) {
+            Exemplars* new_ex = new Exemplars();
+            if (exemplars.compare_exchange_strong(ex, new_ex)) {
+                ex = new_ex;
+            } else {
+                // Other thread already allocated it, `ex` is updated.
+                delete new_ex;
+            }
+        }
+
+        std::lock_guard<std::mutex> l(ex->lock);
+        std::vector<LatencyExemplar>& samples = ex->samples;
+        if (samples.size() >= maxExemplars) {
+            // Other thread may have raised the threshold in the meantime.
+            if (sample.latency <= samples.front().latency) return;
+            std::pop_heap(samples.begin(), samples.end(), exemplarGreater);
+            samples.pop_back();
+        }
+        samples.push_back(sample);
+        std::push_heap(samples.begin(), samples.end(), exemplarGreater);
+        if (samples.size() >= maxExemplars) {
+            exemplarThreshold.store( samples.front().latency,
+                                     std::memory_order_relaxed );
+        }
+    }
+
+    void addExemplars(const LatencyItemT& src) {
+        for (const LatencyExemplar& sample: src.getExemplars()) {
+            if (sample.latency <= exemplarThreshold.load()) break;
+            insertExemplar(sample);
+        }
+    }
+
+    void freeExemplars() {
+        delete exemplars.exchange(nullptr);
+    }
+
+    struct LabelHists {
+        LabelHists() : numUsed(0) {
+            for (auto& entry: hists) entry = nullptr;
+        }
+        ~LabelHists() {
+            for (auto& entry: hists) delete entry.load();
+        }
+        std::atomic<HistT*> hists[LatencyLabelRegistry::MAX_LABEL_SETS];
+        std::atomic<size_t> numUsed;
+    };
+
+    HistT& getLabelHist(LatencyLabelId label) {
+        LabelHists* lh = labelHists.load(std::memory_order_acquire);
+        if (!lh) {
+            // First labeled sample of this stat.
+            LabelHists* new_lh = new LabelHists();
+            if (labelHists.compare_exchange_strong(lh, new_lh)) {
+                lh = new_lh;
+            } else {
+                // Other thread already allocated it, `lh` is updated.
+                delete new_lh;
+            }
+        }
+
+        if (label >= LatencyLabelRegistry::MAX_LABEL_SETS) {
+            label = LatencyLabelRegistry::OVERFLOW_LABEL;
+        }
+        HistT* h = lh->hists[label].load(std::memory_order_acquire);
+        if (h) return *h;
+
+        // New label set for this stat, check the cardinality limit.
+        if ( label != LatencyLabelRegistry::OVERFLOW_LABEL &&
+             lh->numUsed.fetch_add(1) >= maxLabelSets ) {
+            lh->numUsed.fetch_sub(1);
+            return getLabelHist(LatencyLabelRegistry::OVERFLOW_LABEL);
+        }
+
+        HistT* new_h = new HistT();
+        if (lh->hists[label].compare_exchange_strong(h, new_h)) {
+            return *new_h;
+        }
+        // Other thread added it at the same time.
+        delete new_h;
+        if (label != LatencyLabelRegistry::OVERFLOW_LABEL) {
+            lh->numUsed.fetch_sub(1);
+        }
+        return *h;
+    }
+
+    void addLabelHists(const LatencyItemT& src) {
+        for (size_t ii = 0; ii < LatencyLabelRegistry::MAX_LABEL_SETS; ++ii) {
+            const HistT* src_h = src.getLabelHistogram(ii);
+            if (src_h) getLabelHist(ii) += *src_h;
+        }
+    }
+
+    void freeLabelHists() {
+        delete labelHists.exchange(nullptr);
+    }
+
+    // Per-thread histograms, indexed by `LatencyThreadKey`.
+    struct ThreadHists {
+        ThreadHists() {
+            for (auto& entry: hists) entry = nullptr;
+        }
+        ~ThreadHists() {
+            for (auto& entry: hists) delete entry.load();
+        }
+        std::atomic<HistT*> hists[LatencyThreadRegistry::MAX_KEYS];
+    };
+
+    ThreadHists* getThreadHists() {
+        ThreadHists* th = threadHists.load(std::memory_order_acquire);
+        if (th) return th;
+        ThreadHists* new_th = new ThreadHists();
+        if (threadHists.compare_exchange_strong(th, new_th)) return new_th;
+        // Other thread already allocated it, `th` is updated.
+        delete new_th;
+        return th;
+    }
+
+    static HistT& getThreadHist(ThreadHists* th, LatencyThreadKey key) {
+        if (key >= LatencyThreadRegistry::MAX_KEYS) {
+            key = LatencyThreadRegistry::OVERFLOW_KEY;
+        }
+        HistT* h = th->hists[key].load(std::memory_order_acquire);
+        if (h) return *h;
+
+        HistT* new_h = new HistT();
+        if (th->hists[key].compare_exchange_strong(h, new_h)) return *new_h;
+        // Other thread of the same name added it at the same time.
+        delete new_h;
+        return *h;
+    }
+
+    void addThreadHists(const LatencyItemT& src) {
+        if (!src.hasThreadBreakdown()) return;
+        ThreadHists* th = getThreadHists();
+        for (size_t ii = 0; ii < LatencyThreadRegistry::MAX_KEYS; ++ii) {
+            const HistT* src_h = src.getThreadHistogram(ii);
+            if (src_h) getThreadHist(th, ii) += *src_h;
+        }
+    }
+
+    void freeThreadHists() {
+        delete threadHists.exchange(nullptr);
+    }
+
+    std::string statName;
+    HistT hist;
+
+    // Pre-parsed `statName`, see `parsePath()`.
+    size_t pathDepth;
+    size_t leafOffset;
+
+    // Max number of label sets that this stat can have.
+    size_t maxLabelSets;
+
+    // Per-label-set histograms, allocated on the first labeled sample.
+    std::atomic<LabelHists*> labelHists;
+
+    // Per-thread histograms, allocated by `enableThreadBreakdown()`.
+    std::atomic<ThreadHists*> threadHists;
+
+    // Estimated instrumentation cost included in this stat, in nanoseconds.
+    std::atomic<uint64_t> overheadNs;
+
+    // Max number of the slowest samples to keep.
+    size_t maxExemplars;
+
+    // Latency that a sample should exceed to be an exemplar,
+    // i.e., the K-th slowest one so far.
+    std::atomic<uint64_t> exemplarThreshold;
+
+    // Allocated on the first exemplar.
+    std::atomic<Exemplars*> exemplars;
+
+    // Slow scope rule attached to this stat, and its threshold.
+    std::atomic<uint64_t> slowThreshold;
+    std::atomic<uint32_t> slowRule;
+
+    // Stat of the caller, see `getParent()`.
+    std::atomic<LatencyItemT*> parentItem;
+
+    // Number of pins, and the flags below.
+    static const uint64_t PINNED_FOREVER = (uint64_t)1 << 62;
+    static const uint64_t EVICTED = (uint64_t)1 << 63;
+    std::atomic<uint64_t> pinState;
+
+    // Number of map versions containing this stat.
+    std::atomic<uint64_t> mapRefs;
+
+    // Idle tracking, only accessed by the evicting thread of the collector.
+    template<typename Policy> friend class LatencyCollectorT;
+    uint64_t lastSeenCalls;
+    uint64_t idleSinceMs;
+};
+
+template<typename Policy> class LatencyCollectorT;
+template<typename HistT>
+class MapWrapperT {
+    template<typename Policy> friend class LatencyCollectorT;
+    friend class LatencyDumpT<HistT>;
+public:
+    using Item = LatencyItemT<HistT>;
+
+    MapWrapperT(const LatencyLabelRegistry* _labels = nullptr,
+                std::atomic<uint64_t>* _num_alive = nullptr)
+        : labels(_labels)
+        , numAlive(_num_alive)
+    {
+        if (numAlive) numAlive->fetch_add(1, std::memory_order_relaxed);
+    }
+    MapWrapperT(const MapWrapperT &src) : numAlive(src.numAlive) {
+        copyFrom(src);
+        if (numAlive) numAlive->fetch_add(1, std::memory_order_relaxed);
+    }
+
+    ~MapWrapperT() {
+        for (auto& entry: map) {
+            if (entry.second->releaseMapRef()) delete entry.second;
+        }
+        if (numAlive) numAlive->fetch_sub(1, std::memory_order_relaxed);
+    }
+
+    size_t getSize() const {
+        size_t ret = 0;
+        for (auto& entry: map) {
+            if (entry.second->getNumCalls()) {
+                ret++;
+            }
+        }
+        return ret;
+    }
+
+    void copyFrom(const MapWrapperT &src) {
+        // Make a clone (but the map will point to same LatencyItems)
+        map = src.map;
+        for (auto& entry: map) entry.second->addMapRef();
+        labels = src.labels;
+    }
+
+    Item* addItem(const std::string& bin_name,
+                  size_t max_label_sets = Item::DEFAULT_MAX_LABEL_SETS,
+                  size_t max_exemplars = Item::DEFAULT_MAX_EXEMPLARS) {
+        Item* item = new Item(bin_name, max_label_sets, max_exemplars);
+        item->addMapRef();
+        map.insert( std::make_pair(bin_name, item) );
+        return item;
+    }
+
+    /**
+     * Remove an evicted item from this version. It is deleted once no
+     * other version contains it, as other threads may still be using it.
+     */
+    void removeItem(const std::string& bin_name) {
+        auto entry = map.find(bin_name);
+        if (entry == map.end()) return;
+        Item* item = entry->second;
+        map.erase(entry);
+        if (item->releaseMapRef()) delete item;
+    }
+
+    // Delete an item that has not been published yet.
+    void delItem(const std::string& bin_name) {
+        Item* item = nullptr;
+        auto entry = map.find(bin_name);
+        if (entry != map.end()) {
+            item = entry->second;
+            map.erase(entry);
+            delete item;
+        }
+    }
+
+    Item* get(const std::string& bin_name) {
+        Item* item = nullptr;
+        auto entry = map.find(bin_name);
+        if (entry != map.end()) {
+            item = entry->second;
+        }
+        return item;
+    }
+
+    std::string dump(LatencyDumpT<HistT>* dump_inst,
+                     const LatencyCollectorDumpOptions& opt) {
+        if (dump_inst) return dump_inst->dump(this, opt);
+        return "null dump implementation";
+    }
+
+    std::string dumpTree(LatencyDumpT<HistT>* dump_inst,
+                         const LatencyCollectorDumpOptions& opt) {
+        if (dump_inst) return dump_inst->dumpTree(this, opt);
+        return "null dump implementation";
+    }
+
+    // Items also in other versions are deleted along with them.
+    void freeAllItems() {
+        for (auto& entry : map) {
+            entry.second->retire();
+            if (entry.second->releaseMapRef()) delete entry.second;
+        }
+        map.clear();
+    }
+
+private:
+    std::unordered_map<std::string, Item*> map;
+
+    // Label set names, owned by the collector.
+    const LatencyLabelRegistry* labels;
+
+    // Number of live map versions, owned by the collector.
+    std::atomic<uint64_t>* numAlive;
+};
+
+template<typename HistT>
+inline std::unordered_map<std::string, LatencyItemT<HistT>*>&
+    LatencyDumpT<HistT>::getMap(MapWrapperT<HistT>* map_w)
+{
+    return map_w->map;
+}
+
+template<typename HistT>
+inline const LatencyLabelRegistry*
+    LatencyDumpT<HistT>::getLabels(MapWrapperT<HistT>* map_w)
+{
+    return map_w->labels;
+}
+
+/**
+ * Secondary indexes of the stats in the collector, for aggregate queries:
+ *   * leaf function name -> stats, and
+ *   * call path -> stat, sorted so that a subtree is a contiguous range.
+ *
+ * Unlike `MapWrapperT`, it is not copied for each map version. Stats are
+ * added incrementally once they are published, and never removed until
+ * the collector is destroyed.
+ */
+template<typename HistT>
+class LatencyStatIndexT {
+public:
+    using Item = LatencyItemT<HistT>;
+
+    /**
+     * Add a newly published stat, and link it to its caller and callees
+     * (registered in any order, e.g., callees first when scopes end).
+     */
+    void add(Item* item) {
+        std::lock_guard<std::mutex> l(lock);
+        LatencyStringView leaf = item->getLeafView();
+        byLeaf[std::string(leaf.data(), leaf.size())].push_back(item);
+        const std::string& path = item->getName();
+        byPath.insert( std::make_pair(path, item) );
+        if (!item->getNumStacks()) return;
+
+        LatencyStringView parent_path = item->getParentPathView();
+        if (!parent_path.empty()) {
+            auto parent = byPath.find
+                          ( std::string(parent_path.data(), parent_path.size()) );
+            if (parent != byPath.end()) item->setParent(parent->second);
+        }
+
+        std::string child_prefix = path + " ## ";
+        for ( auto itr = byPath.lower_bound(child_prefix);
+              itr != byPath.end(); ++itr ) {
+            if (itr->first.compare(0, child_prefix.size(), child_prefix)) break;
+            if (itr->second->getNumStacks() == item->getNumStacks() + 1) {
+                itr->second->setParent(item);
+            }
+        }
+    }
+
+    // Remove an evicted stat, and unlink its callees.
+    void remove(Item* item) {
+        std::lock_guard<std::mutex> l(lock);
+        LatencyStringView leaf = item->getLeafView();
+        auto entry = byLeaf.find( std::string(leaf.data(), leaf.size()) );
+        if (entry != byLeaf.end()) {
+            std::vector<Item*>& items = entry->second;
+            items.erase( std::remove(items.begin(), items.end(), item),
+                         items.end() );
+            if (items.empty()) byLeaf.erase(entry);
+        }
+        byPath.erase(item->getName());
+
+        std::string child_prefix = item->getName() + " ## ";
+        for ( auto itr = byPath.lower_bound(child_prefix);
+              itr != byPath.end(); ++itr ) {
+            if (itr->first.compare(0, child_prefix.size(), child_prefix)) break;
+            if (itr->second->getParent() == item) {
+                itr->second->setParent(nullptr);
+            }
+        }
+    }
+
+    // Call `func` for all the stats whose leaf function is the given one.
+    template<typename F>
+    void forEachByLeaf(const std::string& func_name, F func) {
+        std::lock_guard<std::mutex> l(lock);
+        auto entry = byLeaf.find(func_name);
+        if (entry == byLeaf.end()) return;
+        for (Item* item: entry->second) func(item);
+    }
+
+    /**
+     * Call `func` for the stat of the given call path and all the stats
+     * under it, e.g., " ## a" covers " ## a" and " ## a ## b",
+     * but not " ## ab".
+     */
+    template<typename F>
+    void forEachInSubtree(const std::string& path, F func) {
+        std::lock_guard<std::mutex> l(lock);
+        for (auto itr = byPath.lower_bound(path); itr != byPath.end(); ++itr) {
+            const std::string& name = itr->first;
+            if (name.compare(0, path.size(), path) != 0) break;
+            if ( name.size() == path.size() ||
+                 name.compare(path.size(), 4, " ## ") == 0 ) {
+                func(itr->second);
+            }
+        }
+    }
+
+private:
+    std::mutex lock;
+    std::unordered_map< std::string, std::vector<Item*> > byLeaf;
+    std::map<std::string, Item*> byPath;
+};
+
+template<typename Policy, bool ENABLED = Policy::ENABLED>
+struct LatencyCollectWrapperT;
+
+struct ThreadTrackerItem;
+
+/**
+ * Per-thread state of a collector, owned by the thread's tracker.
+ * The tracker calls `onThreadExit()` when the thread exits.
+ */
+class LatencyThreadBufferBase {
+public:
+    virtual ~LatencyThreadBufferBase() {}
+
+    // Flush any pending data, and detach from the collector.
+    virtual void onThreadExit() = 0;
+
+    // True if the collector has been destroyed.
+    virtual bool isDetached() const = 0;
+};
+
+// Buffers of a call path tracker, reused by new threads.
+struct ThreadTrackerBuffers {
+    // Initial size of the call path buffer.
+    static const size_t DEFAULT_NAME_BYTES = 4096;
+    // Buffers grown beyond this are not pooled.
+    static const size_t MAX_POOLED_NAME_BYTES = 64 * 1024;
+    // Nested scopes do not allocate up to this depth.
+    static const size_t DEFAULT_DEPTH = 64;
+
+    std::vector<char> aggrStackNameRaw;
+    std::vector<size_t> lenStack;
+    std::vector<uint64_t> childOverheadNs;
+    std::string aggrStackName;
+};
+
+// Call path trackers of all live threads.
+class ThreadTrackerRegistry {
+public:
+    // Max number of buffers kept in the pool.
+    static const size_t MAX_POOLED_BUFFERS = 256;
+
+    ThreadTrackerRegistry() : numReused(0) {}
+
+    static ThreadTrackerRegistry& get() {
+        static ThreadTrackerRegistry instance;
+        return instance;
+    }
+
+    // Buffers of an exited thread if any, or new ones.
+    ThreadTrackerBuffers acquireBuffers() {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            if (!pool.empty()) {
+                ThreadTrackerBuffers ret = std::move(pool.back());
+                pool.pop_back();
+                numReused++;
+                return ret;
+            }
+        }
+        ThreadTrackerBuffers ret;
+        ret.aggrStackNameRaw.resize(ThreadTrackerBuffers::DEFAULT_NAME_BYTES);
+        ret.lenStack.reserve(ThreadTrackerBuffers::DEFAULT_DEPTH);
+        return ret;
+    }
+
+    void releaseBuffers(ThreadTrackerBuffers&& buffers) {
+        if ( buffers.aggrStackNameRaw.size() >
+                 ThreadTrackerBuffers::MAX_POOLED_NAME_BYTES ) {
+            return;
+        }
+        buffers.lenStack.clear();
+        buffers.childOverheadNs.clear();
+        buffers.aggrStackName.clear();
+        std::lock_guard<std::mutex> l(lock);
+        if (pool.size() < MAX_POOLED_BUFFERS) {
+            pool.push_back( std::move(buffers) );
+        }
+    }
+
+    size_t getNumPooled() {
+        std::lock_guard<std::mutex> l(lock);
+        return pool.size();
+    }
+
+    uint64_t getNumReused() {
+        std::lock_guard<std::mutex> l(lock);
+        return numReused;
+    }
+
+    void add(ThreadTrackerItem* tracker) {
+        std::lock_guard<std::mutex> l(lock);
+        trackers.push_back(tracker);
+    }
+
+    void remove(ThreadTrackerItem* tracker) {
+        std::lock_guard<std::mutex> l(lock);
+        trackers.erase( std::remove(trackers.begin(), trackers.end(), tracker),
+                        trackers.end() );
+    }
+
+    inline void getStats(std::vector<LatencyCollectorHealth::Tracker>& dst);
+
+private:
+    std::mutex lock;
+    std::vector<ThreadTrackerItem*> trackers;
+    std::vector<ThreadTrackerBuffers> pool;
+    uint64_t numReused;
+};
+
+template<typename Policy>
+class LatencyCollectorT {
+public:
+    using PolicyType = Policy;
+    using Wrapper = LatencyCollectWrapperT<Policy>;
+    using Hist = typename Policy::Hist;
+    using Item = LatencyItemT<Hist>;
+    using MapW = MapWrapperT<Hist>;
+    using MapWSP = ashared_ptr<MapW>;
+    using Dump = LatencyDumpT<Hist>;
+
+    static const bool THREAD_SAFE = Policy::Concurrency::THREAD_SAFE;
+
+    // Stat for the samples of new stats beyond `setMaxStats()`.
+    static constexpr const char* OVERFLOW_STAT_NAME = "__overflow__";
+
+    /**
+     * The cost of a single scope is calibrated once per policy, when
+     * the first collector of the policy is built.
+     */
+    LatencyCollectorT() : LatencyCollectorT(NoCalibration()) {
+        scopeOverheadNs = policyScopeOverheadNs();
+    }
+
+private:
+    // Tag for the collector used by the calibration itself.
+    struct NoCalibration {};
+
+    explicit LatencyCollectorT(NoCalibration)
+        : maxLabelSets(Item::DEFAULT_MAX_LABEL_SETS)
+        , maxExemplars(Item::DEFAULT_MAX_EXEMPLARS)
+        , numDroppedSamples(0)
+        , overheadMode(LatencyOverheadMode::NONE)
+        , scopeOverheadNs(0)
+        , numCasRetries(0)
+        , numMapVersionsCreated(1)
+        , numMapVersionsAlive(0)
+        , numDumps(0)
+        , dumpTimeNs(0)
+        , lastDumpTimeNs(0)
+        , maxStats(0)
+        , idleTimeoutMs(0)
+        , nextEvictionMs(0)
+        , numEvictedStats(0)
+        , numOverflowLookups(0)
+        , numThreadPatterns(0)
+        , threadBufferSize(0)
+        , threadBuffers(std::make_shared<ThreadBufferList>(this))
+    {
+        latestMap = MapWSP(new MapW(&labels, &numMapVersionsAlive));
+    }
+
+public:
+    ~LatencyCollectorT() {
+        {
+            // Threads still alive will not touch this collector anymore.
+            std::lock_guard<std::mutex> l(threadBuffers->lock);
+            for (ThreadBuffer* buffer: threadBuffers->buffers) {
+                buffer->flush(this);
+            }
+            threadBuffers->buffers.clear();
+            threadBuffers->detached = true;
+        }
+        // Callbacks may access this collector.
+        slowScopes.stop();
+        latestMap->freeAllItems();
+    }
+
+    size_t getNumItems() const {
+        return latestMap->getSize();
+    }
+
+    void addStatName(const std::string& lat_name) {
+        MapWSP snapshot;
+        findItem(lat_name, snapshot);
+    }
+
+    /**
+     * Set the max number of stats. Once reached, samples of new stats
+     * are recorded as `__overflow__`, which is not counted in the limit.
+     * 0 means unlimited, which is the default.
+     */
+    void setMaxStats(size_t max_stats) {
+        maxStats = max_stats;
+    }
+
+    /**
+     * Evict the stats without any new sample for the given time,
+     * checked periodically (every 1/4 of the timeout) while adding
+     * new stats or dumping. 0 disables eviction, which is the default.
+     *
+     * Stats returned by `getItem()` or being used by a span are never
+     * evicted. An evicted stat starts from scratch if it appears again.
+     */
+    void setIdleStatTimeout(uint64_t timeout_ms) {
+        idleTimeoutMs = timeout_ms;
+        nextEvictionMs = 0;
+    }
+
+    /**
+     * Check idle stats and evict them now, see `setIdleStatTimeout()`.
+     *
+     * @return Number of evicted stats.
+     */
+    size_t evictIdleStats() {
+        uint64_t timeout_ms = idleTimeoutMs.load(std::memory_order_relaxed);
+        if (!Policy::ENABLED || !timeout_ms) return 0;
+
+        std::lock_guard<std::mutex> l(evictLock);
+        uint64_t now = nowMs();
+        nextEvictionMs = now + std::max((uint64_t)1, timeout_ms / 4);
+
+        std::vector<Item*> victims;
+        {
+            MapWSP cur_map = latestMap;
+            for (auto& entry: cur_map->map) {
+                Item* item = entry.second;
+                uint64_t num_calls = item->getNumCalls();
+                if (!item->idleSinceMs || num_calls != item->lastSeenCalls) {
+                    // New, or updated since the last check.
+                    item->lastSeenCalls = num_calls;
+                    item->idleSinceMs = now;
+                    continue;
+                }
+                if (now - item->idleSinceMs < timeout_ms) continue;
+                if (item->tryEvict()) victims.push_back(item);
+            }
+        }
+        if (victims.empty()) return 0;
+
+        for (Item* item: victims) statIndex.remove(item);
+
+        if (!THREAD_SAFE) {
+            for (Item* item: victims) latestMap->removeItem(item->getName());
+        } else {
+            // Evicted items are deleted along with the last map version
+            // containing them, so that concurrent readers are safe.
+            while (true) {
+                MapWSP cur_map = latestMap;
+                MapW* new_map_raw = new MapW(*cur_map);
+                MapWSP new_map = MapWSP(new_map_raw);
+                numMapVersionsCreated.fetch_add(1, std::memory_order_relaxed);
+                for (Item* item: victims) {
+                    new_map_raw->removeItem(item->getName());
+                }
+                MapWSP expected = cur_map;
+                if (latestMap.compare_exchange(expected, new_map)) break;
+                numCasRetries.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+        numEvictedStats.fetch_add(victims.size(), std::memory_order_relaxed);
+        return victims.size();
+    }
+
+    /**
+     * Get the ID of the given label set, which can be used for
+     * `addLatency()` or `collectBlockLatency()`.
+     */
+    LatencyLabelId internLabels(const LatencyLabels& label_set) {
+        return labels.intern(label_set);
+    }
+
+    const LatencyLabelRegistry& getLabels() const { return labels; }
+
+    /**
+     * Set the max number of distinct label sets per stat.
+     * Once a stat reaches the limit, samples with other label sets
+     * will be recorded as `__overflow__`.
+     *
+     * Note: it is applied to the stats added after this call.
+     */
+    void setMaxLabelSetsPerStat(size_t max_label_sets) {
+        maxLabelSets = max_label_sets;
+    }
+
+    /**
+     * Set the number of the slowest samples (exemplars) to keep per stat.
+     * 0 disables exemplars, which is the default.
+     *
+     * Note: it is applied to the stats added after this call.
+     */
+    void setMaxExemplarsPerStat(size_t max_exemplars) {
+        maxExemplars = max_exemplars;
+    }
+
+    void addLatency(const std::string& lat_name,
+                    uint64_t lat_value,
+                    const LatencyLabels& label_set) {
+        if (!Policy::ENABLED) return;
+        addLatency(lat_name, lat_value, labels.intern(label_set));
+    }
+
+    /**
+     * @param lat_name Name of the stat.
+     * @param lat_value Latency in microseconds.
+     * @param label Label set ID.
+     * @param exemplar_tag Kept along with the sample if it becomes one of
+     *                     the slowest ones, see `setMaxExemplarsPerStat()`.
+     */
+    void addLatency(const std::string& lat_name,
+                    uint64_t lat_value,
+                    LatencyLabelId label = LatencyLabelRegistry::NO_LABEL,
+                    uint64_t exemplar_tag = 0) {
+        if (!Policy::ENABLED) return;
+        size_t buffer_size = threadBufferSize.load(std::memory_order_relaxed);
+        if ( THREAD_SAFE && buffer_size &&
+             label == LatencyLabelRegistry::NO_LABEL && !exemplar_tag ) {
+            addBufferedLatency(lat_name, lat_value, buffer_size);
+            return;
+        }
+
+        MapWSP snapshot;
+        Item* item = findItem(lat_name, snapshot);
+        if (item) {
+            addLatency(item, lat_value, label, exemplar_tag);
+            return;
+        }
+        // Otherwise: update failed, ignore the given latency at this time.
+        numDroppedSamples.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * Add the latency of a scope measured by `LatencyCollectWrapperT`.
+     *
+     * @param lat_name Name of the stat.
+     * @param lat_ns Measured latency in nanoseconds.
+     * @param child_overhead_ns Instrumentation cost of nested scopes
+     *                          included in `lat_ns`.
+     * @param label Label set ID.
+     * @param exemplar_tag Exemplar tag.
+     */
+    void addScopeLatency(const std::string& lat_name,
+                         uint64_t lat_ns,
+                         uint64_t child_overhead_ns,
+                         LatencyLabelId label,
+                         uint64_t exemplar_tag = 0) {
+        LatencyOverheadMode mode = overheadMode.load(std::memory_order_relaxed);
+        if (mode == LatencyOverheadMode::NONE) {
+            addLatency(lat_name, lat_ns / 1000, label, exemplar_tag);
+            return;
+        }
+
+        if (mode == LatencyOverheadMode::COMPENSATE) {
+            lat_ns = (lat_ns > child_overhead_ns)
+                     ? lat_ns - child_overhead_ns : 0;
+        }
+        MapWSP snapshot;
+        Item* item = findItem(lat_name, snapshot);
+        if (!item) {
+            numDroppedSamples.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        addLatency(item, lat_ns / 1000, label, exemplar_tag);
+        // Once subtracted above, the cost of nested scopes is no longer
+        // a part of this stat: only its own cost remains.
+        item->addOverhead( (mode == LatencyOverheadMode::COMPENSATE)
+                           ? getScopeOverheadNs()
+                           : child_overhead_ns + getScopeOverheadNs() );
+    }
+
+    /**
+     * Set the overhead mode. The per-scope cost has been calibrated
+     * when the collector was built.
+     */
+    void setOverheadMode(LatencyOverheadMode mode) {
+        overheadMode = mode;
+    }
+
+    LatencyOverheadMode getOverheadMode() const {
+        return overheadMode.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Estimated cost of a single `collectFuncLatency` scope (constructor
+     * and destructor of the wrapper), in nanoseconds.
+     * 0 if the policy is disabled.
+     */
+    uint64_t getScopeOverheadNs() const {
+        return scopeOverheadNs.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Measure the cost of empty scopes using a temporary collector
+     * of the same policy, and remember it as the per-scope overhead.
+     *
+     * The scopes run on a short-lived thread, so that they are not
+     * nested under (and their overhead is not charged to) the scope
+     * of the caller, if any.
+     *
+     * @param num_scopes Number of scopes to measure.
+     * @return Calibrated per-scope overhead in nanoseconds.
+     */
+    uint64_t calibrateOverhead(size_t num_scopes = 10000) {
+        uint64_t per_scope = measureScopeOverheadNs(num_scopes);
+        if (per_scope) scopeOverheadNs = per_scope;
+        return per_scope;
+    }
+
+    /**
+     * Number of samples ignored because a new stat could not be added
+     * within `MAX_ADD_NEW_ITEM_RETRIES` due to contention.
+     */
+    uint64_t getNumDroppedSamples() const {
+        return numDroppedSamples.load(std::memory_order_relaxed);
+    }
+
+    // Add a latency to the stat returned by `getItem()`.
+    void addLatency(Item* item,
+                    uint64_t lat_value,
+                    LatencyLabelId label = LatencyLabelRegistry::NO_LABEL,
+                    uint64_t exemplar_tag = 0) {
+        if (!Policy::ENABLED) return;
+        if (THREAD_SAFE) {
+            item->addLatency(lat_value, label, exemplar_tag);
+        } else {
+            item->addLatencyNonAtomic(lat_value, label, exemplar_tag);
+        }
+
+        uint32_t rule_id = item->checkSlowScope(lat_value);
+        if (rule_id != LatencySlowScopeNotifier::NO_RULE) {
+            notifySlowScope(item, rule_id, lat_value, exemplar_tag);
+        }
+    }
+
+    /**
+     * Add latencies measured elsewhere (e.g., I/O completions) to the same
+     * stat at once. They are binned locally and then merged into the stat,
+     * which is much cheaper than calling `addLatency` for each of them.
+     *
+     * @param item Stat returned by `getItem()`.
+     * @param latencies Latencies in microseconds.
+     * @param num Number of latencies.
+     * @param label Label set ID.
+     * @param thread_key Thread to attribute the latencies to, for the
+     *                   per-thread breakdown. The current thread if
+     *                   `NO_KEY`.
+     */
+    void addLatencyBatch(Item* item,
+                         const uint64_t* latencies,
+                         size_t num,
+                         LatencyLabelId label = LatencyLabelRegistry::NO_LABEL,
+                         LatencyThreadKey thread_key
+                             = LatencyThreadRegistry::NO_KEY) {
+        if (!Policy::ENABLED || !num) return;
+        item->addLatencyBatch(latencies, num, label, thread_key);
+        for (size_t ii = 0; ii < num; ++ii) {
+            uint32_t rule_id = item->checkSlowScope(latencies[ii]);
+            if (rule_id != LatencySlowScopeNotifier::NO_RULE) {
+                notifySlowScope(item, rule_id, latencies[ii], 0);
+            }
+        }
+    }
+
+    void addLatencyBatch(const std::string& lat_name,
+                         const uint64_t* latencies,
+                         size_t num,
+                         LatencyLabelId label = LatencyLabelRegistry::NO_LABEL) {
+        if (!Policy::ENABLED || !num) return;
+        MapWSP snapshot;
+        Item* item = findItem(lat_name, snapshot);
+        if (!item) {
+            numDroppedSamples.fetch_add(num, std::memory_order_relaxed);
+            return;
+        }
+        addLatencyBatch(item, latencies, num, label);
+    }
+
+    void addLatencyBatch(const std::string& lat_name,
+                         const std::vector<uint64_t>& latencies,
+                         LatencyLabelId label = LatencyLabelRegistry::NO_LABEL) {
+        addLatencyBatch(lat_name, latencies.data(), latencies.size(), label);
+    }
+
+    /**
+     * Same as above, but for the latencies of different stats.
+     * They are grouped by stat, and each stat is updated once.
+     *
+     * @param samples Pairs of stat name and latency in microseconds.
+     */
+    void addLatencyBatch
+         ( const std::vector< std::pair<std::string, uint64_t> >& samples )
+    {
+        if (!Policy::ENABLED || samples.empty()) return;
+
+        // Consecutive samples tend to have the same name.
+        std::vector< std::pair< Item*, std::vector<uint64_t> > > groups;
+        // Keep the map versions containing the items below.
+        std::vector<MapWSP> snapshots;
+        std::unordered_map<Item*, size_t> group_idx;
+        const std::string* last_name = nullptr;
+        size_t last_group = 0;
+        for (const auto& entry: samples) {
+            if (!last_name || *last_name != entry.first) {
+                MapWSP snapshot;
+                Item* item = findItem(entry.first, snapshot);
+                if (!item) {
+                    numDroppedSamples.fetch_add(1, std::memory_order_relaxed);
+                    last_name = nullptr;
+                    continue;
+                }
+                last_name = &entry.first;
+                auto itr = group_idx.find(item);
+                if (itr == group_idx.end()) {
+                    itr = group_idx.insert
+                          ( std::make_pair(item, groups.size()) ).first;
+                    groups.push_back
+                        ( std::make_pair(item, std::vector<uint64_t>()) );
+                    if (THREAD_SAFE) snapshots.push_back(snapshot);
+                }
+                last_group = itr->second;
+            }
+            groups[last_group].second.push_back(entry.second);
+        }
+
+        for (auto& group: groups) {
+            addLatencyBatch( group.first, group.second.data(),
+                             group.second.size() );
+        }
+    }
+
+    /**
+     * Register a callback invoked when a sample of the matching stats
+     * exceeds the given threshold. Callbacks are invoked on a dedicated
+     * thread, at most `max_per_sec` times per second (up to `burst` at
+     * once) for each rule; the others are counted as suppressed.
+     *
+     * Note: rules are supposed to be added at the beginning. Stats added
+     * at the same time as this call may not get the rule.
+     *
+     * @param pattern Stat name (e.g., " ## func ## block"), or its prefix
+     *                followed by `*` (e.g., " ## func*").
+     * @param threshold_us Latency threshold in microseconds.
+     * @param callback Callback.
+     * @param max_per_sec Rate limit, 0 for unlimited.
+     * @param burst Max number of callbacks at once.
+     * @return `true` on success, `false` if there are too many rules.
+     */
+    bool addSlowScopeCallback(const std::string& pattern,
+                              uint64_t threshold_us,
+                              LatencySlowScopeCallback callback,
+                              double max_per_sec = 10,
+                              size_t burst = 10) {
+        if (!Policy::ENABLED) return false;
+        uint32_t rule_id = slowScopes.addRule( pattern, threshold_us, callback,
+                                               max_per_sec, burst );
+        if (rule_id == LatencySlowScopeNotifier::NO_RULE) return false;
+
+        // Apply to the existing stats.
+        MapWSP cur_map = latestMap;
+        for (auto& entry: cur_map->map) {
+            applySlowScopeRule(entry.second);
+        }
+        return true;
+    }
+
+    LatencySlowScopeNotifier& getSlowScopeNotifier() { return slowScopes; }
+
+    /**
+     * Keep a histogram for each thread in the matching stats, so that
+     * a slow thread is not hidden by the others. Threads are identified
+     * by `latencySetThreadName()`. See `show_threads` of
+     * `LatencyCollectorDumpOptions` to dump them.
+     *
+     * @param pattern Stat name, or its prefix followed by `*`
+     *                (`*` for all stats).
+     */
+    void addThreadBreakdown(const std::string& pattern) {
+        if (!Policy::ENABLED) return;
+        {
+            std::lock_guard<std::mutex> l(threadPatternLock);
+            threadPatterns.push_back(pattern);
+            numThreadPatterns = threadPatterns.size();
+        }
+
+        // Apply to the existing stats.
+        MapWSP cur_map = latestMap;
+        for (auto& entry: cur_map->map) {
+            applyThreadBreakdown(entry.second);
         }
-        return ret;
     }
 
-    std::string getActualFunction() const {
-        size_t level = getNumStacks();
-        if (!level) {
-            return statName;
+    /**
+     * Find the stat of the given name, or add a new one if not exist.
+     * The returned item is valid until this collector is destroyed,
+     * as it will never be evicted.
+     *
+     * Return `nullptr` if it fails to add a new stat due to contention.
+     */
+    Item* getItem(const std::string& lat_name) {
+        while (true) {
+            MapWSP snapshot;
+            Item* item = findItem(lat_name, snapshot);
+            if (!item || item->pinForever()) return item;
+            // Being evicted, it will be added again.
+            std::this_thread::yield();
         }
+    }
 
-        size_t pos = statName.rfind(" ## ");
-        return statName.substr(pos + 4);
+    /**
+     * Buffer the samples of `addLatency()` by name in each thread, and add
+     * them to the stats at once every `num_samples` samples. It avoids
+     * updating shared stats on every sample, at the cost of reads: pending
+     * samples of all threads are flushed before reading stats, and also
+     * when each thread exits. Samples with labels or exemplar tags are not
+     * buffered, nor the ones that would be exemplars or slow scope events
+     * (see `LatencyItemT::isNotable()`), so that those keep the time and
+     * thread of their recording. 0 disables it, which is the default.
+     */
+    void setThreadBufferSize(size_t num_samples) {
+        threadBufferSize = num_samples;
+        if (!num_samples) flushThreadBuffers();
     }
 
-    std::string getStatName() const { return statName; }
+    // Add the pending samples of all threads to the stats.
+    void flushThreadBuffers() {
+        std::lock_guard<std::mutex> l(threadBuffers->lock);
+        for (ThreadBuffer* buffer: threadBuffers->buffers) buffer->flush(this);
+    }
 
-    std::map<double, uint64_t> dumpHistogram() const {
-        std::map<double, uint64_t> ret;
-        for (auto& entry: hist) {
-            HistItr& itr = entry;
-            uint64_t cnt = itr.getCount();
-            if (cnt) {
-                ret.insert( std::make_pair(itr.getUpperBound(), cnt) );
-            }
+    /**
+     * Same as `getItem()`, but the item is valid only until
+     * `releaseItem()` is called. Used by spans.
+     */
+    Item* acquireItem(const std::string& lat_name) {
+        while (true) {
+            MapWSP snapshot;
+            Item* item = findItem(lat_name, snapshot);
+            if (!item || item->tryPin()) return item;
+            std::this_thread::yield();
         }
-        return ret;
     }
 
-private:
-    std::string statName;
-    Histogram hist;
-};
-
-class LatencyCollector;
-class MapWrapper {
-    friend class LatencyCollector;
-    friend class LatencyDump;
-public:
-    MapWrapper() {}
-    MapWrapper(const MapWrapper &src) {
-        copyFrom(src);
+    void releaseItem(Item* item) {
+        item->unpin();
     }
 
-    ~MapWrapper() {}
+    Item getAggrItem(const std::string& lat_name) {
+        Item ret;
+        if (lat_name.empty()) return ret;
+        flushIfBuffered();
 
-    size_t getSize() const {
-        size_t ret = 0;
-        for (auto& entry: map) {
-            if (entry.second->getNumCalls()) {
-                ret++;
+        statIndex.forEachByLeaf(lat_name, [&ret](Item* item) {
+            if (ret.getName().empty()) {
+                // Initialize.
+                ret = *item;
+            } else {
+                // Already exists.
+                ret += *item;
             }
-        }
+        });
+
         return ret;
     }
 
-    void copyFrom(const MapWrapper &src) {
-        // Make a clone (but the map will point to same LatencyItems)
-        map = src.map;
+    /**
+     * Aggregate the stat of the given call path and all the stats called
+     * under it (i.e., whose name starts with `path` + " ## ").
+     * The returned item has the name of `path`.
+     *
+     * @param path Call path, e.g., " ## func_a ## func_b".
+     */
+    Item getSubtreeAggrItem(const std::string& path) {
+        Item ret;
+        if (path.empty()) return ret;
+        flushIfBuffered();
+
+        bool found = false;
+        statIndex.forEachInSubtree(path, [&ret, &found](Item* item) {
+            if (!found) {
+                ret = *item;
+                found = true;
+            } else {
+                ret += *item;
+            }
+        });
+        if (found) ret.setName(path);
+        return ret;
     }
 
-    LatencyItem* addItem(const std::string& bin_name) {
-        LatencyItem* item = new LatencyItem(bin_name);
-        map.insert( std::make_pair(bin_name, item) );
-        return item;
+    uint64_t getAvgLatency(const std::string& lat_name) {
+        flushIfBuffered();
+        MapWSP cur_map = latestMap;
+        Item *item = cur_map->get(lat_name);
+        return (item)? item->getAvgLatency() : 0;
     }
 
-    void delItem(const std::string& bin_name) {
-        LatencyItem* item = nullptr;
-        auto entry = map.find(bin_name);
-        if (entry != map.end()) {
-            item = entry->second;
-            map.erase(entry);
-            delete item;
-        }
+    uint64_t getMinLatency(const std::string& lat_name) {
+        flushIfBuffered();
+        MapWSP cur_map = latestMap;
+        Item *item = cur_map->get(lat_name);
+        return (item && item->getNumCalls()) ? item->getMinLatency() : 0;
     }
 
-    LatencyItem* get(const std::string& bin_name) {
-        LatencyItem* item = nullptr;
-        auto entry = map.find(bin_name);
-        if (entry != map.end()) {
-            item = entry->second;
-        }
-        return item;
+    uint64_t getMaxLatency(const std::string& lat_name) {
+        flushIfBuffered();
+        MapWSP cur_map = latestMap;
+        Item *item = cur_map->get(lat_name);
+        return (item) ? item->getMaxLatency() : 0;
     }
 
-    std::string dump(LatencyDump* dump_inst,
-                     const LatencyCollectorDumpOptions& opt) {
-        if (dump_inst) return dump_inst->dump(this, opt);
-        return "null dump implementation";
+    uint64_t getTotalTime(const std::string& lat_name) {
+        flushIfBuffered();
+        MapWSP cur_map = latestMap;
+        Item *item = cur_map->get(lat_name);
+        return (item) ? item->getTotalTime() : 0;
     }
 
-    std::string dumpTree(LatencyDump* dump_inst,
-                         const LatencyCollectorDumpOptions& opt) {
-        if (dump_inst) return dump_inst->dumpTree(this, opt);
-        return "null dump implementation";
+    uint64_t getNumCalls(const std::string& lat_name) {
+        flushIfBuffered();
+        MapWSP cur_map = latestMap;
+        Item *item = cur_map->get(lat_name);
+        return (item) ? item->getNumCalls() : 0;
     }
 
-    void freeAllItems() {
-        for (auto& entry : map) {
-            delete entry.second;
-        }
+    uint64_t getOverheadNs(const std::string& lat_name) {
+        flushIfBuffered();
+        MapWSP cur_map = latestMap;
+        Item *item = cur_map->get(lat_name);
+        return (item) ? item->getOverheadNs() : 0;
     }
 
-private:
-    std::unordered_map<std::string, LatencyItem*> map;
-};
+    std::vector<LatencyExemplar> getExemplars(const std::string& lat_name) {
+        flushIfBuffered();
+        MapWSP cur_map = latestMap;
+        Item *item = cur_map->get(lat_name);
+        return (item) ? item->getExemplars() : std::vector<LatencyExemplar>();
+    }
 
-inline std::unordered_map<std::string, LatencyItem*>&
-    LatencyDump::getMap(MapWrapper* map_w)
-{
-    return map_w->map;
-}
+    uint64_t getPercentile(const std::string& lat_name, double percentile) {
+        flushIfBuffered();
+        MapWSP cur_map = latestMap;
+        Item *item = cur_map->get(lat_name);
+        return (item) ? item->getPercentile(percentile) : 0;
+    }
 
-using MapWrapperSP = ashared_ptr<MapWrapper>;
-//using MapWrapperSP = std::shared_ptr<MapWrapper>;
+    /**
+     * Get the internal state of this collector.
+     * Counters are read individually, so that they may not be consistent
+     * with each other under concurrent updates.
+     */
+    LatencyCollectorHealth getHealth() {
+        const std::memory_order MO = std::memory_order_relaxed;
+        LatencyCollectorHealth ret;
+        ret.numCasRetries = numCasRetries.load(MO);
+        ret.numDroppedSamples = numDroppedSamples.load(MO);
+        ret.numMapVersionsCreated = numMapVersionsCreated.load(MO);
+        ret.numMapVersionsAlive = numMapVersionsAlive.load(MO);
+        ret.numDumps = numDumps.load(MO);
+        ret.dumpTimeNs = dumpTimeNs.load(MO);
+        ret.lastDumpTimeNs = lastDumpTimeNs.load(MO);
+        ret.numEvictedStats = numEvictedStats.load(MO);
+        ret.numOverflowLookups = numOverflowLookups.load(MO);
+        {
+            std::lock_guard<std::mutex> l(threadBuffers->lock);
+            ret.numThreadBuffers = threadBuffers->buffers.size();
+        }
 
-class LatencyCollector {
-    friend class LatencyDump;
+        {
+            MapWSP cur_map_p = latestMap;
+            // Excluding `latestMap` and `cur_map_p`. The latest version
+            // may have been replaced in the meantime.
+            uint64_t num_refs = latestMap.use_count();
+            ret.numLatestMapRefs = (num_refs > 2) ? num_refs - 2 : 0;
+            for (auto& entry: cur_map_p->map) {
+                Item* item = entry.second;
+                ret.numItems++;
+                ret.itemBytes += item->getMemoryUsage();
+                ret.histogramBytes += item->getHistogramBytes();
+            }
+        }
 
-public:
-    LatencyCollector() {
-        latestMap = MapWrapperSP(new MapWrapper());
+        ThreadTrackerRegistry& registry = ThreadTrackerRegistry::get();
+        registry.getStats(ret.trackers);
+        ret.numPooledTrackerBuffers = registry.getNumPooled();
+        ret.numReusedTrackerBuffers = registry.getNumReused();
+        ret.numNumaFallbackShards = NumaHistogram::getNumFallbackShards();
+        return ret;
     }
 
-    ~LatencyCollector() {
-        latestMap->freeAllItems();
+    std::string dump( Dump* dump_inst,
+                      const LatencyCollectorDumpOptions& opt
+                          = LatencyCollectorDumpOptions() )
+    {
+        flushIfBuffered();
+        maybeEvictIdleStats();
+
+        auto start = std::chrono::steady_clock::now();
+        std::string ret;
+        {
+            MapWSP cur_map_p = latestMap;
+            MapW* cur_map = cur_map_p.get();
+
+            if (opt.view_type == LatencyCollectorDumpOptions::TREE) {
+                ret = cur_map->dumpTree(dump_inst, opt);
+            } else {
+                ret = cur_map->dump(dump_inst, opt);
+            }
+        }
+        uint64_t elapsed_ns = std::chrono::duration_cast
+                              <std::chrono::nanoseconds>
+                              ( std::chrono::steady_clock::now() - start )
+                              .count();
+        numDumps.fetch_add(1, std::memory_order_relaxed);
+        dumpTimeNs.fetch_add(elapsed_ns, std::memory_order_relaxed);
+        lastDumpTimeNs.store(elapsed_ns, std::memory_order_relaxed);
+
+        if (opt.show_health && dump_inst) {
+            ret += dump_inst->dumpHealth(getHealth());
+        }
+        return ret;
     }
 
-    size_t getNumItems() const {
-        return latestMap->getSize();
+private:
+    /**
+     * Per-scope cost shared by all the collectors of this policy,
+     * measured once.
+     */
+    static uint64_t policyScopeOverheadNs() {
+        static const uint64_t ns = measureScopeOverheadNs(10000);
+        return ns;
     }
 
-    void addStatName(const std::string& lat_name) {
-        MapWrapperSP cur_map = latestMap;
-        if (!cur_map->get(lat_name)) {
-            cur_map->addItem(lat_name);
-        } // Otherwise: already exists.
+    // Time `num_scopes` empty scopes, see `calibrateOverhead()`.
+    static uint64_t measureScopeOverheadNs(size_t num_scopes) {
+        if (!Policy::ENABLED || !num_scopes) return 0;
+
+        uint64_t ns = 0;
+        std::thread calibration([num_scopes, &ns]() {
+            LatencyCollectorT<Policy> scratch((NoCalibration()));
+            scratch.overheadMode = LatencyOverheadMode::TRACK;
+            // Nested scopes, to have realistic call path names.
+            Wrapper outer(&scratch, "calibration_outer");
+            auto run = [&scratch](size_t n) {
+                for (size_t ii = 0; ii < n; ++ii) {
+                    Wrapper inner(&scratch, "calibration_inner");
+                }
+            };
+            // Warm up: populate the stat.
+            run(num_scopes / 10 + 1);
+
+            auto start = std::chrono::steady_clock::now();
+            run(num_scopes);
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            ns = std::chrono::duration_cast<std::chrono::nanoseconds>
+                 (elapsed).count();
+        });
+        calibration.join();
+
+        // At least 1 ns, to distinguish it from a disabled policy.
+        return std::max((uint64_t)1, ns / num_scopes);
+    }
+
+    class ThreadBuffer;
+
+    // Thread buffers of this collector, shared with the threads.
+    struct ThreadBufferList {
+        ThreadBufferList(LatencyCollectorT* _owner)
+            : owner(_owner), detached(false) {}
+        std::mutex lock;
+        LatencyCollectorT* owner;
+        std::vector<ThreadBuffer*> buffers;
+        // Set when the collector is destroyed.
+        std::atomic<bool> detached;
+    };
+
+    /**
+     * Pending samples of a thread, grouped by stat. Owned by the thread's
+     * tracker, and flushed by either the thread (when it is full or the
+     * thread exits) or a reader. Items are pinned while they have pending
+     * samples, so that they are not evicted.
+     */
+    class ThreadBuffer : public LatencyThreadBufferBase {
+    public:
+        // Entries kept for reuse after flush, at most.
+        static const size_t MAX_KEPT_ENTRIES = 256;
+
+        ThreadBuffer(const std::shared_ptr<ThreadBufferList>& _list)
+            : list(_list)
+            , numPending(0)
+            , threadKey(LatencyThreadRegistry::NO_KEY) {}
+
+        void add(LatencyCollectorT* lat,
+                 const std::string& lat_name,
+                 uint64_t lat_value,
+                 size_t limit) {
+            std::lock_guard<std::mutex> l(lock);
+            // Samples may be flushed by other threads.
+            threadKey = LatencyThreadRegistry::getCurrentKey();
+            Entry& entry = entries[lat_name];
+            if (!entry.item) {
+                entry.item = lat->acquireItem(lat_name);
+                if (!entry.item) {
+                    lat->numDroppedSamples.fetch_add
+                        (1, std::memory_order_relaxed);
+                    return;
+                }
+            }
+            if (entry.item->isNotable(lat_value)) {
+                // Exemplars and slow scope events take the time and thread
+                // of the recording, add it right away.
+                lat->addLatency(entry.item, lat_value);
+                if (entry.samples.empty()) {
+                    lat->releaseItem(entry.item);
+                    entry.item = nullptr;
+                }
+                return;
+            }
+            entry.samples.push_back(lat_value);
+            if (++numPending >= limit) flushInternal(lat);
+        }
+
+        void flush(LatencyCollectorT* lat) {
+            std::lock_guard<std::mutex> l(lock);
+            flushInternal(lat);
+        }
+
+        void onThreadExit() {
+            std::lock_guard<std::mutex> l(list->lock);
+            if (list->detached) return;
+            flush(list->owner);
+            std::vector<ThreadBuffer*>& buffers = list->buffers;
+            buffers.erase( std::remove(buffers.begin(), buffers.end(), this),
+                           buffers.end() );
+        }
+
+        bool isDetached() const { return list->detached; }
+
+    private:
+        struct Entry {
+            Entry() : item(nullptr) {}
+            Item* item;
+            std::vector<uint64_t> samples;
+        };
+
+        void flushInternal(LatencyCollectorT* lat) {
+            if (!numPending) return;
+            for (auto& entry: entries) {
+                Entry& ee = entry.second;
+                if (!ee.item) continue;
+                ee.item->addBufferedBatch(ee.samples.data(),
+                                          ee.samples.size(),
+                                          LatencyLabelRegistry::NO_LABEL,
+                                          threadKey);
+                lat->releaseItem(ee.item);
+                ee.item = nullptr;
+                ee.samples.clear();
+            }
+            if (entries.size() > MAX_KEPT_ENTRIES) entries.clear();
+            numPending = 0;
+        }
+
+        std::shared_ptr<ThreadBufferList> list;
+        std::mutex lock;
+        std::unordered_map<std::string, Entry> entries;
+        size_t numPending;
+        // Owner thread, see `LatencyThreadRegistry`.
+        LatencyThreadKey threadKey;
+    };
+
+    inline void addBufferedLatency(const std::string& lat_name,
+                                   uint64_t lat_value,
+                                   size_t limit);
+
+    void flushIfBuffered() {
+        if (threadBufferSize.load(std::memory_order_relaxed)) {
+            flushThreadBuffers();
+        }
     }
 
-    void addLatency(const std::string& lat_name, uint64_t lat_value) {
-        MapWrapperSP cur_map = nullptr;
+    /**
+     * Find the stat of the given name, or add a new one if not exist.
+     *
+     * As idle stats may be evicted concurrently, the returned item is
+     * valid only while `snapshot` (a map version containing the item)
+     * is held, unless it is pinned.
+     */
+    Item* findItem(const std::string& lat_name, MapWSP& snapshot) {
+        if (!Policy::ENABLED) return nullptr;
+
+        if (!THREAD_SAFE) {
+            // No one else can access the map, update it in place.
+            MapW* cur_map = latestMap.get();
+            Item* item = cur_map->get(lat_name);
+            if (item) return item;
+            if (isOverCap(cur_map, lat_name)) {
+                return findOverflowItem(snapshot);
+            }
+            maybeEvictIdleStats();
+            item = addItem(cur_map, lat_name);
+            statIndex.add(item);
+            return item;
+        }
+
+        MapWSP& cur_map = snapshot;
+        bool eviction_checked = false;
 
         size_t ticks_allowed = MAX_ADD_NEW_ITEM_RETRIES;
         do {
             cur_map = latestMap;
-            LatencyItem *item = cur_map->get(lat_name);
+            Item *item = cur_map->get(lat_name);
             if (item) {
                 // Found existing latency.
-                item->addLatency(lat_value);
-                return;
+                return item;
+            }
+            if (isOverCap(cur_map.get(), lat_name)) {
+                return findOverflowItem(snapshot);
+            }
+            if (!eviction_checked) {
+                eviction_checked = true;
+                if (maybeEvictIdleStats()) continue;
             }
 
             // Not found,
@@ -303,118 +2610,227 @@ public:
             // anything.
 
             // Copy from the current map.
-            MapWrapper* new_map_raw = new MapWrapper();
-            new_map_raw->copyFrom(*cur_map);
-            MapWrapperSP new_map = MapWrapperSP(new_map_raw);
+            MapW* new_map_raw = new MapW(*cur_map);
+            MapWSP new_map = MapWSP(new_map_raw);
+            numMapVersionsCreated.fetch_add(1, std::memory_order_relaxed);
 
             // Add a new item.
-            item = new_map->addItem(lat_name);
-            item->addLatency(lat_value);
+            item = addItem(new_map.get(), lat_name);
 
             // Atomic CAS, from current map to new map
-            MapWrapperSP expected = cur_map;
+            MapWSP expected = cur_map;
             if (latestMap.compare_exchange(expected, new_map)) {
                 // Succeeded.
-                return;
+                statIndex.add(item);
+                cur_map = new_map;
+                return item;
             }
 
             // Failed, other thread updated the map at the same time.
+            numCasRetries.fetch_add(1, std::memory_order_relaxed);
             // Delete newly added item.
             new_map_raw->delItem(lat_name);
             // Retry.
         } while (ticks_allowed--);
 
-        // Update failed, ignore the given latency at this time.
+        return nullptr;
     }
 
-    LatencyItem getAggrItem(const std::string& lat_name) {
-        LatencyItem ret;
-        if (lat_name.empty()) return ret;
-
-        MapWrapperSP cur_map_p = latestMap;
-        MapWrapper* cur_map = cur_map_p.get();
-
-        for (auto& entry: cur_map->map) {
-            LatencyItem *item = entry.second;
-            std::string actual_name = item->getActualFunction();
-
-            if (actual_name != lat_name) continue;
-
-            if (ret.getName().empty()) {
-                // Initialize.
-                ret = *item;
-            } else {
-                // Already exists.
-                ret += *item;
-            }
-        }
-
-        return ret;
+    bool isOverCap(MapW* map_w, const std::string& lat_name) const {
+        size_t max_stats = maxStats.load(std::memory_order_relaxed);
+        if (!max_stats || lat_name == OVERFLOW_STAT_NAME) return false;
+        size_t num_stats = map_w->map.size();
+        if (map_w->get(OVERFLOW_STAT_NAME)) num_stats--;
+        return num_stats >= max_stats;
     }
 
-    uint64_t getAvgLatency(const std::string& lat_name) {
-        MapWrapperSP cur_map = latestMap;
-        LatencyItem *item = cur_map->get(lat_name);
-        return (item)? item->getAvgLatency() : 0;
+    Item* findOverflowItem(MapWSP& snapshot) {
+        numOverflowLookups.fetch_add(1, std::memory_order_relaxed);
+        Item* item = findItem(OVERFLOW_STAT_NAME, snapshot);
+        if (item) item->pinForever();
+        return item;
     }
 
-    uint64_t getMinLatency(const std::string& lat_name) {
-        MapWrapperSP cur_map = latestMap;
-        LatencyItem *item = cur_map->get(lat_name);
-        return (item && item->getNumCalls()) ? item->getMinLatency() : 0;
+    // Run `evictIdleStats()` if it is time to do so.
+    size_t maybeEvictIdleStats() {
+        if (!idleTimeoutMs.load(std::memory_order_relaxed)) return 0;
+        if (nowMs() < nextEvictionMs.load(std::memory_order_relaxed)) return 0;
+        return evictIdleStats();
     }
 
-    uint64_t getMaxLatency(const std::string& lat_name) {
-        MapWrapperSP cur_map = latestMap;
-        LatencyItem *item = cur_map->get(lat_name);
-        return (item) ? item->getMaxLatency() : 0;
+    static uint64_t nowMs() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>
+               ( std::chrono::steady_clock::now().time_since_epoch() ).count();
     }
 
-    uint64_t getTotalTime(const std::string& lat_name) {
-        MapWrapperSP cur_map = latestMap;
-        LatencyItem *item = cur_map->get(lat_name);
-        return (item) ? item->getTotalTime() : 0;
+    Item* addItem(MapW* map_w, const std::string& lat_name) {
+        Item* item = map_w->addItem(lat_name, maxLabelSets, maxExemplars);
+        if (slowScopes.getNumRules()) applySlowScopeRule(item);
+        if (numThreadPatterns.load(std::memory_order_relaxed)) {
+            applyThreadBreakdown(item);
+        }
+        return item;
     }
 
-    uint64_t getNumCalls(const std::string& lat_name) {
-        MapWrapperSP cur_map = latestMap;
-        LatencyItem *item = cur_map->get(lat_name);
-        return (item) ? item->getNumCalls() : 0;
+    void applyThreadBreakdown(Item* item) {
+        const std::string& name = item->getName();
+        std::lock_guard<std::mutex> l(threadPatternLock);
+        for (const std::string& pattern: threadPatterns) {
+            bool prefix = !pattern.empty() && pattern.back() == '*';
+            size_t len = (prefix) ? pattern.size() - 1 : pattern.size();
+            if ( (prefix && name.compare(0, len, pattern, 0, len) == 0) ||
+                 (!prefix && name == pattern) ) {
+                item->enableThreadBreakdown();
+                return;
+            }
+        }
     }
 
-    uint64_t getPercentile(const std::string& lat_name, double percentile) {
-        MapWrapperSP cur_map = latestMap;
-        LatencyItem *item = cur_map->get(lat_name);
-        return (item) ? item->getPercentile(percentile) : 0;
+    void applySlowScopeRule(Item* item) {
+        uint32_t rule_id = slowScopes.match(item->getName());
+        if (rule_id == LatencySlowScopeNotifier::NO_RULE) return;
+        item->setSlowScopeRule(rule_id, slowScopes.getThreshold(rule_id));
     }
 
-    std::string dump( LatencyDump* dump_inst,
-                      const LatencyCollectorDumpOptions& opt
-                          = LatencyCollectorDumpOptions() )
-    {
-        MapWrapperSP cur_map_p = latestMap;
-        MapWrapper* cur_map = cur_map_p.get();
-
-        if (opt.view_type == LatencyCollectorDumpOptions::TREE) {
-            return cur_map->dumpTree(dump_inst, opt);
-        } else {
-            return cur_map->dump(dump_inst, opt);
-        }
+    void notifySlowScope(Item* item,
+                         uint32_t rule_id,
+                         uint64_t lat_value,
+                         uint64_t exemplar_tag) {
+        // Nothing is allocated if rate limited.
+        if (!slowScopes.admit(rule_id)) return;
+
+        LatencySlowScopeEvent event;
+        event.statName = item->getName();
+        event.latency = lat_value;
+        event.timestamp = std::chrono::duration_cast<std::chrono::microseconds>
+                          ( std::chrono::system_clock::now()
+                                .time_since_epoch() ).count();
+        event.threadId = latencyThreadId();
+        event.tag = exemplar_tag;
+        slowScopes.push(rule_id, event);
     }
 
-private:
     static const size_t MAX_ADD_NEW_ITEM_RETRIES = 16;
     // Mutex for Compare-And-Swap of latestMap.
     std::mutex lock;
-    MapWrapperSP latestMap;
+    // Interned label sets, should be declared before `latestMap`.
+    LatencyLabelRegistry labels;
+    // Per-stat label set limit for newly added stats.
+    std::atomic<size_t> maxLabelSets;
+    // Per-stat exemplar limit for newly added stats.
+    std::atomic<size_t> maxExemplars;
+    // Number of samples dropped due to contention.
+    std::atomic<uint64_t> numDroppedSamples;
+    // Instrumentation cost handling.
+    std::atomic<LatencyOverheadMode> overheadMode;
+    // Calibrated cost of a single scope, in nanoseconds.
+    std::atomic<uint64_t> scopeOverheadNs;
+    // Health counters, should be declared before `latestMap`.
+    std::atomic<uint64_t> numCasRetries;
+    std::atomic<uint64_t> numMapVersionsCreated;
+    std::atomic<uint64_t> numMapVersionsAlive;
+    std::atomic<uint64_t> numDumps;
+    std::atomic<uint64_t> dumpTimeNs;
+    std::atomic<uint64_t> lastDumpTimeNs;
+    // Slow scope callbacks.
+    LatencySlowScopeNotifier slowScopes;
+    // Indexes for aggregate queries.
+    LatencyStatIndexT<Hist> statIndex;
+    // Stat cap and idle stat eviction.
+    std::atomic<size_t> maxStats;
+    std::atomic<uint64_t> idleTimeoutMs;
+    std::atomic<uint64_t> nextEvictionMs;
+    std::mutex evictLock;
+    std::atomic<uint64_t> numEvictedStats;
+    std::atomic<uint64_t> numOverflowLookups;
+    // Stat name patterns of `addThreadBreakdown()`.
+    std::mutex threadPatternLock;
+    std::vector<std::string> threadPatterns;
+    std::atomic<size_t> numThreadPatterns;
+    // Per-thread sample buffers.
+    std::atomic<size_t> threadBufferSize;
+    std::shared_ptr<ThreadBufferList> threadBuffers;
+    MapWSP latestMap;
 };
 
+template<typename Policy>
+constexpr const char* LatencyCollectorT<Policy>::OVERFLOW_STAT_NAME;
+
 struct ThreadTrackerItem {
     ThreadTrackerItem()
         : numStacks(0),
-          aggrStackNameRaw(4096),
-          lenName(0)
-        {}
+          lenName(0),
+          threadId(std::this_thread::get_id()),
+          bufferBytes(0),
+          maxDepth(0),
+          lastOwner(nullptr),
+          lastBuffer(nullptr)
+    {
+        ThreadTrackerRegistry& registry = ThreadTrackerRegistry::get();
+        ThreadTrackerBuffers buffers = registry.acquireBuffers();
+        aggrStackNameRaw = std::move(buffers.aggrStackNameRaw);
+        lenStack = std::move(buffers.lenStack);
+        childOverheadNs = std::move(buffers.childOverheadNs);
+        aggrStackName = std::move(buffers.aggrStackName);
+        updateBufferBytes();
+        registry.add(this);
+    }
+
+    ~ThreadTrackerItem() {
+        // Flush the pending data of this thread to the collectors.
+        for (auto& entry: threadBuffers) entry.second->onThreadExit();
+        threadBuffers.clear();
+
+        ThreadTrackerRegistry& registry = ThreadTrackerRegistry::get();
+        registry.remove(this);
+
+        ThreadTrackerBuffers buffers;
+        buffers.aggrStackNameRaw = std::move(aggrStackNameRaw);
+        buffers.lenStack = std::move(lenStack);
+        buffers.childOverheadNs = std::move(childOverheadNs);
+        buffers.aggrStackName = std::move(aggrStackName);
+        registry.releaseBuffers( std::move(buffers) );
+    }
+
+    /**
+     * Per-thread state of the given collector.
+     *
+     * @param owner Collector.
+     * @return State, or `nullptr` if not registered yet.
+     */
+    LatencyThreadBufferBase* findBuffer(const void* owner) {
+        if (owner == lastOwner && !lastBuffer->isDetached()) {
+            return lastBuffer;
+        }
+        LatencyThreadBufferBase* ret = nullptr;
+        for (size_t ii = 0; ii < threadBuffers.size(); ) {
+            auto& entry = threadBuffers[ii];
+            if (entry.second->isDetached()) {
+                // The collector is gone (and a new one may have
+                // the same address).
+                if (entry.second.get() == lastBuffer) {
+                    lastOwner = nullptr;
+                    lastBuffer = nullptr;
+                }
+                threadBuffers.erase(threadBuffers.begin() + ii);
+                continue;
+            }
+            if (entry.first == owner) ret = entry.second.get();
+            ++ii;
+        }
+        if (ret) {
+            lastOwner = owner;
+            lastBuffer = ret;
+        }
+        return ret;
+    }
+
+    void addBuffer(const void* owner, LatencyThreadBufferBase* buffer) {
+        threadBuffers.push_back( std::make_pair
+            ( owner, std::unique_ptr<LatencyThreadBufferBase>(buffer) ) );
+        lastOwner = owner;
+        lastBuffer = buffer;
+    }
 
     void pushStackName(const std::string& cur_stack_name) {
         size_t cur_stack_name_len = cur_stack_name.size();
@@ -425,72 +2841,347 @@ struct ThreadTrackerItem {
 
         // Remember the latest length for later poping up.
         lenStack.push_back(lenName);
+        childOverheadNs.push_back(0);
         strcpy(&aggrStackNameRaw[0] + lenName, " ## ");
         lenName += 4;
         strcpy(&aggrStackNameRaw[0] + lenName, cur_stack_name.c_str());
         lenName += cur_stack_name_len;
 
         numStacks++;
+        if (numStacks > maxDepth.load(std::memory_order_relaxed)) {
+            // Buffers may have grown only in this case.
+            maxDepth.store(numStacks, std::memory_order_relaxed);
+            updateBufferBytes();
+        }
     }
 
     size_t popLastStack() {
-        lenName = *(lenStack.rbegin());
+        lenName = lenStack.back();
         lenStack.pop_back();
+        childOverheadNs.pop_back();
 
         return --numStacks;
     }
 
-    std::string getAggrStackName() {
-        aggrStackNameRaw[lenName] = 0;
-        return &aggrStackNameRaw[0];
+    // Instrumentation cost of the scopes nested in the current one.
+    uint64_t getChildOverheadNs() const {
+        return childOverheadNs.back();
+    }
+
+    // Charge the given instrumentation cost to the current scope.
+    void addChildOverheadNs(uint64_t ns) {
+        if (!childOverheadNs.empty()) childOverheadNs.back() += ns;
+    }
+
+    // Returned string is valid until the next call.
+    const std::string& getAggrStackName() {
+        // `assign` reuses the existing capacity,
+        // no allocation once it becomes large enough.
+        size_t prev_capacity = aggrStackName.capacity();
+        aggrStackName.assign(&aggrStackNameRaw[0], lenName);
+        if (aggrStackName.capacity() != prev_capacity) updateBufferBytes();
+        return aggrStackName;
+    }
+
+    // Publish the buffer size so that other threads can read it.
+    void updateBufferBytes() {
+        size_t bytes = aggrStackNameRaw.capacity() +
+                       aggrStackName.capacity() +
+                       childOverheadNs.capacity() * sizeof(uint64_t) +
+                       lenStack.capacity() * sizeof(size_t);
+        bufferBytes.store(bytes, std::memory_order_relaxed);
+    }
+
+    // Tracker of the current thread.
+    static ThreadTrackerItem* get() {
+        thread_local ThreadTrackerItem thr_item;
+        return &thr_item;
     }
 
     size_t numStacks;
     std::vector<char> aggrStackNameRaw;
     size_t lenName;
-    std::list<size_t> lenStack;
+    std::vector<size_t> lenStack;
+    std::vector<uint64_t> childOverheadNs;
+    std::string aggrStackName;
+
+    // For `ThreadTrackerRegistry`.
+    std::thread::id threadId;
+    std::atomic<size_t> bufferBytes;
+    std::atomic<size_t> maxDepth;
+
+    // Per-collector state of this thread, and the last one looked up.
+    std::vector< std::pair< const void*,
+                            std::unique_ptr<LatencyThreadBufferBase> > >
+        threadBuffers;
+    const void* lastOwner;
+    LatencyThreadBufferBase* lastBuffer;
 };
 
-struct LatencyCollectWrapper {
-    using SystemClock = std::chrono::system_clock;
-    using TimePoint = std::chrono::time_point<SystemClock>;
-    using MicroSeconds = std::chrono::microseconds;
+inline void ThreadTrackerRegistry::getStats
+            (std::vector<LatencyCollectorHealth::Tracker>& dst)
+{
+    std::lock_guard<std::mutex> l(lock);
+    for (ThreadTrackerItem* tracker: trackers) {
+        LatencyCollectorHealth::Tracker entry;
+        std::stringstream ss;
+        ss << tracker->threadId;
+        entry.threadId = ss.str();
+        entry.bufferBytes = tracker->bufferBytes.load(std::memory_order_relaxed);
+        entry.maxDepth = tracker->maxDepth.load(std::memory_order_relaxed);
+        dst.push_back(entry);
+    }
+}
+
+template<typename Policy>
+inline void LatencyCollectorT<Policy>::addBufferedLatency
+            (const std::string& lat_name, uint64_t lat_value, size_t limit)
+{
+    ThreadTrackerItem* tracker = ThreadTrackerItem::get();
+    ThreadBuffer* buffer = static_cast<ThreadBuffer*>
+                           ( tracker->findBuffer(this) );
+    if (!buffer) {
+        buffer = new ThreadBuffer(threadBuffers);
+        {
+            std::lock_guard<std::mutex> l(threadBuffers->lock);
+            threadBuffers->buffers.push_back(buffer);
+        }
+        tracker->addBuffer(this, buffer);
+    }
+    buffer->add(this, lat_name, lat_value, limit);
+}
 
-    LatencyCollectWrapper(LatencyCollector *_lat,
-                          const std::string& _func_name) {
+template<typename Policy, bool ENABLED>
+struct LatencyCollectWrapperT {
+    using Clock = typename Policy::Clock;
+    using TimePoint = typename Clock::time_point;
+    using NanoSeconds = std::chrono::nanoseconds;
+    using Collector = LatencyCollectorT<Policy>;
+
+    LatencyCollectWrapperT(Collector *_lat,
+                           const std::string& _func_name,
+                           LatencyLabelId _label = LatencyLabelRegistry::NO_LABEL)
+        : label(_label)
+        , exemplarTag(0)
+    {
         lat = _lat;
         if (lat) {
-            start = SystemClock::now();
+            start = Clock::now();
 
-            thread_local ThreadTrackerItem thr_item;
-            cur_tracker = &thr_item;
+            cur_tracker = ThreadTrackerItem::get();
             cur_tracker->pushStackName(_func_name);
         }
     }
 
-    ~LatencyCollectWrapper() {
+    LatencyCollectWrapperT(Collector *_lat,
+                           const std::string& _func_name,
+                           const LatencyLabels& _labels)
+        : LatencyCollectWrapperT( _lat, _func_name,
+                                  (_lat) ? _lat->internLabels(_labels)
+                                         : LatencyLabelRegistry::NO_LABEL ) {}
+
+    ~LatencyCollectWrapperT() {
         if (lat) {
-            TimePoint end = SystemClock::now();
-            auto us = std::chrono::duration_cast<MicroSeconds>(end - start);
+            TimePoint end = Clock::now();
+            auto ns = std::chrono::duration_cast<NanoSeconds>(end - start);
 
-            lat->addLatency(cur_tracker->getAggrStackName(), us.count());
+            uint64_t child_overhead = cur_tracker->getChildOverheadNs();
+            lat->addScopeLatency( cur_tracker->getAggrStackName(),
+                                  ns.count(), child_overhead, label,
+                                  exemplarTag );
             cur_tracker->popLastStack();
+
+            // Nested scopes and this scope itself are the overhead
+            // of the parent scope.
+            uint64_t scope_overhead = lat->getScopeOverheadNs();
+            if ( scope_overhead &&
+                 lat->getOverheadMode() != LatencyOverheadMode::NONE ) {
+                cur_tracker->addChildOverheadNs
+                    (child_overhead + scope_overhead);
+            }
         }
     }
 
-    LatencyCollector *lat;
+    // Change the label set, if it is decided in the middle of the scope
+    // (e.g., the result of the operation).
+    void setLabels(LatencyLabelId _label) { label = _label; }
+    void setLabels(const LatencyLabels& _labels) {
+        if (lat) label = lat->internLabels(_labels);
+    }
+
+    // Tag kept along with this sample if it becomes an exemplar.
+    void setExemplarTag(uint64_t tag) { exemplarTag = tag; }
+
+    Collector *lat;
     ThreadTrackerItem *cur_tracker;
     TimePoint start;
+    LatencyLabelId label;
+    uint64_t exemplarTag;
+};
+
+// Disabled: everything is compiled out.
+template<typename Policy>
+struct LatencyCollectWrapperT<Policy, false> {
+    using LabelList = std::initializer_list< std::pair<const char*, const char*> >;
+
+    template<typename C, typename N>
+    LatencyCollectWrapperT(const C&, const N&) {}
+    template<typename C, typename N>
+    LatencyCollectWrapperT(const C&, const N&, LatencyLabelId) {}
+    template<typename C, typename N>
+    LatencyCollectWrapperT(const C&, const N&, const LatencyLabels&) {}
+    template<typename C, typename N>
+    LatencyCollectWrapperT(const C&, const N&, LabelList) {}
+
+    template<typename L>
+    void setLabels(const L&) {}
+
+    void setExemplarTag(uint64_t) {}
+};
+
+/**
+ * Movable handle of a latency whose start and end happen on different
+ * threads (e.g., an asynchronous I/O and its completion callback).
+ *
+ * The start time and the call path of the creating thread are captured
+ * at construction, and the latency is recorded into that call path
+ * whenever `finish()` is called (or the handle is destroyed), regardless
+ * of the finishing thread. Once the stat exists, neither creating nor
+ * finishing a span allocates memory.
+ */
+template<typename Policy>
+class LatencySpanT {
+public:
+    using Clock = typename Policy::Clock;
+    using TimePoint = typename Clock::time_point;
+    using MicroSeconds = std::chrono::microseconds;
+    using Collector = LatencyCollectorT<Policy>;
+    using Item = typename Collector::Item;
+
+    LatencySpanT()
+        : lat(nullptr)
+        , item(nullptr)
+        , label(LatencyLabelRegistry::NO_LABEL)
+        , exemplarTag(0) {}
+
+    LatencySpanT(Collector* _lat,
+                 const std::string& name,
+                 LatencyLabelId _label = LatencyLabelRegistry::NO_LABEL)
+        : lat(_lat)
+        , item(nullptr)
+        , label(_label)
+        , exemplarTag(0)
+    {
+        if (!lat || !Policy::ENABLED) return;
+
+        // Resolve the stat as if it is a nested scope of the current one.
+        ThreadTrackerItem* tracker = ThreadTrackerItem::get();
+        tracker->pushStackName(name);
+        item = lat->acquireItem(tracker->getAggrStackName());
+        tracker->popLastStack();
+
+        start = Clock::now();
+    }
+
+    LatencySpanT(LatencySpanT&& src)
+        : lat(src.lat)
+        , item(src.item)
+        , start(src.start)
+        , label(src.label)
+        , exemplarTag(src.exemplarTag)
+    {
+        src.item = nullptr;
+    }
+
+    LatencySpanT& operator=(LatencySpanT&& src) {
+        if (this == &src) return *this;
+        finish();
+        lat = src.lat;
+        item = src.item;
+        start = src.start;
+        label = src.label;
+        exemplarTag = src.exemplarTag;
+        src.item = nullptr;
+        return *this;
+    }
+
+    LatencySpanT(const LatencySpanT&) = delete;
+    LatencySpanT& operator=(const LatencySpanT&) = delete;
+
+    ~LatencySpanT() {
+        finish();
+    }
+
+    /**
+     * Record the latency from the creation until now.
+     * Only the first call is effective.
+     *
+     * @return Recorded latency in microseconds.
+     */
+    uint64_t finish() {
+        if (!item) return 0;
+        TimePoint end = Clock::now();
+        auto us = std::chrono::duration_cast<MicroSeconds>(end - start);
+        lat->addLatency(item, us.count(), label, exemplarTag);
+        lat->releaseItem(item);
+        item = nullptr;
+        return us.count();
+    }
+
+    // Discard this span without recording.
+    void cancel() {
+        if (item) lat->releaseItem(item);
+        item = nullptr;
+    }
+
+    bool isActive() const { return item != nullptr; }
+
+    void setLabels(LatencyLabelId _label) { label = _label; }
+
+    void setExemplarTag(uint64_t tag) { exemplarTag = tag; }
+
+private:
+    Collector* lat;
+    Item* item;
+    TimePoint start;
+    LatencyLabelId label;
+    uint64_t exemplarTag;
+};
+
+// === Default types ===
+
+using LatencyItem = LatencyItemT<LatencyDefaultPolicy::Hist>;
+using MapWrapper = MapWrapperT<LatencyDefaultPolicy::Hist>;
+using MapWrapperSP = ashared_ptr<MapWrapper>;
+using LatencyDump = LatencyDumpT<LatencyDefaultPolicy::Hist>;
+using LatencyCollector = LatencyCollectorT<LatencyDefaultPolicy>;
+using LatencyCollectWrapper = LatencyCollectWrapperT<LatencyDefaultPolicy>;
+using LatencySpan = LatencySpanT<LatencyDefaultPolicy>;
+
+// Wrapper type for the given collector pointer type.
+template<typename T>
+struct LatencyWrapperOf {
+    using type = typename std::remove_cv<
+                     typename std::remove_pointer<
+                         typename std::decay<T>::type >::type >::type
+                 ::Wrapper;
 };
+template<>
+struct LatencyWrapperOf<std::nullptr_t> {
+    using type = LatencyCollectWrapper;
+};
+template<typename T>
+using LatencyWrapperFor = typename LatencyWrapperOf<T>::type;
 
 #if defined(WIN32) || defined(_WIN32)
 #define collectFuncLatency(lat) \
-    LatencyCollectWrapper LCW__func_latency__((lat), __FUNCTION__)
+    LatencyWrapperFor<decltype(lat)> LCW__func_latency__((lat), __FUNCTION__)
 #else
 #define collectFuncLatency(lat) \
-    LatencyCollectWrapper LCW__func_latency__((lat), __func__)
+    LatencyWrapperFor<decltype(lat)> LCW__func_latency__((lat), __func__)
 #endif
 
-#define collectBlockLatency(lat, name) \
-    LatencyCollectWrapper LCW__block_latency__((lat), name)
-
+// Optional 3rd parameter: label set, e.g. {{"status", "hit"}},
+// or its ID returned by `LatencyCollector::internLabels()`.
+#define collectBlockLatency(lat, ...) \
+    LatencyWrapperFor<decltype(lat)> LCW__block_latency__((lat), __VA_ARGS__)
@@ -0,0 +1,577 @@
+/**
+ * Copyright (C) 2017-present Jung-Sang Ahn <jungsang.ahn@gmail.com>
+ * All rights reserved.
+ *
+ * https://github.com/greensky00
+ *
+ * Latency Snapshot Diff Module
+ * Version: 0.1.0
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "latency_snapshot.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <cmath>
+#include <iomanip>
+#include <limits>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * Difference of a stat between two snapshots.
+ */
+struct LatencyStatDiff {
+    enum Metric {
+        CALLS,
+        TOTAL,
+        P50,
+        P99,
+        P999
+    };
+
+    enum Status {
+        // Exists in both snapshots.
+        COMMON,
+        // Exists only in the `after` snapshot.
+        ADDED,
+        // Exists only in the `before` snapshot.
+        REMOVED
+    };
+
+    LatencyStatDiff() : status(COMMON), ksDistance(0), pValue(1) {}
+
+    std::string name;
+    Status status;
+    // Empty stat if it does not exist in the snapshot.
+    LatencySnapshotStat before;
+    LatencySnapshotStat after;
+
+    // Max distance between the cumulative distributions of the two
+    // histograms (Kolmogorov-Smirnov statistic), from 0 to 1.
+    double ksDistance;
+
+    // Probability of a distance at least `ksDistance` if both were drawn
+    // from the same distribution. The smaller, the more significant.
+    double pValue;
+
+    static uint64_t getValue(const LatencySnapshotStat& stat, Metric metric) {
+        switch (metric) {
+        case CALLS: return stat.numCalls;
+        case TOTAL: return stat.totalTime;
+        case P50:   return stat.p50;
+        case P99:   return stat.p99;
+        case P999:  return stat.p999;
+        }
+        return 0;
+    }
+
+    static const char* getMetricName(Metric metric) {
+        switch (metric) {
+        case CALLS: return "calls";
+        case TOTAL: return "total";
+        case P50:   return "p50";
+        case P99:   return "p99";
+        case P999:  return "p99.9";
+        }
+        return "unknown";
+    }
+
+    int64_t getDelta(Metric metric) const {
+        return (int64_t)getValue(after, metric) -
+               (int64_t)getValue(before, metric);
+    }
+
+    // Relative change (`after` / `before` - 1), or 0 if `before` is 0.
+    double getRelative(Metric metric) const {
+        uint64_t base = getValue(before, metric);
+        if (!base) return 0;
+        return (double)getValue(after, metric) / base - 1.0;
+    }
+
+    bool isSignificant(double significance_level) const {
+        return status == COMMON && pValue < significance_level;
+    }
+
+    // Average latency per call in `stat`, or 0 if it has no calls.
+    static double getPerCall(const LatencySnapshotStat& stat) {
+        return (stat.numCalls) ? (double)stat.totalTime / stat.numCalls : 0;
+    }
+
+    /**
+     * Check if the latency got worse in the given metric, with a
+     * significant change of the distribution.
+     *
+     * More calls are a change of the load, not of the latency: `CALLS`
+     * is never a regression, and `TOTAL` is compared per call.
+     */
+    bool isRegression(Metric metric, double significance_level) const {
+        if (status != COMMON || metric == CALLS) return false;
+        if (metric == TOTAL) {
+            if (getPerCall(after) <= getPerCall(before)) return false;
+        } else if (getDelta(metric) <= 0) {
+            return false;
+        }
+        return isSignificant(significance_level);
+    }
+};
+
+struct LatencyDiffOptions {
+    LatencyDiffOptions()
+        : sort_by(LatencyStatDiff::P99)
+        , view_type(LatencyCollectorDumpOptions::FLAT)
+        , top(0)
+        , significance_level(0.01)
+        , regressions_only(false)
+        {}
+
+    // Stats are sorted by the delta of this metric, the largest first.
+    LatencyStatDiff::Metric sort_by;
+
+    // `FLAT` by default, as a list of the largest regressions.
+    // In `TREE`, each call path is shown under its caller.
+    LatencyCollectorDumpOptions::ViewType view_type;
+
+    // Max number of stats in `FLAT`, 0 for unlimited.
+    size_t top;
+
+    // Max p-value of a significant change.
+    double significance_level;
+
+    // If true, only the regressions of `sort_by` (and their callers in
+    // `TREE`) are shown.
+    bool regressions_only;
+};
+
+/**
+ * Per-stat comparison of two snapshots, e.g., before and after a deploy.
+ *
+ * Along with the deltas of the numbers, the bins of each stat are compared
+ * by the two-sample Kolmogorov-Smirnov test, so that a change by chance
+ * (of a stat with a few samples) can be told from an actual shift.
+ * Note that the bins should be from the same histogram type.
+ */
+class LatencySnapshotDiff {
+public:
+    using Metric = LatencyStatDiff::Metric;
+
+    LatencySnapshotDiff(const LatencySnapshot& before,
+                        const LatencySnapshot& after) {
+        auto b_itr = before.getStats().begin();
+        auto b_end = before.getStats().end();
+        auto a_itr = after.getStats().begin();
+        auto a_end = after.getStats().end();
+        // Merge two sorted maps.
+        while (b_itr != b_end || a_itr != a_end) {
+            LatencyStatDiff diff;
+            if ( a_itr == a_end ||
+                 (b_itr != b_end && b_itr->first < a_itr->first) ) {
+                diff.status = LatencyStatDiff::REMOVED;
+                diff.before = b_itr->second;
+                ++b_itr;
+            } else if (b_itr == b_end || a_itr->first < b_itr->first) {
+                diff.status = LatencyStatDiff::ADDED;
+                diff.after = a_itr->second;
+                ++a_itr;
+            } else {
+                diff.before = b_itr->second;
+                diff.after = a_itr->second;
+                diff.ksDistance = getKsDistance(diff.before, diff.after);
+                diff.pValue = getKsPValue( diff.ksDistance,
+                                           diff.before.numCalls,
+                                           diff.after.numCalls );
+                ++b_itr;
+                ++a_itr;
+            }
+            diff.name = (diff.status == LatencyStatDiff::REMOVED)
+                        ? diff.before.name : diff.after.name;
+            stats.push_back(std::move(diff));
+        }
+    }
+
+    // All stats, sorted by name.
+    const std::vector<LatencyStatDiff>& getStats() const { return stats; }
+
+    // Return `nullptr` if not exist.
+    const LatencyStatDiff* find(const std::string& name) const {
+        auto itr = std::lower_bound( stats.begin(), stats.end(), name,
+                                     [](const LatencyStatDiff& diff,
+                                        const std::string& val) {
+                                         return diff.name < val;
+                                     } );
+        if (itr == stats.end() || itr->name != name) return nullptr;
+        return &*itr;
+    }
+
+    /**
+     * Get the regressions of the given metric, the largest delta first.
+     *
+     * @param metric Metric to compare.
+     * @param significance_level Max p-value of a significant change.
+     * @param top Max number of stats to return, 0 for unlimited.
+     */
+    std::vector<const LatencyStatDiff*> getRegressions
+        ( Metric metric,
+          double significance_level = 0.01,
+          size_t top = 0 ) const
+    {
+        std::vector<const LatencyStatDiff*> ret;
+        for (const LatencyStatDiff& diff: stats) {
+            if (diff.isRegression(metric, significance_level)) {
+                ret.push_back(&diff);
+            }
+        }
+        sortByDelta(ret, metric);
+        if (top && ret.size() > top) ret.resize(top);
+        return ret;
+    }
+
+    std::string dump(const LatencyDiffOptions& opt
+                         = LatencyDiffOptions()) const {
+        std::stringstream ss;
+        size_t num_added = 0, num_removed = 0;
+        for (const LatencyStatDiff& diff: stats) {
+            if (diff.status == LatencyStatDiff::ADDED) num_added++;
+            if (diff.status == LatencyStatDiff::REMOVED) num_removed++;
+        }
+        size_t num_regressions =
+            getRegressions(opt.sort_by, opt.significance_level).size();
+        ss << "# diff: " << stats.size() << " stats, "
+           << num_regressions << " regressions in "
+           << LatencyStatDiff::getMetricName(opt.sort_by);
+        if (opt.sort_by == LatencyStatDiff::TOTAL) {
+            ss << " per call";
+        }
+        if (opt.sort_by != LatencyStatDiff::CALLS) {
+            ss << " (p < " << opt.significance_level << ")";
+        }
+        ss << ", " << num_added << " added, "
+           << num_removed << " removed" << std::endl;
+
+        if (opt.view_type == LatencyCollectorDumpOptions::TREE) {
+            dumpTree(ss, opt);
+        } else {
+            dumpFlat(ss, opt);
+        }
+        return ss.str();
+    }
+
+    /**
+     * Kolmogorov-Smirnov statistic of the two histograms: the max distance
+     * between their cumulative distributions, evaluated at bin boundaries.
+     */
+    static double getKsDistance(const LatencySnapshotStat& lhs,
+                                const LatencySnapshotStat& rhs) {
+        uint64_t l_total = 0, r_total = 0;
+        for (const LatencySnapshotBin& bin: lhs.bins) l_total += bin.count;
+        for (const LatencySnapshotBin& bin: rhs.bins) r_total += bin.count;
+        if (!l_total || !r_total) return 0;
+
+        double ret = 0;
+        uint64_t l_cum = 0, r_cum = 0;
+        size_t ll = 0, rr = 0;
+        while (ll < lhs.bins.size() || rr < rhs.bins.size()) {
+            // Next boundary, and all the bins ending there.
+            uint64_t bound = std::numeric_limits<uint64_t>::max();
+            if (ll < lhs.bins.size()) bound = lhs.bins[ll].upperBound;
+            if (rr < rhs.bins.size()) {
+                bound = std::min(bound, rhs.bins[rr].upperBound);
+            }
+            while (ll < lhs.bins.size() && lhs.bins[ll].upperBound <= bound) {
+                l_cum += lhs.bins[ll++].count;
+            }
+            while (rr < rhs.bins.size() && rhs.bins[rr].upperBound <= bound) {
+                r_cum += rhs.bins[rr++].count;
+            }
+            double dist = std::fabs( (double)l_cum / l_total -
+                                     (double)r_cum / r_total );
+            ret = std::max(ret, dist);
+        }
+        return ret;
+    }
+
+    /**
+     * Asymptotic p-value of the two-sample Kolmogorov-Smirnov test
+     * (Numerical Recipes, 14.3). As samples are binned, it tends to
+     * underestimate the distance, i.e., it is conservative.
+     */
+    static double getKsPValue(double distance, uint64_t n1, uint64_t n2) {
+        if (!n1 || !n2 || distance <= 0) return 1.0;
+        double n_eff = (double)n1 * n2 / ((double)n1 + n2);
+        double sqrt_n = std::sqrt(n_eff);
+        double lambda = (sqrt_n + 0.12 + 0.11 / sqrt_n) * distance;
+
+        // Q_KS(lambda) = 2 * sum_{k=1}^{inf} (-1)^(k-1) * exp(-2 k^2 lambda^2)
+        double sum = 0, sign = 1, prev_term = 0;
+        for (size_t kk = 1; kk <= 100; ++kk) {
+            double term = sign * 2.0 *
+                          std::exp(-2.0 * kk * kk * lambda * lambda);
+            sum += term;
+            if ( std::fabs(term) <= 0.001 * std::fabs(prev_term) ||
+                 std::fabs(term) <= 1e-8 * sum ) {
+                return std::min(1.0, std::max(0.0, sum));
+            }
+            sign = -sign;
+            prev_term = term;
+        }
+        // Not converged: lambda is too small, i.e., no difference.
+        return 1.0;
+    }
+
+private:
+    static void sortByDelta(std::vector<const LatencyStatDiff*>& diffs,
+                            Metric metric) {
+        std::stable_sort( diffs.begin(), diffs.end(),
+                          [metric](const LatencyStatDiff* a,
+                                   const LatencyStatDiff* b) {
+                              return a->getDelta(metric) > b->getDelta(metric);
+                          } );
+    }
+
+    void dumpFlat(std::stringstream& ss,
+                  const LatencyDiffOptions& opt) const {
+        std::vector<const LatencyStatDiff*> rows;
+        for (const LatencyStatDiff& diff: stats) {
+            if ( opt.regressions_only &&
+                 !diff.isRegression(opt.sort_by, opt.significance_level) ) {
+                continue;
+            }
+            rows.push_back(&diff);
+        }
+        sortByDelta(rows, opt.sort_by);
+        if (opt.top && rows.size() > opt.top) rows.resize(opt.top);
+
+        size_t max_name_len = 9;
+        for (const LatencyStatDiff* diff: rows) {
+            max_name_len = std::max(max_name_len, diff->name.size());
+        }
+        addTitle(ss, max_name_len);
+        for (const LatencyStatDiff* diff: rows) {
+            dumpRow(ss, *diff, diff->name, max_name_len, opt);
+        }
+    }
+
+    struct Node {
+        Node() : diff(nullptr), hasRegression(false) {}
+        const LatencyStatDiff* diff;
+        // This node or any of its descendants.
+        bool hasRegression;
+        std::vector< std::unique_ptr<Node> > children;
+    };
+
+    void dumpTree(std::stringstream& ss,
+                  const LatencyDiffOptions& opt) const {
+        // Stats are sorted by name, so that callers come first.
+        Node root;
+        std::map<std::string, Node*> by_name;
+        for (const LatencyStatDiff& diff: stats) {
+            Node* parent = &root;
+            // Nearest caller in the diff.
+            std::string path = diff.name;
+            size_t pos = path.rfind(" ## ");
+            while (pos != std::string::npos && pos > 0) {
+                path.resize(pos);
+                auto entry = by_name.find(path);
+                if (entry != by_name.end()) {
+                    parent = entry->second;
+                    break;
+                }
+                pos = path.rfind(" ## ");
+            }
+            Node* node = new Node();
+            node->diff = &diff;
+            parent->children.push_back(std::unique_ptr<Node>(node));
+            by_name[diff.name] = node;
+        }
+        markRegressions(&root, opt);
+
+        size_t max_name_len = std::max((size_t)9, getMaxNameLen(&root, 0));
+        addTitle(ss, max_name_len);
+        dumpRecursive(ss, &root, 0, max_name_len, opt);
+    }
+
+    static size_t getMaxNameLen(const Node* node, size_t indent) {
+        size_t ret = 0;
+        for (auto& child: node->children) {
+            ret = std::max(ret, indent + getLeaf(*child->diff).size());
+            ret = std::max(ret, getMaxNameLen(child.get(), indent + 2));
+        }
+        return ret;
+    }
+
+    static bool markRegressions(Node* node, const LatencyDiffOptions& opt) {
+        bool ret = node->diff &&
+                   node->diff->isRegression( opt.sort_by,
+                                             opt.significance_level );
+        for (auto& child: node->children) {
+            if (markRegressions(child.get(), opt)) ret = true;
+        }
+        node->hasRegression = ret;
+        return ret;
+    }
+
+    static void dumpRecursive(std::stringstream& ss,
+                              Node* node,
+                              size_t indent,
+                              size_t max_name_len,
+                              const LatencyDiffOptions& opt) {
+        std::vector<Node*> children;
+        for (auto& child: node->children) {
+            if (opt.regressions_only && !child->hasRegression) continue;
+            children.push_back(child.get());
+        }
+        Metric metric = opt.sort_by;
+        std::stable_sort( children.begin(), children.end(),
+                          [metric](const Node* a, const Node* b) {
+                              return a->diff->getDelta(metric) >
+                                     b->diff->getDelta(metric);
+                          } );
+        for (Node* child: children) {
+            dumpRow( ss, *child->diff,
+                     std::string(indent, ' ') + getLeaf(*child->diff),
+                     max_name_len, opt );
+            dumpRecursive(ss, child, indent + 2, max_name_len, opt);
+        }
+    }
+
+    static std::string getLeaf(const LatencyStatDiff& diff) {
+        return (diff.status == LatencyStatDiff::REMOVED)
+               ? diff.before.getLeaf() : diff.after.getLeaf();
+    }
+
+    static void addTitle(std::stringstream& ss, size_t max_name_len) {
+        ss << std::left << std::setw(max_name_len) << "STAT NAME" << ": ";
+        ss << std::right;
+        ss << std::setw(6) << "CALLS" << " ";
+        ss << std::setw(7) << "+CALLS" << " ";
+        ss << std::setw(8) << "+TOTAL" << " ";
+        ss << std::setw(8) << "p50" << " ";
+        ss << std::setw(9) << "+p50" << " ";
+        ss << std::setw(8) << "p99" << " ";
+        ss << std::setw(9) << "+p99" << " ";
+        ss << std::setw(8) << "p99 %" << " ";
+        ss << std::setw(8) << "p99.9" << " ";
+        ss << std::setw(9) << "+p99.9" << " ";
+        ss << std::setw(8) << "P-VALUE";
+        ss << std::endl;
+    }
+
+    static void dumpRow(std::stringstream& ss,
+                        const LatencyStatDiff& diff,
+                        const std::string& name,
+                        size_t max_name_len,
+                        const LatencyDiffOptions& opt) {
+        const LatencySnapshotStat& cur =
+            (diff.status == LatencyStatDiff::REMOVED)
+            ? diff.before : diff.after;
+        ss << std::left << std::setw(max_name_len) << name << ": ";
+        ss << std::right;
+        ss << std::setw(6) << countToString(cur.numCalls) << " ";
+        ss << std::setw(7)
+           << deltaToString(diff.getDelta(LatencyStatDiff::CALLS), false)
+           << " ";
+        ss << std::setw(8)
+           << deltaToString(diff.getDelta(LatencyStatDiff::TOTAL), true)
+           << " ";
+        ss << std::setw(8) << usToString(cur.p50) << " ";
+        ss << std::setw(9)
+           << deltaToString(diff.getDelta(LatencyStatDiff::P50), true) << " ";
+        ss << std::setw(8) << usToString(cur.p99) << " ";
+        ss << std::setw(9)
+           << deltaToString(diff.getDelta(LatencyStatDiff::P99), true) << " ";
+        if (diff.status == LatencyStatDiff::COMMON && diff.before.p99) {
+            std::stringstream pct;
+            pct << std::showpos << std::fixed << std::setprecision(1)
+                << diff.getRelative(LatencyStatDiff::P99) * 100 << " %";
+            ss << std::setw(8) << pct.str() << " ";
+        } else {
+            ss << std::setw(8) << "---" << " ";
+        }
+        ss << std::setw(8) << usToString(cur.p999) << " ";
+        ss << std::setw(9)
+           << deltaToString(diff.getDelta(LatencyStatDiff::P999), true)
+           << " ";
+        if (diff.status == LatencyStatDiff::COMMON) {
+            std::stringstream pv;
+            pv << std::setprecision(2) << diff.pValue;
+            ss << std::setw(8) << pv.str();
+        } else {
+            ss << std::setw(8) << "---";
+        }
+
+        if (diff.status == LatencyStatDiff::ADDED) {
+            ss << "  (added)";
+        } else if (diff.status == LatencyStatDiff::REMOVED) {
+            ss << "  (removed)";
+        } else if (diff.isRegression(opt.sort_by, opt.significance_level)) {
+            ss << "  <- REGRESSION";
+        }
+        ss << std::endl;
+    }
+
+    static std::string usToString(uint64_t us) {
+        std::stringstream ss;
+        if (us < 1000) {
+            ss << us << " us";
+        } else if (us < 1000000) {
+            ss << std::fixed << std::setprecision(1) << us / 1000.0 << " ms";
+        } else {
+            ss << std::fixed << std::setprecision(1) << us / 1000000.0 << " s";
+        }
+        return ss.str();
+    }
+
+    static std::string countToString(uint64_t count) {
+        std::stringstream ss;
+        if (count < 1000) {
+            ss << count;
+        } else if (count < 1000000) {
+            ss << std::fixed << std::setprecision(1) << count / 1000.0 << "K";
+        } else if (count < (uint64_t)1000000000) {
+            ss << std::fixed << std::setprecision(1)
+               << count / 1000000.0 << "M";
+        } else {
+            ss << std::fixed << std::setprecision(1)
+               << count / 1000000000.0 << "B";
+        }
+        return ss.str();
+    }
+
+    // Signed delta, as a time if `is_us` or as a count otherwise.
+    static std::string deltaToString(int64_t delta, bool is_us) {
+        if (!delta) return "0";
+        uint64_t abs_val = (delta < 0) ? (uint64_t)(-delta) : (uint64_t)delta;
+        std::string sign = (delta < 0) ? "-" : "+";
+        return sign + ( (is_us) ? usToString(abs_val)
+                                : countToString(abs_val) );
+    }
+
+    std::vector<LatencyStatDiff> stats;
+};
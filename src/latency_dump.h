@@ -33,13 +33,18 @@
 
 #include "latency_collector.h"
 
+#include <algorithm>
 #include <list>
 #include <memory>
 #include <vector>
 
-class LatencyDumpDefaultImpl : public LatencyDump {
+template<typename HistT>
+class LatencyDumpDefaultImplT : public LatencyDumpT<HistT> {
 public:
-    std::string dump(MapWrapper* map_w,
+    using Item = LatencyItemT<HistT>;
+    using MapW = MapWrapperT<HistT>;
+
+    std::string dump(MapW* map_w,
                      const LatencyCollectorDumpOptions& opt) {
         std::stringstream ss;
         if (!map_w->getSize()) {
@@ -48,28 +53,37 @@ public:
         }
 
         std::multimap<uint64_t,
-                      LatencyItem*,
+                      Item*,
                       std::greater<uint64_t> > map_uint64_t;
-        std::map<std::string, LatencyItem*> map_string;
+        // Keys point to the names of the copied items below.
+        std::map<LatencyStringView, Item*> map_string;
         size_t max_name_len = 9; // reserved for "STAT NAME" 9 chars
 
-        std::unordered_map<std::string, LatencyItem*>& map = getMap(map_w);
+        std::unordered_map<std::string, Item*>& map = this->getMap(map_w);
+        const LatencyLabelRegistry* labels = this->getLabels(map_w);
+        bool filter_label = labels && !opt.label_filter.empty();
 
         // Deduplication
         for (auto& entry: map) {
-            LatencyItem *item = entry.second;
+            Item *item = entry.second;
+            Item filtered;
+            if (filter_label) {
+                filtered = item->filterByLabel(*labels, opt.label_filter);
+                item = &filtered;
+            }
             if (!item->getNumCalls()) {
                 continue;
             }
-            std::string actual_name = getActualFunction(item->getName(), false);
+            LatencyStringView actual_name = item->getLeafView();
 
             auto existing = map_string.find(actual_name);
             if (existing != map_string.end()) {
-                LatencyItem* item_found = existing->second;
+                Item* item_found = existing->second;
                 *item_found += *item;
             } else {
-                LatencyItem* new_item = new LatencyItem(*item);
-                map_string.insert( std::make_pair(actual_name, new_item) );
+                Item* new_item = new Item(*item);
+                map_string.insert( std::make_pair(new_item->getLeafView(),
+                                                  new_item) );
             }
 
             if (actual_name.size() > max_name_len) {
@@ -77,10 +91,23 @@ public:
             }
         }
 
+        if (opt.group_by_label) {
+            for (auto& entry: map_string) {
+                size_t len = getMaxLabelRowLen(entry.second, labels, 0);
+                if (len > max_name_len) max_name_len = len;
+            }
+        }
+        if (opt.show_threads) {
+            for (auto& entry: map_string) {
+                size_t len = getMaxThreadRowLen(entry.second, 0);
+                if (len > max_name_len) max_name_len = len;
+            }
+        }
+
         ss << "# stats: " << map_string.size() << std::endl;
 
         for (auto& entry: map_string) {
-            LatencyItem *item = entry.second;
+            Item *item = entry.second;
             if (!item->getNumCalls()) continue;
 
             switch (opt.sort_by) {
@@ -104,24 +131,32 @@ public:
             }
         }
 
-        addDumpTitle(ss, max_name_len);
+        addDumpTitle(ss, max_name_len, opt.show_overhead);
 
         if (opt.sort_by == LatencyCollectorDumpOptions::NAME) {
             // Name (string)
             for (auto& entry: map_string) {
-                LatencyItem *item = entry.second;
+                Item *item = entry.second;
                 if (item->getNumCalls()) {
-                    ss << dumpItem(item, max_name_len, 0, false)
+                    ss << dumpItem( item, max_name_len, 0, false,
+                                    opt.show_overhead )
                        << std::endl;
+                    dumpDetailRows( ss, item,
+                                    (opt.group_by_label) ? labels : nullptr,
+                                    max_name_len, 0, opt );
                 }
             }
         } else {
             // Otherwise (number)
             for (auto& entry: map_uint64_t) {
-                LatencyItem *item = entry.second;
+                Item *item = entry.second;
                 if (item->getNumCalls()) {
-                    ss << dumpItem(item, max_name_len, 0, false)
+                    ss << dumpItem( item, max_name_len, 0, false,
+                                    opt.show_overhead )
                        << std::endl;
+                    dumpDetailRows( ss, item,
+                                    (opt.group_by_label) ? labels : nullptr,
+                                    max_name_len, 0, opt );
                 }
             }
         }
@@ -134,33 +169,50 @@ public:
         return ss.str();
     }
 
-    std::string dumpTree(MapWrapper* map_w,
+    std::string dumpTree(MapW* map_w,
                          const LatencyCollectorDumpOptions& opt) {
         std::stringstream ss;
         DumpItem root;
 
         // Sort by name first.
-        std::map<std::string, LatencyItem*> by_name;
-        std::unordered_map<std::string, LatencyItem*>& map = getMap(map_w);
+        std::map<LatencyStringView, Item*> by_name;
+        std::unordered_map<std::string, Item*>& map = this->getMap(map_w);
+        const LatencyLabelRegistry* labels = this->getLabels(map_w);
+        bool filter_label = labels && !opt.label_filter.empty();
+        // Filtered copies of items, if label filter is given.
+        std::list<Item> filtered;
         for (auto& entry : map) {
-            LatencyItem *item = entry.second;
-            by_name.insert( std::make_pair(item->getName(), item) );
+            Item *item = entry.second;
+            if (filter_label) {
+                filtered.push_back
+                    ( item->filterByLabel(*labels, opt.label_filter) );
+                item = &filtered.back();
+            }
+            by_name.insert( std::make_pair( LatencyStringView(item->getName()),
+                                            item ) );
         }
 
         size_t max_name_len = 9;
         std::vector<DumpItem*> last_ptr(1);
         last_ptr[0] = &root;
         for (auto& entry : by_name) {
-            LatencyItem *item = entry.second;
-            std::string item_name = item->getName();
-            size_t level = getNumStacks(item_name);
+            Item *item = entry.second;
+            size_t level = item->getNumStacks();
             if (!level) {
                 // Not a thread-aware latency item, stop.
                 return dump(map_w, opt);
             }
 
-            DumpItem* parent = last_ptr[level-1];
-            assert(parent); // Must exist
+            // The caller may not exist, e.g., in the stats restored from
+            // a filtered snapshot. Then the nearest ancestor is used.
+            DumpItem* parent = &root;
+            for (size_t ii = std::min(level, last_ptr.size()) - 1; ii; --ii) {
+                DumpItem* cand = last_ptr[ii];
+                if (cand && isAncestor(cand->itself, item)) {
+                    parent = cand;
+                    break;
+                }
+            }
 
             DumpItemP dump_item(new DumpItem(level, item, parent->itself));
             if (level >= last_ptr.size()) {
@@ -169,19 +221,94 @@ public:
             last_ptr[level] = dump_item.get();
             parent->child.push_back(std::move(dump_item));
 
-            size_t actual_name_len = getActualFunction(item_name).size();
+            size_t actual_name_len = getNameIndent(item, true) +
+                                     item->getLeafView().size();
             if (actual_name_len > max_name_len) {
                 max_name_len = actual_name_len;
             }
+            if (opt.group_by_label) {
+                size_t len = getMaxLabelRowLen(item, labels, (level - 1) * 2);
+                if (len > max_name_len) max_name_len = len;
+            }
+            if (opt.show_threads) {
+                size_t len = getMaxThreadRowLen(item, (level - 1) * 2);
+                if (len > max_name_len) max_name_len = len;
+            }
         }
 
-        addDumpTitle(ss, max_name_len);
-        dumpRecursive(ss, &root, max_name_len);
+        addDumpTitle(ss, max_name_len, opt.show_overhead);
+        dumpRecursive( ss, &root, max_name_len,
+                       (opt.group_by_label) ? labels : nullptr, opt );
+
+        return ss.str();
+    }
 
+    std::string dumpHealth(const LatencyCollectorHealth& health) {
+        std::stringstream ss;
+        ss << std::endl << "# collector health" << std::endl;
+        ss << "CAS retries       : " << health.numCasRetries << std::endl;
+        ss << "dropped samples   : " << health.numDroppedSamples << std::endl;
+        ss << "map versions      : " << health.numMapVersionsAlive
+           << " alive / " << health.numMapVersionsCreated << " created, "
+           << health.numLatestMapRefs << " refs to latest" << std::endl;
+        ss << "stats             : " << health.numItems << ", "
+           << bytesToString(health.itemBytes) << " ("
+           << bytesToString(health.histogramBytes) << " histograms)"
+           << std::endl;
+        ss << "evicted stats     : " << health.numEvictedStats << ", "
+           << health.numOverflowLookups << " lookups to __overflow__"
+           << std::endl;
+        ss << "dumps             : " << health.numDumps << ", "
+           << usToString(health.dumpTimeNs / 1000) << " total, "
+           << usToString(health.lastDumpTimeNs / 1000) << " last"
+           << std::endl;
+        ss << "thread buffers    : " << health.numThreadBuffers << std::endl;
+        ss << "thread trackers   : " << health.trackers.size() << ", "
+           << health.numPooledTrackerBuffers << " pooled buffers, "
+           << health.numReusedTrackerBuffers << " reused" << std::endl;
+        for (auto& entry: health.trackers) {
+            ss << "  thread " << entry.threadId << ": "
+               << bytesToString(entry.bufferBytes) << ", max depth "
+               << entry.maxDepth << std::endl;
+        }
+        if (health.numNumaFallbackShards) {
+            ss << "NUMA fallbacks    : " << health.numNumaFallbackShards
+               << " shards on the heap" << std::endl;
+        }
         return ss.str();
     }
 
 private:
+    // Local time, e.g., "2017-01-01 12:34:56.789012".
+    static std::string timestampToString(uint64_t us) {
+        std::time_t sec = us / 1000000;
+        std::tm tm_val;
+#if defined(WIN32) || defined(_WIN32)
+        localtime_s(&tm_val, &sec);
+#else
+        localtime_r(&sec, &tm_val);
+#endif
+        char buf[32];
+        std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm_val);
+        std::stringstream ss;
+        ss << buf << "." << std::setw(6) << std::setfill('0') << us % 1000000;
+        return ss.str();
+    }
+
+    static std::string bytesToString(uint64_t bytes) {
+        std::stringstream ss;
+        if (bytes < 1024) {
+            ss << bytes << " B";
+        } else if (bytes < 1024 * 1024) {
+            double tmp = static_cast<double>(bytes / 1024.0);
+            ss << std::fixed << std::setprecision(1) << tmp << " KiB";
+        } else {
+            double tmp = static_cast<double>(bytes / 1024.0 / 1024.0);
+            ss << std::fixed << std::setprecision(1) << tmp << " MiB";
+        }
+        return ss.str();
+    }
+
     static std::string usToString(uint64_t us) {
         std::stringstream ss;
         if (us < 1000) {
@@ -230,49 +357,32 @@ private:
         return ss.str();
     }
 
-    static size_t getNumStacks(const std::string& str) {
-        size_t pos = 0;
-        size_t str_size = str.size();
-        size_t ret = 0;
-        while (pos < str_size) {
-            pos = str.find(" ## ", pos);
-            if (pos == std::string::npos) break;
-            pos += 4;
-            ret++;
-        }
-        return ret;
-    }
-
-    static std::string getActualFunction(const std::string& str,
-                                         bool add_tab = true) {
-        size_t level = getNumStacks(str);
-        if (!level) {
-            return str;
-        }
-
-        size_t pos = str.rfind(" ## ");
-        std::string ret = "";
-        if (level > 1 && add_tab) {
-            for (size_t i=1; i<level; ++i) {
-                ret += "  ";
-            }
-        }
-        ret += str.substr(pos + 4);
-        return ret;
+    // Spaces before the name of the given item in the tree view.
+    static size_t getNameIndent(const Item* item, bool add_tab) {
+        size_t level = item->getNumStacks();
+        return (add_tab && level > 1) ? (level - 1) * 2 : 0;
     }
 
-    static std::string dumpItem(LatencyItem* item,
+    static std::string dumpItem(Item* item,
                                 size_t max_filename_field = 0,
                                 uint64_t parent_total_time = 0,
-                                bool add_tab = true)
+                                bool add_tab = true,
+                                bool show_overhead = false)
     {
         if (!max_filename_field) {
             max_filename_field = 32;
         }
         std::stringstream ss;
-        ss << std::left << std::setw(max_filename_field)
-           << getActualFunction(item->getStatName(), add_tab) << ": ";
-        ss << std::right;
+        // Indent by the depth, and then pad to `max_filename_field`.
+        size_t indent = getNameIndent(item, add_tab);
+        LatencyStringView leaf = item->getLeafView();
+        size_t name_len = indent + leaf.size();
+        if (indent) ss << std::setw(indent) << "";
+        ss << leaf;
+        if (name_len < max_filename_field) {
+            ss << std::setw(max_filename_field - name_len) << "";
+        }
+        ss << ": ";
         ss << std::setw(8) << usToString(item->getTotalTime()) << " ";
         if (parent_total_time) {
             ss << std::setw(7)
@@ -283,9 +393,22 @@ private:
         }
         ss << std::setw(6) << countToString(item->getNumCalls()) << " ";
         ss << std::setw(8) << usToString(item->getAvgLatency()) << " ";
-        ss << std::setw(8) << usToString(item->getPercentile(50)) << " ";
-        ss << std::setw(8) << usToString(item->getPercentile(99)) << " ";
-        ss << std::setw(8) << usToString(item->getPercentile(99.9));
+        const double PCTS[] = {50, 99, 99.9};
+        uint64_t pct_values[3];
+        item->getPercentiles(PCTS, pct_values, 3);
+        ss << std::setw(8) << usToString(pct_values[0]) << " ";
+        ss << std::setw(8) << usToString(pct_values[1]) << " ";
+        ss << std::setw(8) << usToString(pct_values[2]);
+        if (show_overhead) {
+            uint64_t overhead_us = item->getOverheadNs() / 1000;
+            ss << " " << std::setw(8) << usToString(overhead_us) << " ";
+            if (item->getTotalTime()) {
+                ss << std::setw(7)
+                   << ratioToPercent(overhead_us, item->getTotalTime());
+            } else {
+                ss << "    ---";
+            }
+        }
         return ss.str();
     }
 
@@ -293,37 +416,166 @@ private:
         using UPtr = std::unique_ptr<DumpItem>;
 
         DumpItem() : level(0), itself(nullptr), parent(nullptr) {}
-        DumpItem(size_t _level, LatencyItem* _item, LatencyItem* _parent)
+        DumpItem(size_t _level, Item* _item, Item* _parent)
             : level(_level),
               itself(_item),
               parent(_parent) {}
 
         size_t level;
-        LatencyItem* itself;
-        LatencyItem* parent;
+        Item* itself;
+        Item* parent;
         std::list<UPtr> child;
     };
-    using DumpItemP = DumpItem::UPtr;
+    using DumpItemP = typename DumpItem::UPtr;
+
+    // True if `item` is in the subtree of `ancestor`.
+    static bool isAncestor(Item* ancestor, Item* item) {
+        const std::string& prefix = ancestor->getName();
+        const std::string& name = item->getName();
+        return name.size() > prefix.size() + 4 &&
+               name.compare(0, prefix.size(), prefix) == 0 &&
+               name.compare(prefix.size(), 4, " ## ") == 0;
+    }
 
     static void dumpRecursive(std::stringstream& ss,
                               DumpItem* dump_item,
-                              size_t max_name_len) {
+                              size_t max_name_len,
+                              const LatencyLabelRegistry* labels,
+                              const LatencyCollectorDumpOptions& opt) {
         if (dump_item->itself) {
-            if (dump_item->parent) {
-                ss << dumpItem(dump_item->itself, max_name_len,
-                               dump_item->parent->getTotalTime());
-            } else {
-                ss << dumpItem(dump_item->itself, max_name_len);
-            }
+            uint64_t parent_total_time = (dump_item->parent)
+                                         ? dump_item->parent->getTotalTime()
+                                         : 0;
+            ss << dumpItem(dump_item->itself, max_name_len,
+                           parent_total_time, true, opt.show_overhead);
             ss << std::endl;
+            dumpDetailRows(ss, dump_item->itself, labels, max_name_len,
+                           (dump_item->level - 1) * 2, opt);
         }
         for (auto& entry : dump_item->child) {
             DumpItem* child = entry.get();
-            dumpRecursive(ss, child, max_name_len);
+            dumpRecursive(ss, child, max_name_len, labels, opt);
+        }
+    }
+
+    // Rows following each stat: label sets (if `labels` is given),
+    // threads, and exemplars.
+    static void dumpDetailRows(std::stringstream& ss,
+                               Item* item,
+                               const LatencyLabelRegistry* labels,
+                               size_t max_name_len,
+                               size_t indent,
+                               const LatencyCollectorDumpOptions& opt) {
+        dumpLabelRows(ss, item, labels, max_name_len, indent,
+                      opt.show_overhead);
+        if (opt.show_threads) {
+            dumpThreadRows(ss, item, max_name_len, indent);
+        }
+        if (opt.show_exemplars) {
+            dumpExemplarRows(ss, item, indent);
+        }
+    }
+
+    // Print out the slowest samples of the given item.
+    static void dumpExemplarRows(std::stringstream& ss,
+                                 Item* item,
+                                 size_t indent) {
+        for (const LatencyExemplar& sample: item->getExemplars()) {
+            ss << std::string(indent + 2, ' ') << "! "
+               << std::setw(8) << usToString(sample.latency)
+               << " at " << timestampToString(sample.timestamp)
+               << ", thread " << sample.threadId;
+            if (sample.tag) ss << ", tag " << sample.tag;
+            ss << std::endl;
         }
     }
 
-    static void addDumpTitle(std::stringstream& ss, size_t max_name_len) {
+    static std::string getLabelRowName(const LatencyLabelRegistry* labels,
+                                       LatencyLabelId id,
+                                       size_t indent) {
+        return std::string(indent + 2, ' ') + "{" + labels->getName(id) + "}";
+    }
+
+    static size_t getMaxLabelRowLen(Item* item,
+                                    const LatencyLabelRegistry* labels,
+                                    size_t indent) {
+        size_t ret = 0;
+        if (!labels) return ret;
+        for (size_t ii = 1; ii < labels->getNumLabelSets(); ++ii) {
+            if (!item->getLabelHistogram(ii)) continue;
+            size_t len = getLabelRowName(labels, ii, indent).size();
+            if (len > ret) ret = len;
+        }
+        return ret;
+    }
+
+    // Print out the per-label-set breakdown of the given item.
+    static void dumpLabelRows(std::stringstream& ss,
+                              Item* item,
+                              const LatencyLabelRegistry* labels,
+                              size_t max_name_len,
+                              size_t indent,
+                              bool show_overhead = false) {
+        if (!labels) return;
+        for (size_t ii = 1; ii < labels->getNumLabelSets(); ++ii) {
+            const HistT* hist = item->getLabelHistogram(ii);
+            if (!hist || !hist->getTotal()) continue;
+
+            Item row(getLabelRowName(labels, ii, indent), *hist);
+            ss << dumpItem( &row, max_name_len, item->getTotalTime(), false,
+                            show_overhead )
+               << std::endl;
+        }
+    }
+
+    static std::string getThreadRowName(LatencyThreadKey key,
+                                        size_t indent) {
+        LatencyThreadRegistry& registry = LatencyThreadRegistry::get();
+        return std::string(indent + 2, ' ') + "[" + registry.getName(key) + "]";
+    }
+
+    static size_t getMaxThreadRowLen(Item* item, size_t indent) {
+        size_t ret = 0;
+        if (!item->hasThreadBreakdown()) return ret;
+        size_t num_keys = LatencyThreadRegistry::get().getNumKeys();
+        for (size_t ii = 0; ii < num_keys; ++ii) {
+            if (!item->getThreadHistogram(ii)) continue;
+            size_t len = getThreadRowName(ii, indent).size();
+            if (len > ret) ret = len;
+        }
+        return ret;
+    }
+
+    // Print out the per-thread breakdown of the given item, followed by
+    // the p99 skew between the slowest and the fastest thread.
+    static void dumpThreadRows(std::stringstream& ss,
+                               Item* item,
+                               size_t max_name_len,
+                               size_t indent) {
+        if (!item->hasThreadBreakdown()) return;
+        size_t num_keys = LatencyThreadRegistry::get().getNumKeys();
+        for (size_t ii = 0; ii < num_keys; ++ii) {
+            const HistT* hist = item->getThreadHistogram(ii);
+            if (!hist || !hist->getTotal()) continue;
+
+            Item row(getThreadRowName(ii, indent), *hist);
+            ss << dumpItem(&row, max_name_len, item->getTotalTime(), false)
+               << std::endl;
+        }
+
+        LatencyThreadKey slowest = 0, fastest = 0;
+        double skew = item->getThreadSkew(&slowest, &fastest);
+        if (skew <= 0) return;
+        LatencyThreadRegistry& registry = LatencyThreadRegistry::get();
+        ss << std::string(indent + 2, ' ') << "~ p99 skew "
+           << std::fixed << std::setprecision(1) << skew << "x, slowest ["
+           << registry.getName(slowest) << "], fastest ["
+           << registry.getName(fastest) << "]" << std::endl;
+    }
+
+    static void addDumpTitle(std::stringstream& ss,
+                             size_t max_name_len,
+                             bool show_overhead = false) {
         ss << std::left << std::setw(max_name_len) << "STAT NAME" << ": ";
         ss << std::right;
         ss << std::setw(8) << "TOTAL" << " ";
@@ -333,17 +585,22 @@ private:
         ss << std::setw(8) << "p50" << " ";
         ss << std::setw(8) << "p99" << " ";
         ss << std::setw(8) << "p99.9";
+        if (show_overhead) {
+            ss << " " << std::setw(8) << "OVERHEAD";
+            ss << " " << std::setw(7) << "OH %";
+        }
         ss << std::endl;
     }
 
     static void addToUintMap(uint64_t value,
                              std::multimap<uint64_t,
-                                           LatencyItem*,
+                                           Item*,
                                            std::greater<uint64_t> >& map,
-                        LatencyItem* item)
+                        Item* item)
     {
         map.insert( std::make_pair(value, item) );
     }
 };
 
+using LatencyDumpDefaultImpl = LatencyDumpDefaultImplT<LatencyDefaultPolicy::Hist>;
 
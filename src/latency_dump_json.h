@@ -0,0 +1,258 @@
+/**
+ * Copyright (C) 2017-present Jung-Sang Ahn <jungsang.ahn@gmail.com>
+ * All rights reserved.
+ *
+ * https://github.com/greensky00
+ *
+ * Latency Collector JSON Dump Module
+ * Version: 0.1.0
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "latency_collector.h"
+
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+
+/**
+ * Dumps stats as a JSON object, for other programs.
+ * All latencies are in microseconds.
+ *
+ * `dump()` gives a flat list of stats (`"stats": [...]`), and `dumpTree()`
+ * nests each stat under its caller (`"children": [...]`).
+ * Per-label-set breakdown is included if `group_by_label` is set,
+ * per-thread breakdown if `show_threads` is set, and exemplars are
+ * always included if the stat has any.
+ */
+template<typename HistT>
+class LatencyDumpJsonImplT : public LatencyDumpT<HistT> {
+public:
+    using Item = LatencyItemT<HistT>;
+    using MapW = MapWrapperT<HistT>;
+
+    std::string dump(MapW* map_w,
+                     const LatencyCollectorDumpOptions& opt) {
+        std::map<std::string, Item> by_name;
+        collectItems(map_w, opt, by_name);
+
+        std::stringstream ss;
+        ss << "{\"stats\": [";
+        bool first = true;
+        for (auto& entry: by_name) {
+            if (!entry.second.getNumCalls()) continue;
+            if (!first) ss << ", ";
+            first = false;
+            dumpItem(ss, entry.second, this->getLabels(map_w), opt);
+            ss << "}";
+        }
+        ss << "]}";
+        return ss.str();
+    }
+
+    std::string dumpTree(MapW* map_w,
+                         const LatencyCollectorDumpOptions& opt) {
+        std::map<std::string, Item> by_name;
+        collectItems(map_w, opt, by_name);
+
+        Node root;
+        for (auto& entry: by_name) {
+            Node* cur = &root;
+            const std::string& name = entry.first;
+            size_t pos = name.find(" ## ");
+            if (pos == std::string::npos) {
+                // Not a thread-aware latency item.
+                return dump(map_w, opt);
+            }
+            while (pos != std::string::npos) {
+                size_t next = name.find(" ## ", pos + 4);
+                std::string func = name.substr( pos + 4,
+                                                (next == std::string::npos)
+                                                ? std::string::npos
+                                                : next - pos - 4 );
+                std::unique_ptr<Node>& child = cur->children[func];
+                if (!child) child.reset(new Node());
+                cur = child.get();
+                pos = next;
+            }
+            cur->item = &entry.second;
+        }
+
+        std::stringstream ss;
+        ss << "{\"stats\": ";
+        dumpChildren(ss, root, this->getLabels(map_w), opt);
+        ss << "}";
+        return ss.str();
+    }
+
+private:
+    struct Node {
+        Node() : item(nullptr) {}
+        Item* item;
+        std::map< std::string, std::unique_ptr<Node> > children;
+    };
+
+    // Copy (and filter, if needed) all items, sorted by name.
+    void collectItems(MapW* map_w,
+                      const LatencyCollectorDumpOptions& opt,
+                      std::map<std::string, Item>& dst) {
+        const LatencyLabelRegistry* labels = this->getLabels(map_w);
+        bool filter_label = labels && !opt.label_filter.empty();
+        for (auto& entry: this->getMap(map_w)) {
+            Item* item = entry.second;
+            if (filter_label) {
+                dst.insert( std::make_pair
+                            ( item->getName(),
+                              item->filterByLabel(*labels,
+                                                  opt.label_filter) ) );
+            } else {
+                dst.insert( std::make_pair(item->getName(), *item) );
+            }
+        }
+    }
+
+    void dumpChildren(std::stringstream& ss,
+                      const Node& node,
+                      const LatencyLabelRegistry* labels,
+                      const LatencyCollectorDumpOptions& opt) {
+        ss << "[";
+        bool first = true;
+        for (auto& entry: node.children) {
+            const Node& child = *entry.second;
+            if (!first) ss << ", ";
+            first = false;
+            if (child.item) {
+                dumpItem(ss, *child.item, labels, opt);
+            } else {
+                // Intermediate call path without its own samples.
+                ss << "{\"name\": \"" << escape(entry.first) << "\"";
+            }
+            if (!child.children.empty()) {
+                ss << ", \"children\": ";
+                dumpChildren(ss, child, labels, opt);
+            }
+            ss << "}";
+        }
+        ss << "]";
+    }
+
+    // Print out the fields of the given item, without the closing brace.
+    static void dumpItem(std::stringstream& ss,
+                         Item& item,
+                         const LatencyLabelRegistry* labels,
+                         const LatencyCollectorDumpOptions& opt) {
+        ss << "{\"name\": \"" << escape(item.getLeafView()) << "\", "
+           << "\"path\": \"" << escape(item.getName()) << "\", ";
+        dumpStats(ss, item);
+        if (opt.show_overhead) {
+            ss << ", \"overhead_ns\": " << item.getOverheadNs();
+        }
+
+        if (opt.group_by_label && labels) {
+            ss << ", \"labels\": [";
+            bool first = true;
+            for (size_t ii = 1; ii < labels->getNumLabelSets(); ++ii) {
+                const HistT* hist = item.getLabelHistogram(ii);
+                if (!hist || !hist->getTotal()) continue;
+                if (!first) ss << ", ";
+                first = false;
+                Item row(labels->getName(ii), *hist);
+                ss << "{\"labels\": \"" << escape(row.getName()) << "\", ";
+                dumpStats(ss, row);
+                ss << "}";
+            }
+            ss << "]";
+        }
+
+        if (opt.show_threads && item.hasThreadBreakdown()) {
+            LatencyThreadRegistry& registry = LatencyThreadRegistry::get();
+            ss << ", \"threads\": [";
+            bool first = true;
+            for (size_t ii = 0; ii < registry.getNumKeys(); ++ii) {
+                const HistT* hist = item.getThreadHistogram(ii);
+                if (!hist || !hist->getTotal()) continue;
+                if (!first) ss << ", ";
+                first = false;
+                Item row(registry.getName(ii), *hist);
+                ss << "{\"thread\": \"" << escape(row.getName()) << "\", ";
+                dumpStats(ss, row);
+                ss << "}";
+            }
+            ss << "], \"thread_skew\": " << item.getThreadSkew();
+        }
+
+        std::vector<LatencyExemplar> exemplars = item.getExemplars();
+        if (!exemplars.empty()) {
+            ss << ", \"exemplars\": [";
+            for (size_t ii = 0; ii < exemplars.size(); ++ii) {
+                const LatencyExemplar& sample = exemplars[ii];
+                if (ii) ss << ", ";
+                ss << "{\"latency\": " << sample.latency
+                   << ", \"timestamp\": " << sample.timestamp
+                   << ", \"thread_id\": " << sample.threadId
+                   << ", \"tag\": " << sample.tag << "}";
+            }
+            ss << "]";
+        }
+    }
+
+    static void dumpStats(std::stringstream& ss, Item& item) {
+        const double PCTS[] = {50, 99, 99.9};
+        uint64_t pct_values[3];
+        item.getPercentiles(PCTS, pct_values, 3);
+        ss << "\"calls\": " << item.getNumCalls()
+           << ", \"total\": " << item.getTotalTime()
+           << ", \"avg\": " << item.getAvgLatency()
+           << ", \"max\": " << item.getMaxLatency()
+           << ", \"p50\": " << pct_values[0]
+           << ", \"p99\": " << pct_values[1]
+           << ", \"p99.9\": " << pct_values[2];
+    }
+
+    static std::string escape(LatencyStringView str) {
+        std::string ret;
+        for (char c: str) {
+            switch (c) {
+            case '"':  ret += "\\\""; break;
+            case '\\': ret += "\\\\"; break;
+            case '\n': ret += "\\n"; break;
+            case '\t': ret += "\\t"; break;
+            default:
+                if ((unsigned char)c < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    ret += buf;
+                } else {
+                    ret += c;
+                }
+            }
+        }
+        return ret;
+    }
+};
+
+using LatencyDumpJsonImpl = LatencyDumpJsonImplT<LatencyDefaultPolicy::Hist>;
@@ -0,0 +1,512 @@
+/**
+ * Copyright (C) 2017-present Jung-Sang Ahn <jungsang.ahn@gmail.com>
+ * All rights reserved.
+ *
+ * https://github.com/greensky00
+ *
+ * Latency Collector History File Module
+ * Version: 0.1.0
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "latency_reporter.h"
+#include "latency_snapshot.h"
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/**
+ * Layout of the history file, shared by `LatencyHistoryWriter` and
+ * `LatencyHistoryReader`. All integers are little-endian.
+ *
+ *   file header (64 bytes): "LATHIST" + '\0', version (u32), reserved
+ *       (u32), capacity of the ring in bytes (u64), and zero padding.
+ *   ring: records, each aligned to 64 bytes. A record that does not fit
+ *       in the rest of the ring starts over from the beginning.
+ *   record header (32 bytes): magic (u32), payload length (u32),
+ *       sequence number (u64), timestamp (u64), interval in ms (u32),
+ *       and CRC32 of the header (without CRC) and the payload (u32).
+ *   payload: serialized `LatencySnapshot` of the interval.
+ */
+struct LatencyHistoryFormat {
+    static const uint32_t VERSION = 1;
+    static const size_t FILE_HEADER_SIZE = 64;
+    static const size_t RECORD_HEADER_SIZE = 32;
+    static const size_t ALIGN = 64;
+    static const uint32_t RECORD_MAGIC = 0x4345524c; // "LREC"
+    static constexpr const char* MAGIC = "LATHIST";
+    static const size_t MAGIC_LEN = 8;
+
+    // CRC-32 (IEEE 802.3).
+    static uint32_t crc32(const void* data, size_t len, uint32_t crc = 0) {
+        static const std::vector<uint32_t> table = []() {
+            std::vector<uint32_t> ret(256);
+            for (uint32_t ii = 0; ii < 256; ++ii) {
+                uint32_t cc = ii;
+                for (size_t jj = 0; jj < 8; ++jj) {
+                    cc = (cc & 1) ? (0xedb88320 ^ (cc >> 1)) : (cc >> 1);
+                }
+                ret[ii] = cc;
+            }
+            return ret;
+        }();
+        const uint8_t* ptr = (const uint8_t*)data;
+        crc = ~crc;
+        for (size_t ii = 0; ii < len; ++ii) {
+            crc = table[(crc ^ ptr[ii]) & 0xff] ^ (crc >> 8);
+        }
+        return ~crc;
+    }
+
+    static size_t alignUp(size_t len) {
+        return (len + ALIGN - 1) / ALIGN * ALIGN;
+    }
+
+    static void putLE(uint8_t* dst, uint64_t val, size_t len) {
+        for (size_t ii = 0; ii < len; ++ii) {
+            dst[ii] = (uint8_t)(val >> (ii * 8));
+        }
+    }
+
+    static uint64_t getLE(const uint8_t* src, size_t len) {
+        uint64_t ret = 0;
+        for (size_t ii = 0; ii < len; ++ii) {
+            ret |= (uint64_t)src[ii] << (ii * 8);
+        }
+        return ret;
+    }
+
+    struct RecordHeader {
+        RecordHeader()
+            : magic(0), length(0), seq(0), timestamp(0)
+            , intervalMs(0), crc(0) {}
+        uint32_t magic;
+        uint32_t length;
+        uint64_t seq;
+        uint64_t timestamp;
+        uint32_t intervalMs;
+        uint32_t crc;
+
+        void encode(uint8_t* dst) const {
+            putLE(dst, magic, 4);
+            putLE(dst + 4, length, 4);
+            putLE(dst + 8, seq, 8);
+            putLE(dst + 16, timestamp, 8);
+            putLE(dst + 24, intervalMs, 4);
+            putLE(dst + 28, crc, 4);
+        }
+
+        void decode(const uint8_t* src) {
+            magic = getLE(src, 4);
+            length = getLE(src + 4, 4);
+            seq = getLE(src + 8, 8);
+            timestamp = getLE(src + 16, 8);
+            intervalMs = getLE(src + 24, 4);
+            crc = getLE(src + 28, 4);
+        }
+
+        // CRC of the encoded header (except the CRC field) and payload.
+        static uint32_t getCrc(const uint8_t* header, const void* payload,
+                               size_t len) {
+            uint32_t ret = crc32(header, RECORD_HEADER_SIZE - 4);
+            return crc32(payload, len, ret);
+        }
+    };
+};
+
+/**
+ * Appends the interval snapshots of a collector to a preallocated,
+ * memory-mapped ring file, so that the latency history survives a crash
+ * of the process: the written pages belong to the kernel page cache.
+ *
+ * Appends are lock-free: a record reserves its space with a CAS on the
+ * write position, and is written in place without any system call. A
+ * record being written at the moment of a crash fails the checksum, and
+ * is skipped by `LatencyHistoryReader`. Once the ring is full, the oldest
+ * records are overwritten.
+ */
+class LatencyHistoryWriter {
+public:
+    LatencyHistoryWriter()
+        : fd(-1)
+        , base(nullptr)
+        , capacity(0)
+        , writePos(0)
+        , nextSeq(0)
+        , numRecords(0)
+        , numDropped(0)
+        , lastAppend(std::chrono::steady_clock::now())
+        {}
+
+    ~LatencyHistoryWriter() {
+        close();
+    }
+
+    /**
+     * Open the ring file of `capacity` bytes (rounded down to 64 bytes),
+     * creating it if not exist. If the file already has the same
+     * capacity, new records continue after the latest one in it.
+     * Otherwise, it is initialized.
+     *
+     * @return `false` if the file cannot be created or mapped.
+     */
+    bool open(const std::string& path, size_t _capacity) {
+        using F = LatencyHistoryFormat;
+        close();
+        capacity = _capacity / F::ALIGN * F::ALIGN;
+        if (capacity < F::ALIGN) return false;
+        size_t file_size = F::FILE_HEADER_SIZE + capacity;
+
+        fd = ::open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) return false;
+        struct stat st;
+        bool resume = fstat(fd, &st) == 0 && (size_t)st.st_size == file_size;
+        if (!resume && ftruncate(fd, file_size) != 0) {
+            close();
+            return false;
+        }
+#if defined(__linux__)
+        // Allocate all blocks now, not to get SIGBUS on a full disk later.
+        if (posix_fallocate(fd, 0, file_size) != 0) {
+            close();
+            return false;
+        }
+#endif
+        void* addr = mmap( nullptr, file_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fd, 0 );
+        if (addr == MAP_FAILED) {
+            close();
+            return false;
+        }
+        base = (uint8_t*)addr;
+
+        uint8_t header[F::FILE_HEADER_SIZE] = {0};
+        memcpy(header, F::MAGIC, F::MAGIC_LEN);
+        F::putLE(header + F::MAGIC_LEN, F::VERSION, 4);
+        F::putLE(header + F::MAGIC_LEN + 8, capacity, 8);
+        if (!resume || memcmp(base, header, F::FILE_HEADER_SIZE) != 0) {
+            memset(base, 0, file_size);
+            memcpy(base, header, F::FILE_HEADER_SIZE);
+            writePos = 0;
+            nextSeq = 0;
+            return true;
+        }
+
+        // Continue after the latest valid record.
+        uint64_t last_seq = 0;
+        size_t last_end = 0;
+        bool found = false;
+        for (size_t pos = 0; pos + F::RECORD_HEADER_SIZE <= capacity;
+             pos += F::ALIGN) {
+            F::RecordHeader rec;
+            if (!checkRecord(base + F::FILE_HEADER_SIZE, capacity, pos, rec)) {
+                continue;
+            }
+            if (!found || rec.seq > last_seq) {
+                last_seq = rec.seq;
+                last_end = pos + F::alignUp(F::RECORD_HEADER_SIZE
+                                            + rec.length);
+                found = true;
+            }
+        }
+        writePos = last_end;
+        nextSeq = (found) ? last_seq + 1 : 0;
+        return true;
+    }
+
+    /**
+     * Append the given interval snapshot, of `interval_ms` long.
+     * Lock-free, and safe to be called by multiple threads.
+     *
+     * @return `false` if not open, or too large for the ring.
+     */
+    bool append(const LatencySnapshot& interval, uint64_t interval_ms) {
+        using F = LatencyHistoryFormat;
+        if (!base) return false;
+        std::string payload = interval.serialize();
+        size_t len = F::alignUp(F::RECORD_HEADER_SIZE + payload.size());
+        if (len > capacity) {
+            numDropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        uint8_t* dst = base + F::FILE_HEADER_SIZE + reserve(len);
+        F::RecordHeader rec;
+        rec.magic = F::RECORD_MAGIC;
+        rec.length = payload.size();
+        rec.seq = nextSeq.fetch_add(1, std::memory_order_relaxed);
+        rec.timestamp = interval.getTimestamp();
+        rec.intervalMs = std::min(interval_ms, (uint64_t)UINT32_MAX);
+        uint8_t header[F::RECORD_HEADER_SIZE];
+        rec.encode(header);
+        rec.crc = F::RecordHeader::getCrc(header, payload.data(),
+                                          payload.size());
+        rec.encode(header);
+
+        // Invalidate the old record here first, and publish the header
+        // last, so that a torn write is never taken as a valid record.
+        memset(dst, 0, F::RECORD_HEADER_SIZE);
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(dst + F::RECORD_HEADER_SIZE, payload.data(), payload.size());
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(dst, header, F::RECORD_HEADER_SIZE);
+        numRecords.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /**
+     * Append the samples of the given collector since the previous call.
+     * Only for a single thread, e.g., the reporter thread of `start()`.
+     */
+    template<typename Policy>
+    bool append(LatencyCollectorT<Policy>& lat) {
+        LatencySnapshot cur = LatencySnapshot::take(lat);
+        LatencySnapshot interval = cur;
+        interval -= prev;
+        prev = cur;
+
+        auto now = std::chrono::steady_clock::now();
+        uint64_t interval_ms =
+            std::chrono::duration_cast<std::chrono::milliseconds>
+                (now - lastAppend).count();
+        lastAppend = now;
+        return append(interval, interval_ms);
+    }
+
+    /**
+     * Append the given collector every `interval_ms` on a background
+     * thread, until `stop()` is called.
+     */
+    template<typename Policy>
+    void start(LatencyCollectorT<Policy>& lat, uint64_t interval_ms) {
+        prev = LatencySnapshot::take(lat);
+        lastAppend = std::chrono::steady_clock::now();
+        reporter.start([this, &lat]() { append(lat); }, interval_ms);
+    }
+
+    // Append the last interval and stop the background thread.
+    void stop() {
+        reporter.stop();
+    }
+
+    /**
+     * Flush the written records to the disk. Not needed for a crash of
+     * the process, but for a crash of the machine.
+     */
+    bool sync() {
+        if (!base) return false;
+        return msync( base, LatencyHistoryFormat::FILE_HEADER_SIZE + capacity,
+                      MS_SYNC ) == 0;
+    }
+
+    void close() {
+        stop();
+        if (base) {
+            munmap(base, LatencyHistoryFormat::FILE_HEADER_SIZE + capacity);
+        }
+        if (fd >= 0) ::close(fd);
+        base = nullptr;
+        fd = -1;
+    }
+
+    // Number of records appended.
+    uint64_t getNumRecords() const { return numRecords.load(); }
+
+    // Number of snapshots dropped, as they are larger than the ring.
+    uint64_t getNumDropped() const { return numDropped.load(); }
+
+    /**
+     * Validate the record at `pos` of the ring.
+     *
+     * @return `true` if both magic and CRC match.
+     */
+    static bool checkRecord(const uint8_t* ring, size_t ring_size, size_t pos,
+                            LatencyHistoryFormat::RecordHeader& rec) {
+        using F = LatencyHistoryFormat;
+        if (pos + F::RECORD_HEADER_SIZE > ring_size) return false;
+        rec.decode(ring + pos);
+        if ( rec.magic != F::RECORD_MAGIC ||
+             rec.length > ring_size - pos - F::RECORD_HEADER_SIZE ) {
+            return false;
+        }
+        const uint8_t* payload = ring + pos + F::RECORD_HEADER_SIZE;
+        return F::RecordHeader::getCrc(ring + pos, payload, rec.length)
+               == rec.crc;
+    }
+
+private:
+    // Reserve `len` bytes of the ring, not straddling its end.
+    // Return the offset in the ring.
+    size_t reserve(size_t len) {
+        uint64_t cur = writePos.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t start = cur;
+            size_t offset = start % capacity;
+            // Not enough room until the end, start over from the beginning.
+            if (offset + len > capacity) start += capacity - offset;
+            if (writePos.compare_exchange_weak(cur, start + len)) {
+                return start % capacity;
+            }
+            // `cur` is updated, retry.
+        }
+    }
+
+    int fd;
+    uint8_t* base;
+    size_t capacity;
+    // Total bytes reserved so far; the offset in the ring is this
+    // modulo `capacity`.
+    std::atomic<uint64_t> writePos;
+    std::atomic<uint64_t> nextSeq;
+
+    std::atomic<uint64_t> numRecords;
+    std::atomic<uint64_t> numDropped;
+
+    // State of `append(lat)`, only used by a single thread.
+    LatencySnapshot prev;
+    std::chrono::steady_clock::time_point lastAppend;
+
+    LatencyReporterThread reporter;
+};
+
+/**
+ * Interval snapshot read from the history file.
+ */
+struct LatencyHistoryRecord {
+    LatencyHistoryRecord() : seq(0), intervalMs(0) {}
+    uint64_t seq;
+    uint64_t intervalMs;
+    // Samples of the interval, with their percentiles. The timestamp is
+    // the end of the interval.
+    LatencySnapshot stats;
+};
+
+/**
+ * Reads the intervals in a history file written by `LatencyHistoryWriter`,
+ * including the one left by a crashed process.
+ */
+class LatencyHistoryReader {
+public:
+    LatencyHistoryReader() : numCorrupted(0) {}
+
+    /**
+     * Read all valid records, in the order they were written.
+     *
+     * @return `false` if the file cannot be read, or is not a history file.
+     */
+    bool load(const std::string& path) {
+        using F = LatencyHistoryFormat;
+        FILE* fp = fopen(path.c_str(), "rb");
+        if (!fp) return false;
+        std::string data;
+        char buf[65536];
+        size_t len = 0;
+        while ( (len = fread(buf, 1, sizeof(buf), fp)) > 0 ) {
+            data.append(buf, len);
+        }
+        bool ok = !ferror(fp);
+        fclose(fp);
+        if ( !ok || data.size() < F::FILE_HEADER_SIZE ||
+             memcmp(data.data(), F::MAGIC, F::MAGIC_LEN) != 0 ) {
+            return false;
+        }
+        const uint8_t* header = (const uint8_t*)data.data();
+        if (F::getLE(header + F::MAGIC_LEN, 4) != F::VERSION) return false;
+        size_t capacity = F::getLE(header + F::MAGIC_LEN + 8, 8);
+        if (data.size() - F::FILE_HEADER_SIZE < capacity) return false;
+
+        records.clear();
+        numCorrupted = 0;
+        const uint8_t* ring = header + F::FILE_HEADER_SIZE;
+        size_t pos = 0;
+        while (pos + F::RECORD_HEADER_SIZE <= capacity) {
+            F::RecordHeader rec;
+            if (!LatencyHistoryWriter::checkRecord(ring, capacity, pos, rec)) {
+                rec.decode(ring + pos);
+                if (rec.magic == F::RECORD_MAGIC) numCorrupted++;
+                pos += F::ALIGN;
+                continue;
+            }
+            LatencyHistoryRecord entry;
+            entry.seq = rec.seq;
+            entry.intervalMs = rec.intervalMs;
+            std::string payload( (const char*)ring + pos
+                                     + F::RECORD_HEADER_SIZE,
+                                 rec.length );
+            if (entry.stats.deserialize(payload)) {
+                records.push_back(std::move(entry));
+            } else {
+                numCorrupted++;
+            }
+            pos += F::alignUp(F::RECORD_HEADER_SIZE + rec.length);
+        }
+        std::sort( records.begin(), records.end(),
+                   [](const LatencyHistoryRecord& a,
+                      const LatencyHistoryRecord& b) {
+                       return a.seq < b.seq;
+                   } );
+        return true;
+    }
+
+    const std::vector<LatencyHistoryRecord>& getRecords() const {
+        return records;
+    }
+
+    /**
+     * The given stat in each interval, oldest first. Intervals without
+     * its samples are skipped.
+     */
+    std::vector< std::pair<const LatencyHistoryRecord*,
+                           const LatencySnapshotStat*> >
+        getSeries(const std::string& stat_name) const
+    {
+        std::vector< std::pair<const LatencyHistoryRecord*,
+                               const LatencySnapshotStat*> > ret;
+        for (const LatencyHistoryRecord& rec: records) {
+            const LatencySnapshotStat* stat = rec.stats.find(stat_name);
+            if (stat) ret.push_back( std::make_pair(&rec, stat) );
+        }
+        return ret;
+    }
+
+    // Number of records that were being written, or partially
+    // overwritten, i.e., with the magic but failing the checksum.
+    size_t getNumCorrupted() const { return numCorrupted; }
+
+private:
+    std::vector<LatencyHistoryRecord> records;
+    size_t numCorrupted;
+};
@@ -0,0 +1,90 @@
+/**
+ * Copyright (C) 2017-present Jung-Sang Ahn <jungsang.ahn@gmail.com>
+ * All rights reserved.
+ *
+ * https://github.com/greensky00
+ *
+ * Latency Collector Reporter Thread Module
+ * Version: 0.1.0
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+/**
+ * Background thread calling the given function periodically, e.g., to
+ * push stats out of the process. The function is called one last time
+ * when stopped, not to lose the last interval.
+ */
+class LatencyReporterThread {
+public:
+    LatencyReporterThread() : stopping(false) {}
+
+    ~LatencyReporterThread() {
+        stop();
+    }
+
+    // Call `func` every `interval_ms`, replacing the running one if any.
+    void start(std::function<void()> func, uint64_t interval_ms) {
+        stop();
+        stopping = false;
+        reporter = std::thread([this, func, interval_ms]() {
+            std::unique_lock<std::mutex> l(lock);
+            while (true) {
+                cv.wait_for( l,
+                             std::chrono::milliseconds(interval_ms),
+                             [this]() { return stopping; } );
+                bool last = stopping;
+                l.unlock();
+                func();
+                l.lock();
+                if (last) break;
+            }
+        });
+    }
+
+    // Call the function for the last time, and stop the thread.
+    void stop() {
+        {
+            std::lock_guard<std::mutex> l(lock);
+            if (!reporter.joinable()) return;
+            stopping = true;
+        }
+        cv.notify_all();
+        reporter.join();
+    }
+
+private:
+    std::mutex lock;
+    std::condition_variable cv;
+    bool stopping;
+    std::thread reporter;
+};
@@ -0,0 +1,314 @@
+/**
+ * Copyright (C) 2017-present Jung-Sang Ahn <jungsang.ahn@gmail.com>
+ * All rights reserved.
+ *
+ * https://github.com/greensky00
+ *
+ * Slow Scope Notifier
+ * Version: 0.1.0
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+
+/**
+ * A sample that exceeded the threshold of its slow scope rule.
+ */
+struct LatencySlowScopeEvent {
+    LatencySlowScopeEvent()
+        : latency(0), threshold(0), timestamp(0)
+        , threadId(0), tag(0), numSuppressed(0) {}
+    // Stat name, i.e., the call path for scopes.
+    std::string statName;
+    // Latency and the threshold, in microseconds.
+    uint64_t latency;
+    uint64_t threshold;
+    // Wall-clock time in microseconds since the epoch.
+    uint64_t timestamp;
+    // Sequential ID of the recording thread.
+    uint32_t threadId;
+    // Exemplar tag given to the sample, 0 if not given.
+    uint64_t tag;
+    // Number of events of the same rule dropped since the previous one,
+    // due to the rate limit or the queue being full.
+    uint64_t numSuppressed;
+};
+
+using LatencySlowScopeCallback =
+    std::function< void(const LatencySlowScopeEvent&) >;
+
+/**
+ * Delivers slow scope events to user callbacks, on a dedicated thread.
+ *
+ * Recording threads only do a rate limit check (lock-free) and push the
+ * event into a bounded queue, so that neither a slow callback nor a
+ * latency storm can block them. Events over the rate limit or the queue
+ * capacity are counted and reported with the next delivered event.
+ */
+class LatencySlowScopeNotifier {
+public:
+    static const size_t MAX_RULES = 64;
+    static const size_t DEFAULT_QUEUE_SIZE = 1024;
+    static const uint32_t NO_RULE = MAX_RULES;
+
+    LatencySlowScopeNotifier(size_t queue_size = DEFAULT_QUEUE_SIZE)
+        : numRules(0)
+        , maxQueueSize(queue_size)
+        , numInFlight(0)
+        , stopping(false)
+        , numDelivered(0)
+        , numSuppressed(0)
+        {}
+
+    ~LatencySlowScopeNotifier() {
+        stop();
+    }
+
+    /**
+     * Add a rule. The dispatcher thread is started by the first rule,
+     * or by the first one after `stop()`.
+     *
+     * @param pattern Stat name, or its prefix followed by `*`.
+     * @param threshold_us Latency threshold in microseconds.
+     * @param callback Callback to be invoked on the dispatcher thread.
+     * @param max_per_sec Max number of events per second.
+     * @param burst Max number of events at once.
+     * @return Rule ID, or `NO_RULE` if there are too many rules.
+     */
+    uint32_t addRule(const std::string& pattern,
+                     uint64_t threshold_us,
+                     LatencySlowScopeCallback callback,
+                     double max_per_sec,
+                     size_t burst)
+    {
+        std::lock_guard<std::mutex> l(rulesLock);
+        size_t rule_id = numRules.load();
+        if (rule_id >= MAX_RULES) return NO_RULE;
+
+        Rule* rule = new Rule();
+        rule->prefix = !pattern.empty() && pattern.back() == '*';
+        rule->pattern = (rule->prefix)
+                        ? pattern.substr(0, pattern.size() - 1) : pattern;
+        rule->threshold = threshold_us;
+        rule->callback = callback;
+        rule->intervalNs = (max_per_sec > 0)
+                           ? (uint64_t)(1e9 / max_per_sec) : 0;
+        rule->burstNs = rule->intervalNs * (burst ? burst : 1);
+        rules[rule_id].reset(rule);
+        numRules.store(rule_id + 1, std::memory_order_release);
+
+        startDispatcher();
+        return rule_id;
+    }
+
+    /**
+     * Find the rule for the given stat. An exact match is preferred,
+     * and then the longest prefix.
+     *
+     * @return Rule ID, or `NO_RULE` if not found.
+     */
+    uint32_t match(const std::string& stat_name) const {
+        uint32_t ret = NO_RULE;
+        size_t best_len = 0;
+        size_t num = numRules.load(std::memory_order_acquire);
+        for (size_t ii = 0; ii < num; ++ii) {
+            const Rule& rule = *rules[ii];
+            if (!rule.prefix) {
+                if (rule.pattern == stat_name) return ii;
+                continue;
+            }
+            if ( stat_name.compare(0, rule.pattern.size(), rule.pattern) == 0 &&
+                 (ret == NO_RULE || rule.pattern.size() > best_len) ) {
+                ret = ii;
+                best_len = rule.pattern.size();
+            }
+        }
+        return ret;
+    }
+
+    uint64_t getThreshold(uint32_t rule_id) const {
+        return rules[rule_id]->threshold;
+    }
+
+    size_t getNumRules() const {
+        return numRules.load(std::memory_order_acquire);
+    }
+
+    /**
+     * Called by the recording thread, once the threshold of the given rule
+     * is exceeded. If it returns `true`, the caller should build the event
+     * and call `push()`. Otherwise, the event is rate limited.
+     */
+    bool admit(uint32_t rule_id) {
+        Rule& rule = *rules[rule_id];
+        if (tryAcquire(rule)) return true;
+        suppress(rule);
+        return false;
+    }
+
+    // Queue the event admitted by `admit()`.
+    void push(uint32_t rule_id, LatencySlowScopeEvent& event) {
+        Rule& rule = *rules[rule_id];
+        std::unique_lock<std::mutex> l(queueLock);
+        if (stopping || queue.size() >= maxQueueSize) {
+            l.unlock();
+            suppress(rule);
+            return;
+        }
+        event.threshold = rule.threshold;
+        event.numSuppressed = rule.numSuppressed.exchange(0);
+        queue.push_back( std::make_pair(rule_id, std::move(event)) );
+        numInFlight++;
+        l.unlock();
+        queueCv.notify_one();
+    }
+
+    // Wait until all the queued events are delivered.
+    void flush() {
+        std::unique_lock<std::mutex> l(queueLock);
+        idleCv.wait(l, [this]() { return numInFlight == 0 || stopping; });
+    }
+
+    /**
+     * Deliver the remaining events and stop the dispatcher thread.
+     * Events pushed afterwards are suppressed, until a new rule is added.
+     */
+    void stop() {
+        std::lock_guard<std::mutex> dl(dispatcherLock);
+        {
+            std::lock_guard<std::mutex> l(queueLock);
+            if (!dispatcher.joinable()) return;
+            stopping = true;
+        }
+        queueCv.notify_all();
+        dispatcher.join();
+    }
+
+    // Number of events delivered to the callbacks.
+    uint64_t getNumDelivered() const { return numDelivered.load(); }
+
+    // Number of events dropped due to the rate limit or the queue size.
+    uint64_t getNumSuppressed() const { return numSuppressed.load(); }
+
+private:
+    struct Rule {
+        Rule() : threshold(0), intervalNs(0), burstNs(0)
+               , prefix(false), tat(0), numSuppressed(0) {}
+        std::string pattern;
+        uint64_t threshold;
+        LatencySlowScopeCallback callback;
+        // Rate limit: one event per `intervalNs`, up to `burstNs` ahead.
+        uint64_t intervalNs;
+        uint64_t burstNs;
+        bool prefix;
+        // Theoretical arrival time of the next event (GCRA).
+        std::atomic<uint64_t> tat;
+        std::atomic<uint64_t> numSuppressed;
+    };
+
+    // Generic cell rate algorithm, equivalent to a token bucket
+    // but with a single atomic variable.
+    static bool tryAcquire(Rule& rule) {
+        if (!rule.intervalNs) return true;
+        uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>
+                       ( std::chrono::steady_clock::now().time_since_epoch() )
+                       .count();
+        uint64_t tat = rule.tat.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t base = (tat > now) ? tat : now;
+            if (base + rule.intervalNs > now + rule.burstNs) return false;
+            if (rule.tat.compare_exchange_weak(tat, base + rule.intervalNs)) {
+                return true;
+            }
+            // `tat` is updated, retry.
+        }
+    }
+
+    void suppress(Rule& rule) {
+        rule.numSuppressed.fetch_add(1, std::memory_order_relaxed);
+        numSuppressed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void startDispatcher() {
+        std::lock_guard<std::mutex> dl(dispatcherLock);
+        if (dispatcher.joinable()) return;
+        {
+            std::lock_guard<std::mutex> l(queueLock);
+            stopping = false;
+        }
+        dispatcher = std::thread(&LatencySlowScopeNotifier::dispatchLoop,
+                                 this);
+    }
+
+    void dispatchLoop() {
+        std::unique_lock<std::mutex> l(queueLock);
+        while (true) {
+            queueCv.wait(l, [this]() { return stopping || !queue.empty(); });
+            if (queue.empty()) break; // Stopping, and nothing left.
+
+            std::pair<uint32_t, LatencySlowScopeEvent> entry =
+                std::move(queue.front());
+            queue.pop_front();
+            l.unlock();
+
+            rules[entry.first]->callback(entry.second);
+            numDelivered.fetch_add(1, std::memory_order_relaxed);
+
+            l.lock();
+            if (--numInFlight == 0) idleCv.notify_all();
+        }
+        idleCv.notify_all();
+    }
+
+    // Rules are never removed, so that they can be read without lock.
+    std::mutex rulesLock;
+    std::unique_ptr<Rule> rules[MAX_RULES];
+    std::atomic<size_t> numRules;
+
+    std::mutex queueLock;
+    std::condition_variable queueCv;
+    std::condition_variable idleCv;
+    std::deque< std::pair<uint32_t, LatencySlowScopeEvent> > queue;
+    size_t maxQueueSize;
+    size_t numInFlight;
+    bool stopping;
+    // Serializes starting and stopping the dispatcher thread.
+    std::mutex dispatcherLock;
+    std::thread dispatcher;
+
+    std::atomic<uint64_t> numDelivered;
+    std::atomic<uint64_t> numSuppressed;
+};
@@ -0,0 +1,715 @@
+/**
+ * Copyright (C) 2017-present Jung-Sang Ahn <jungsang.ahn@gmail.com>
+ * All rights reserved.
+ *
+ * https://github.com/greensky00
+ *
+ * Latency Collector Snapshot Module
+ * Version: 0.1.0
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "latency_collector.h"
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <iterator>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * Histogram bin of a snapshot: `count` samples in [lowerBound, upperBound).
+ */
+struct LatencySnapshotBin {
+    LatencySnapshotBin(uint64_t lower = 0, uint64_t upper = 0, uint64_t cnt = 0)
+        : lowerBound(lower), upperBound(upper), count(cnt) {}
+    uint64_t lowerBound;
+    uint64_t upperBound;
+    uint64_t count;
+};
+
+/**
+ * Stat in a `LatencySnapshot`, independent of the histogram type of the
+ * collector it came from. All latencies are in microseconds.
+ */
+struct LatencySnapshotStat {
+    LatencySnapshotStat()
+        : numCalls(0), totalTime(0), maxLatency(0)
+        , p50(0), p99(0), p999(0), overheadNs(0) {}
+
+    std::string name;
+    uint64_t numCalls;
+    uint64_t totalTime;
+    uint64_t maxLatency;
+    // Percentiles estimated by the histogram of the collector.
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+    uint64_t overheadNs;
+    // Non-empty bins, by upper bound.
+    std::vector<LatencySnapshotBin> bins;
+
+    // Depth of the call path, e.g., 2 for " ## a ## b", 0 if not a path.
+    size_t getNumStacks() const {
+        size_t ret = 0;
+        size_t pos = name.find(" ## ");
+        while (pos != std::string::npos) {
+            ret++;
+            pos = name.find(" ## ", pos + 4);
+        }
+        return ret;
+    }
+
+    // Leaf function of the call path, or the whole name if not a path.
+    std::string getLeaf() const {
+        size_t pos = name.rfind(" ## ");
+        return (pos == std::string::npos) ? name : name.substr(pos + 4);
+    }
+
+    // this += rhs. Bins of the same bounds are added up, and the
+    // percentiles are estimated again from the merged bins.
+    LatencySnapshotStat& operator+=(const LatencySnapshotStat& rhs) {
+        numCalls += rhs.numCalls;
+        totalTime += rhs.totalTime;
+        maxLatency = std::max(maxLatency, rhs.maxLatency);
+        overheadNs += rhs.overheadNs;
+
+        std::vector<LatencySnapshotBin> merged;
+        merged.reserve(bins.size() + rhs.bins.size());
+        size_t ii = 0, jj = 0;
+        while (ii < bins.size() || jj < rhs.bins.size()) {
+            if ( jj == rhs.bins.size() ||
+                 ( ii < bins.size() && binLess(bins[ii], rhs.bins[jj]) ) ) {
+                merged.push_back(bins[ii++]);
+            } else if ( ii == bins.size() ||
+                        binLess(rhs.bins[jj], bins[ii]) ) {
+                merged.push_back(rhs.bins[jj++]);
+            } else {
+                merged.push_back(bins[ii++]);
+                merged.back().count += rhs.bins[jj++].count;
+            }
+        }
+        bins.swap(merged);
+        updatePercentiles();
+        return *this;
+    }
+
+    /**
+     * this -= rhs, where `rhs` is an earlier snapshot of the same stat,
+     * leaving only the samples added since then. Their max is not known,
+     * it is capped by the upper bound of the largest bin left.
+     */
+    LatencySnapshotStat& operator-=(const LatencySnapshotStat& rhs) {
+        numCalls -= std::min(numCalls, rhs.numCalls);
+        totalTime -= std::min(totalTime, rhs.totalTime);
+        overheadNs -= std::min(overheadNs, rhs.overheadNs);
+
+        std::vector<LatencySnapshotBin> left;
+        size_t jj = 0;
+        for (const LatencySnapshotBin& bin: bins) {
+            while ( jj < rhs.bins.size() && binLess(rhs.bins[jj], bin) ) jj++;
+            uint64_t cnt = bin.count;
+            if ( jj < rhs.bins.size() && !binLess(bin, rhs.bins[jj]) ) {
+                cnt -= std::min(cnt, rhs.bins[jj].count);
+            }
+            if (cnt) left.push_back( LatencySnapshotBin( bin.lowerBound,
+                                                         bin.upperBound,
+                                                         cnt ) );
+        }
+        bins.swap(left);
+
+        if (bins.empty()) {
+            maxLatency = 0;
+        } else if (maxLatency >= bins.back().upperBound) {
+            maxLatency = std::max( bins.back().lowerBound,
+                                   bins.back().upperBound - 1 );
+        }
+        updatePercentiles();
+        return *this;
+    }
+
+    /**
+     * Rebuild a `Histogram` from the bins. Each bin goes to the
+     * power-of-two bin its lower bound belongs to, which is exact for
+     * the snapshots of `Histogram` and its variants, but approximate for
+     * the others such as `DDSketch`.
+     */
+    Histogram toHistogram() const {
+        Histogram ret;
+        addBinsTo(ret);
+        return ret;
+    }
+
+    // Same as above, as a plain copy for estimating percentiles.
+    HistogramSnapshot toHistogramSnapshot() const {
+        HistogramSnapshot ret;
+        addBinsTo(ret);
+        return ret;
+    }
+
+private:
+    template<typename HistT>
+    void addBinsTo(HistT& dst) const {
+        for (size_t ii = 0; ii < bins.size(); ++ii) {
+            // Only the total sum and max are known,
+            // add them along with the last bin, where the max belongs.
+            bool last = (ii + 1 == bins.size());
+            dst.addBin( bins[ii].lowerBound, bins[ii].count,
+                        (last) ? totalTime : 0,
+                        (last) ? maxLatency : 0 );
+        }
+    }
+
+    void updatePercentiles() {
+        HistogramSnapshot hist = toHistogramSnapshot();
+        p50 = hist.estimate(50);
+        p99 = hist.estimate(99);
+        p999 = hist.estimate(99.9);
+    }
+
+    static bool binLess(const LatencySnapshotBin& a,
+                        const LatencySnapshotBin& b) {
+        if (a.upperBound != b.upperBound) return a.upperBound < b.upperBound;
+        return a.lowerBound < b.lowerBound;
+    }
+};
+
+/**
+ * Point-in-time copy of the stats of a collector, which can be saved to
+ * a file and loaded later, e.g., to compare the profiles before and after
+ * a deploy (see `LatencySnapshotDiff`).
+ *
+ * Binary format, all integers are little-endian:
+ *   header: "LATSNAP" + '\0', version (u32), timestamp (u64),
+ *           number of stats (u32).
+ *   stat:   name length (u32), name, calls, total, max, p50, p99, p99.9,
+ *           overhead in ns (u64 each), number of bins (u32), and then
+ *           lower bound, upper bound, and count (u64 each) of each bin.
+ */
+class LatencySnapshot {
+    friend class LatencySnapshotReader;
+
+public:
+    static const uint32_t FORMAT_VERSION = 1;
+
+    LatencySnapshot() : timestamp(0) {}
+
+    /**
+     * Take a snapshot of the given collector. Stats without samples are
+     * excluded, and `label_filter` of `opt` is applied if given.
+     */
+    template<typename Policy>
+    static LatencySnapshot take(LatencyCollectorT<Policy>& lat,
+                                const LatencyCollectorDumpOptions& opt
+                                    = LatencyCollectorDumpOptions());
+
+    // Add the given stat, replacing the existing one of the same name.
+    void add(const LatencySnapshotStat& stat) {
+        stats[stat.name] = stat;
+    }
+
+    // Merge the given stat into the one of the same name, if exists.
+    void merge(const LatencySnapshotStat& stat) {
+        auto entry = stats.find(stat.name);
+        if (entry == stats.end()) {
+            stats.insert( std::make_pair(stat.name, stat) );
+        } else {
+            entry->second += stat;
+        }
+    }
+
+    /**
+     * this -= prev, where `prev` is an earlier snapshot of the same
+     * collector, leaving only the samples added since then. Stats without
+     * new samples are removed. See `LatencySnapshotStat::operator-=()`.
+     */
+    LatencySnapshot& operator-=(const LatencySnapshot& prev) {
+        auto itr = stats.begin();
+        while (itr != stats.end()) {
+            LatencySnapshotStat& stat = itr->second;
+            const LatencySnapshotStat* prev_stat = prev.find(itr->first);
+            // Fewer calls than before: evicted and added again.
+            if (prev_stat && prev_stat->numCalls <= stat.numCalls) {
+                stat -= *prev_stat;
+            }
+            itr = (stat.numCalls) ? std::next(itr) : stats.erase(itr);
+        }
+        return *this;
+    }
+
+    // Merge all stats of `src`. The timestamp becomes the later one.
+    void merge(const LatencySnapshot& src) {
+        for (auto& entry: src.stats) merge(entry.second);
+        timestamp = std::max(timestamp, src.timestamp);
+    }
+
+    /**
+     * Add the stats to the given collector of `Histogram`, so that they
+     * can be rendered by any dump implementation. See
+     * `LatencySnapshotStat::toHistogram()` for the accuracy of the bins.
+     */
+    template<typename Policy>
+    void restore(LatencyCollectorT<Policy>& lat) const;
+
+    const std::map<std::string, LatencySnapshotStat>& getStats() const {
+        return stats;
+    }
+
+    // Return `nullptr` if not exist.
+    const LatencySnapshotStat* find(const std::string& name) const {
+        auto entry = stats.find(name);
+        return (entry == stats.end()) ? nullptr : &entry->second;
+    }
+
+    size_t getNumStats() const { return stats.size(); }
+
+    // Wall-clock time when the snapshot was taken,
+    // in microseconds since the epoch.
+    uint64_t getTimestamp() const { return timestamp; }
+    void setTimestamp(uint64_t us) { timestamp = us; }
+
+    std::string serialize() const {
+        std::string ret;
+        putHeader(ret, stats.size());
+        for (auto& entry: stats) putStat(ret, entry.second);
+        return ret;
+    }
+
+    /**
+     * Same as `serialize()`, but split into multiple snapshots of up to
+     * `max_size` bytes each, e.g., to fit in datagrams. A stat larger than
+     * that by itself goes alone. Nothing is returned if empty.
+     */
+    std::vector<std::string> serializeChunks(size_t max_size) const {
+        std::vector<std::string> ret;
+        std::string body;
+        std::string stat_data;
+        size_t num_stats = 0;
+        for (auto& entry: stats) {
+            stat_data.clear();
+            putStat(stat_data, entry.second);
+            if ( num_stats &&
+                 HEADER_SIZE + body.size() + stat_data.size() > max_size ) {
+                ret.push_back(std::string());
+                putHeader(ret.back(), num_stats);
+                ret.back() += body;
+                body.clear();
+                num_stats = 0;
+            }
+            body += stat_data;
+            num_stats++;
+        }
+        if (num_stats) {
+            ret.push_back(std::string());
+            putHeader(ret.back(), num_stats);
+            ret.back() += body;
+        }
+        return ret;
+    }
+
+    /**
+     * Replace the contents with the given serialized snapshot.
+     *
+     * @return `false` if the data is malformed or of an unknown version.
+     *         The contents are not changed in that case.
+     */
+    bool deserialize(const std::string& data) {
+        Reader rd(data);
+        if ( data.size() < MAGIC_LEN ||
+             data.compare(0, MAGIC_LEN, MAGIC, MAGIC_LEN) != 0 ) {
+            return false;
+        }
+        rd.pos = MAGIC_LEN;
+
+        uint32_t version = 0, num_stats = 0;
+        uint64_t ts = 0;
+        if ( !rd.getU32(version) || version != FORMAT_VERSION ||
+             !rd.getU64(ts) || !rd.getU32(num_stats) ) {
+            return false;
+        }
+
+        std::map<std::string, LatencySnapshotStat> new_stats;
+        for (uint32_t ii = 0; ii < num_stats; ++ii) {
+            LatencySnapshotStat stat;
+            uint32_t name_len = 0, num_bins = 0;
+            if ( !rd.getU32(name_len) || !rd.getBytes(name_len, stat.name) ||
+                 !rd.getU64(stat.numCalls) || !rd.getU64(stat.totalTime) ||
+                 !rd.getU64(stat.maxLatency) || !rd.getU64(stat.p50) ||
+                 !rd.getU64(stat.p99) || !rd.getU64(stat.p999) ||
+                 !rd.getU64(stat.overheadNs) || !rd.getU32(num_bins) ) {
+                return false;
+            }
+            // Check the size first, not to allocate a bogus number of bins.
+            if (rd.remaining() / BIN_SIZE < num_bins) return false;
+            stat.bins.resize(num_bins);
+            for (LatencySnapshotBin& bin: stat.bins) {
+                rd.getU64(bin.lowerBound);
+                rd.getU64(bin.upperBound);
+                rd.getU64(bin.count);
+            }
+            new_stats[stat.name] = std::move(stat);
+        }
+        if (rd.remaining()) return false;
+
+        stats.swap(new_stats);
+        timestamp = ts;
+        return true;
+    }
+
+    // Return `false` if the file cannot be written.
+    bool save(const std::string& path) const {
+        FILE* fp = fopen(path.c_str(), "wb");
+        if (!fp) return false;
+        std::string data = serialize();
+        bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+        ok = (fclose(fp) == 0) && ok;
+        return ok;
+    }
+
+    /**
+     * Return `false` if the file cannot be read, or is malformed.
+     * The contents are not changed in that case.
+     */
+    bool load(const std::string& path);
+
+private:
+    static constexpr const char* MAGIC = "LATSNAP";
+    // Including the terminating null.
+    static const size_t MAGIC_LEN = 8;
+    // Magic, version, timestamp, and number of stats.
+    static const size_t HEADER_SIZE = MAGIC_LEN + 4 + 8 + 4;
+    static const size_t BIN_SIZE = 3 * sizeof(uint64_t);
+
+    void putHeader(std::string& dst, size_t num_stats) const {
+        dst.append(MAGIC, MAGIC_LEN);
+        putU32(dst, FORMAT_VERSION);
+        putU64(dst, timestamp);
+        putU32(dst, num_stats);
+    }
+
+    static void putStat(std::string& dst, const LatencySnapshotStat& stat) {
+        putU32(dst, stat.name.size());
+        dst += stat.name;
+        putU64(dst, stat.numCalls);
+        putU64(dst, stat.totalTime);
+        putU64(dst, stat.maxLatency);
+        putU64(dst, stat.p50);
+        putU64(dst, stat.p99);
+        putU64(dst, stat.p999);
+        putU64(dst, stat.overheadNs);
+        putU32(dst, stat.bins.size());
+        for (const LatencySnapshotBin& bin: stat.bins) {
+            putU64(dst, bin.lowerBound);
+            putU64(dst, bin.upperBound);
+            putU64(dst, bin.count);
+        }
+    }
+
+    static void putU32(std::string& dst, uint64_t val) {
+        for (size_t ii = 0; ii < 4; ++ii) dst += (char)(val >> (ii * 8));
+    }
+
+    static void putU64(std::string& dst, uint64_t val) {
+        for (size_t ii = 0; ii < 8; ++ii) dst += (char)(val >> (ii * 8));
+    }
+
+    struct Reader {
+        Reader(const std::string& _data) : data(_data), pos(0) {}
+
+        size_t remaining() const { return data.size() - pos; }
+
+        bool getU32(uint32_t& val) {
+            uint64_t tmp = 0;
+            if (!getLE(4, tmp)) return false;
+            val = (uint32_t)tmp;
+            return true;
+        }
+
+        bool getU64(uint64_t& val) { return getLE(8, val); }
+
+        bool getBytes(size_t len, std::string& dst) {
+            if (remaining() < len) return false;
+            dst.assign(data, pos, len);
+            pos += len;
+            return true;
+        }
+
+        bool getLE(size_t len, uint64_t& val) {
+            if (remaining() < len) return false;
+            val = 0;
+            for (size_t ii = 0; ii < len; ++ii) {
+                val |= (uint64_t)(uint8_t)data[pos + ii] << (ii * 8);
+            }
+            pos += len;
+            return true;
+        }
+
+        const std::string& data;
+        size_t pos;
+    };
+
+    std::map<std::string, LatencySnapshotStat> stats;
+    uint64_t timestamp;
+};
+
+/**
+ * Reads the stats of a saved snapshot one by one, without loading the
+ * whole file, so that large files are processed with bounded memory.
+ *
+ *   LatencySnapshotReader reader;
+ *   LatencySnapshotStat stat;
+ *   if (!reader.open(path)) ...
+ *   while (reader.next(stat)) ...
+ *   if (reader.hasError()) ...
+ */
+class LatencySnapshotReader {
+public:
+    LatencySnapshotReader()
+        : fp(nullptr), timestamp(0), numStats(0), numRead(0), failed(false)
+        {}
+
+    ~LatencySnapshotReader() { close(); }
+
+    // Return `false` if the file cannot be opened, or of an unknown format.
+    bool open(const std::string& path) {
+        close();
+        failed = false;
+        numRead = 0;
+        fp = fopen(path.c_str(), "rb");
+        if (!fp) return false;
+
+        std::string header;
+        if ( !readBytes(LatencySnapshot::HEADER_SIZE, header) ||
+             header.compare(0, LatencySnapshot::MAGIC_LEN,
+                            LatencySnapshot::MAGIC,
+                            LatencySnapshot::MAGIC_LEN) != 0 ) {
+            close();
+            return false;
+        }
+        LatencySnapshot::Reader rd(header);
+        rd.pos = LatencySnapshot::MAGIC_LEN;
+        uint32_t version = 0;
+        rd.getU32(version);
+        rd.getU64(timestamp);
+        rd.getU32(numStats);
+        if (version != LatencySnapshot::FORMAT_VERSION) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Read the next stat into `dst`.
+     *
+     * @return `false` if there is no more stat, or on error.
+     *         `hasError()` tells which.
+     */
+    bool next(LatencySnapshotStat& dst) {
+        if (!fp || failed) return false;
+        if (numRead == numStats) {
+            // Nothing should follow the last stat.
+            if (fgetc(fp) != EOF) failed = true;
+            close();
+            return false;
+        }
+
+        std::string buf;
+        uint32_t name_len = 0, num_bins = 0;
+        if (!readBytes(4, buf)) return fail();
+        LatencySnapshot::Reader(buf).getU32(name_len);
+        if (!readBytes(name_len, dst.name)) return fail();
+
+        // calls, total, max, p50, p99, p99.9, overhead, and number of bins.
+        if (!readBytes(7 * 8 + 4, buf)) return fail();
+        LatencySnapshot::Reader rd(buf);
+        rd.getU64(dst.numCalls);
+        rd.getU64(dst.totalTime);
+        rd.getU64(dst.maxLatency);
+        rd.getU64(dst.p50);
+        rd.getU64(dst.p99);
+        rd.getU64(dst.p999);
+        rd.getU64(dst.overheadNs);
+        rd.getU32(num_bins);
+
+        if (!readBytes((size_t)num_bins * LatencySnapshot::BIN_SIZE, buf)) {
+            return fail();
+        }
+        LatencySnapshot::Reader bin_rd(buf);
+        dst.bins.resize(num_bins);
+        for (LatencySnapshotBin& bin: dst.bins) {
+            bin_rd.getU64(bin.lowerBound);
+            bin_rd.getU64(bin.upperBound);
+            bin_rd.getU64(bin.count);
+        }
+        numRead++;
+        return true;
+    }
+
+    // `true` if the file turned out to be truncated or malformed.
+    bool hasError() const { return failed; }
+
+    uint64_t getTimestamp() const { return timestamp; }
+
+    size_t getNumStats() const { return numStats; }
+
+    void close() {
+        if (fp) fclose(fp);
+        fp = nullptr;
+    }
+
+private:
+    bool fail() {
+        failed = true;
+        close();
+        return false;
+    }
+
+    // Read in chunks, not to allocate a bogus length at once.
+    bool readBytes(size_t len, std::string& dst) {
+        const size_t CHUNK = 65536;
+        dst.clear();
+        while (dst.size() < len) {
+            size_t prev = dst.size();
+            size_t to_read = std::min(CHUNK, len - prev);
+            dst.resize(prev + to_read);
+            if (fread(&dst[prev], 1, to_read, fp) != to_read) return false;
+        }
+        return true;
+    }
+
+    FILE* fp;
+    uint64_t timestamp;
+    uint32_t numStats;
+    uint32_t numRead;
+    bool failed;
+};
+
+/**
+ * Dumps stats as a serialized `LatencySnapshot`, so that they can be
+ * saved or sent as they are. The tree and flat views are the same.
+ */
+template<typename HistT>
+class LatencyDumpSnapshotImplT : public LatencyDumpT<HistT> {
+public:
+    using Item = LatencyItemT<HistT>;
+    using MapW = MapWrapperT<HistT>;
+
+    std::string dump(MapW* map_w,
+                     const LatencyCollectorDumpOptions& opt) {
+        LatencySnapshot snapshot;
+        snapshot.setTimestamp
+            ( std::chrono::duration_cast<std::chrono::microseconds>
+                  ( std::chrono::system_clock::now().time_since_epoch() )
+                  .count() );
+
+        const LatencyLabelRegistry* labels = this->getLabels(map_w);
+        bool filter_label = labels && !opt.label_filter.empty();
+        for (auto& entry: this->getMap(map_w)) {
+            Item* item = entry.second;
+            Item filtered;
+            if (filter_label) {
+                filtered = item->filterByLabel(*labels, opt.label_filter);
+                item = &filtered;
+            }
+            if (!item->getNumCalls()) continue;
+            snapshot.add( toStat(*item) );
+        }
+        return snapshot.serialize();
+    }
+
+    std::string dumpTree(MapW* map_w,
+                         const LatencyCollectorDumpOptions& opt) {
+        return dump(map_w, opt);
+    }
+
+    static LatencySnapshotStat toStat(Item& item) {
+        LatencySnapshotStat ret;
+        ret.name = item.getName();
+        ret.numCalls = item.getNumCalls();
+        ret.totalTime = item.getTotalTime();
+        ret.maxLatency = item.getMaxLatency();
+        const double PCTS[] = {50, 99, 99.9};
+        uint64_t pct_values[3];
+        item.getPercentiles(PCTS, pct_values, 3);
+        ret.p50 = pct_values[0];
+        ret.p99 = pct_values[1];
+        ret.p999 = pct_values[2];
+        ret.overheadNs = item.getOverheadNs();
+        item.forEachBin([&ret](uint64_t lower, uint64_t upper, uint64_t cnt) {
+            ret.bins.push_back( LatencySnapshotBin(lower, upper, cnt) );
+        });
+        std::sort( ret.bins.begin(), ret.bins.end(),
+                   [](const LatencySnapshotBin& a,
+                      const LatencySnapshotBin& b) {
+                       return a.upperBound < b.upperBound;
+                   } );
+        return ret;
+    }
+};
+
+using LatencyDumpSnapshotImpl =
+    LatencyDumpSnapshotImplT<LatencyDefaultPolicy::Hist>;
+
+template<typename Policy>
+LatencySnapshot LatencySnapshot::take(LatencyCollectorT<Policy>& lat,
+                                      const LatencyCollectorDumpOptions& opt)
+{
+    LatencyDumpSnapshotImplT<typename Policy::Hist> dump_inst;
+    LatencySnapshot ret;
+    ret.deserialize( lat.dump(&dump_inst, opt) );
+    return ret;
+}
+
+template<typename Policy>
+void LatencySnapshot::restore(LatencyCollectorT<Policy>& lat) const {
+    using Item = LatencyItemT<typename Policy::Hist>;
+    for (auto& entry: stats) {
+        const LatencySnapshotStat& stat = entry.second;
+        Item* item = lat.getItem(stat.name);
+        if (!item) continue;
+        Item src(stat.name, stat.toHistogram());
+        src.addOverhead(stat.overheadNs);
+        *item += src;
+    }
+}
+
+inline bool LatencySnapshot::load(const std::string& path) {
+    LatencySnapshotReader reader;
+    if (!reader.open(path)) return false;
+
+    std::map<std::string, LatencySnapshotStat> new_stats;
+    LatencySnapshotStat stat;
+    while (reader.next(stat)) new_stats[stat.name] = stat;
+    if (reader.hasError()) return false;
+
+    stats.swap(new_stats);
+    timestamp = reader.getTimestamp();
+    return true;
+}
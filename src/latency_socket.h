@@ -0,0 +1,156 @@
+/**
+ * Copyright (C) 2017-present Jung-Sang Ahn <jungsang.ahn@gmail.com>
+ * All rights reserved.
+ *
+ * https://github.com/greensky00
+ *
+ * Latency Collector Datagram Socket Module
+ * Version: 0.1.0
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+/**
+ * Non-blocking datagram socket to a UDP address or a Unix domain socket
+ * path, for pushing stats out of the process.
+ *
+ * Datagrams that cannot be sent at once, e.g., as the receiver is stuck
+ * or not listening, are dropped and counted, so that the sender never
+ * blocks.
+ */
+class LatencyDatagramSocket {
+public:
+    LatencyDatagramSocket()
+        : sock(-1)
+        , addrLen(0)
+        , numPackets(0)
+        , numDropped(0)
+        , numBytes(0)
+        {}
+
+    LatencyDatagramSocket(const LatencyDatagramSocket&) = delete;
+    LatencyDatagramSocket& operator=(const LatencyDatagramSocket&) = delete;
+
+    ~LatencyDatagramSocket() {
+        close();
+    }
+
+    // Return `false` if the address cannot be resolved.
+    bool connectUdp(const std::string& host, uint16_t port) {
+        struct addrinfo hints;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        struct addrinfo* res = nullptr;
+        std::string port_str = std::to_string(port);
+        if (getaddrinfo(host.c_str(), port_str.c_str(), &hints, &res) != 0) {
+            return false;
+        }
+        bool ok = open(res->ai_family, res->ai_addr, res->ai_addrlen);
+        freeaddrinfo(res);
+        return ok;
+    }
+
+    // Return `false` if the path is too long.
+    bool connectUnix(const std::string& path) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        if (path.size() >= sizeof(addr.sun_path)) return false;
+        addr.sun_family = AF_UNIX;
+        memcpy(addr.sun_path, path.data(), path.size());
+        return open(AF_UNIX, (struct sockaddr*)&addr, sizeof(addr));
+    }
+
+    // Return `false` if the datagram is dropped.
+    bool send(const std::string& packet) {
+        ssize_t sent = -1;
+        {
+            std::lock_guard<std::mutex> l(lock);
+            if (sock >= 0) {
+                sent = sendto( sock, packet.data(), packet.size(),
+                               MSG_DONTWAIT,
+                               (const struct sockaddr*)&addrBuf, addrLen );
+            }
+        }
+        if (sent < 0) {
+            // Would block, or no one is listening.
+            numDropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        numPackets.fetch_add(1, std::memory_order_relaxed);
+        numBytes.fetch_add(sent, std::memory_order_relaxed);
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> l(lock);
+        if (sock >= 0) ::close(sock);
+        sock = -1;
+    }
+
+    // Number of datagrams sent.
+    uint64_t getNumPackets() const { return numPackets.load(); }
+
+    // Number of datagrams dropped, as the socket was not ready.
+    uint64_t getNumDropped() const { return numDropped.load(); }
+
+    // Number of bytes sent.
+    uint64_t getNumBytes() const { return numBytes.load(); }
+
+private:
+    bool open(int family, const struct sockaddr* addr, size_t len) {
+        int fd = socket(family, SOCK_DGRAM, 0);
+        if (fd < 0) return false;
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+        std::lock_guard<std::mutex> l(lock);
+        if (sock >= 0) ::close(sock);
+        sock = fd;
+        memcpy(&addrBuf, addr, len);
+        addrLen = len;
+        return true;
+    }
+
+    // Guards the socket and the address.
+    std::mutex lock;
+    int sock;
+    struct sockaddr_storage addrBuf;
+    size_t addrLen;
+
+    std::atomic<uint64_t> numPackets;
+    std::atomic<uint64_t> numDropped;
+    std::atomic<uint64_t> numBytes;
+};
@@ -0,0 +1,261 @@
+/**
+ * Copyright (C) 2017-present Jung-Sang Ahn <jungsang.ahn@gmail.com>
+ * All rights reserved.
+ *
+ * https://github.com/greensky00
+ *
+ * Latency Collector StatsD Exporter Module
+ * Version: 0.1.0
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+#pragma once
+
+#include "latency_reporter.h"
+#include "latency_snapshot.h"
+#include "latency_socket.h"
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct LatencyStatsdOptions {
+    enum Format {
+        // Per interval: count and sum as counters,
+        // max and percentiles as gauges.
+        SUMMARY,
+        // DogStatsD distribution: a value for each histogram bin,
+        // sampled at the rate of 1 / (number of samples in the bin).
+        DISTRIBUTION
+    };
+
+    LatencyStatsdOptions()
+        : format(SUMMARY)
+        , max_packet_size(DEFAULT_MAX_PACKET_SIZE)
+        , percentiles({50, 99, 99.9})
+        {}
+
+    // Fits the MTU of Ethernet, with IP and UDP headers.
+    static const size_t DEFAULT_MAX_PACKET_SIZE = 1432;
+
+    Format format;
+
+    // Prepended to all metric names, e.g., "myapp.".
+    std::string prefix;
+
+    // DogStatsD tags attached to all metrics, e.g., "env:prod,zone:a".
+    std::string tags;
+
+    // Metrics are batched into a datagram up to this size, in bytes.
+    size_t max_packet_size;
+
+    // Percentiles to report in `SUMMARY` format.
+    std::vector<double> percentiles;
+};
+
+/**
+ * Pushes stats to a StatsD (or DogStatsD) agent, over UDP or a Unix
+ * domain datagram socket.
+ *
+ * Stats are aggregated on the client side: each push sends only the
+ * samples recorded since the previous push, computed from the difference
+ * of two `LatencySnapshot`s. Latencies are in microseconds. Call paths
+ * become dot-separated names, e.g., " ## a ## b" to "a.b".
+ *
+ * Sends never block, see `LatencyDatagramSocket`.
+ */
+class LatencyStatsdExporter {
+public:
+    LatencyStatsdExporter(const LatencyStatsdOptions& _opt
+                              = LatencyStatsdOptions())
+        : opt(_opt)
+        {}
+
+    ~LatencyStatsdExporter() {
+        stop();
+    }
+
+    // See `LatencyDatagramSocket`.
+    bool connectUdp(const std::string& host, uint16_t port) {
+        return sock.connectUdp(host, port);
+    }
+
+    bool connectUnix(const std::string& path) {
+        return sock.connectUnix(path);
+    }
+
+    /**
+     * Push the samples of the given collector since the previous push.
+     *
+     * @return Number of datagrams sent.
+     */
+    template<typename Policy>
+    size_t push(LatencyCollectorT<Policy>& lat) {
+        return push( LatencySnapshot::take(lat) );
+    }
+
+    // Same as above, with a snapshot taken by the caller.
+    size_t push(const LatencySnapshot& cur) {
+        std::lock_guard<std::mutex> l(pushLock);
+        LatencySnapshot delta = cur;
+        delta -= prev;
+        prev = cur;
+
+        std::vector<std::string> lines;
+        for (auto& entry: delta.getStats()) addLines(entry.second, lines);
+        return sendLines(lines);
+    }
+
+    /**
+     * Push the given collector every `interval_ms` on a background
+     * thread, until `stop()` is called.
+     */
+    template<typename Policy>
+    void start(LatencyCollectorT<Policy>& lat, uint64_t interval_ms) {
+        reporter.start([this, &lat]() { push(lat); }, interval_ms);
+    }
+
+    // Push the last interval and stop the background thread.
+    void stop() {
+        reporter.stop();
+    }
+
+    /**
+     * StatsD lines of the given stat, e.g., "a.b.count:10|c" or
+     * "a.b:128|d|@0.1" depending on the format.
+     */
+    void addLines(const LatencySnapshotStat& stat,
+                  std::vector<std::string>& dst) const
+    {
+        std::string name = opt.prefix + getMetricName(stat.name);
+        if (opt.format == LatencyStatsdOptions::DISTRIBUTION) {
+            for (const LatencySnapshotBin& bin: stat.bins) {
+                std::string line = name + ":"
+                                 + std::to_string(getBinValue(stat, bin))
+                                 + "|d";
+                if (bin.count > 1) {
+                    char rate[32];
+                    snprintf(rate, sizeof(rate), "|@%.6g", 1.0 / bin.count);
+                    line += rate;
+                }
+                dst.push_back(line + getTagsSuffix());
+            }
+            return;
+        }
+
+        dst.push_back( name + ".count:" + std::to_string(stat.numCalls)
+                       + "|c" + getTagsSuffix() );
+        dst.push_back( name + ".sum:" + std::to_string(stat.totalTime)
+                       + "|c" + getTagsSuffix() );
+        dst.push_back( name + ".max:" + std::to_string(stat.maxLatency)
+                       + "|g" + getTagsSuffix() );
+        HistogramSnapshot hist = stat.toHistogramSnapshot();
+        for (double pct: opt.percentiles) {
+            dst.push_back( name + "." + getPercentileName(pct) + ":"
+                           + std::to_string(hist.estimate(pct))
+                           + "|g" + getTagsSuffix() );
+        }
+    }
+
+    // Call paths are joined by dots, and characters not allowed in
+    // metric names are replaced by '_'.
+    static std::string getMetricName(const std::string& stat_name) {
+        std::string name = stat_name;
+        if (name.compare(0, 4, " ## ") == 0) name = name.substr(4);
+        std::string ret;
+        size_t pos = 0;
+        while (pos < name.size()) {
+            if (name.compare(pos, 4, " ## ") == 0) {
+                ret += '.';
+                pos += 4;
+                continue;
+            }
+            char cc = name[pos++];
+            bool valid = (cc >= 'a' && cc <= 'z') ||
+                         (cc >= 'A' && cc <= 'Z') ||
+                         (cc >= '0' && cc <= '9') ||
+                         cc == '_' || cc == '-' || cc == '.';
+            ret += (valid) ? cc : '_';
+        }
+        return ret;
+    }
+
+    // See `LatencyDatagramSocket`.
+    uint64_t getNumPackets() const { return sock.getNumPackets(); }
+    uint64_t getNumDropped() const { return sock.getNumDropped(); }
+    uint64_t getNumBytes() const { return sock.getNumBytes(); }
+
+private:
+    // Batch the lines into datagrams up to `max_packet_size`.
+    size_t sendLines(const std::vector<std::string>& lines) {
+        size_t ret = 0;
+        std::string packet;
+        for (const std::string& line: lines) {
+            if ( !packet.empty() &&
+                 packet.size() + 1 + line.size() > opt.max_packet_size ) {
+                ret += sock.send(packet);
+                packet.clear();
+            }
+            if (!packet.empty()) packet += '\n';
+            packet += line;
+        }
+        if (!packet.empty()) ret += sock.send(packet);
+        return ret;
+    }
+
+    std::string getTagsSuffix() const {
+        return (opt.tags.empty()) ? std::string() : "|#" + opt.tags;
+    }
+
+    // e.g., "p99", "p99_9".
+    static std::string getPercentileName(double pct) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "p%g", pct);
+        std::string ret = buf;
+        for (char& cc: ret) if (cc == '.') cc = '_';
+        return ret;
+    }
+
+    // Middle of the bin, within the max of the stat.
+    static uint64_t getBinValue(const LatencySnapshotStat& stat,
+                                const LatencySnapshotBin& bin) {
+        uint64_t lower = bin.lowerBound;
+        uint64_t upper = std::min(bin.upperBound - 1, stat.maxLatency);
+        if (upper < lower) upper = lower;
+        return lower + (upper - lower) / 2;
+    }
+
+    LatencyStatsdOptions opt;
+    LatencyDatagramSocket sock;
+
+    // Serializes pushes, and guards `prev`.
+    std::mutex pushLock;
+    // Snapshot of the previous push.
+    LatencySnapshot prev;
+
+    LatencyReporterThread reporter;
+};
@@ -0,0 +1,662 @@
+/**
+ * Copyright (C) 2017-present Jung-Sang Ahn <jungsang.ahn@gmail.com>
+ * All rights reserved.
+ *
+ * https://github.com/greensky00
+ *
+ * NUMA-aware Histogram
+ * Version: 0.1.0
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "percpu_histogram.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <cctype>
+#include <cmath>
+#include <cstddef>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/**
+ * NUMA topology (CPU to node), and memory allocation on a given node.
+ *
+ * Memory is allocated in chunks by `mmap`, and bound to the node by
+ * `mbind` (preferred policy, so that it falls back to other nodes if the
+ * node is full). If `mbind` is not available (e.g., not Linux, or blocked
+ * by seccomp), the chunk is still used: it is first touched by the
+ * allocating thread, which usually runs on that node anyway.
+ *
+ * Freed blocks are kept in per-size free lists for reuse, and chunks are
+ * returned to the OS only when the allocator is destroyed. The total size
+ * of the chunks can be capped by `setMemoryLimit()`.
+ */
+class LatencyNumaAllocator {
+public:
+    // Chunk size of each `mmap`.
+    static const size_t CHUNK_SIZE = 64 * 1024;
+    // Every block is aligned to the cache line size.
+    static const size_t BLOCK_ALIGN = 64;
+
+    /**
+     * @param cpu_to_node Node ID of each CPU. If empty, it is read from
+     *                    sysfs, or a single node if not available.
+     */
+    LatencyNumaAllocator(const std::vector<uint32_t>& cpu_to_node =
+                             std::vector<uint32_t>())
+        : cpuToNode(cpu_to_node.empty() ? detectTopology() : cpu_to_node)
+        , numNodes(1)
+        , numChunks(0)
+        , memoryLimit(0)
+    {
+        for (uint32_t node: cpuToNode) {
+            if (node + 1 > numNodes) numNodes = node + 1;
+        }
+        nodes.resize(numNodes);
+        for (size_t ii = 0; ii < numNodes; ++ii) nodes[ii].reset(new Node());
+    }
+
+    ~LatencyNumaAllocator() {
+        for (auto& node: nodes) {
+            for (auto& chunk: node->chunks) freeChunk(chunk);
+        }
+    }
+
+    // Allocator used by default, never destroyed.
+    static LatencyNumaAllocator& getDefault() {
+        static LatencyNumaAllocator* instance = new LatencyNumaAllocator();
+        return *instance;
+    }
+
+    size_t getNumNodes() const { return numNodes; }
+
+    size_t getNodeOfCpu(size_t cpu) const {
+        if (cpuToNode.empty()) return 0;
+        return cpuToNode[cpu % cpuToNode.size()];
+    }
+
+    // Node the current thread is running on.
+    size_t getCurrentNode() const {
+        if (numNodes == 1) return 0;
+        return getNodeOfCpu( PerCpuHistogram::getCurrentCpu() );
+    }
+
+    /**
+     * Allocate a block on the given node.
+     *
+     * @param node Node ID.
+     * @param size Block size, up to `CHUNK_SIZE`.
+     * @return Block, or `nullptr` if `size` is too big or out of memory.
+     */
+    void* alloc(size_t node, size_t size) {
+        size = roundUp(size);
+        if (size > CHUNK_SIZE) return nullptr;
+        Node& nn = *nodes[node % numNodes];
+        std::lock_guard<std::mutex> l(nn.lock);
+        std::vector<void*>& free_list = nn.freeLists[size];
+        if (!free_list.empty()) {
+            void* ret = free_list.back();
+            free_list.pop_back();
+            return ret;
+        }
+
+        if (nn.remaining < size) {
+            size_t limit = memoryLimit.load(std::memory_order_relaxed);
+            if ( limit &&
+                 (numChunks.load(std::memory_order_relaxed) + 1) * CHUNK_SIZE
+                     > limit ) {
+                return nullptr;
+            }
+            Chunk chunk = allocChunk(node % numNodes, nn.bound);
+            if (!chunk.first) return nullptr;
+            numChunks.fetch_add(1, std::memory_order_relaxed);
+            nn.chunks.push_back(chunk);
+            nn.cursor = static_cast<char*>(chunk.first);
+            nn.remaining = CHUNK_SIZE;
+        }
+        void* ret = nn.cursor;
+        nn.cursor += size;
+        nn.remaining -= size;
+        return ret;
+    }
+
+    // Return the block allocated by `alloc()` with the same node and size.
+    void free(size_t node, void* ptr, size_t size) {
+        if (!ptr) return;
+        Node& nn = *nodes[node % numNodes];
+        std::lock_guard<std::mutex> l(nn.lock);
+        nn.freeLists[roundUp(size)].push_back(ptr);
+    }
+
+    // True if the memory of the given node was actually bound by `mbind`.
+    bool isBound(size_t node) const {
+        Node& nn = *nodes[node % numNodes];
+        std::lock_guard<std::mutex> l(nn.lock);
+        return nn.bound;
+    }
+
+    // Total size of the chunks allocated so far, in bytes.
+    size_t getMappedBytes() const {
+        size_t ret = 0;
+        for (auto& node: nodes) {
+            std::lock_guard<std::mutex> l(node->lock);
+            ret += node->chunks.size() * CHUNK_SIZE;
+        }
+        return ret;
+    }
+
+    /**
+     * Cap the total size of the chunks. Once reached, `alloc()` fails
+     * unless a freed block can be reused.
+     *
+     * @param bytes Limit in bytes, or 0 for no limit.
+     */
+    void setMemoryLimit(size_t bytes) {
+        memoryLimit.store(bytes, std::memory_order_relaxed);
+    }
+
+    /**
+     * Read the node of each CPU from sysfs.
+     *
+     * @return Node ID of each CPU, or empty if not available.
+     */
+    static std::vector<uint32_t> detectTopology() {
+        std::vector<uint32_t> ret;
+        const std::string base = "/sys/devices/system/node/";
+        for (size_t node: parseList( readFile(base + "online") )) {
+            std::string cpus = readFile( base + "node" + std::to_string(node) +
+                                         "/cpulist" );
+            for (size_t cpu: parseList(cpus)) {
+                if (ret.size() <= cpu) ret.resize(cpu + 1, 0);
+                ret[cpu] = node;
+            }
+        }
+        return ret;
+    }
+
+    // Parse a list such as "0-3,8,10-11".
+    static std::vector<size_t> parseList(const std::string& str) {
+        std::vector<size_t> ret;
+        std::stringstream ss(str);
+        std::string token;
+        while (std::getline(ss, token, ',')) {
+            if (token.empty() || !isdigit(token[0])) continue;
+            size_t dash = token.find('-');
+            size_t first = std::stoul(token.substr(0, dash));
+            size_t last = (dash == std::string::npos)
+                          ? first : std::stoul(token.substr(dash + 1));
+            for (size_t ii = first; ii <= last; ++ii) ret.push_back(ii);
+        }
+        return ret;
+    }
+
+private:
+    // Memory, and whether it is from `mmap`.
+    using Chunk = std::pair<void*, bool>;
+
+    struct Node {
+        Node() : cursor(nullptr), remaining(0), bound(false) {}
+        mutable std::mutex lock;
+        std::vector<Chunk> chunks;
+        char* cursor;
+        size_t remaining;
+        // Free blocks, by size.
+        std::map< size_t, std::vector<void*> > freeLists;
+        bool bound;
+    };
+
+    // `MPOL_PREFERRED` in <linux/mempolicy.h>.
+    static const int MPOL_PREFERRED_MODE = 1;
+
+    static size_t roundUp(size_t size) {
+        return (size + BLOCK_ALIGN - 1) / BLOCK_ALIGN * BLOCK_ALIGN;
+    }
+
+    static Chunk allocChunk(size_t node, bool& bound_out) {
+        bound_out = false;
+#if defined(__linux__)
+        void* ret = mmap(nullptr, CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ret != MAP_FAILED) {
+#if defined(SYS_mbind)
+            const size_t BITS = 8 * sizeof(unsigned long);
+            std::vector<unsigned long> mask(node / BITS + 1, 0);
+            mask[node / BITS] = 1UL << (node % BITS);
+            // The kernel reads `maxnode - 1` bits.
+            long rc = syscall( SYS_mbind, ret, CHUNK_SIZE,
+                               MPOL_PREFERRED_MODE, mask.data(),
+                               mask.size() * BITS + 1, 0 );
+            bound_out = (rc == 0);
+#endif
+            return Chunk(ret, true);
+        }
+#endif
+        return Chunk(::operator new(CHUNK_SIZE, std::nothrow), false);
+    }
+
+    static void freeChunk(const Chunk& chunk) {
+#if defined(__linux__)
+        if (chunk.second) {
+            munmap(chunk.first, CHUNK_SIZE);
+            return;
+        }
+#endif
+        ::operator delete(chunk.first);
+    }
+
+    static std::string readFile(const std::string& path) {
+        std::ifstream fs(path);
+        std::string ret;
+        std::getline(fs, ret);
+        return ret;
+    }
+
+    std::vector<uint32_t> cpuToNode;
+    size_t numNodes;
+    std::vector< std::unique_ptr<Node> > nodes;
+    std::atomic<size_t> numChunks;
+    std::atomic<size_t> memoryLimit;
+};
+
+/**
+ * Histogram with a shard for each NUMA node, allocated on that node.
+ *
+ * Each `add` goes to the shard of the node the caller is running on, so
+ * that recording threads never write to the memory of a remote node,
+ * no matter which thread created the stat. Shards are allocated on the
+ * first use by each node, and reads merge all of them.
+ *
+ * Shards have the same power-of-two bins as `Histogram`, inline, so that
+ * the entire shard is on the node. If the allocator is out of memory, the
+ * shard is allocated on the heap instead, so that `add` never fails; see
+ * `getNumFallbackShards()`. Estimates are the same as `Histogram`.
+ * It provides the same interface as `Histogram`, so that it can be used
+ * as `Hist` of a collector policy.
+ */
+class NumaHistogram {
+public:
+    static const size_t MAX_BINS = 65;
+
+    class Iterator {
+    public:
+        Iterator() : idx(MAX_BINS), bins() {}
+
+        Iterator& operator++() {
+            if (idx < MAX_BINS) idx++;
+            return *this;
+        }
+
+        Iterator& operator*() { return *this; }
+
+        bool operator==(const Iterator& val) const { return idx == val.idx; }
+        bool operator!=(const Iterator& val) const { return idx != val.idx; }
+
+        size_t getIdx() const { return idx; }
+
+        uint64_t getCount() const { return (idx < MAX_BINS) ? bins[idx] : 0; }
+
+        // Same bounds as `HistItr`.
+        uint64_t getLowerBound() const {
+            size_t idx_rev = MAX_BINS - idx - 1;
+            return (idx_rev) ? ( (uint64_t)1 << (idx_rev - 1) ) : 0;
+        }
+
+        uint64_t getUpperBound() const {
+            if (!idx) return std::numeric_limits<uint64_t>::max();
+            return (uint64_t)1 << (MAX_BINS - idx - 1);
+        }
+
+    private:
+        friend class NumaHistogram;
+        size_t idx;
+        uint64_t bins[MAX_BINS];
+    };
+
+    using iterator = Iterator;
+
+    NumaHistogram(LatencyNumaAllocator* _allocator =
+                      &LatencyNumaAllocator::getDefault())
+        : allocator(_allocator)
+        , numNodes(allocator->getNumNodes())
+        , shards(new std::atomic<Shard*>[numNodes])
+    {
+        for (size_t ii = 0; ii < numNodes; ++ii) shards[ii] = nullptr;
+    }
+
+    // A copy has a single shard with the merged `src`, on the current node.
+    NumaHistogram(const NumaHistogram& src)
+        : NumaHistogram(src.allocator)
+    {
+        *this = src;
+    }
+
+    ~NumaHistogram() {
+        freeShards();
+    }
+
+    // this = src
+    NumaHistogram& operator=(const NumaHistogram& src) {
+        if (this == &src) return *this;
+        if (allocator != src.allocator) {
+            freeShards();
+            allocator = src.allocator;
+            numNodes = allocator->getNumNodes();
+            shards.reset(new std::atomic<Shard*>[numNodes]);
+            for (size_t ii = 0; ii < numNodes; ++ii) shards[ii] = nullptr;
+        }
+        HistogramSnapshot merged;
+        src.mergeTo(merged);
+        freeShards();
+        getLocalShard().addFrom(merged);
+        return *this;
+    }
+
+    // this += rhs
+    NumaHistogram& operator+=(const NumaHistogram& rhs) {
+        HistogramSnapshot merged;
+        rhs.mergeTo(merged);
+        getLocalShard().addFrom(merged);
+        return *this;
+    }
+
+    // returning lhs + rhs
+    friend NumaHistogram operator+(NumaHistogram lhs,
+                                   const NumaHistogram& rhs) {
+        lhs += rhs;
+        return lhs;
+    }
+
+    void add(uint64_t val) {
+        Shard& shard = getLocalShard();
+        shard.bins[getBinIdx(val)].fetch_add(1, MO);
+        shard.count.fetch_add(1, MO);
+        shard.sum.fetch_add(val, MO);
+
+        size_t num_trial = 0;
+        while (num_trial++ < MAX_TRIAL && shard.max.load(MO) < val) {
+            // 'max' may not be updated properly under race condition.
+            shard.max.store(val, MO);
+        }
+    }
+
+    // Only for the histograms updated by a single thread.
+    void addNonAtomic(uint64_t val) {
+        Shard& shard = getLocalShard();
+        std::atomic<uint64_t>& bin = shard.bins[getBinIdx(val)];
+        bin.store(bin.load(MO) + 1, MO);
+        shard.count.store(shard.count.load(MO) + 1, MO);
+        shard.sum.store(shard.sum.load(MO) + val, MO);
+        if (shard.max.load(MO) < val) shard.max.store(val, MO);
+    }
+
+    // Add `num` values at once, binned locally first.
+    void addBatch(const uint64_t* vals, size_t num) {
+        if (!num) return;
+        Shard local;
+        for (size_t ii = 0; ii < num; ++ii) {
+            uint64_t val = vals[ii];
+            std::atomic<uint64_t>& bin = local.bins[getBinIdx(val)];
+            bin.store(bin.load(MO) + 1, MO);
+            local.sum.store(local.sum.load(MO) + val, MO);
+            if (local.max.load(MO) < val) local.max.store(val, MO);
+        }
+        local.count.store(num, MO);
+        getLocalShard().addFrom(local);
+    }
+
+    uint64_t getTotal() const {
+        uint64_t ret = 0;
+        forEachShard([&ret](const Shard& s) { ret += s.count.load(MO); });
+        return ret;
+    }
+
+    uint64_t getSum() const {
+        uint64_t ret = 0;
+        forEachShard([&ret](const Shard& s) { ret += s.sum.load(MO); });
+        return ret;
+    }
+
+    uint64_t getAverage() const {
+        uint64_t total = getTotal();
+        return (total) ? (getSum() / total) : 0;
+    }
+
+    uint64_t getMax() const {
+        uint64_t ret = 0;
+        forEachShard([&ret](const Shard& s) {
+            uint64_t cur = s.max.load(MO);
+            if (ret < cur) ret = cur;
+        });
+        return ret;
+    }
+
+    // Memory consumed by this histogram, in bytes.
+    size_t getMemoryUsage() const {
+        return sizeof(*this) + numNodes * sizeof(std::atomic<Shard*>) +
+               getNumActiveShards() * sizeof(Shard);
+    }
+
+    // Number of shards allocated so far.
+    size_t getNumActiveShards() const {
+        size_t ret = 0;
+        forEachShard([&ret](const Shard&) { ret++; });
+        return ret;
+    }
+
+    // Number of samples recorded on the given node.
+    uint64_t getNodeTotal(size_t node) const {
+        if (node >= numNodes) return 0;
+        Shard* shard = shards[node].load(MO_ACQ);
+        return (shard) ? shard->count.load(MO) : 0;
+    }
+
+    /**
+     * Number of shards allocated on the heap so far, instead of on their
+     * node, as the allocator was out of memory. Shared by all histograms
+     * in the process.
+     */
+    static uint64_t getNumFallbackShards() {
+        return getFallbackRef().load(MO);
+    }
+
+    // Same as `Histogram::estimate()`.
+    uint64_t estimate(double percentile) const {
+        HistogramSnapshot merged;
+        mergeTo(merged);
+        return merged.estimate(percentile);
+    }
+
+    // Estimate `num` percentiles at once, merging the shards only once.
+    void estimate(const double* percentiles, uint64_t* dst, size_t num) const {
+        HistogramSnapshot merged;
+        mergeTo(merged);
+        merged.estimate(percentiles, dst, num);
+    }
+
+    iterator begin() const {
+        HistogramSnapshot merged;
+        mergeTo(merged);
+        Iterator ret;
+        for (size_t ii = 0; ii < MAX_BINS; ++ii) {
+            ret.bins[ii] = merged.getBinCount(ii);
+        }
+        ret.idx = 0;
+        while (ret.idx < MAX_BINS && !ret.bins[ret.idx]) ret.idx++;
+        return ret;
+    }
+
+    iterator end() const { return Iterator(); }
+
+private:
+    struct Shard {
+        Shard() : count(0), sum(0), max(0), heapMem(nullptr) {
+            for (size_t ii = 0; ii < MAX_BINS; ++ii) bins[ii] = 0;
+        }
+
+        void addFrom(const Shard& src) {
+            uint64_t src_bins[MAX_BINS];
+            for (size_t ii = 0; ii < MAX_BINS; ++ii) {
+                src_bins[ii] = src.bins[ii].load(MO);
+            }
+            addFrom( src_bins, src.count.load(MO), src.sum.load(MO),
+                     src.max.load(MO) );
+        }
+
+        void addFrom(const HistogramSnapshot& src) {
+            uint64_t src_bins[MAX_BINS];
+            for (size_t ii = 0; ii < MAX_BINS; ++ii) {
+                src_bins[ii] = src.getBinCount(ii);
+            }
+            addFrom( src_bins, src.getTotal(), src.getSum(), src.getMax() );
+        }
+
+        void addFrom(const uint64_t* src_bins, uint64_t src_count,
+                     uint64_t src_sum, uint64_t src_max) {
+            for (size_t ii = 0; ii < MAX_BINS; ++ii) {
+                if (src_bins[ii]) bins[ii].fetch_add(src_bins[ii], MO);
+            }
+            count.fetch_add(src_count, MO);
+            sum.fetch_add(src_sum, MO);
+            size_t num_trial = 0;
+            while (num_trial++ < MAX_TRIAL && max.load(MO) < src_max) {
+                max.store(src_max, MO);
+            }
+        }
+
+        std::atomic<uint64_t> bins[MAX_BINS];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+        // Start of the heap memory, if not from the allocator.
+        void* heapMem;
+    };
+
+    static const size_t MAX_TRIAL = 3;
+    static const std::memory_order MO = std::memory_order_relaxed;
+    static const std::memory_order MO_ACQ = std::memory_order_acquire;
+
+    static size_t getBinIdx(uint64_t val) {
+        // Same as `Histogram`: the number of leading zeros, 64 for 0.
+        if (!val) return MAX_BINS - 1;
+#if defined(__GNUC__)
+        return __builtin_clzll(val);
+#else
+        size_t ret = 0;
+        while ( !(val & ((uint64_t)1 << 63)) ) {
+            val <<= 1;
+            ret++;
+        }
+        return ret;
+#endif
+    }
+
+    Shard& getLocalShard() {
+        size_t node = (numNodes == 1) ? 0 : allocator->getCurrentNode();
+        if (node >= numNodes) node = 0;
+        Shard* shard = shards[node].load(MO_ACQ);
+        if (shard) return *shard;
+
+        Shard* new_shard = newShard(node);
+        if (shards[node].compare_exchange_strong(shard, new_shard,
+                                                 std::memory_order_acq_rel)) {
+            return *new_shard;
+        }
+        // Other thread allocated it at the same time, `shard` is updated.
+        releaseShard(node, new_shard);
+        return *shard;
+    }
+
+    Shard* newShard(size_t node) {
+        void* mem = allocator->alloc(node, sizeof(Shard));
+        if (mem) return new (mem) Shard();
+
+        // Out of node memory: still record the samples, on the heap.
+        const size_t ALIGN = LatencyNumaAllocator::BLOCK_ALIGN;
+        void* heap_mem = ::operator new(sizeof(Shard) + ALIGN);
+        uintptr_t addr = reinterpret_cast<uintptr_t>(heap_mem);
+        addr = (addr + ALIGN - 1) / ALIGN * ALIGN;
+        Shard* ret = new (reinterpret_cast<void*>(addr)) Shard();
+        ret->heapMem = heap_mem;
+        getFallbackRef().fetch_add(1, MO);
+        return ret;
+    }
+
+    void releaseShard(size_t node, Shard* shard) {
+        void* heap_mem = shard->heapMem;
+        shard->~Shard();
+        if (heap_mem) {
+            ::operator delete(heap_mem);
+        } else {
+            allocator->free(node, shard, sizeof(Shard));
+        }
+    }
+
+    static std::atomic<uint64_t>& getFallbackRef() {
+        static std::atomic<uint64_t> num_fallbacks(0);
+        return num_fallbacks;
+    }
+
+    template<typename F>
+    void forEachShard(F func) const {
+        for (size_t ii = 0; ii < numNodes; ++ii) {
+            Shard* shard = shards[ii].load(MO_ACQ);
+            if (shard) func(*shard);
+        }
+    }
+
+    void mergeTo(HistogramSnapshot& dst) const {
+        forEachShard([&dst](const Shard& s) {
+            dst.addBins( s.bins, s.count.load(MO), s.sum.load(MO),
+                         s.max.load(MO) );
+        });
+    }
+
+    void freeShards() {
+        for (size_t ii = 0; ii < numNodes; ++ii) {
+            Shard* shard = shards[ii].exchange(nullptr);
+            if (shard) releaseShard(ii, shard);
+        }
+    }
+
+    LatencyNumaAllocator* allocator;
+    size_t numNodes;
+    std::unique_ptr<std::atomic<Shard*>[]> shards;
+};
@@ -0,0 +1,484 @@
+/**
+ * Copyright (C) 2017-present Jung-Sang Ahn <jungsang.ahn@gmail.com>
+ * All rights reserved.
+ *
+ * https://github.com/greensky00
+ *
+ * Per-CPU Histogram
+ * Version: 0.1.0
+ *
+ * Permission is hereby granted, free of charge, to any person
+ * obtaining a copy of this software and associated documentation
+ * files (the "Software"), to deal in the Software without
+ * restriction, including without limitation the rights to use,
+ * copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following
+ * conditions:
+ *
+ * The above copyright notice and this permission notice shall be
+ * included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+ * OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+ * HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+ * WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+
+#pragma once
+
+#include "histogram.h"
+
+#include <stdint.h>
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <new>
+#include <thread>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <unistd.h>
+#if defined(__has_include)
+#if __has_include(<sys/rseq.h>) && \
+    ( (defined(__GNUC__) && __GNUC__ >= 11) || defined(__clang__) )
+#include <sys/rseq.h>
+#define PERCPU_HIST_RSEQ 1
+#endif
+#endif
+#endif
+
+/**
+ * Histogram sharded by CPU, instead of by thread.
+ *
+ * Each `add` goes to the shard of the CPU the caller is running on, so
+ * that threads on different CPUs do not share cache lines, while memory
+ * is bounded by the number of CPUs regardless of how many threads come
+ * and go. Nothing is kept per thread, so nothing is lost when a thread
+ * exits. Shards are allocated on the first use by each CPU.
+ *
+ * A thread may migrate between choosing the shard and updating it, hence
+ * shards are still updated atomically; it just rarely contends.
+ *
+ * The current CPU is read from the rseq area registered by glibc (2.35+)
+ * if available, otherwise from `sched_getcpu()`. If neither works, a hash
+ * of the thread ID is used instead.
+ *
+ * Shards have the same power-of-two bins as `Histogram`, inline and
+ * aligned to the cache line size, so that no two shards share a cache
+ * line. Reads (total, percentiles, iteration) merge all shards into a
+ * `HistogramSnapshot` on the stack. It provides the same interface as
+ * `Histogram`, so that it can be used as `Hist` of a collector policy.
+ */
+class PerCpuHistogram {
+public:
+    static const size_t MAX_BINS = 65;
+
+    enum CpuSource {
+        RSEQ = 0,
+        SCHED_GETCPU = 1,
+        THREAD_HASH = 2,
+    };
+
+    /**
+     * Iterates the merged bins. It keeps a copy of them,
+     * so it remains valid after the source changes.
+     */
+    class Iterator {
+    public:
+        Iterator() : idx(MAX_BINS), bins() {}
+
+        Iterator& operator++() {
+            if (idx < MAX_BINS) idx++;
+            return *this;
+        }
+
+        Iterator& operator*() { return *this; }
+
+        bool operator==(const Iterator& val) const { return idx == val.idx; }
+        bool operator!=(const Iterator& val) const { return idx != val.idx; }
+
+        size_t getIdx() const { return idx; }
+
+        uint64_t getCount() const { return (idx < MAX_BINS) ? bins[idx] : 0; }
+
+        // Same bounds as `HistItr`.
+        uint64_t getLowerBound() const {
+            size_t idx_rev = MAX_BINS - idx - 1;
+            return (idx_rev) ? ( (uint64_t)1 << (idx_rev - 1) ) : 0;
+        }
+
+        uint64_t getUpperBound() const {
+            if (!idx) return std::numeric_limits<uint64_t>::max();
+            return (uint64_t)1 << (MAX_BINS - idx - 1);
+        }
+
+    private:
+        friend class PerCpuHistogram;
+        size_t idx;
+        uint64_t bins[MAX_BINS];
+    };
+
+    using iterator = Iterator;
+
+    PerCpuHistogram()
+        : numShards(getNumCpus())
+        , shards(new std::atomic<Shard*>[numShards])
+    {
+        for (size_t ii = 0; ii < numShards; ++ii) shards[ii] = nullptr;
+    }
+
+    // A copy has a single shard with the merged `src`, as it is mostly
+    // for reading.
+    PerCpuHistogram(const PerCpuHistogram& src)
+        : PerCpuHistogram()
+    {
+        *this = src;
+    }
+
+    ~PerCpuHistogram() {
+        freeShards();
+    }
+
+    // this = src
+    PerCpuHistogram& operator=(const PerCpuHistogram& src) {
+        if (this == &src) return *this;
+        HistogramSnapshot merged;
+        src.mergeTo(merged);
+        freeShards();
+        getShard(0).addFrom(merged);
+        return *this;
+    }
+
+    // this += rhs
+    PerCpuHistogram& operator+=(const PerCpuHistogram& rhs) {
+        HistogramSnapshot merged;
+        rhs.mergeTo(merged);
+        getShard( getCurrentCpu() % numShards ).addFrom(merged);
+        return *this;
+    }
+
+    // returning lhs + rhs
+    friend PerCpuHistogram operator+(PerCpuHistogram lhs,
+                                     const PerCpuHistogram& rhs) {
+        lhs += rhs;
+        return lhs;
+    }
+
+    void add(uint64_t val) {
+        Shard& shard = getShard( getCurrentCpu() % numShards );
+        shard.bins[getBinIdx(val)].fetch_add(1, MO);
+        shard.count.fetch_add(1, MO);
+        shard.sum.fetch_add(val, MO);
+
+        size_t num_trial = 0;
+        while (num_trial++ < MAX_TRIAL && shard.max.load(MO) < val) {
+            // 'max' may not be updated properly under race condition.
+            shard.max.store(val, MO);
+        }
+    }
+
+    // Single-thread histograms do not need shards, but keep the interface.
+    void addNonAtomic(uint64_t val) {
+        Shard& shard = getShard(0);
+        std::atomic<uint64_t>& bin = shard.bins[getBinIdx(val)];
+        bin.store(bin.load(MO) + 1, MO);
+        shard.count.store(shard.count.load(MO) + 1, MO);
+        shard.sum.store(shard.sum.load(MO) + val, MO);
+        if (shard.max.load(MO) < val) shard.max.store(val, MO);
+    }
+
+    // Add `num` values at once, binned locally first.
+    void addBatch(const uint64_t* vals, size_t num) {
+        if (!num) return;
+        uint64_t local[MAX_BINS] = {0};
+        uint64_t local_sum = 0;
+        uint64_t local_max = 0;
+        for (size_t ii = 0; ii < num; ++ii) {
+            uint64_t val = vals[ii];
+            local[getBinIdx(val)]++;
+            local_sum += val;
+            if (local_max < val) local_max = val;
+        }
+        getShard( getCurrentCpu() % numShards )
+            .addFrom(local, num, local_sum, local_max);
+    }
+
+    uint64_t getTotal() const {
+        uint64_t ret = 0;
+        forEachShard([&ret](const Shard& s) { ret += s.count.load(MO); });
+        return ret;
+    }
+
+    uint64_t getSum() const {
+        uint64_t ret = 0;
+        forEachShard([&ret](const Shard& s) { ret += s.sum.load(MO); });
+        return ret;
+    }
+
+    uint64_t getAverage() const {
+        uint64_t total = 0, sum = 0;
+        forEachShard([&](const Shard& s) {
+            total += s.count.load(MO);
+            sum += s.sum.load(MO);
+        });
+        return (total) ? (sum / total) : 0;
+    }
+
+    uint64_t getMax() const {
+        uint64_t ret = 0;
+        forEachShard([&ret](const Shard& s) {
+            uint64_t cur = s.max.load(MO);
+            if (ret < cur) ret = cur;
+        });
+        return ret;
+    }
+
+    // Memory consumed by this histogram, in bytes.
+    size_t getMemoryUsage() const {
+        return sizeof(*this) + numShards * sizeof(std::atomic<Shard*>) +
+               getNumActiveShards() * (sizeof(Shard) + CACHE_LINE);
+    }
+
+    // Number of shards allocated so far.
+    size_t getNumActiveShards() const {
+        size_t ret = 0;
+        forEachShard([&ret](const Shard&) { ret++; });
+        return ret;
+    }
+
+    uint64_t estimate(double percentile) const {
+        HistogramSnapshot merged;
+        mergeTo(merged);
+        return merged.estimate(percentile);
+    }
+
+    // Estimate `num` percentiles at once, merging the shards only once.
+    void estimate(const double* percentiles, uint64_t* dst, size_t num) const {
+        HistogramSnapshot merged;
+        mergeTo(merged);
+        merged.estimate(percentiles, dst, num);
+    }
+
+    // Merges the shards once; the iterator keeps the merged bins.
+    iterator begin() const {
+        HistogramSnapshot merged;
+        mergeTo(merged);
+        Iterator ret;
+        for (size_t ii = 0; ii < MAX_BINS; ++ii) {
+            ret.bins[ii] = merged.getBinCount(ii);
+        }
+        ret.idx = 0;
+        while (ret.idx < MAX_BINS && !ret.bins[ret.idx]) ret.idx++;
+        return ret;
+    }
+
+    iterator end() const { return Iterator(); }
+
+    /**
+     * CPU the current thread is running on, from the selected source.
+     * With `THREAD_HASH`, it is a hash of the thread ID instead.
+     */
+    static size_t getCurrentCpu() {
+        switch (getSourceRef().load(std::memory_order_relaxed)) {
+#if defined(PERCPU_HIST_RSEQ)
+        case RSEQ: {
+            const struct rseq* area = (const struct rseq*)
+                ( (char*)__builtin_thread_pointer() + __rseq_offset );
+            return *(volatile const uint32_t*)&area->cpu_id;
+        }
+#endif
+#if defined(__linux__)
+        case SCHED_GETCPU: {
+            int cpu = sched_getcpu();
+            if (cpu >= 0) return cpu;
+            break;
+        }
+#endif
+        default:
+            break;
+        }
+        thread_local size_t hash =
+            std::hash<std::thread::id>()( std::this_thread::get_id() );
+        return hash;
+    }
+
+    // The best source available on this system.
+    static CpuSource getSupportedSource() {
+#if defined(PERCPU_HIST_RSEQ)
+        // Zero if glibc did not register rseq (e.g., disabled by tunable).
+        if (__rseq_size > 0) {
+            const struct rseq* area = (const struct rseq*)
+                ( (char*)__builtin_thread_pointer() + __rseq_offset );
+            if ((int32_t)area->cpu_id >= 0) return RSEQ;
+        }
+#endif
+#if defined(__linux__)
+        if (sched_getcpu() >= 0) return SCHED_GETCPU;
+#endif
+        return THREAD_HASH;
+    }
+
+    static CpuSource getSource() {
+        return getSourceRef().load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Override the source, e.g., for testing the fallback.
+     * A source better than the supported one is ignored.
+     *
+     * @return The source actually selected.
+     */
+    static CpuSource setSource(CpuSource source) {
+        CpuSource supported = getSupportedSource();
+        if (source < supported) source = supported;
+        getSourceRef().store(source, std::memory_order_relaxed);
+        return source;
+    }
+
+    static const char* getSourceName(CpuSource source) {
+        switch (source) {
+        case RSEQ:          return "rseq";
+        case SCHED_GETCPU:  return "sched_getcpu";
+        case THREAD_HASH:   return "thread_hash";
+        }
+        return "unknown";
+    }
+
+    // Number of shards: configured (not only online) CPUs.
+    static size_t getNumCpus() {
+        static size_t num_cpus = []() {
+            long ret = 0;
+#if defined(__linux__)
+            ret = sysconf(_SC_NPROCESSORS_CONF);
+#endif
+            if (ret <= 0) ret = std::thread::hardware_concurrency();
+            return (size_t)( (ret > 0) ? ret : 1 );
+        }();
+        return num_cpus;
+    }
+
+private:
+    static const size_t CACHE_LINE = 64;
+    static const size_t MAX_TRIAL = 3;
+    static const std::memory_order MO = std::memory_order_relaxed;
+    static const std::memory_order MO_ACQ = std::memory_order_acquire;
+
+    // Bins are inline, and each shard starts on its own cache line.
+    struct alignas(64) Shard {
+        Shard() : count(0), sum(0), max(0), mem(nullptr) {
+            for (size_t ii = 0; ii < MAX_BINS; ++ii) bins[ii] = 0;
+        }
+
+        void addFrom(const HistogramSnapshot& src) {
+            uint64_t src_bins[MAX_BINS];
+            for (size_t ii = 0; ii < MAX_BINS; ++ii) {
+                src_bins[ii] = src.getBinCount(ii);
+            }
+            addFrom( src_bins, src.getTotal(), src.getSum(), src.getMax() );
+        }
+
+        void addFrom(const uint64_t* src_bins, uint64_t src_count,
+                     uint64_t src_sum, uint64_t src_max) {
+            for (size_t ii = 0; ii < MAX_BINS; ++ii) {
+                if (src_bins[ii]) bins[ii].fetch_add(src_bins[ii], MO);
+            }
+            count.fetch_add(src_count, MO);
+            sum.fetch_add(src_sum, MO);
+            size_t num_trial = 0;
+            while (num_trial++ < MAX_TRIAL && max.load(MO) < src_max) {
+                max.store(src_max, MO);
+            }
+        }
+
+        std::atomic<uint64_t> bins[MAX_BINS];
+        std::atomic<uint64_t> count;
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> max;
+        // Start of the allocated memory, before alignment.
+        void* mem;
+    };
+
+    static std::atomic<CpuSource>& getSourceRef() {
+        static std::atomic<CpuSource> source( getSupportedSource() );
+        return source;
+    }
+
+    static size_t getBinIdx(uint64_t val) {
+        // Same as `Histogram`: the number of leading zeros, 64 for 0.
+        if (!val) return MAX_BINS - 1;
+#if defined(__GNUC__)
+        return __builtin_clzll(val);
+#else
+        size_t ret = 0;
+        while ( !(val & ((uint64_t)1 << 63)) ) {
+            val <<= 1;
+            ret++;
+        }
+        return ret;
+#endif
+    }
+
+    // `new` does not align beyond `max_align_t` until C++17.
+    static Shard* newShard() {
+        void* mem = ::operator new(sizeof(Shard) + CACHE_LINE);
+        uintptr_t addr = reinterpret_cast<uintptr_t>(mem);
+        addr = (addr + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+        Shard* ret = new (reinterpret_cast<void*>(addr)) Shard();
+        ret->mem = mem;
+        return ret;
+    }
+
+    static void deleteShard(Shard* shard) {
+        if (!shard) return;
+        void* mem = shard->mem;
+        shard->~Shard();
+        ::operator delete(mem);
+    }
+
+    Shard& getShard(size_t idx) {
+        Shard* shard = shards[idx].load(MO_ACQ);
+        if (shard) return *shard;
+
+        Shard* new_shard = newShard();
+        if (shards[idx].compare_exchange_strong(shard, new_shard,
+                                                std::memory_order_acq_rel)) {
+            return *new_shard;
+        }
+        // Other thread allocated it at the same time, `shard` is updated.
+        deleteShard(new_shard);
+        return *shard;
+    }
+
+    template<typename F>
+    void forEachShard(F func) const {
+        for (size_t ii = 0; ii < numShards; ++ii) {
+            Shard* shard = shards[ii].load(MO_ACQ);
+            if (shard) func(*shard);
+        }
+    }
+
+    void mergeTo(HistogramSnapshot& dst) const {
+        forEachShard([&dst](const Shard& s) {
+            dst.addBins( s.bins, s.count.load(MO), s.sum.load(MO),
+                         s.max.load(MO) );
+        });
+    }
+
+    void freeShards() {
+        for (size_t ii = 0; ii < numShards; ++ii) {
+            deleteShard( shards[ii].exchange(nullptr) );
+        }
+    }
+
+    size_t numShards;
+    std::unique_ptr<std::atomic<Shard*>[]> shards;
+};
@@ -0,0 +1,553 @@
+#include "latency_collector.h"
+#include "latency_dump.h"
+#include "histogram_simd.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <ctime>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using SingleThreadCollector = LatencyCollectorT<LatencySingleThreadPolicy>;
+using DisabledCollector = LatencyCollectorT<LatencyDisabledPolicy>;
+using DDSketchCollector = LatencyCollectorT<LatencyDDSketchPolicy>;
+using CompactCollector = LatencyCollectorT<LatencyCompactPolicy>;
+using PerCpuCollector = LatencyCollectorT<LatencyPerCpuPolicy>;
+using NumaCollector = LatencyCollectorT<LatencyNumaPolicy>;
+
+// Prevent the compiler from optimizing out the given value.
+template<typename T>
+inline void do_not_optimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct BenchOptions {
+    BenchOptions()
+        : warmup(3)
+        , reps(30)
+        {}
+    size_t warmup;
+    size_t reps;
+    std::string filter;
+    std::string json_path;
+};
+
+struct BenchResult {
+    std::string name;
+    size_t opsPerRep;
+    size_t reps;
+    double medianNs;
+    double p99Ns;
+    double minNs;
+    double meanNs;
+};
+
+/**
+ * Runs each case `warmup + reps` times, and reports the distribution of
+ * per-op latencies over the repetitions (excluding warmup).
+ */
+class BenchRunner {
+public:
+    // Run `ops` operations and return the elapsed time in nanoseconds.
+    using BenchFunc = std::function< double(size_t ops) >;
+
+    BenchRunner(const BenchOptions& _opt) : opt(_opt) {}
+
+    void run(const std::string& name, size_t ops, BenchFunc func) {
+        if ( !opt.filter.empty() &&
+             name.find(opt.filter) == std::string::npos ) {
+            return;
+        }
+
+        for (size_t ii = 0; ii < opt.warmup; ++ii) func(ops);
+
+        std::vector<double> per_op(opt.reps);
+        for (size_t ii = 0; ii < opt.reps; ++ii) {
+            per_op[ii] = func(ops) / ops;
+        }
+        std::sort(per_op.begin(), per_op.end());
+
+        BenchResult res;
+        res.name = name;
+        res.opsPerRep = ops;
+        res.reps = opt.reps;
+        res.medianNs = percentile(per_op, 50);
+        res.p99Ns = percentile(per_op, 99);
+        res.minNs = per_op.front();
+        double sum = 0;
+        for (double v: per_op) sum += v;
+        res.meanNs = sum / per_op.size();
+        results.push_back(res);
+
+        printf("%-44s %10.1f %10.1f %10.1f  ns/op\n",
+               name.c_str(), res.medianNs, res.p99Ns, res.minNs);
+        fflush(stdout);
+    }
+
+    void printTitle() {
+        printf("%-44s %10s %10s %10s\n", "BENCHMARK", "median", "p99", "min");
+    }
+
+    // Time `body(i)` for i in [0, ops).
+    template<typename F>
+    static double timeLoop(size_t ops, F body) {
+        auto start = std::chrono::steady_clock::now();
+        for (size_t ii = 0; ii < ops; ++ii) body(ii);
+        auto end = std::chrono::steady_clock::now();
+        return std::chrono::duration<double, std::nano>(end - start).count();
+    }
+
+    std::string toJson() const {
+        std::stringstream ss;
+        ss << "{\n";
+        ss << "  \"timestamp\": " << (uint64_t)std::time(nullptr) << ",\n";
+        ss << "  \"warmup\": " << opt.warmup << ",\n";
+        ss << "  \"results\": [\n";
+        for (size_t ii = 0; ii < results.size(); ++ii) {
+            const BenchResult& res = results[ii];
+            ss << "    {\"name\": \"" << res.name << "\", "
+               << "\"ops_per_rep\": " << res.opsPerRep << ", "
+               << "\"reps\": " << res.reps << ", "
+               << std::fixed << std::setprecision(2)
+               << "\"median_ns\": " << res.medianNs << ", "
+               << "\"p99_ns\": " << res.p99Ns << ", "
+               << "\"min_ns\": " << res.minNs << ", "
+               << "\"mean_ns\": " << res.meanNs << "}"
+               << ( (ii + 1 < results.size()) ? "," : "" ) << "\n";
+        }
+        ss << "  ]\n";
+        ss << "}\n";
+        return ss.str();
+    }
+
+private:
+    static double percentile(const std::vector<double>& sorted, double pct) {
+        size_t idx = (size_t)( (sorted.size() - 1) * pct / 100.0 + 0.5 );
+        return sorted[std::min(idx, sorted.size() - 1)];
+    }
+
+    BenchOptions opt;
+    std::vector<BenchResult> results;
+};
+
+template<typename C>
+void nested_scope(C* lat, size_t depth) {
+    collectFuncLatency(lat);
+    if (depth > 1) nested_scope(lat, depth - 1);
+}
+
+template<typename C>
+void bench_add_latency(BenchRunner& runner,
+                       const std::string& policy_name,
+                       size_t max_exemplars = 0,
+                       size_t thread_buffer_size = 0) {
+    C lat;
+    lat.setMaxExemplarsPerStat(max_exemplars);
+    lat.setThreadBufferSize(thread_buffer_size);
+    std::string name("existing_stat");
+    lat.addLatency(name, 1);
+
+    runner.run( "addLatency/existing/" + policy_name, 100000,
+                [&lat, &name](size_t ops) {
+        return BenchRunner::timeLoop( ops, [&lat, &name](size_t ii) {
+            lat.addLatency(name, ii & 0xfff);
+        } );
+    } );
+}
+
+void bench_add_new_latency(BenchRunner& runner) {
+    const size_t NUM_NAMES = 1000;
+    std::vector<std::string> names(NUM_NAMES);
+    for (size_t ii = 0; ii < NUM_NAMES; ++ii) {
+        names[ii] = "new_stat_" + std::to_string(ii);
+    }
+
+    runner.run( "addLatency/new", NUM_NAMES, [&names](size_t ops) {
+        LatencyCollector lat;
+        return BenchRunner::timeLoop( ops, [&lat, &names](size_t ii) {
+            lat.addLatency(names[ii], ii);
+        } );
+    } );
+}
+
+// Per-sample cost of 4096 pre-measured latencies, one by one vs. batch.
+template<typename C>
+void bench_add_batch(BenchRunner& runner, const std::string& policy_name) {
+    const size_t NUM = 4096;
+    std::vector<uint64_t> values(NUM);
+    std::vector< std::pair<std::string, uint64_t> > pairs(NUM);
+    for (size_t ii = 0; ii < NUM; ++ii) {
+        values[ii] = ii & 0xfff;
+        pairs[ii] = std::make_pair( "batch_stat_" + std::to_string(ii / 512),
+                                    values[ii] );
+    }
+
+    C lat;
+    std::string name("batch_stat");
+    typename C::Item* item = lat.getItem(name);
+    for (auto& entry: pairs) lat.addLatency(entry.first, 0);
+
+    runner.run( "addLatency/batch-loop/" + policy_name, NUM,
+                [&lat, &name, &values](size_t ops) {
+        return BenchRunner::timeLoop( 1, [&](size_t) {
+            for (size_t ii = 0; ii < ops; ++ii) {
+                lat.addLatency(name, values[ii]);
+            }
+        } );
+    } );
+    runner.run( "addLatencyBatch/handle/" + policy_name, NUM,
+                [&lat, item, &values](size_t ops) {
+        return BenchRunner::timeLoop( 1, [&](size_t) {
+            lat.addLatencyBatch(item, values.data(), ops);
+        } );
+    } );
+    runner.run( "addLatencyBatch/pairs/" + policy_name, NUM,
+                [&lat, &pairs](size_t) {
+        return BenchRunner::timeLoop( 1, [&](size_t) {
+            lat.addLatencyBatch(pairs);
+        } );
+    } );
+}
+
+template<typename C>
+void bench_func_latency(BenchRunner& runner, const std::string& policy_name) {
+    for (size_t depth: {1, 8, 32}) {
+        C lat;
+        // Populate the stats first.
+        nested_scope(&lat, depth);
+
+        runner.run( "collectFuncLatency/depth=" + std::to_string(depth) +
+                        "/" + policy_name,
+                    20000 / depth,
+                    [&lat, depth](size_t ops) {
+            return BenchRunner::timeLoop( ops, [&lat, depth](size_t) {
+                nested_scope(&lat, depth);
+            } );
+        } );
+    }
+}
+
+template<typename H>
+void bench_histogram(BenchRunner& runner, const std::string& hist_name) {
+    std::mt19937_64 rng(0);
+    std::vector<uint64_t> values(4096);
+    for (uint64_t& v: values) v = rng() % 100000;
+
+    H add_hist;
+    runner.run( hist_name + "::add", 100000,
+                [&add_hist, &values](size_t ops) {
+        return BenchRunner::timeLoop( ops, [&add_hist, &values](size_t ii) {
+            add_hist.add(values[ii & 4095]);
+        } );
+    } );
+
+    H est_hist;
+    for (uint64_t v: values) est_hist.add(v);
+    runner.run( hist_name + "::estimate", 100000, [&est_hist](size_t ops) {
+        return BenchRunner::timeLoop( ops, [&est_hist](size_t ii) {
+            do_not_optimize( est_hist.estimate( (ii & 1) ? 99.0 : 50.0 ) );
+        } );
+    } );
+}
+
+// Cost of finding the current CPU, for each source.
+void bench_current_cpu(BenchRunner& runner) {
+    PerCpuHistogram::CpuSource orig = PerCpuHistogram::getSource();
+    for (PerCpuHistogram::CpuSource source: { PerCpuHistogram::RSEQ,
+                                              PerCpuHistogram::SCHED_GETCPU,
+                                              PerCpuHistogram::THREAD_HASH }) {
+        if (PerCpuHistogram::setSource(source) != source) continue;
+        runner.run( std::string("getCurrentCpu/") +
+                        PerCpuHistogram::getSourceName(source),
+                    1000000, [](size_t ops) {
+            return BenchRunner::timeLoop( ops, [](size_t) {
+                do_not_optimize( PerCpuHistogram::getCurrentCpu() );
+            } );
+        } );
+    }
+    PerCpuHistogram::setSource(orig);
+}
+
+// Aggregating many histograms (e.g., per-thread shards) for a report,
+// and then 3 percentiles: `Histogram` vs. `HistogramSnapshot` per ISA.
+void bench_histogram_merge(BenchRunner& runner) {
+    const size_t NUM_HISTS = 1000;
+    std::mt19937_64 rng(0);
+    std::vector<Histogram> hists(NUM_HISTS);
+    for (Histogram& hist: hists) {
+        for (size_t ii = 0; ii < 64; ++ii) hist.add(rng() >> (rng() % 64));
+    }
+
+    runner.run( "Histogram::merge+estimate", NUM_HISTS,
+                [&hists](size_t ops) {
+        return BenchRunner::timeLoop( 1, [&hists, ops](size_t) {
+            Histogram merged;
+            for (size_t ii = 0; ii < ops; ++ii) merged += hists[ii];
+            for (double pct: {50.0, 99.0, 99.9}) {
+                do_not_optimize( merged.estimate(pct) );
+            }
+        } );
+    } );
+
+    HistogramSimd::Isa supported = HistogramSimd::getSupportedIsa();
+    for (HistogramSimd::Isa isa: { HistogramSimd::SCALAR,
+                                   HistogramSimd::SSE2,
+                                   HistogramSimd::AVX2 }) {
+        if (HistogramSimd::setIsa(isa) != isa) continue;
+        runner.run( std::string("HistogramSnapshot::merge+estimate/") +
+                        HistogramSimd::getIsaName(isa),
+                    NUM_HISTS,
+                    [&hists](size_t ops) {
+            return BenchRunner::timeLoop( 1, [&hists, ops](size_t) {
+                HistogramSnapshot merged;
+                for (size_t ii = 0; ii < ops; ++ii) merged += hists[ii];
+                for (double pct: {50.0, 99.0, 99.9}) {
+                    do_not_optimize( merged.estimate(pct) );
+                }
+            } );
+        } );
+    }
+    HistogramSimd::setIsa(supported);
+
+    // Merging snapshots only, i.e., without loading atomic bins.
+    std::vector<HistogramSnapshot> snaps(hists.begin(), hists.end());
+    for (HistogramSimd::Isa isa: { HistogramSimd::SCALAR,
+                                   HistogramSimd::SSE2,
+                                   HistogramSimd::AVX2 }) {
+        if (HistogramSimd::setIsa(isa) != isa) continue;
+        runner.run( std::string("HistogramSnapshot::merge(snapshot)/") +
+                        HistogramSimd::getIsaName(isa),
+                    NUM_HISTS,
+                    [&snaps](size_t ops) {
+            return BenchRunner::timeLoop( 1, [&snaps, ops](size_t) {
+                HistogramSnapshot merged;
+                for (size_t ii = 0; ii < ops; ++ii) merged += snaps[ii];
+                do_not_optimize( merged.estimate(99.0) );
+            } );
+        } );
+    }
+    HistogramSimd::setIsa(supported);
+}
+
+// Relative error of the percentiles, against the exact ones.
+void report_accuracy(const BenchOptions& opt) {
+    if ( !opt.filter.empty() &&
+         std::string("accuracy").find(opt.filter) == std::string::npos ) {
+        return;
+    }
+
+    // Log-normal latencies, median ~3 ms.
+    std::mt19937_64 rng(0);
+    std::lognormal_distribution<double> dist(8.0, 1.5);
+    std::vector<uint64_t> values(200000);
+    for (uint64_t& v: values) v = 1 + (uint64_t)dist(rng);
+
+    Histogram hist;
+    DDSketch sketch;
+    for (uint64_t v: values) {
+        hist.add(v);
+        sketch.add(v);
+    }
+    std::sort(values.begin(), values.end());
+
+    printf("\n%-12s %12s %12s %8s %12s %8s\n",
+           "PERCENTILE", "exact", "Histogram", "error", "DDSketch", "error");
+    for (double pct: {50.0, 90.0, 99.0, 99.9, 99.99}) {
+        uint64_t exact = values[ (size_t)((values.size() - 1) * pct / 100) ];
+        uint64_t h_est = hist.estimate(pct);
+        uint64_t d_est = sketch.estimate(pct);
+        printf("%-12.2f %12" PRIu64 " %12" PRIu64 " %7.2f%% %12" PRIu64
+               " %7.2f%%\n",
+               pct, exact,
+               h_est, 100.0 * std::abs((double)h_est - exact) / exact,
+               d_est, 100.0 * std::abs((double)d_est - exact) / exact);
+    }
+    printf("%-12s %12s %12zu %8s %12zu\n\n", "memory (B)", "",
+           hist.getMemoryUsage(), "",
+           sketch.getMemoryUsage());
+}
+
+// Memory of many stats with a narrow latency range each,
+// `Histogram` vs. `CompactHistogram`.
+// Single-thread policy to add stats in place.
+template<typename H>
+struct SingleThreadHistPolicy : public LatencySingleThreadPolicy {
+    using Hist = H;
+};
+
+template<typename P>
+LatencyCollectorHealth stats_memory(size_t num_stats,
+                                    size_t samples_per_stat) {
+    std::mt19937_64 rng(0);
+    std::lognormal_distribution<double> dist(8.0, 0.5);
+    LatencyCollectorT< SingleThreadHistPolicy<typename P::Hist> > lat;
+    for (size_t ii = 0; ii < num_stats; ++ii) {
+        std::string name = "stat_" + std::to_string(ii);
+        for (size_t jj = 0; jj < samples_per_stat; ++jj) {
+            lat.addLatency(name, 1 + (uint64_t)dist(rng));
+        }
+    }
+    return lat.getHealth();
+}
+
+void report_memory(const BenchOptions& opt) {
+    if ( !opt.filter.empty() &&
+         std::string("memory").find(opt.filter) == std::string::npos ) {
+        return;
+    }
+
+    const size_t NUM_STATS = 50000;
+    const double MB = 1048576.0;
+    printf("\n%-20s %12s %12s %12s %12s\n", "50K STATS",
+           "Histogram", "(total)", "Compact", "(total)");
+    for (size_t samples: {1, 100}) {
+        LatencyCollectorHealth std_h =
+            stats_memory<LatencyStandardPolicy>(NUM_STATS, samples);
+        LatencyCollectorHealth compact_h =
+            stats_memory<LatencyCompactPolicy>(NUM_STATS, samples);
+        printf("%-20s %10.1fMB %10.1fMB %10.1fMB %10.1fMB\n",
+               (std::to_string(samples) + " samples/stat").c_str(),
+               std_h.histogramBytes / MB, std_h.itemBytes / MB,
+               compact_h.histogramBytes / MB, compact_h.itemBytes / MB);
+    }
+    printf("\n");
+}
+
+void bench_aggr_item(BenchRunner& runner) {
+    const size_t NUM_STATS = 1000;
+    LatencyCollector lat;
+    for (size_t ii = 0; ii < NUM_STATS; ++ii) {
+        // 4 call paths for each leaf function.
+        lat.addLatency( " ## caller_" + std::to_string(ii % 4) +
+                        " ## func_" + std::to_string(ii / 4), ii );
+    }
+
+    runner.run( "getAggrItem/stats=1000", 1000, [&lat](size_t ops) {
+        return BenchRunner::timeLoop( ops, [&lat](size_t ii) {
+            do_not_optimize( lat.getAggrItem( "func_" +
+                                              std::to_string(ii % 250) )
+                             .getNumCalls() );
+        } );
+    } );
+    runner.run( "getSubtreeAggrItem/stats=1000", 100, [&lat](size_t ops) {
+        return BenchRunner::timeLoop( ops, [&lat](size_t ii) {
+            do_not_optimize( lat.getSubtreeAggrItem( " ## caller_" +
+                                                     std::to_string(ii % 4) )
+                             .getNumCalls() );
+        } );
+    } );
+}
+
+void bench_dump(BenchRunner& runner) {
+    for (size_t num_stats: {10, 100, 1000}) {
+        LatencyCollector lat;
+        for (size_t ii = 0; ii < num_stats; ++ii) {
+            // Depth 1 ~ 4 call paths, so that both views have something.
+            std::string name;
+            for (size_t jj = 0; jj <= ii % 4; ++jj) {
+                name += " ## func_" + std::to_string( (ii / 4) * 4 + jj );
+            }
+            for (size_t jj = 0; jj < 16; ++jj) {
+                lat.addLatency(name, (jj + 1) * 10);
+            }
+        }
+
+        LatencyDumpDefaultImpl default_dump;
+        for (auto view: { LatencyCollectorDumpOptions::TREE,
+                          LatencyCollectorDumpOptions::FLAT }) {
+            LatencyCollectorDumpOptions opt;
+            opt.view_type = view;
+            std::string view_name =
+                (view == LatencyCollectorDumpOptions::TREE) ? "tree" : "flat";
+
+            runner.run( "LatencyDumpDefaultImpl::dump/" + view_name +
+                            "/stats=" + std::to_string(num_stats),
+                        std::max((size_t)2, 1000 / num_stats),
+                        [&lat, &default_dump, opt](size_t ops) {
+                return BenchRunner::timeLoop( ops,
+                    [&lat, &default_dump, &opt](size_t) {
+                        do_not_optimize( lat.dump(&default_dump, opt).size() );
+                    } );
+            } );
+        }
+    }
+}
+
+void usage(const char* prog) {
+    printf("Usage: %s [--reps N] [--warmup N] [--filter STR] [--json FILE]\n",
+           prog);
+}
+
+int main(int argc, char** argv) {
+    BenchOptions opt;
+    for (int ii = 1; ii < argc; ++ii) {
+        std::string arg = argv[ii];
+        bool has_next = (ii + 1 < argc);
+        if (arg == "--reps" && has_next) {
+            opt.reps = std::max(1, atoi(argv[++ii]));
+        } else if (arg == "--warmup" && has_next) {
+            opt.warmup = atoi(argv[++ii]);
+        } else if (arg == "--filter" && has_next) {
+            opt.filter = argv[++ii];
+        } else if (arg == "--json" && has_next) {
+            opt.json_path = argv[++ii];
+        } else {
+            usage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+
+    BenchRunner runner(opt);
+    runner.printTitle();
+
+    bench_add_latency<LatencyCollector>(runner, "atomic");
+    bench_add_latency<SingleThreadCollector>(runner, "single-thread");
+    bench_add_latency<DisabledCollector>(runner, "disabled");
+    bench_add_latency<DDSketchCollector>(runner, "ddsketch");
+    bench_add_latency<CompactCollector>(runner, "compact");
+    bench_add_latency<PerCpuCollector>(runner, "percpu");
+    bench_add_latency<NumaCollector>(runner, "numa");
+    bench_add_latency<LatencyCollector>(runner, "atomic+exemplars", 8);
+    bench_add_latency<LatencyCollector>(runner, "atomic+thread-buffer", 0, 64);
+    bench_add_new_latency(runner);
+    bench_add_batch<LatencyCollector>(runner, "atomic");
+    bench_add_batch<DDSketchCollector>(runner, "ddsketch");
+
+    bench_func_latency<LatencyCollector>(runner, "atomic");
+    bench_func_latency<SingleThreadCollector>(runner, "single-thread");
+    bench_func_latency<DisabledCollector>(runner, "disabled");
+
+    bench_histogram<Histogram>(runner, "Histogram");
+    bench_histogram<DDSketch>(runner, "DDSketch");
+    bench_histogram<CompactHistogram>(runner, "CompactHistogram");
+    bench_histogram<PerCpuHistogram>(runner, "PerCpuHistogram");
+    bench_histogram<NumaHistogram>(runner, "NumaHistogram");
+    bench_current_cpu(runner);
+    bench_histogram_merge(runner);
+    report_accuracy(opt);
+    report_memory(opt);
+    bench_aggr_item(runner);
+    bench_dump(runner);
+
+    if (!opt.json_path.empty()) {
+        std::ofstream fs(opt.json_path);
+        fs << runner.toJson();
+        if (!fs) {
+            printf("failed to write %s\n", opt.json_path.c_str());
+            return 1;
+        }
+    }
+    return 0;
+}
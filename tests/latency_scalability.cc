@@ -0,0 +1,207 @@
+#include "test_common.h"
+#include "latency_collector.h"
+#include "latency_dump.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Scalability of `LatencyCollector::addLatency` from 1 to `max_threads`
+// threads, for the following access patterns:
+//   * same:      all threads update the same stat.
+//   * disjoint:  each thread updates its own stat.
+//   * new_names: each op adds a new stat.
+
+enum AccessPattern {
+    SAME = 0,
+    DISJOINT = 1,
+    NEW_NAMES = 2,
+};
+
+static const char* pattern_name(AccessPattern pattern) {
+    switch (pattern) {
+    case SAME:      return "same";
+    case DISJOINT:  return "disjoint";
+    case NEW_NAMES: return "new_names";
+    }
+    return "unknown";
+}
+
+// Time of every `SAMPLE_INTERVAL`-th op is measured.
+static const size_t SAMPLE_INTERVAL = 16;
+
+// Throughput below this ratio of the ideal one is flagged.
+static const double LINEAR_SCALING_THRESHOLD = 0.7;
+
+static size_t max_threads = 128;
+
+struct scale_args : TestSuite::ThreadArgs {
+    scale_args()
+        : lat(nullptr), pattern(SAME), tid(0), numOps(0), go(nullptr) {}
+    LatencyCollector* lat;
+    AccessPattern pattern;
+    size_t tid;
+    size_t numOps;
+    std::vector<std::string> names;
+    std::atomic<bool>* go;
+    // Per-op latency in nanoseconds (sampled).
+    Histogram opLatency;
+};
+
+int scale_worker(TestSuite::ThreadArgs* t_args) {
+    scale_args* args = static_cast<scale_args*>(t_args);
+    while (!args->go->load()) std::this_thread::yield();
+
+    const std::vector<std::string>& names = args->names;
+    for (size_t ii = 0; ii < args->numOps; ++ii) {
+        const std::string& name =
+            (args->pattern == NEW_NAMES) ? names[ii] : names[0];
+
+        if (ii % SAMPLE_INTERVAL) {
+            args->lat->addLatency(name, ii & 0xfff);
+            continue;
+        }
+        auto start = std::chrono::steady_clock::now();
+        args->lat->addLatency(name, ii & 0xfff);
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        args->opLatency.add
+            ( std::chrono::duration_cast<std::chrono::nanoseconds>
+                  (elapsed).count() );
+    }
+    return 0;
+}
+
+struct ScaleResult {
+    size_t numThreads;
+    double opsPerSec;
+    Histogram opLatency;
+    uint64_t dropped;
+    uint64_t casRetries;
+    uint64_t numLocks;
+    uint64_t numContended;
+    uint64_t lockWaitNs;
+};
+
+ScaleResult run_once(AccessPattern pattern, size_t n_threads) {
+    // Adding new stats is O(n) each, so that keeps the total small.
+    size_t ops_per_thread = (pattern == NEW_NAMES)
+                            ? std::max((size_t)8, 2048 / n_threads)
+                            : std::max((size_t)1000, 1000000 / n_threads);
+
+    LatencyCollector lat;
+    std::atomic<bool> go(false);
+    std::vector<scale_args> args(n_threads);
+    for (size_t ii = 0; ii < n_threads; ++ii) {
+        args[ii].lat = &lat;
+        args[ii].pattern = pattern;
+        args[ii].tid = ii;
+        args[ii].numOps = ops_per_thread;
+        args[ii].go = &go;
+        switch (pattern) {
+        case SAME:
+            args[ii].names.push_back("same_stat");
+            break;
+        case DISJOINT:
+            args[ii].names.push_back("stat_" + std::to_string(ii));
+            // Populate in advance, to measure the steady state.
+            lat.addLatency(args[ii].names[0], 0);
+            break;
+        case NEW_NAMES:
+            for (size_t jj = 0; jj < ops_per_thread; ++jj) {
+                args[ii].names.push_back( "t" + std::to_string(ii) +
+                                          "_n" + std::to_string(jj) );
+            }
+            break;
+        }
+    }
+    if (pattern == SAME) lat.addLatency("same_stat", 0);
+
+    std::vector<TestSuite::ThreadHolder> t_hdl(n_threads);
+    for (size_t ii = 0; ii < n_threads; ++ii) {
+        t_hdl[ii].spawn(&args[ii], scale_worker, nullptr);
+    }
+
+    ashared_ptr_lock_stats::reset();
+    TestSuite::Timer timer;
+    go = true;
+    for (size_t ii = 0; ii < n_threads; ++ii) {
+        t_hdl[ii].join();
+    }
+    uint64_t elapsed_us = std::max((uint64_t)1, timer.getTimeUs());
+
+    ScaleResult res;
+    res.numThreads = n_threads;
+    res.opsPerSec = TestSuite::calcThroughput( ops_per_thread * n_threads,
+                                               elapsed_us );
+    for (size_t ii = 0; ii < n_threads; ++ii) {
+        res.opLatency += args[ii].opLatency;
+    }
+    res.dropped = lat.getNumDroppedSamples();
+    res.casRetries = lat.getHealth().numCasRetries;
+    res.numLocks = ashared_ptr_lock_stats::numLocks();
+    res.numContended = ashared_ptr_lock_stats::numContended();
+    res.lockWaitNs = ashared_ptr_lock_stats::waitNs();
+    return res;
+}
+
+int scalability_test(AccessPattern pattern) {
+    size_t num_cores = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<ScaleResult> results;
+    for (size_t n_threads = 1; n_threads <= max_threads; n_threads *= 2) {
+        results.push_back( run_once(pattern, n_threads) );
+    }
+
+    TestSuite::_msg("pattern: %s, %zu cores\n",
+                    pattern_name(pattern), num_cores);
+    TestSuite::_msg("%7s %12s %8s %9s %9s %9s %8s %10s %10s %12s\n",
+                    "THREADS", "OPS/SEC", "SCALING",
+                    "p50(ns)", "p99(ns)", "p99.9(ns)",
+                    "DROPPED", "CAS RETRY", "CONTENDED", "LOCK WAIT");
+
+    double base = results[0].opsPerSec;
+    for (ScaleResult& res: results) {
+        // Ideal: linear up to the number of cores, flat after that.
+        double ideal = base * std::min(res.numThreads, num_cores);
+        double scaling = res.opsPerSec / ideal;
+
+        TestSuite::_msg("%7zu %12s %7.2fx %9" PRIu64 " %9" PRIu64
+                        " %9" PRIu64 " %8" PRIu64 " %10" PRIu64
+                        " %10s %12s%s\n",
+                        res.numThreads,
+                        TestSuite::countToString(res.opsPerSec).c_str(),
+                        res.opsPerSec / base,
+                        res.opLatency.estimate(50),
+                        res.opLatency.estimate(99),
+                        res.opLatency.estimate(99.9),
+                        res.dropped,
+                        res.casRetries,
+                        TestSuite::countToString(res.numContended).c_str(),
+                        TestSuite::usToString(res.lockWaitNs / 1000).c_str(),
+                        (scaling < LINEAR_SCALING_THRESHOLD)
+                        ? "  <- NON-LINEAR" : "");
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    // Optional: max number of threads.
+    for (int ii = 1; ii < argc; ++ii) {
+        if (std::string(argv[ii]) == "--max-threads" && ii + 1 < argc) {
+            max_threads = std::max(1, atoi(argv[++ii]));
+        }
+    }
+
+    TestSuite test(argc, argv);
+    test.options.printTestMessage = true;
+    test.doTest("scalability: same stat", scalability_test, SAME);
+    test.doTest("scalability: disjoint stats", scalability_test, DISJOINT);
+    test.doTest("scalability: new stat names", scalability_test, NEW_NAMES);
+
+    return 0;
+}
@@ -1,10 +1,67 @@
 #include "test_common.h"
 #include "latency_collector.h"
 #include "latency_dump.h"
+#include "latency_dump_json.h"
+#include "latency_diff.h"
+#include "latency_statsd.h"
+#include "latency_aggregator.h"
+#include "latency_history.h"
+#include "histogram_simd.h"
 
+#include <algorithm>
+#include <random>
+#include <new>
 #include <thread>
+#include <vector>
 
 #include <stdio.h>
+#include <stdlib.h>
+
+// Number of allocations by the current thread, to check the paths
+// supposed to be allocation-free.
+static thread_local size_t num_allocs = 0;
+
+// All forms are replaced, so that memory never goes to the default
+// (or sanitizer's) functions of another form. Not inlined, so that the
+// compiler does not pair `malloc` in `new` with `delete`.
+__attribute__((noinline))
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    num_allocs++;
+    return malloc(size ? size : 1);
+}
+
+__attribute__((noinline)) void* operator new(size_t size) {
+    void* ret = operator new(size, std::nothrow);
+    if (!ret) throw std::bad_alloc();
+    return ret;
+}
+
+__attribute__((noinline))
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return operator new(size, std::nothrow);
+}
+
+__attribute__((noinline)) void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+__attribute__((noinline))
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+__attribute__((noinline)) void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+__attribute__((noinline))
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
 
 struct test_args : TestSuite::ThreadArgs {
     LatencyCollector* lat;
@@ -158,12 +215,2203 @@ int latency_macro_test() {
     return 0;
 }
 
+int label_test() {
+    LatencyCollector lat;
+    lat.setMaxLabelSetsPerStat(2);
+
+    LatencyLabelId hit = lat.internLabels({{"status", "hit"}});
+    LatencyLabelId miss = lat.internLabels({{"status", "miss"}});
+    // Order of labels should not matter.
+    CHK_EQ( lat.internLabels({{"op", "get"}, {"status", "hit"}}),
+            lat.internLabels({{"status", "hit"}, {"op", "get"}}) );
+    CHK_NEQ(hit, miss);
+
+    for (size_t ii=0; ii<10; ++ii) {
+        lat.addLatency("get", 100, hit);
+    }
+    for (size_t ii=0; ii<5; ++ii) {
+        lat.addLatency("get", 1000, miss);
+    }
+    // Exceeds the per-stat cardinality limit.
+    lat.addLatency("get", 50, {{"status", "error"}});
+    lat.addLatency("get", 10);
+
+    {   collectBlockLatency(&lat, "block", {{"status", "hit"}});
+    }
+
+    // All samples are counted in the stat itself.
+    CHK_EQ(17, lat.getNumCalls("get"));
+
+    LatencyItem item = lat.getAggrItem("get");
+    CHK_EQ(10, item.filterByLabel(lat.getLabels(), "status=hit")
+                   .getNumCalls());
+    // Labeled samples only.
+    CHK_EQ(16, item.filterByLabel(lat.getLabels(), "").getNumCalls());
+    const Histogram* overflow =
+        item.getLabelHistogram(LatencyLabelRegistry::OVERFLOW_LABEL);
+    CHK_NONNULL(overflow);
+    CHK_EQ(1, overflow->getTotal());
+
+    LatencyDumpDefaultImpl default_dump;
+    TestSuite::Msg msg_stream;
+    LatencyCollectorDumpOptions opt;
+    opt.view_type = LatencyCollectorDumpOptions::FLAT;
+    opt.group_by_label = true;
+    msg_stream << lat.dump(&default_dump, opt) << std::endl;
+
+    opt.view_type = LatencyCollectorDumpOptions::TREE;
+    msg_stream << lat.dump(&default_dump, opt) << std::endl;
+
+    opt.label_filter = "status=miss";
+    opt.view_type = LatencyCollectorDumpOptions::FLAT;
+    std::string filtered = lat.dump(&default_dump, opt);
+    msg_stream << filtered << std::endl;
+    CHK_EQ(std::string::npos, filtered.find("status=hit"));
+
+    return 0;
+}
+
+int async_span_test() {
+    LatencyCollector lat;
+    std::vector<LatencySpan> spans;
+
+    {   collectBlockLatency(&lat, "issuer");
+        for (size_t ii=0; ii<4; ++ii) {
+            spans.push_back( LatencySpan(&lat, "rpc") );
+        }
+        // Cancelled span should not be recorded.
+        spans.push_back( LatencySpan(&lat, "rpc") );
+        spans.back().cancel();
+    }
+
+    // Finish them on another thread.
+    std::thread completer([&spans]() {
+        collectBlockLatency(nullptr, "completer");
+        TestSuite::sleep_ms(1);
+        for (LatencySpan& span: spans) span.finish();
+    });
+    completer.join();
+
+    for (LatencySpan& span: spans) {
+        CHK_FALSE(span.isActive());
+    }
+    CHK_EQ(4, lat.getNumCalls(" ## issuer ## rpc"));
+    CHK_GTEQ(lat.getMinLatency(" ## issuer ## rpc"), 1000);
+    CHK_EQ(1, lat.getNumCalls(" ## issuer"));
+
+    // Moved-from span does nothing.
+    {   LatencySpan span(&lat, "moved");
+        LatencySpan other = std::move(span);
+        CHK_FALSE(span.isActive());
+        CHK_TRUE(other.isActive());
+    }
+    CHK_EQ(1, lat.getNumCalls(" ## moved"));
+
+    // Once the stat exists, neither creating nor finishing a span
+    // allocates memory.
+    {   LatencySpan warm_up(&lat, "no_alloc");
+    }
+    size_t allocs_before = num_allocs;
+    for (size_t ii=0; ii<100; ++ii) {
+        LatencySpan span(&lat, "no_alloc");
+        span.finish();
+    }
+    CHK_EQ(allocs_before, num_allocs);
+    CHK_EQ(101, lat.getNumCalls(" ## no_alloc"));
+
+    LatencyDumpDefaultImpl default_dump;
+    TestSuite::Msg msg_stream;
+    msg_stream << lat.dump(&default_dump) << std::endl;
+
+    return 0;
+}
+
+template<typename C>
+void policy_test_func(C* lat) {
+    collectFuncLatency(lat);
+    collectBlockLatency(lat, "block", {{"status", "hit"}});
+}
+
+int policy_test() {
+    LatencyCollectorT<LatencySingleThreadPolicy> st_lat;
+    for (size_t ii=0; ii<10; ++ii) {
+        policy_test_func(&st_lat);
+        st_lat.addLatency("direct", 100 + ii);
+    }
+    CHK_EQ(10, st_lat.getNumCalls(" ## policy_test_func"));
+    CHK_EQ(10, st_lat.getNumCalls(" ## policy_test_func ## block"));
+    CHK_EQ(109, st_lat.getMaxLatency("direct"));
+    CHK_EQ(1045, st_lat.getTotalTime("direct"));
+
+    LatencyCollectorT<LatencyDisabledPolicy> dis_lat;
+    for (size_t ii=0; ii<10; ++ii) {
+        policy_test_func(&dis_lat);
+        dis_lat.addLatency("direct", 100 + ii);
+    }
+    CHK_EQ(0, dis_lat.getNumItems());
+    CHK_EQ(0, dis_lat.getNumCalls("direct"));
+    CHK_EQ(1, sizeof(LatencyCollectorT<LatencyDisabledPolicy>::Wrapper));
+
+    LatencyDumpDefaultImplT<Histogram> default_dump;
+    TestSuite::Msg msg_stream;
+    msg_stream << st_lat.dump(&default_dump) << std::endl;
+
+    return 0;
+}
+
+// Clock advancing by 1 ms at each call, for exact scope latencies.
+struct StepClock {
+    using duration = std::chrono::nanoseconds;
+    using rep = duration::rep;
+    using period = duration::period;
+    using time_point = std::chrono::time_point<StepClock>;
+    static const bool is_steady = true;
+    static const rep STEP_NS = 1000000;
+
+    static time_point now() {
+        static std::atomic<rep> ticks(0);
+        return time_point(duration(ticks.fetch_add(STEP_NS) + STEP_NS));
+    }
+};
+
+struct StepClockPolicy : public LatencyStandardPolicy {
+    using Clock = StepClock;
+};
+
+template<typename C>
+void overhead_outer(C* lat, size_t num_inner) {
+    collectFuncLatency(lat);
+    for (size_t ii=0; ii<num_inner; ++ii) {
+        collectBlockLatency(lat, "inner");
+    }
+}
+
+int self_overhead_test() {
+    const size_t NUM_INNER = 100;
+
+    // Calibrated when built.
+    LatencyCollector lat;
+    uint64_t scope_ns = lat.getScopeOverheadNs();
+    CHK_GT(scope_ns, 0);
+    CHK_OK(LatencyOverheadMode::NONE == lat.getOverheadMode());
+    overhead_outer(&lat, NUM_INNER);
+    // Not tracked by default.
+    CHK_EQ(0, lat.getOverheadNs(" ## overhead_outer"));
+
+    // Same policy, same cost.
+    LatencyCollector track_lat;
+    CHK_EQ(scope_ns, track_lat.getScopeOverheadNs());
+    track_lat.setOverheadMode(LatencyOverheadMode::TRACK);
+    overhead_outer(&track_lat, NUM_INNER);
+    CHK_EQ(NUM_INNER, track_lat.getNumCalls(" ## overhead_outer ## inner"));
+    // Each inner scope has its own cost only.
+    CHK_EQ( NUM_INNER * scope_ns,
+            track_lat.getOverheadNs(" ## overhead_outer ## inner") );
+    // The outer one includes the cost of all inner scopes.
+    CHK_EQ( (NUM_INNER + 1) * scope_ns,
+            track_lat.getOverheadNs(" ## overhead_outer") );
+
+    // Enabled inside a live scope: only the scopes after it are charged.
+    LatencyCollector lazy_lat;
+    {
+        collectBlockLatency(&lazy_lat, "live");
+        lazy_lat.setOverheadMode(LatencyOverheadMode::TRACK);
+        {
+            collectBlockLatency(&lazy_lat, "after");
+        }
+    }
+    scope_ns = lazy_lat.getScopeOverheadNs();
+    CHK_GT(scope_ns, 0);
+    CHK_EQ(2, (int)lazy_lat.getNumItems());
+    CHK_EQ(1, lazy_lat.getNumCalls(" ## live ## after"));
+    CHK_EQ(scope_ns * 2, lazy_lat.getOverheadNs(" ## live"));
+
+    LatencyCollector comp_lat;
+    comp_lat.setOverheadMode(LatencyOverheadMode::COMPENSATE);
+    CHK_OK(LatencyOverheadMode::COMPENSATE == comp_lat.getOverheadMode());
+    overhead_outer(&comp_lat, NUM_INNER);
+    CHK_EQ(1, comp_lat.getNumCalls(" ## overhead_outer"));
+    CHK_EQ(NUM_INNER, comp_lat.getNumCalls(" ## overhead_outer ## inner"));
+
+    LatencyCollectorT<StepClockPolicy> step_lat;
+    step_lat.setOverheadMode(LatencyOverheadMode::COMPENSATE);
+    scope_ns = step_lat.getScopeOverheadNs();
+    overhead_outer(&step_lat, NUM_INNER);
+    // Each inner scope takes a single step, with nothing to subtract.
+    CHK_EQ( NUM_INNER * StepClock::STEP_NS / 1000,
+            step_lat.getTotalTime(" ## overhead_outer ## inner") );
+    CHK_EQ( NUM_INNER * scope_ns,
+            step_lat.getOverheadNs(" ## overhead_outer ## inner") );
+    // The outer scope spans 2 steps per inner scope, and the cost of
+    // the inner scopes is subtracted only once.
+    uint64_t outer_ns = (2 * NUM_INNER + 1) * StepClock::STEP_NS;
+    CHK_EQ( (outer_ns - NUM_INNER * scope_ns) / 1000,
+            step_lat.getTotalTime(" ## overhead_outer") );
+    CHK_EQ(scope_ns, step_lat.getOverheadNs(" ## overhead_outer"));
+
+    LatencyCollectorDumpOptions opt;
+    opt.show_overhead = true;
+    LatencyDumpDefaultImpl default_dump;
+    TestSuite::Msg msg_stream;
+    msg_stream << track_lat.dump(&default_dump, opt) << std::endl;
+
+    return 0;
+}
+
+int health_test() {
+    LatencyCollector lat;
+    LatencyCollectorHealth health = lat.getHealth();
+    CHK_EQ(0, health.numItems);
+    CHK_EQ(1, health.numMapVersionsCreated);
+    CHK_EQ(1, health.numMapVersionsAlive);
+    CHK_EQ(0, health.numLatestMapRefs);
+
+    for (size_t ii=0; ii<10; ++ii) {
+        lat.addLatency("stat_" + std::to_string(ii), ii);
+    }
+    lat.addLatency("stat_0", 10, lat.internLabels({{"status", "ok"}}));
+    policy_test_func(&lat);
+
+    health = lat.getHealth();
+    CHK_EQ(12, health.numItems);
+    CHK_EQ(13, health.numMapVersionsCreated);
+    // Old versions are freed once no one refers to them.
+    CHK_EQ(1, health.numMapVersionsAlive);
+    CHK_EQ(0, health.numCasRetries);
+    CHK_EQ(0, health.numDroppedSamples);
+    // Two labeled stats have one more histogram each.
+    CHK_EQ(14 * Histogram().getMemoryUsage(), health.histogramBytes);
+    CHK_GT(health.itemBytes, health.histogramBytes);
+
+    // At least the tracker of this thread.
+    CHK_GTEQ(health.trackers.size(), 1);
+    bool found = false;
+    for (auto& entry: health.trackers) {
+        if (entry.maxDepth >= 2) found = true;
+        CHK_GT(entry.bufferBytes, 0);
+    }
+    CHK_OK(found);
+
+    LatencyCollectorDumpOptions opt;
+    opt.show_health = true;
+    LatencyDumpDefaultImpl default_dump;
+    lat.dump(&default_dump);
+    std::string dump_str = lat.dump(&default_dump, opt);
+    health = lat.getHealth();
+    CHK_EQ(2, health.numDumps);
+    CHK_GT(health.dumpTimeNs, 0);
+    CHK_OK(dump_str.find("# collector health") != std::string::npos);
+
+    TestSuite::Msg msg_stream;
+    msg_stream << dump_str << std::endl;
+
+    return 0;
+}
+
+int ddsketch_test() {
+    // Log-normal-like latencies from 100 us to a few seconds.
+    std::mt19937_64 rng(0);
+    std::lognormal_distribution<double> dist(8.0, 1.5);
+    const size_t NUM = 100000;
+    std::vector<uint64_t> values(NUM);
+    for (uint64_t& v: values) v = 100 + (uint64_t)dist(rng);
+
+    DDSketch whole, part_a, part_b;
+    for (size_t ii=0; ii<NUM; ++ii) {
+        whole.add(values[ii]);
+        if (ii % 2) part_a.add(values[ii]);
+        else part_b.addNonAtomic(values[ii]);
+    }
+    std::vector<uint64_t> sorted = values;
+    std::sort(sorted.begin(), sorted.end());
+
+    for (double pct: {1.0, 25.0, 50.0, 90.0, 99.0, 99.9, 99.99}) {
+        uint64_t exact = sorted[ (size_t)((NUM - 1) * pct / 100.0) ];
+        uint64_t est = whole.estimate(pct);
+        double err = std::abs((double)est - exact) / exact;
+        // Bin boundaries are subject to floating point errors.
+        CHK_SM(err, DDSketch::ALPHA * 1.01);
+    }
+    CHK_EQ(sorted.back(), whole.getMax());
+
+    // Merge is exact.
+    DDSketch merged(part_a);
+    merged += part_b;
+    CHK_EQ(whole.getTotal(), merged.getTotal());
+    CHK_EQ(whole.getSum(), merged.getSum());
+    CHK_EQ(whole.getMax(), merged.getMax());
+    auto w_itr = whole.begin();
+    auto m_itr = merged.begin();
+    for (; w_itr != whole.end(); ++w_itr, ++m_itr) {
+        CHK_EQ(w_itr.getIdx(), m_itr.getIdx());
+        CHK_EQ(w_itr.getCount(), m_itr.getCount());
+    }
+    CHK_OK(m_itr == merged.end());
+
+    // Only the pages in use are allocated.
+    DDSketch empty;
+    CHK_GT(whole.getMemoryUsage(), empty.getMemoryUsage());
+    CHK_EQ(0, empty.estimate(50));
+    empty.add(0);
+    CHK_EQ(0, empty.estimate(50));
+
+    // As a backend of the collector.
+    LatencyCollectorT<LatencyDDSketchPolicy> lat;
+    for (uint64_t v: values) lat.addLatency("sketch", v);
+    CHK_EQ(NUM, lat.getNumCalls("sketch"));
+    CHK_EQ(whole.estimate(99), lat.getPercentile("sketch", 99));
+    for (size_t ii=0; ii<10; ++ii) policy_test_func(&lat);
+
+    LatencyDumpDefaultImplT<DDSketch> default_dump;
+    TestSuite::Msg msg_stream;
+    msg_stream << lat.dump(&default_dump) << std::endl;
+
+    return 0;
+}
+
+/**
+ * Add the same lognormal samples to `hist` and `expected`, half of them
+ * by `addNonAtomic()`.
+ */
+template<typename HistT>
+void add_lognormal(HistT& hist, Histogram& expected, size_t num) {
+    std::mt19937_64 rng(0);
+    std::lognormal_distribution<double> dist(8.0, 1.5);
+    for (size_t ii=0; ii<num; ++ii) {
+        uint64_t v = 100 + (uint64_t)dist(rng);
+        expected.add(v);
+        if (ii % 2) hist.add(v);
+        else hist.addNonAtomic(v);
+    }
+}
+
+/**
+ * Check that `hist` has the same numbers, estimates, and bins as
+ * `expected`, and that its iterator keeps the bins of `begin()`.
+ * One more sample is added to both.
+ */
+template<typename HistT>
+int same_as_histogram_check(HistT& hist, Histogram& expected) {
+    CHK_EQ(expected.getTotal(), hist.getTotal());
+    CHK_EQ(expected.getSum(), hist.getSum());
+    CHK_EQ(expected.getMax(), hist.getMax());
+    for (double pct: {1.0, 25.0, 50.0, 90.0, 99.0, 99.9, 99.99}) {
+        CHK_EQ(expected.estimate(pct), hist.estimate(pct));
+    }
+    auto e_itr = expected.begin();
+    auto h_itr = hist.begin();
+    for (; e_itr != expected.end(); ++e_itr, ++h_itr) {
+        CHK_EQ(e_itr.getIdx(), h_itr.getIdx());
+        CHK_EQ(e_itr.getCount(), h_itr.getCount());
+        CHK_EQ(e_itr.getUpperBound(), h_itr.getUpperBound());
+    }
+    CHK_OK(h_itr == hist.end());
+
+    // Later updates are not visible to the iterator.
+    h_itr = hist.begin();
+    uint64_t first_count = h_itr.getCount();
+    hist.add(h_itr.getLowerBound());
+    CHK_EQ(first_count, h_itr.getCount());
+    CHK_EQ(first_count + 1, hist.begin().getCount());
+    expected.add(h_itr.getLowerBound());
+    return 0;
+}
+
+// CALLS column of the given stat in a default dump, empty if not found.
+static std::string dumped_calls(const std::string& dump,
+                                const std::string& stat_name) {
+    std::stringstream ss(dump);
+    std::string line;
+    size_t calls_end = std::string::npos;
+    while (std::getline(ss, line)) {
+        if (line.compare(0, 9, "STAT NAME") == 0) {
+            calls_end = line.find("CALLS") + 5;
+            continue;
+        }
+        size_t colon = line.find(':');
+        if (calls_end == std::string::npos || colon == std::string::npos) {
+            continue;
+        }
+        std::string name = line.substr(0, colon);
+        name.erase(name.find_last_not_of(' ') + 1);
+        if (name != stat_name) continue;
+        std::string calls = line.substr(calls_end - 6, 6);
+        return calls.substr(calls.find_first_not_of(' '));
+    }
+    return std::string();
+}
+
+/**
+ * Collect the same samples with `Policy` and with the default one:
+ * the stats and the dump should be the same, and scopes should work.
+ */
+template<typename Policy>
+int backend_policy_check() {
+    LatencyCollectorT<Policy> lat;
+    LatencyCollector std_lat;
+    std::mt19937_64 rng(1);
+    std::lognormal_distribution<double> dist(8.0, 1.5);
+    for (size_t ii=0; ii<1000; ++ii) {
+        uint64_t v = 100 + (uint64_t)dist(rng);
+        lat.addLatency("backend", v);
+        std_lat.addLatency("backend", v);
+    }
+    CHK_EQ(1000, lat.getNumCalls("backend"));
+    CHK_EQ(std_lat.getMaxLatency("backend"), lat.getMaxLatency("backend"));
+    CHK_EQ( std_lat.getPercentile("backend", 99),
+            lat.getPercentile("backend", 99) );
+    LatencyDumpDefaultImplT<typename Policy::Hist> policy_dump;
+    LatencyDumpDefaultImpl default_dump;
+    CHK_EQ(std_lat.dump(&default_dump), lat.dump(&policy_dump));
+
+    for (size_t ii=0; ii<10; ++ii) policy_test_func(&lat);
+    CHK_EQ(10, lat.getNumCalls(" ## policy_test_func"));
+    CHK_EQ(10, lat.getNumCalls(" ## policy_test_func ## block"));
+    std::string dump = lat.dump(&policy_dump);
+    CHK_EQ(std::string("1.0K"), dumped_calls(dump, "backend"));
+    CHK_EQ(std::string("10"), dumped_calls(dump, "policy_test_func"));
+    CHK_EQ(std::string("10"), dumped_calls(dump, "block"));
+
+    TestSuite::Msg msg_stream;
+    msg_stream << dump << std::endl;
+    return 0;
+}
+
+struct compact_args : TestSuite::ThreadArgs {
+    CompactHistogram* hist;
+    uint64_t shift;
+};
+
+int compact_worker(TestSuite::ThreadArgs* t_args) {
+    compact_args* args = static_cast<compact_args*>(t_args);
+    for (uint64_t ii=0; ii<10000; ++ii) {
+        // Each thread spreads to different bins, to race on window growth.
+        args->hist->add( ((ii % 16) + 1) << args->shift );
+    }
+    return 0;
+}
+
+int compact_histogram_test() {
+    // Same estimates as `Histogram`.
+    Histogram hist;
+    CompactHistogram compact;
+    CHK_OK(compact.isSparse());
+    compact.add(100);
+    compact.add(120);
+    CHK_OK(compact.isSparse());
+    CHK_EQ(2, compact.getTotal());
+    for (uint64_t v: {100, 120}) hist.add(v);
+    add_lognormal(compact, hist, 100000);
+    CHK_FALSE(compact.isSparse());
+    CHK_FALSE(compact.hasWideBins());
+    CHK_Z(same_as_histogram_check(compact, hist));
+    CHK_SM(compact.getMemoryUsage(), hist.getMemoryUsage() / 2);
+
+    // Copy and merge.
+    CompactHistogram copied(compact);
+    CHK_EQ(compact.estimate(99), copied.estimate(99));
+    copied += compact;
+    CHK_EQ(compact.getTotal() * 2, copied.getTotal());
+    CHK_EQ(compact.estimate(50), copied.estimate(50));
+
+    // 32-bit counters move to 64-bit ones at the limit.
+    CompactHistogram big;
+    std::vector<uint64_t> batch(1024, 1000);
+    big.addBatch(batch.data(), batch.size());
+    // 2^23 samples in a bin.
+    for (size_t ii=0; ii<13; ++ii) big += big;
+    CHK_FALSE(big.hasWideBins());
+    CompactHistogram sum;
+    sum.add(1000);
+    // More bins than the sparse slots.
+    for (size_t shift: {0, 8, 16, 24, 32}) sum.add((uint64_t)1 << shift);
+    CHK_FALSE(sum.isSparse());
+    for (size_t ii=0; ii<300; ++ii) sum += big;
+    CHK_OK(sum.hasWideBins());
+    uint64_t expected = 300 * big.getTotal() + 1;
+    CHK_EQ(expected + 5, sum.getTotal());
+    for (auto& itr: sum) {
+        if (itr.getUpperBound() == 1024) {
+            CHK_EQ(expected, itr.getCount());
+        }
+    }
+
+    // Concurrent updates growing the window.
+    const size_t NUM_THREADS = 4;
+    CompactHistogram shared;
+    std::vector<TestSuite::ThreadHolder> t_hdl(NUM_THREADS);
+    std::vector<compact_args> args(NUM_THREADS);
+    for (size_t ii=0; ii<NUM_THREADS; ++ii) {
+        args[ii].hist = &shared;
+        args[ii].shift = ii * 10;
+        t_hdl[ii].spawn(&args[ii], compact_worker, nullptr);
+    }
+    for (auto& entry: t_hdl) entry.join();
+    uint64_t total = 0;
+    for (auto& itr: shared) total += itr.getCount();
+    CHK_EQ(NUM_THREADS * 10000, total);
+    CHK_EQ(total, shared.getTotal());
+
+    // As a backend of the collector.
+    CHK_Z(backend_policy_check<LatencyCompactPolicy>());
+
+    return 0;
+}
+
+struct percpu_args : TestSuite::ThreadArgs {
+    PerCpuHistogram* hist;
+    LatencyCollectorT<LatencyPerCpuPolicy>* lat;
+    uint64_t base;
+};
+
+int percpu_worker(TestSuite::ThreadArgs* t_args) {
+    percpu_args* args = static_cast<percpu_args*>(t_args);
+    for (uint64_t ii=0; ii<100; ++ii) {
+        args->hist->add(args->base + ii);
+        args->lat->addLatency("percpu", args->base + ii);
+    }
+    return 0;
+}
+
+int percpu_histogram_test(int source_num) {
+    PerCpuHistogram::CpuSource source =
+        (PerCpuHistogram::CpuSource)source_num;
+    PerCpuHistogram::CpuSource orig = PerCpuHistogram::getSource();
+    PerCpuHistogram::CpuSource selected = PerCpuHistogram::setSource(source);
+    TestSuite::_msg("cpu source: %s (supported: %s), %zu cpus\n",
+                    PerCpuHistogram::getSourceName(selected),
+                    PerCpuHistogram::getSourceName
+                        ( PerCpuHistogram::getSupportedSource() ),
+                    PerCpuHistogram::getNumCpus());
+    if (source == PerCpuHistogram::THREAD_HASH) {
+        CHK_OK(selected == PerCpuHistogram::THREAD_HASH);
+    }
+    if (selected != PerCpuHistogram::THREAD_HASH) {
+        CHK_SM(PerCpuHistogram::getCurrentCpu(),
+               PerCpuHistogram::getNumCpus());
+    }
+
+    // Many short-lived threads: nothing is lost when they exit,
+    // and shards are bounded by the number of CPUs.
+    const size_t NUM_THREADS = 64;
+    PerCpuHistogram hist;
+    Histogram expected;
+    LatencyCollectorT<LatencyPerCpuPolicy> lat;
+    for (size_t ii=0; ii<NUM_THREADS; ++ii) {
+        percpu_args args;
+        args.hist = &hist;
+        args.lat = &lat;
+        args.base = ii * 1000;
+        TestSuite::ThreadHolder t_hdl(&args, percpu_worker, nullptr);
+        t_hdl.join();
+        for (uint64_t jj=0; jj<100; ++jj) expected.add(args.base + jj);
+    }
+    CHK_EQ(NUM_THREADS * 100, hist.getTotal());
+    CHK_EQ(expected.getSum(), hist.getSum());
+    CHK_EQ(expected.getMax(), hist.getMax());
+    CHK_GT(hist.getNumActiveShards(), 0);
+    CHK_SMEQ(hist.getNumActiveShards(), PerCpuHistogram::getNumCpus());
+    CHK_Z(same_as_histogram_check(hist, expected));
+
+    // Bins are inline in each shard.
+    CHK_SMEQ(hist.getMemoryUsage(),
+             sizeof(hist) + PerCpuHistogram::getNumCpus() * 1024);
+
+    // Batch is the same as adding one by one.
+    PerCpuHistogram batched;
+    std::vector<uint64_t> vals;
+    for (uint64_t ii=0; ii<1000; ++ii) vals.push_back(ii * 37);
+    batched.addBatch(vals.data(), vals.size());
+    Histogram batched_expected;
+    for (uint64_t val: vals) batched_expected.add(val);
+    CHK_EQ(batched_expected.getTotal(), batched.getTotal());
+    CHK_EQ(batched_expected.getMax(), batched.getMax());
+    CHK_EQ(batched_expected.estimate(99), batched.estimate(99));
+
+    // Copy merges the shards.
+    PerCpuHistogram copied(hist);
+    CHK_EQ(1, copied.getNumActiveShards());
+    CHK_EQ(hist.estimate(99), copied.estimate(99));
+    copied += hist;
+    CHK_EQ(hist.getTotal() * 2, copied.getTotal());
+
+    // As a backend of the collector.
+    CHK_EQ(NUM_THREADS * 100, lat.getNumCalls("percpu"));
+    CHK_EQ(expected.estimate(99), lat.getPercentile("percpu", 99));
+    CHK_Z(backend_policy_check<LatencyPerCpuPolicy>());
+
+    PerCpuHistogram::setSource(orig);
+    return 0;
+}
+
+int numa_histogram_test() {
+    std::vector<size_t> list = LatencyNumaAllocator::parseList("0-2,5,7-8\n");
+    CHK_EQ(6, list.size());
+    CHK_EQ(2, list[2]);
+    CHK_EQ(8, list[5]);
+
+    // Same estimates as `Histogram`.
+    Histogram hist;
+    NumaHistogram numa;
+    add_lognormal(numa, hist, 10000);
+    CHK_Z(same_as_histogram_check(numa, hist));
+
+    LatencyNumaAllocator& def_alloc = LatencyNumaAllocator::getDefault();
+    size_t cur_node = def_alloc.getCurrentNode();
+    TestSuite::_msg("%zu nodes, current node %zu (bound: %s)\n",
+                    def_alloc.getNumNodes(), cur_node,
+                    def_alloc.isBound(cur_node) ? "yes" : "no");
+    CHK_GT(def_alloc.getNumNodes(), 0);
+    CHK_EQ(numa.getTotal(), numa.getNodeTotal(cur_node));
+
+    // Two nodes, and all actual CPUs are on node 1. Node 1 does not exist
+    // here, so `mbind` fails and the memory is used as is.
+    std::vector<uint32_t> cpu_to_node(PerCpuHistogram::getNumCpus(), 1);
+    // Non-existing CPU on node 0.
+    cpu_to_node.push_back(0);
+    LatencyNumaAllocator fake_alloc(cpu_to_node);
+    CHK_EQ(2, fake_alloc.getNumNodes());
+    {
+        NumaHistogram remote(&fake_alloc);
+        size_t node = fake_alloc.getCurrentNode();
+        for (uint64_t v: {10, 20, 30}) remote.add(v);
+        CHK_EQ(1, remote.getNumActiveShards());
+        CHK_EQ(3, remote.getNodeTotal(node));
+        CHK_EQ(0, remote.getNodeTotal(1 - node));
+        CHK_EQ(30, remote.getMax());
+
+        // Merged on copy.
+        NumaHistogram copied(remote);
+        copied += remote;
+        CHK_EQ(6, copied.getTotal());
+        CHK_EQ(1, copied.getNumActiveShards());
+    }
+
+    // Blocks are reused.
+    size_t mapped = fake_alloc.getMappedBytes();
+    for (size_t ii=0; ii<100; ++ii) {
+        NumaHistogram tmp(&fake_alloc);
+        tmp.add(ii);
+    }
+    CHK_EQ(mapped, fake_alloc.getMappedBytes());
+
+    // Out of node memory: shards fall back to the heap, nothing is lost.
+    uint64_t num_fallbacks = NumaHistogram::getNumFallbackShards();
+    {
+        LatencyNumaAllocator small_alloc(cpu_to_node);
+        small_alloc.setMemoryLimit(LatencyNumaAllocator::CHUNK_SIZE);
+        const size_t NUM_HISTS = 200;
+        std::vector< std::unique_ptr<NumaHistogram> > hists;
+        for (size_t ii=0; ii<NUM_HISTS; ++ii) {
+            hists.emplace_back(new NumaHistogram(&small_alloc));
+            hists.back()->add(ii);
+            hists.back()->add(ii + 1);
+        }
+        CHK_EQ(LatencyNumaAllocator::CHUNK_SIZE,
+               small_alloc.getMappedBytes());
+        for (size_t ii=0; ii<NUM_HISTS; ++ii) {
+            CHK_EQ(2, hists[ii]->getTotal());
+            CHK_EQ(ii + 1, hists[ii]->getMax());
+        }
+        CHK_GT(NumaHistogram::getNumFallbackShards(), num_fallbacks);
+    }
+
+    // As a backend of the collector.
+    LatencyCollectorT<LatencyNumaPolicy> lat;
+    CHK_EQ(NumaHistogram::getNumFallbackShards(),
+           lat.getHealth().numNumaFallbackShards);
+    CHK_Z(backend_policy_check<LatencyNumaPolicy>());
+
+    return 0;
+}
+
+struct exemplar_args : TestSuite::ThreadArgs {
+    LatencyCollector* lat;
+    uint64_t base;
+};
+
+int exemplar_worker(TestSuite::ThreadArgs* t_args) {
+    exemplar_args* args = static_cast<exemplar_args*>(t_args);
+    for (uint64_t ii=0; ii<1000; ++ii) {
+        uint64_t val = args->base + ii * 4;
+        args->lat->addLatency("mt", val, LatencyLabelRegistry::NO_LABEL, val);
+    }
+    return 0;
+}
+
+void exemplar_scope(LatencyCollector* lat, uint64_t tag) {
+    collectFuncLatency(lat);
+    LCW__func_latency__.setExemplarTag(tag);
+    TestSuite::sleep_ms(1);
+}
+
+int exemplar_test() {
+    LatencyCollector lat;
+    // Disabled by default.
+    lat.addLatency("off", 100);
+    CHK_EQ(0, lat.getExemplars("off").size());
+
+    lat.setMaxExemplarsPerStat(3);
+    for (uint64_t ii=1; ii<=100; ++ii) {
+        lat.addLatency("stat", ii, LatencyLabelRegistry::NO_LABEL, ii * 10);
+    }
+    lat.addLatency("stat", 50);
+
+    std::vector<LatencyExemplar> exemplars = lat.getExemplars("stat");
+    CHK_EQ(3, exemplars.size());
+    for (size_t ii=0; ii<3; ++ii) {
+        CHK_EQ(100 - ii, exemplars[ii].latency);
+        CHK_EQ((100 - ii) * 10, exemplars[ii].tag);
+        CHK_EQ(latencyThreadId(), exemplars[ii].threadId);
+        CHK_GT(exemplars[ii].timestamp, (uint64_t)0);
+    }
+
+    // Samples from multiple threads: the slowest ones overall.
+    const size_t NUM_THREADS = 4;
+    std::vector<TestSuite::ThreadHolder> t_hdl(NUM_THREADS);
+    std::vector<exemplar_args> args(NUM_THREADS);
+    for (size_t ii=0; ii<NUM_THREADS; ++ii) {
+        args[ii].lat = &lat;
+        args[ii].base = ii;
+        t_hdl[ii].spawn(&args[ii], exemplar_worker, nullptr);
+    }
+    for (size_t ii=0; ii<NUM_THREADS; ++ii) t_hdl[ii].join();
+
+    exemplars = lat.getExemplars("mt");
+    CHK_EQ(3, exemplars.size());
+    for (size_t ii=0; ii<3; ++ii) {
+        // 3999, 3998, 3997: from 3 different threads.
+        CHK_EQ(3999 - ii, exemplars[ii].latency);
+        CHK_EQ(3999 - ii, exemplars[ii].tag);
+        CHK_NEQ(latencyThreadId(), exemplars[ii].threadId);
+    }
+    CHK_NEQ(exemplars[0].threadId, exemplars[1].threadId);
+
+    // Scopes.
+    for (uint64_t ii=1; ii<=5; ++ii) exemplar_scope(&lat, ii);
+    exemplars = lat.getExemplars(" ## exemplar_scope");
+    CHK_EQ(3, exemplars.size());
+    CHK_GT(exemplars[0].tag, 0);
+
+    LatencyCollectorDumpOptions opt;
+    opt.show_exemplars = true;
+    LatencyDumpDefaultImpl default_dump;
+    std::string text = lat.dump(&default_dump, opt);
+    CHK_OK(text.find("tag 1000") != std::string::npos);
+
+    LatencyDumpJsonImpl json_dump;
+    std::string json = lat.dump(&json_dump);
+    CHK_OK(json.find("\"tag\": 1000}") != std::string::npos);
+    CHK_OK(json.find("\"children\"") == std::string::npos);
+
+    LatencyCollector tree_lat;
+    policy_test_func(&tree_lat);
+    std::string json_tree = tree_lat.dump(&json_dump);
+    CHK_OK(json_tree.find("\"children\": [{\"name\": \"block\"")
+           != std::string::npos);
+
+    TestSuite::Msg msg_stream;
+    msg_stream << text << std::endl << json << std::endl
+               << json_tree << std::endl;
+
+    return 0;
+}
+
+void slow_scope_func(LatencyCollector* lat, size_t sleep_ms) {
+    collectFuncLatency(lat);
+    LCW__func_latency__.setExemplarTag(sleep_ms);
+    if (sleep_ms) TestSuite::sleep_ms(sleep_ms);
+}
+
+int slow_scope_test() {
+    LatencyCollector lat;
+    std::mutex events_lock;
+    std::vector<LatencySlowScopeEvent> events;
+    std::atomic<bool> other_thread(true);
+    std::thread::id this_thread = std::this_thread::get_id();
+    auto callback = [&](const LatencySlowScopeEvent& event) {
+        if (std::this_thread::get_id() == this_thread) other_thread = false;
+        std::lock_guard<std::mutex> l(events_lock);
+        events.push_back(event);
+    };
+
+    // Exact name, no rate limit.
+    CHK_OK(lat.addSlowScopeCallback(" ## slow_scope_func", 500, callback, 0));
+    for (size_t ii=0; ii<3; ++ii) slow_scope_func(&lat, 2);
+    for (size_t ii=0; ii<10; ++ii) slow_scope_func(&lat, 0);
+    lat.getSlowScopeNotifier().flush();
+    CHK_EQ(3, events.size());
+    CHK_OK(other_thread.load());
+    CHK_EQ(std::string(" ## slow_scope_func"), events[0].statName);
+    CHK_EQ(500, events[0].threshold);
+    CHK_EQ(2, events[0].tag);
+    CHK_GT(events[0].latency, 500);
+
+    // Rule added after the stat.
+    lat.addLatency("late", 100);
+    CHK_OK(lat.addSlowScopeCallback("late", 50, callback, 0));
+    lat.addLatency("late", 100);
+    lat.addLatency("late", 10);
+    lat.getSlowScopeNotifier().flush();
+    CHK_EQ(4, events.size());
+    CHK_EQ(std::string("late"), events[3].statName);
+
+    // Prefix with rate limit: 1/sec, burst 5.
+    events.clear();
+    CHK_OK(lat.addSlowScopeCallback(" ## storm*", 10, callback, 1, 5));
+    for (size_t ii=0; ii<1000; ++ii) {
+        lat.addLatency(" ## storm ## " + std::to_string(ii % 4), 100);
+    }
+    lat.addLatency(" ## calm", 100);
+    lat.getSlowScopeNotifier().flush();
+    CHK_EQ(5, events.size());
+    CHK_EQ(995, lat.getSlowScopeNotifier().getNumSuppressed());
+    CHK_EQ(9, lat.getSlowScopeNotifier().getNumDelivered());
+
+    // Stopped: suppressed until a new rule restarts the dispatcher.
+    lat.getSlowScopeNotifier().stop();
+    lat.addLatency("late", 100);
+    CHK_EQ(5, events.size());
+    CHK_OK(lat.addSlowScopeCallback("restarted", 50, callback, 0));
+    lat.addLatency("late", 100);
+    lat.addLatency("restarted", 100);
+    lat.getSlowScopeNotifier().flush();
+    CHK_EQ(7, events.size());
+    CHK_EQ(std::string("restarted"), events[6].statName);
+
+    return 0;
+}
+
+int histogram_simd_test() {
+    std::mt19937_64 rng(0);
+    HistogramSimd::Isa supported = HistogramSimd::getSupportedIsa();
+    TestSuite::_msg("supported: %s\n", HistogramSimd::getIsaName(supported));
+
+    // Reference: merged by `Histogram`.
+    const size_t NUM_HISTS = 50;
+    std::vector<Histogram> hists(NUM_HISTS);
+    Histogram expected;
+    for (Histogram& hist: hists) {
+        for (size_t ii=0; ii<1000; ++ii) {
+            // Wide range, including 0 and huge numbers.
+            hist.add( (rng() % 10) ? (rng() >> (rng() % 64)) : 0 );
+        }
+        expected += hist;
+    }
+
+    for (HistogramSimd::Isa isa: { HistogramSimd::SCALAR,
+                                   HistogramSimd::SSE2,
+                                   HistogramSimd::AVX2 }) {
+        if (HistogramSimd::setIsa(isa) != isa) continue;
+
+        // Kernels, for all lengths including the remainders.
+        for (size_t len=0; len<=70; ++len) {
+            std::vector<uint64_t> dst(len), src(len), cdf(len);
+            uint64_t sum = 0;
+            for (size_t ii=0; ii<len; ++ii) {
+                dst[ii] = rng() >> 8;
+                src[ii] = rng() >> 8;
+            }
+            std::vector<uint64_t> merged = dst;
+            HistogramSimd::merge(merged.data(), src.data(), len);
+            HistogramSimd::prefixSum(cdf.data(), src.data(), len);
+            for (size_t ii=0; ii<len; ++ii) {
+                CHK_EQ(dst[ii] + src[ii], merged[ii]);
+                sum += src[ii];
+                CHK_EQ(sum, cdf[ii]);
+            }
+            for (size_t ii=0; ii<len; ++ii) {
+                uint64_t val = cdf[ii];
+                size_t exp_idx = std::lower_bound(cdf.begin(), cdf.end(), val)
+                                 - cdf.begin();
+                CHK_EQ(exp_idx, HistogramSimd::lowerBound(cdf.data(), len, val));
+            }
+            CHK_EQ(len, HistogramSimd::lowerBound(cdf.data(), len, sum + 1));
+        }
+
+        HistogramSnapshot snap;
+        for (Histogram& hist: hists) snap += hist;
+        CHK_EQ(expected.getTotal(), snap.getTotal());
+        CHK_EQ(expected.getSum(), snap.getSum());
+        CHK_EQ(expected.getMax(), snap.getMax());
+        for (auto& entry: expected) {
+            CHK_EQ(entry.getCount(), snap.getBinCount(entry.getIdx()));
+        }
+        const double PCTS[] = {0.1, 1.0, 25.0, 50.0, 90.0, 99.0, 99.9, 99.99};
+        const size_t NUM_PCTS = sizeof(PCTS) / sizeof(PCTS[0]);
+        uint64_t multi[NUM_PCTS];
+        expected.estimate(PCTS, multi, NUM_PCTS);
+        for (size_t ii=0; ii<NUM_PCTS; ++ii) {
+            // Direct scan over the bins.
+            uint64_t exp_value = expected.estimate(PCTS[ii]);
+            CHK_EQ(exp_value, snap.estimate(PCTS[ii]));
+            CHK_EQ(exp_value, multi[ii]);
+        }
+
+        // Snapshot + snapshot.
+        HistogramSnapshot half_a(hists[0]), half_b(hists[1]);
+        half_a += half_b;
+        Histogram exp_half = hists[0] + hists[1];
+        CHK_EQ(exp_half.estimate(99), half_a.estimate(99));
+
+        // Sharded histograms merge their shards into a snapshot.
+        PerCpuHistogram percpu;
+        NumaHistogram numa;
+        CompactHistogram compact;
+        for (auto& entry: hists[0]) {
+            uint64_t val = entry.getLowerBound();
+            for (size_t ii=0; ii<entry.getCount(); ++ii) {
+                percpu.add(val);
+                numa.add(val);
+                compact.add(val);
+            }
+        }
+        uint64_t exp_multi[NUM_PCTS];
+        Histogram exp_hist;
+        for (auto& entry: hists[0]) {
+            for (size_t ii=0; ii<entry.getCount(); ++ii) {
+                exp_hist.add(entry.getLowerBound());
+            }
+        }
+        exp_hist.estimate(PCTS, exp_multi, NUM_PCTS);
+        uint64_t percpu_multi[NUM_PCTS], numa_multi[NUM_PCTS];
+        uint64_t compact_multi[NUM_PCTS];
+        percpu.estimate(PCTS, percpu_multi, NUM_PCTS);
+        numa.estimate(PCTS, numa_multi, NUM_PCTS);
+        compact.estimate(PCTS, compact_multi, NUM_PCTS);
+        for (size_t ii=0; ii<NUM_PCTS; ++ii) {
+            CHK_EQ(exp_multi[ii], percpu_multi[ii]);
+            CHK_EQ(exp_multi[ii], numa_multi[ii]);
+            CHK_EQ(exp_multi[ii], compact_multi[ii]);
+            CHK_EQ(exp_multi[ii], percpu.estimate(PCTS[ii]));
+        }
+    }
+    HistogramSimd::setIsa(supported);
+    return 0;
+}
+
+int batch_test() {
+    std::mt19937_64 rng(0);
+    std::vector<uint64_t> values(5000);
+    for (uint64_t& v: values) v = (rng() % 100) ? rng() % 100000 : 0;
+
+    LatencyCollector lat;
+    lat.setMaxExemplarsPerStat(4);
+    LatencyLabelId label = lat.internLabels({{"op", "read"}});
+    for (uint64_t v: values) lat.addLatency("single", v, label);
+
+    // By handle, in a few chunks.
+    LatencyCollector::Item* item = lat.getItem("batch");
+    CHK_NONNULL(item);
+    lat.addLatencyBatch(item, values.data(), 1000, label);
+    lat.addLatencyBatch(item, values.data() + 1000, 4000, label);
+    lat.addLatencyBatch(item, values.data(), 0, label);
+
+    // Name/value pairs of different stats.
+    std::vector< std::pair<std::string, uint64_t> > pairs;
+    for (size_t ii=0; ii<values.size(); ++ii) {
+        pairs.push_back( std::make_pair( (ii / 7) % 2 ? "pair_a" : "pair_b",
+                                         values[ii] ) );
+    }
+    lat.addLatencyBatch(pairs);
+
+    LatencyCollector::Item single = lat.getAggrItem("single");
+    LatencyCollector::Item batch = lat.getAggrItem("batch");
+    LatencyCollector::Item pair_ab = lat.getAggrItem("pair_a") +
+                                     lat.getAggrItem("pair_b");
+    for (LatencyCollector::Item* cur: {&batch, &pair_ab}) {
+        CHK_EQ(single.getNumCalls(), cur->getNumCalls());
+        CHK_EQ(single.getTotalTime(), cur->getTotalTime());
+        CHK_EQ(single.getMaxLatency(), cur->getMaxLatency());
+        for (double pct: {1.0, 50.0, 99.0, 99.9}) {
+            CHK_EQ(single.getPercentile(pct), cur->getPercentile(pct));
+        }
+    }
+    CHK_EQ(single.getLabelHistogram(label)->getTotal(),
+           batch.getLabelHistogram(label)->getTotal());
+
+    // Exemplars see all the samples.
+    std::vector<LatencyExemplar> ex = batch.getExemplars();
+    CHK_EQ(4, ex.size());
+    CHK_EQ(single.getMaxLatency(), ex[0].latency);
+
+    // Slow scope rules apply to each sample.
+    std::atomic<size_t> num_events(0);
+    CHK_OK( lat.addSlowScopeCallback
+            ( "batch", 99990,
+              [&](const LatencySlowScopeEvent&) { num_events++; }, 0 ) );
+    lat.addLatencyBatch(item, values.data(), values.size());
+    lat.getSlowScopeNotifier().flush();
+    size_t exp_events = 0;
+    for (uint64_t v: values) exp_events += (v > 99990) ? 1 : 0;
+    CHK_EQ(exp_events, num_events.load());
+
+    return 0;
+}
+
+int aggregate_index_test() {
+    LatencyCollector lat;
+    lat.addLatency(" ## a", 1);
+    lat.addLatency(" ## a ## b", 10);
+    lat.addLatency(" ## a ## b ## c", 100);
+    lat.addLatency(" ## ab", 1000);
+    lat.addLatency(" ## x ## b", 10000);
+    lat.addLatency("b", 100000);
+
+    // By leaf function.
+    LatencyCollector::Item by_leaf = lat.getAggrItem("b");
+    CHK_EQ(3, by_leaf.getNumCalls());
+    CHK_EQ(110010, by_leaf.getTotalTime());
+    CHK_EQ(1, lat.getAggrItem("ab").getNumCalls());
+    CHK_EQ(0, lat.getAggrItem("not_exist").getNumCalls());
+
+    // By subtree.
+    LatencyCollector::Item subtree = lat.getSubtreeAggrItem(" ## a");
+    CHK_EQ(std::string(" ## a"), subtree.getName());
+    CHK_EQ(3, subtree.getNumCalls());
+    CHK_EQ(111, subtree.getTotalTime());
+    CHK_EQ(2, lat.getSubtreeAggrItem(" ## a ## b").getNumCalls());
+    CHK_EQ(0, lat.getSubtreeAggrItem(" ## a ## ").getNumCalls());
+    CHK_EQ(0, lat.getSubtreeAggrItem(" ## z").getNumCalls());
+
+    // Indexes follow the stats added later.
+    lat.addLatency(" ## a ## d ## b", 1000000);
+    CHK_EQ(4, lat.getAggrItem("b").getNumCalls());
+    CHK_EQ(4, lat.getSubtreeAggrItem(" ## a").getNumCalls());
+
+    return 0;
+}
+
+int call_path_test() {
+    LatencyCollector::Item plain("plain");
+    CHK_EQ(0, plain.getNumStacks());
+    CHK_OK(plain.getLeafView() == LatencyStringView("plain"));
+    CHK_OK(plain.getParentPathView().empty());
+
+    LatencyCollector::Item deep(" ## a ## bb ## ccc");
+    CHK_EQ(3, deep.getNumStacks());
+    CHK_OK(deep.getLeafView() == LatencyStringView("ccc"));
+    CHK_OK(deep.getParentPathView() == LatencyStringView(" ## a ## bb"));
+    CHK_EQ(std::string("ccc"), deep.getActualFunction());
+
+    // Re-parsed on rename.
+    deep.setName(" ## x");
+    CHK_EQ(1, deep.getNumStacks());
+    CHK_OK(deep.getLeafView() == LatencyStringView("x"));
+    CHK_OK(deep.getParentPathView().empty());
+
+    // Parent links, regardless of the order of registration:
+    // callees are usually registered first as their scopes end first.
+    LatencyCollector lat;
+    LatencyCollector::Item* c = lat.getItem(" ## a ## b ## c");
+    LatencyCollector::Item* b = lat.getItem(" ## a ## b");
+    LatencyCollector::Item* a = lat.getItem(" ## a");
+    LatencyCollector::Item* d = lat.getItem(" ## a ## d");
+    LatencyCollector::Item* ab = lat.getItem(" ## ab");
+    CHK_OK(c->getParent() == b);
+    CHK_OK(b->getParent() == a);
+    CHK_OK(d->getParent() == a);
+    CHK_NULL(a->getParent());
+    CHK_NULL(ab->getParent());
+
+    // Copies are not linked.
+    LatencyCollector::Item copied(*c);
+    CHK_NULL(copied.getParent());
+    CHK_EQ(3, copied.getNumStacks());
+
+    return 0;
+}
+
+struct eviction_args : TestSuite::ThreadArgs {
+    LatencyCollector* lat;
+    std::atomic<bool>* stop;
+    size_t tid;
+};
+
+int eviction_worker(TestSuite::ThreadArgs* t_args) {
+    eviction_args* args = static_cast<eviction_args*>(t_args);
+    size_t count = 0;
+    while (!args->stop->load()) {
+        // Rotating names, so that some of them become idle.
+        std::string name = "rotating_" + std::to_string(args->tid) + "_" +
+                           std::to_string( (count++ / 100) % 50 );
+        args->lat->addLatency(name, count);
+        LatencySpan span(args->lat, "span_" + std::to_string(count % 10));
+    }
+    return 0;
+}
+
+int memory_bound_test() {
+    // Cap.
+    {
+        LatencyCollector lat;
+        lat.setMaxStats(3);
+        lat.addLatency("a", 1);
+        lat.addLatency("b", 1);
+        lat.addLatency("c", 1);
+        lat.addLatency("d", 10);
+        lat.addLatency("e", 20);
+        lat.addLatency("a", 1);
+        CHK_EQ(2, lat.getNumCalls("a"));
+        CHK_EQ(0, lat.getNumCalls("d"));
+        CHK_EQ(2, lat.getNumCalls(LatencyCollector::OVERFLOW_STAT_NAME));
+        CHK_EQ(30, lat.getTotalTime(LatencyCollector::OVERFLOW_STAT_NAME));
+        CHK_EQ(4, lat.getNumItems());
+        CHK_EQ(2, lat.getHealth().numOverflowLookups);
+
+        // Nested scopes as well.
+        {
+            collectBlockLatency(&lat, "scope_beyond_cap");
+        }
+        CHK_EQ(3, lat.getNumCalls(LatencyCollector::OVERFLOW_STAT_NAME));
+    }
+
+    // Idle stat eviction.
+    {
+        LatencyCollector lat;
+        lat.setIdleStatTimeout(20);
+        lat.addLatency("active", 1);
+        lat.addLatency("idle", 1);
+        LatencyCollector::Item* pinned = lat.getItem("pinned");
+        pinned->addLatency(1);
+        LatencySpan span(&lat, "span");
+
+        // The first check only starts tracking.
+        CHK_EQ(0, lat.evictIdleStats());
+        TestSuite::sleep_ms(30);
+        lat.addLatency("active", 1);
+        CHK_EQ(1, lat.evictIdleStats());
+        CHK_EQ(0, lat.getNumCalls("idle"));
+        CHK_EQ(2, lat.getNumCalls("active"));
+        CHK_EQ(0, lat.getAggrItem("idle").getNumCalls());
+
+        // Evicted stat starts from scratch.
+        lat.addLatency("idle", 5);
+        CHK_EQ(1, lat.getNumCalls("idle"));
+
+        // `getItem()` and spans pin their stats.
+        lat.evictIdleStats();
+        TestSuite::sleep_ms(30);
+        CHK_EQ(2, lat.evictIdleStats()); // "active" and "idle".
+        pinned->addLatency(1);
+        CHK_EQ(2, lat.getNumCalls("pinned"));
+        span.finish();
+        CHK_EQ(1, lat.getNumCalls(" ## span"));
+
+        // Now the span is done.
+        lat.evictIdleStats();
+        TestSuite::sleep_ms(30);
+        CHK_EQ(1, lat.evictIdleStats());
+        CHK_EQ(0, lat.getNumCalls(" ## span"));
+        CHK_EQ(1, lat.getNumItems());
+        CHK_EQ(4, lat.getHealth().numEvictedStats);
+    }
+
+    // Eviction under concurrent updates.
+    {
+        LatencyCollector lat;
+        lat.setIdleStatTimeout(1);
+        std::atomic<bool> stop(false);
+        const size_t NUM_THREADS = 4;
+        std::vector<TestSuite::ThreadHolder> t_hdl(NUM_THREADS);
+        std::vector<eviction_args> args(NUM_THREADS);
+        for (size_t ii=0; ii<NUM_THREADS; ++ii) {
+            args[ii].lat = &lat;
+            args[ii].stop = &stop;
+            args[ii].tid = ii;
+            t_hdl[ii].spawn(&args[ii], eviction_worker, nullptr);
+        }
+        TestSuite::Timer timer(300);
+        size_t num_evicted = 0;
+        while (!timer.timeout()) {
+            num_evicted += lat.evictIdleStats();
+            lat.getAggrItem("span_0");
+            TestSuite::sleep_ms(1);
+        }
+        stop = true;
+        for (auto& entry: t_hdl) entry.join();
+        TestSuite::_msg("%zu stats evicted\n", num_evicted);
+        CHK_GT(num_evicted, 0);
+        CHK_EQ(1, lat.getHealth().numMapVersionsAlive);
+    }
+    return 0;
+}
+
+struct thread_buffer_args : TestSuite::ThreadArgs {
+    LatencyCollector* lat;
+    size_t numSamples;
+    size_t numNames;
+};
+
+int thread_buffer_worker(TestSuite::ThreadArgs* t_args) {
+    thread_buffer_args* args = static_cast<thread_buffer_args*>(t_args);
+    for (size_t ii=0; ii<args->numSamples; ++ii) {
+        args->lat->addLatency( "buffered_" +
+                               std::to_string(ii % args->numNames), ii );
+    }
+    // Scope, so that the tracker is used as well.
+    collectBlockLatency(args->lat, "worker");
+    return 0;
+}
+
+int thread_lifecycle_test() {
+    LatencyCollector lat;
+    lat.setThreadBufferSize(64);
+
+    // Short-lived threads: pending samples are flushed at exit.
+    const size_t NUM_THREADS = 50;
+    for (size_t ii=0; ii<NUM_THREADS; ++ii) {
+        thread_buffer_args args;
+        args.lat = &lat;
+        args.numSamples = 10;
+        args.numNames = 2;
+        TestSuite::ThreadHolder t_hdl(&args, thread_buffer_worker, nullptr);
+        t_hdl.join();
+    }
+    CHK_EQ(NUM_THREADS * 5, lat.getNumCalls("buffered_0"));
+    CHK_EQ(NUM_THREADS * 5, lat.getNumCalls("buffered_1"));
+    CHK_EQ(NUM_THREADS, lat.getNumCalls(" ## worker"));
+    LatencyCollectorHealth health = lat.getHealth();
+    CHK_EQ(0, health.numThreadBuffers);
+    // Trackers of exited threads are reused.
+    CHK_GT(health.numPooledTrackerBuffers, 0);
+    CHK_GTEQ(health.numReusedTrackerBuffers, NUM_THREADS - 1);
+
+    // Reading stats flushes the buffer of live threads.
+    for (size_t ii=0; ii<10; ++ii) lat.addLatency("main_buffered", ii);
+    CHK_EQ(1, lat.getHealth().numThreadBuffers);
+    CHK_EQ(10, lat.getNumCalls("main_buffered"));
+    CHK_EQ(9, lat.getMaxLatency("main_buffered"));
+
+    // Full buffer is flushed by the thread itself.
+    LatencyCollector::Item* full = lat.getItem("full");
+    for (size_t ii=0; ii<63; ++ii) lat.addLatency("full", ii);
+    CHK_EQ(0, full->getNumCalls());
+    lat.addLatency("full", 63);
+    CHK_EQ(64, full->getNumCalls());
+
+    // Labels and tags bypass the buffer.
+    LatencyLabelId label = lat.internLabels({{"op", "get"}});
+    lat.addLatency("labeled", 100, label);
+    lat.setThreadBufferSize(0);
+    lat.addLatency("unbuffered", 1);
+    CHK_EQ(1, lat.getNumCalls("labeled"));
+    CHK_EQ(1, lat.getNumCalls("unbuffered"));
+
+    // Exemplars and slow scope events keep the recording thread, even if
+    // the other samples of the thread are flushed by a reader.
+    {
+        LatencyCollector ex_lat;
+        ex_lat.setThreadBufferSize(1000);
+        ex_lat.setMaxExemplarsPerStat(2);
+        std::mutex events_lock;
+        std::vector<LatencySlowScopeEvent> events;
+        CHK_OK( ex_lat.addSlowScopeCallback
+                ( "notable", 500,
+                  [&](const LatencySlowScopeEvent& event) {
+                      std::lock_guard<std::mutex> l(events_lock);
+                      events.push_back(event);
+                  }, 0 ) );
+        std::atomic<uint32_t> worker_id(0);
+        std::atomic<bool> done(false);
+        std::thread worker([&]() {
+            // Only the first two are exemplars at the time.
+            for (uint64_t ii=100; ii>0; --ii) ex_lat.addLatency("notable", ii);
+            ex_lat.addLatency("notable", 1000);
+            worker_id = latencyThreadId();
+            while (!done) std::this_thread::yield();
+        });
+        while (!worker_id) std::this_thread::yield();
+
+        // Flushed by this thread, while the worker is alive.
+        uint64_t num_calls = ex_lat.getNumCalls("notable");
+        std::vector<LatencyExemplar> ex = ex_lat.getExemplars("notable");
+        done = true;
+        worker.join();
+
+        CHK_EQ(101, num_calls);
+        CHK_EQ(2, ex.size());
+        for (const LatencyExemplar& sample: ex) {
+            CHK_EQ(worker_id.load(), sample.threadId);
+        }
+        ex_lat.getSlowScopeNotifier().flush();
+        std::lock_guard<std::mutex> l(events_lock);
+        CHK_EQ(1, events.size());
+        CHK_EQ(worker_id.load(), events[0].threadId);
+        CHK_EQ(1000, events[0].latency);
+    }
+
+    // Concurrent threads with a reader.
+    lat.setThreadBufferSize(16);
+    const size_t NUM_CONCURRENT = 4;
+    std::vector<TestSuite::ThreadHolder> t_hdl(NUM_CONCURRENT);
+    std::vector<thread_buffer_args> args(NUM_CONCURRENT);
+    for (size_t ii=0; ii<NUM_CONCURRENT; ++ii) {
+        args[ii].lat = &lat;
+        args[ii].numSamples = 10000;
+        args[ii].numNames = 10;
+        t_hdl[ii].spawn(&args[ii], thread_buffer_worker, nullptr);
+    }
+    for (size_t ii=0; ii<100; ++ii) lat.getNumCalls("buffered_0");
+    for (auto& entry: t_hdl) entry.join();
+    uint64_t total = 0;
+    for (size_t ii=0; ii<10; ++ii) {
+        total += lat.getNumCalls("buffered_" + std::to_string(ii));
+    }
+    CHK_EQ(NUM_THREADS * 10 + NUM_CONCURRENT * 10000, total);
+
+    // Buffers outliving their collector.
+    {
+        LatencyCollector tmp;
+        tmp.setThreadBufferSize(100);
+        tmp.addLatency("tmp", 1);
+        CHK_EQ(1, tmp.getNumCalls("tmp"));
+        tmp.addLatency("tmp", 1);
+    }
+    {
+        LatencyCollector tmp;
+        tmp.setThreadBufferSize(100);
+        tmp.addLatency("tmp", 1);
+        CHK_EQ(1, tmp.getNumCalls("tmp"));
+    }
+
+    TestSuite::Msg msg_stream;
+    LatencyCollectorDumpOptions opt;
+    opt.show_health = true;
+    LatencyDumpDefaultImpl default_dump;
+    msg_stream << lat.dump(&default_dump, opt) << std::endl;
+    return 0;
+}
+
+struct thread_breakdown_args : TestSuite::ThreadArgs {
+    thread_breakdown_args() : lat(nullptr), latency(0), numSamples(0) {}
+    LatencyCollector* lat;
+    std::string threadName;
+    uint64_t latency;
+    size_t numSamples;
+};
+
+int thread_breakdown_worker(TestSuite::ThreadArgs* t_args) {
+    thread_breakdown_args* args = static_cast<thread_breakdown_args*>(t_args);
+    if (!args->threadName.empty()) latencySetThreadName(args->threadName);
+    for (size_t ii=0; ii<args->numSamples; ++ii) {
+        args->lat->addLatency("io", args->latency);
+        args->lat->addLatency("other", args->latency);
+        args->lat->addLatency("buffered", args->latency);
+    }
+    return 0;
+}
+
+int thread_breakdown_test() {
+    LatencyCollector lat;
+    lat.addLatency("io", 1);
+    lat.addThreadBreakdown("io");
+    lat.addThreadBreakdown("buf*");
+
+    // Two named workers of a pool, a slow one, and an unnamed one.
+    const size_t NUM_THREADS = 4;
+    const char* names[NUM_THREADS] = {"pool", "pool", "slow_worker", ""};
+    const uint64_t latencies[NUM_THREADS] = {100, 100, 10000, 100};
+    std::vector<TestSuite::ThreadHolder> t_hdl(NUM_THREADS);
+    std::vector<thread_breakdown_args> args(NUM_THREADS);
+    for (size_t ii=0; ii<NUM_THREADS; ++ii) {
+        args[ii].lat = &lat;
+        args[ii].threadName = names[ii];
+        args[ii].latency = latencies[ii];
+        args[ii].numSamples = 1000;
+        t_hdl[ii].spawn(&args[ii], thread_breakdown_worker, nullptr);
+    }
+    for (auto& entry: t_hdl) entry.join();
+
+    LatencyThreadRegistry& registry = LatencyThreadRegistry::get();
+    LatencyThreadKey pool = registry.intern("pool");
+    LatencyThreadKey slow = registry.intern("slow_worker");
+
+    LatencyCollector::Item* io = lat.getItem("io");
+    CHK_TRUE(io->hasThreadBreakdown());
+    CHK_EQ(4001, io->getNumCalls());
+    // Threads of the same name are merged.
+    CHK_EQ(2000, io->getThreadHistogram(pool)->getTotal());
+    CHK_EQ(1000, io->getThreadHistogram(slow)->getTotal());
+    // The sample added before enabling it is not attributed.
+    uint64_t attributed = 0;
+    for (size_t ii=0; ii<registry.getNumKeys(); ++ii) {
+        const Histogram* hist = io->getThreadHistogram(ii);
+        if (hist) attributed += hist->getTotal();
+    }
+    CHK_EQ(4000, attributed);
+
+    LatencyThreadKey slowest = 0, fastest = 0;
+    double skew = io->getThreadSkew(&slowest, &fastest);
+    CHK_GT(skew, 50.0);
+    CHK_EQ(slow, slowest);
+    CHK_NEQ(slow, fastest);
+
+    // Not selected.
+    LatencyCollector::Item* other = lat.getItem("other");
+    CHK_FALSE(other->hasThreadBreakdown());
+    CHK_EQ(0.0, other->getThreadSkew());
+
+    // Copies keep the breakdown.
+    LatencyCollector::Item copied(*io);
+    CHK_EQ(2000, copied.getThreadHistogram(pool)->getTotal());
+
+    // Flushing other threads' buffers keeps the original thread.
+    {
+        LatencyCollector buf_lat;
+        buf_lat.addThreadBreakdown("*");
+        buf_lat.setThreadBufferSize(1000000);
+        thread_breakdown_args buf_args;
+        buf_args.lat = &buf_lat;
+        buf_args.threadName = "buffered_worker";
+        buf_args.latency = 10;
+        buf_args.numSamples = 10;
+        TestSuite::ThreadHolder t_buf(&buf_args, thread_breakdown_worker,
+                                      nullptr);
+        t_buf.join();
+        CHK_EQ(10, buf_lat.getNumCalls("buffered"));
+        LatencyThreadKey key = registry.intern("buffered_worker");
+        LatencyCollector::Item* item = buf_lat.getItem("buffered");
+        CHK_NONNULL(item->getThreadHistogram(key));
+        CHK_EQ(10, item->getThreadHistogram(key)->getTotal());
+    }
+
+    // Unnamed threads coming and going reuse the keys of exited ones,
+    // instead of running out of keys.
+    {
+        LatencyCollector churn_lat;
+        churn_lat.addThreadBreakdown("*");
+        const size_t NUM_CHURN = LatencyThreadRegistry::MAX_KEYS + 72;
+        std::vector<LatencyThreadKey> keys(NUM_CHURN);
+        size_t num_keys = 0;
+        for (size_t ii=0; ii<NUM_CHURN; ++ii) {
+            std::thread t([&churn_lat, &keys, ii]() {
+                churn_lat.addLatency("churn", 10);
+                keys[ii] = LatencyThreadRegistry::getCurrentKey();
+            });
+            t.join();
+            if (!ii) num_keys = registry.getNumKeys();
+        }
+        CHK_EQ(num_keys, registry.getNumKeys());
+
+        // A live thread keeps its own key.
+        std::atomic<LatencyThreadKey> live_key(LatencyThreadRegistry::NO_KEY);
+        std::atomic<bool> done(false);
+        std::thread live([&churn_lat, &live_key, &done]() {
+            churn_lat.addLatency("churn", 10);
+            live_key = LatencyThreadRegistry::getCurrentKey();
+            while (!done) std::this_thread::yield();
+        });
+        while (live_key == LatencyThreadRegistry::NO_KEY) {
+            std::this_thread::yield();
+        }
+        std::thread other([&churn_lat, &keys]() {
+            churn_lat.addLatency("churn", 10);
+            keys.push_back(LatencyThreadRegistry::getCurrentKey());
+        });
+        other.join();
+        done = true;
+        live.join();
+        CHK_NEQ(live_key.load(), keys.back());
+        keys.push_back(live_key);
+
+        LatencyCollector::Item* churn = churn_lat.getItem("churn");
+        LatencyThreadKey overflow = LatencyThreadRegistry::OVERFLOW_KEY;
+        uint64_t total = 0;
+        for (LatencyThreadKey key: keys) {
+            CHK_NEQ(overflow, key);
+            CHK_EQ(0, registry.getName(key).find("thread "));
+        }
+        for (size_t ii=0; ii<registry.getNumKeys(); ++ii) {
+            const Histogram* hist = churn->getThreadHistogram(ii);
+            if (hist) total += hist->getTotal();
+        }
+        CHK_EQ(NUM_CHURN + 2, total);
+        CHK_NULL(churn->getThreadHistogram(overflow));
+    }
+
+    LatencyCollectorDumpOptions opt;
+    opt.show_threads = true;
+    LatencyDumpDefaultImpl default_dump;
+    std::string dump = lat.dump(&default_dump, opt);
+    CHK_TRUE(dump.find("[pool]") != std::string::npos);
+    CHK_TRUE(dump.find("[slow_worker]") != std::string::npos);
+    CHK_TRUE(dump.find("p99 skew") != std::string::npos);
+    opt.view_type = LatencyCollectorDumpOptions::FLAT;
+    CHK_TRUE( lat.dump(&default_dump, opt).find("slowest [slow_worker]")
+              != std::string::npos );
+
+    LatencyDumpJsonImpl json_dump;
+    std::string json = lat.dump(&json_dump, opt);
+    CHK_TRUE(json.find("\"thread\": \"pool\"") != std::string::npos);
+    CHK_TRUE(json.find("\"thread_skew\": ") != std::string::npos);
+
+    TestSuite::Msg msg_stream;
+    msg_stream << dump << std::endl;
+    return 0;
+}
+
+int snapshot_diff_test() {
+    LatencyCollector before;
+    LatencyCollector after;
+    for (size_t ii=0; ii<1000; ++ii) {
+        before.addLatency(" ## handler", 100 + ii % 50);
+        before.addLatency(" ## handler ## db", 50 + ii % 10);
+        before.addLatency(" ## handler ## cache", 10);
+        before.addLatency("removed", 10);
+
+        after.addLatency(" ## handler", 100 + ii % 50);
+        // 10x slower.
+        after.addLatency(" ## handler ## db", 500 + ii % 100);
+        after.addLatency(" ## handler ## cache", 10);
+        after.addLatency("added", 10);
+    }
+    // A few slow samples by chance.
+    before.addLatency("noisy", 100);
+    after.addLatency("noisy", 200);
+
+    // Round trip through a file.
+    LatencySnapshot snap_before = LatencySnapshot::take(before);
+    CHK_EQ(5, snap_before.getNumStats());
+    CHK_GT(snap_before.getTimestamp(), (uint64_t)0);
+    std::string path = "./latency_test_snapshot";
+    CHK_TRUE(snap_before.save(path));
+    LatencySnapshot loaded;
+    CHK_TRUE(loaded.load(path));
+    remove(path.c_str());
+    CHK_EQ(snap_before.serialize(), loaded.serialize());
+    const LatencySnapshotStat* db = loaded.find(" ## handler ## db");
+    CHK_NONNULL(db);
+    CHK_EQ(1000, db->numCalls);
+    CHK_EQ(before.getTotalTime(" ## handler ## db"), db->totalTime);
+    CHK_EQ(before.getPercentile(" ## handler ## db", 99), db->p99);
+    CHK_EQ(std::string("db"), db->getLeaf());
+    uint64_t num_binned = 0;
+    for (const LatencySnapshotBin& bin: db->bins) num_binned += bin.count;
+    CHK_EQ(1000, num_binned);
+
+    // Malformed data is rejected, and nothing is changed.
+    std::string data = snap_before.serialize();
+    CHK_FALSE(loaded.deserialize(data.substr(0, data.size() - 1)));
+    CHK_FALSE(loaded.deserialize(data + "x"));
+    CHK_FALSE(loaded.deserialize("LATSNAP"));
+    CHK_EQ(5, loaded.getNumStats());
+    CHK_FALSE(loaded.load("./not_exist_snapshot"));
+
+    // The same as dump.
+    LatencyDumpSnapshotImpl snapshot_dump;
+    LatencySnapshot dumped;
+    CHK_TRUE(dumped.deserialize(after.dump(&snapshot_dump)));
+    CHK_EQ(5, dumped.getNumStats());
+
+    LatencySnapshotDiff diff(snap_before, dumped);
+    CHK_EQ(6, diff.getStats().size());
+    const LatencyStatDiff* db_diff = diff.find(" ## handler ## db");
+    CHK_NONNULL(db_diff);
+    CHK_GT(db_diff->getDelta(LatencyStatDiff::P99), 0);
+    CHK_GT(db_diff->getRelative(LatencyStatDiff::P99), 5.0);
+    CHK_EQ(1.0, db_diff->ksDistance);
+    CHK_SM(db_diff->pValue, 0.001);
+    const LatencyStatDiff* same = diff.find(" ## handler ## cache");
+    CHK_EQ(0.0, same->ksDistance);
+    CHK_EQ(1.0, same->pValue);
+    // Too few samples to be significant.
+    const LatencyStatDiff* noisy = diff.find("noisy");
+    CHK_GT(noisy->getDelta(LatencyStatDiff::P99), 0);
+    CHK_FALSE(noisy->isSignificant(0.01));
+    CHK_EQ((int)LatencyStatDiff::ADDED, (int)diff.find("added")->status);
+    CHK_EQ((int)LatencyStatDiff::REMOVED, (int)diff.find("removed")->status);
+    CHK_NULL(diff.find("not_exist"));
+
+    std::vector<const LatencyStatDiff*> regressions =
+        diff.getRegressions(LatencyStatDiff::P99);
+    CHK_EQ(1, regressions.size());
+    CHK_EQ(std::string(" ## handler ## db"), regressions[0]->name);
+    // Slower per call.
+    regressions = diff.getRegressions(LatencyStatDiff::TOTAL);
+    CHK_EQ(1, regressions.size());
+    CHK_EQ(std::string(" ## handler ## db"), regressions[0]->name);
+
+    // Twice the calls of the same latencies: not a regression.
+    {
+        LatencyCollector light;
+        LatencyCollector heavy;
+        for (size_t ii=0; ii<1000; ++ii) {
+            light.addLatency("load", 100 + ii % 200);
+            heavy.addLatency("load", 100 + ii % 200);
+            heavy.addLatency("load", 100 + ii % 200);
+        }
+        LatencySnapshotDiff load_diff( LatencySnapshot::take(light),
+                                       LatencySnapshot::take(heavy) );
+        const LatencyStatDiff* load = load_diff.find("load");
+        CHK_EQ(1000, load->getDelta(LatencyStatDiff::CALLS));
+        CHK_GT(load->getDelta(LatencyStatDiff::TOTAL), 0);
+        for (LatencyStatDiff::Metric metric: { LatencyStatDiff::CALLS,
+                                               LatencyStatDiff::TOTAL,
+                                               LatencyStatDiff::P50,
+                                               LatencyStatDiff::P99,
+                                               LatencyStatDiff::P999 }) {
+            CHK_FALSE(load->isRegression(metric, 0.01));
+            CHK_EQ(0, load_diff.getRegressions(metric).size());
+        }
+    }
+
+    // Significance of the KS test.
+    CHK_EQ(1.0, LatencySnapshotDiff::getKsPValue(0, 100, 100));
+    CHK_GT(LatencySnapshotDiff::getKsPValue(0.1, 100, 100), 0.5);
+    CHK_SM(LatencySnapshotDiff::getKsPValue(0.1, 10000, 10000), 0.001);
+
+    LatencyDiffOptions opt;
+    std::string flat = diff.dump(opt);
+    CHK_TRUE(flat.find("REGRESSION") != std::string::npos);
+    CHK_TRUE(flat.find("(added)") != std::string::npos);
+    // Largest regression first.
+    CHK_SM(flat.find(" ## handler ## db"), flat.find("noisy"));
+    opt.view_type = LatencyCollectorDumpOptions::TREE;
+    opt.regressions_only = true;
+    std::string tree = diff.dump(opt);
+    CHK_TRUE(tree.find("handler") != std::string::npos);
+    CHK_TRUE(tree.find("  db") != std::string::npos);
+    CHK_TRUE(tree.find("cache") == std::string::npos);
+
+    TestSuite::Msg msg_stream;
+    msg_stream << flat << std::endl << tree << std::endl;
+    return 0;
+}
+
+int snapshot_merge_test() {
+    // Two hosts, and all samples in one collector.
+    LatencyCollector hosts[2];
+    LatencyCollector all;
+    for (size_t ii=0; ii<1000; ++ii) {
+        for (size_t jj=0; jj<2; ++jj) {
+            uint64_t lat = (jj + 1) * (100 + ii % 300);
+            hosts[jj].addLatency(" ## handler", lat);
+            all.addLatency(" ## handler", lat);
+            hosts[jj].addLatency(" ## handler ## db", lat / 2);
+            all.addLatency(" ## handler ## db", lat / 2);
+        }
+    }
+    hosts[1].addLatency("only_one", 10);
+    all.addLatency("only_one", 10);
+
+    LatencySnapshot merged = LatencySnapshot::take(hosts[0]);
+    merged.merge( LatencySnapshot::take(hosts[1]) );
+    CHK_EQ(3, merged.getNumStats());
+    const LatencySnapshotStat* handler = merged.find(" ## handler");
+    CHK_NONNULL(handler);
+    CHK_EQ(all.getNumCalls(" ## handler"), handler->numCalls);
+    CHK_EQ(all.getTotalTime(" ## handler"), handler->totalTime);
+    CHK_EQ(all.getMaxLatency(" ## handler"), handler->maxLatency);
+    // Same bins, same estimates.
+    CHK_EQ(all.getPercentile(" ## handler", 50), handler->p50);
+    CHK_EQ(all.getPercentile(" ## handler", 99), handler->p99);
+    CHK_EQ(all.getPercentile(" ## handler", 99.9), handler->p999);
+    CHK_EQ( LatencySnapshot::take(all).find(" ## handler")->bins.size(),
+            handler->bins.size() );
+
+    // Stream through a file, stat by stat.
+    std::string path = "./latency_test_snapshot_merge";
+    CHK_TRUE(merged.save(path));
+    LatencySnapshotReader reader;
+    CHK_TRUE(reader.open(path));
+    CHK_EQ(3, reader.getNumStats());
+    LatencySnapshot streamed;
+    streamed.setTimestamp(reader.getTimestamp());
+    LatencySnapshotStat stat;
+    while (reader.next(stat)) streamed.add(stat);
+    CHK_FALSE(reader.hasError());
+    CHK_EQ(merged.serialize(), streamed.serialize());
+
+    // Truncated file.
+    std::string data = merged.serialize();
+    FILE* fp = fopen(path.c_str(), "wb");
+    fwrite(data.data(), 1, data.size() - 8, fp);
+    fclose(fp);
+    CHK_TRUE(reader.open(path));
+    while (reader.next(stat));
+    CHK_TRUE(reader.hasError());
+    remove(path.c_str());
+    CHK_FALSE(reader.open("./not_exist_snapshot"));
+
+    // Restore into a collector, to render with any dump implementation.
+    LatencyCollectorT<LatencySingleThreadPolicy> restored;
+    merged.restore(restored);
+    const char* names[] = {" ## handler", " ## handler ## db", "only_one"};
+    for (const char* name: names) {
+        CHK_EQ(all.getNumCalls(name), restored.getNumCalls(name));
+        CHK_EQ(all.getTotalTime(name), restored.getTotalTime(name));
+        CHK_EQ(all.getMaxLatency(name), restored.getMaxLatency(name));
+        CHK_EQ( all.getPercentile(name, 99),
+                restored.getPercentile(name, 99) );
+    }
+    LatencyDumpDefaultImplT<Histogram> default_dump;
+    std::string dump = restored.dump(&default_dump);
+    CHK_TRUE(dump.find("db") != std::string::npos);
+    CHK_EQ(all.dump(&default_dump), dump);
+
+    // Filtered by name or prefix: callers may be missing.
+    LatencyCollector calls;
+    const char* paths[] = { " ## handler",
+                            " ## handler ## db",
+                            " ## handler ## db ## io",
+                            " ## other",
+                            " ## other ## cache ## io" };
+    for (const char* name: paths) calls.addLatency(name, 100);
+    LatencySnapshot full = LatencySnapshot::take(calls);
+    std::vector< std::vector<std::string> > filters =
+        { { " ## handler ## db" },
+          { " ## handler ## db ## io", " ## other ## cache ## io" },
+          { " ## handler", " ## handler ## db ## io",
+            " ## other", " ## other ## cache ## io" } };
+    TestSuite::Msg msg_stream;
+    for (auto& filter: filters) {
+        LatencySnapshot filtered;
+        for (const std::string& name: filter) filtered.add(*full.find(name));
+        LatencyCollectorT<LatencySingleThreadPolicy> filtered_restored;
+        filtered.restore(filtered_restored);
+        std::string filtered_dump = filtered_restored.dump(&default_dump);
+        for (const std::string& name: filter) {
+            CHK_EQ(1, filtered_restored.getNumCalls(name));
+            std::string leaf = name.substr(name.rfind(' ') + 1);
+            CHK_TRUE( filtered_dump.find(leaf) != std::string::npos );
+        }
+        msg_stream << filtered_dump << std::endl;
+    }
+
+    msg_stream << dump << std::endl;
+    return 0;
+}
+
+// Receive all pending datagrams of the given non-blocking socket.
+static std::vector<std::string> recv_statsd_lines(int fd, size_t max_size,
+                                                  size_t* num_packets) {
+    std::vector<std::string> ret;
+    char buf[65536];
+    ssize_t len = 0;
+    *num_packets = 0;
+    while ( (len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0 ) {
+        if ((size_t)len > max_size) return std::vector<std::string>();
+        (*num_packets)++;
+        std::string packet(buf, len);
+        size_t pos = 0;
+        while (pos <= packet.size()) {
+            size_t end = packet.find('\n', pos);
+            if (end == std::string::npos) end = packet.size();
+            ret.push_back(packet.substr(pos, end - pos));
+            pos = end + 1;
+        }
+    }
+    return ret;
+}
+
+int statsd_exporter_test() {
+    // Local stand-in of the agent.
+    int agent = socket(AF_INET, SOCK_DGRAM, 0);
+    CHK_GTEQ(agent, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = 0;
+    CHK_Z( bind(agent, (struct sockaddr*)&addr, sizeof(addr)) );
+    socklen_t addr_len = sizeof(addr);
+    getsockname(agent, (struct sockaddr*)&addr, &addr_len);
+
+    LatencyCollector lat;
+    for (size_t ii=0; ii<100; ++ii) {
+        lat.addLatency(" ## handler ## db", 100 + ii);
+        lat.addLatency("stat:with|bad chars", 10);
+    }
+
+    LatencyStatsdOptions opt;
+    opt.prefix = "app.";
+    opt.tags = "env:test";
+    opt.max_packet_size = 100;
+    LatencyStatsdExporter exporter(opt);
+    CHK_TRUE( exporter.connectUdp("127.0.0.1", ntohs(addr.sin_port)) );
+    size_t num_sent = exporter.push(lat);
+    CHK_GT(num_sent, 1);
+
+    size_t num_packets = 0;
+    std::vector<std::string> lines =
+        recv_statsd_lines(agent, opt.max_packet_size, &num_packets);
+    CHK_EQ(num_sent, num_packets);
+    // count, sum, max, and 3 percentiles for each.
+    CHK_EQ(12, lines.size());
+    auto has_line = [&lines](const std::string& line) {
+        return std::find(lines.begin(), lines.end(), line) != lines.end();
+    };
+    CHK_TRUE( has_line("app.handler.db.count:100|c|#env:test") );
+    CHK_TRUE( has_line( "app.handler.db.sum:" +
+                        std::to_string(lat.getTotalTime(" ## handler ## db")) +
+                        "|c|#env:test" ) );
+    CHK_TRUE( has_line("app.handler.db.max:199|g|#env:test") );
+    CHK_TRUE( has_line("app.stat_with_bad_chars.count:100|c|#env:test") );
+
+    // Only the samples since the previous push.
+    for (size_t ii=0; ii<10; ++ii) lat.addLatency(" ## handler ## db", 1000);
+    exporter.push(lat);
+    lines = recv_statsd_lines(agent, opt.max_packet_size, &num_packets);
+    CHK_EQ(6, lines.size());
+    CHK_TRUE( has_line("app.handler.db.count:10|c|#env:test") );
+    CHK_TRUE( has_line("app.handler.db.sum:10000|c|#env:test") );
+    CHK_TRUE( has_line("app.handler.db.p99:1000|g|#env:test") );
+    // Nothing new.
+    CHK_Z( exporter.push(lat) );
+
+    // Distribution: a line for each bin, sampled by its count.
+    opt.format = LatencyStatsdOptions::DISTRIBUTION;
+    opt.tags.clear();
+    LatencyStatsdExporter dist_exporter(opt);
+    CHK_TRUE( dist_exporter.connectUdp("127.0.0.1", ntohs(addr.sin_port)) );
+    dist_exporter.push(lat);
+    lines = recv_statsd_lines(agent, opt.max_packet_size, &num_packets);
+    double num_samples = 0;
+    for (const std::string& line: lines) {
+        if (line.find("app.handler.db:") != 0) continue;
+        size_t rate_pos = line.find("|@");
+        num_samples += (rate_pos == std::string::npos)
+                       ? 1 : 1.0 / atof(line.c_str() + rate_pos + 2);
+    }
+    CHK_GT(num_samples, 109.9);
+    CHK_SM(num_samples, 110.1);
+    close(agent);
+
+    // The agent is stuck: sends never block, datagrams are dropped.
+    std::string path = "./latency_test_statsd.sock";
+    unlink(path.c_str());
+    int stuck_agent = socket(AF_UNIX, SOCK_DGRAM, 0);
+    struct sockaddr_un un_addr;
+    memset(&un_addr, 0, sizeof(un_addr));
+    un_addr.sun_family = AF_UNIX;
+    strcpy(un_addr.sun_path, path.c_str());
+    CHK_Z( bind(stuck_agent, (struct sockaddr*)&un_addr, sizeof(un_addr)) );
+
+    LatencyCollector many;
+    for (size_t ii=0; ii<2000; ++ii) {
+        many.addLatency("stat_" + std::to_string(ii), 10);
+    }
+    opt.format = LatencyStatsdOptions::SUMMARY;
+    opt.max_packet_size = 8192;
+    LatencyStatsdExporter unix_exporter(opt);
+    CHK_TRUE( unix_exporter.connectUnix(path) );
+    unix_exporter.push(many);
+    CHK_GT(unix_exporter.getNumPackets(), 0);
+    CHK_GT(unix_exporter.getNumDropped(), 0);
+    close(stuck_agent);
+    unlink(path.c_str());
+
+    // Periodic push, and the last interval at stop.
+    LatencyStatsdExporter bg_exporter(opt);
+    CHK_TRUE( bg_exporter.connectUnix(path) );
+    bg_exporter.start(lat, 10);
+    bg_exporter.stop();
+    // No agent listening.
+    CHK_GT(bg_exporter.getNumDropped(), 0);
+    return 0;
+}
+
+int aggregator_test() {
+    // Three processes, and all samples in one collector.
+    LatencyCollector procs[3];
+    LatencyCollector all;
+    for (size_t ii=0; ii<300; ++ii) {
+        uint64_t lat = 100 + ii * (ii % 3 + 1);
+        procs[ii % 3].addLatency(" ## req", lat);
+        all.addLatency(" ## req", lat);
+    }
+
+    LatencyAggregatorOptions opt;
+    opt.bucket_ms = 1000;
+    opt.num_buckets = 3;
+    LatencyAggregator agg(opt);
+    for (LatencyCollector& proc: procs) {
+        CHK_TRUE( agg.addPush(LatencySnapshot::take(proc).serialize(), 100) );
+    }
+    LatencySnapshot window = agg.getWindow(100);
+    const LatencySnapshotStat* req = window.find(" ## req");
+    CHK_NONNULL(req);
+    CHK_EQ(all.getNumCalls(" ## req"), req->numCalls);
+    CHK_EQ(all.getTotalTime(" ## req"), req->totalTime);
+    CHK_EQ(all.getPercentile(" ## req", 99), req->p99);
+    CHK_FALSE( agg.addPush("not a snapshot") );
+    CHK_EQ(1, agg.getNumMalformed());
+
+    // Rolling window of 3 buckets: the first one expires at 3000.
+    CHK_TRUE( agg.addPush(LatencySnapshot::take(procs[0]).serialize(), 2500) );
+    CHK_EQ(400, agg.getWindow(2999).find(" ## req")->numCalls);
+    CHK_EQ(100, agg.getWindow(3000).find(" ## req")->numCalls);
+    CHK_Z( agg.getWindow(5000).getNumStats() );
+
+    // Split into chunks to fit in datagrams.
+    LatencyCollector many;
+    for (size_t ii=0; ii<2000; ++ii) {
+        many.addLatency("stat_" + std::to_string(ii), ii);
+    }
+    LatencySnapshot many_snapshot = LatencySnapshot::take(many);
+    std::vector<std::string> chunks = many_snapshot.serializeChunks(10000);
+    CHK_GT(chunks.size(), 1);
+    LatencySnapshot reassembled;
+    for (const std::string& chunk: chunks) {
+        CHK_SMEQ(chunk.size(), 10000);
+        LatencySnapshot part;
+        CHK_TRUE( part.deserialize(chunk) );
+        reassembled.merge(part);
+    }
+    reassembled.setTimestamp(many_snapshot.getTimestamp());
+    CHK_EQ(many_snapshot.serialize(), reassembled.serialize());
+
+    // Over the sockets.
+    std::string push_path = "./latency_test_agg.sock";
+    std::string query_path = push_path + ".query";
+    LatencyAggregator server;
+    CHK_TRUE( server.listen(push_path, query_path) );
+    std::atomic<bool> stopping(false);
+    std::thread server_thread([&server, &stopping]() {
+        while (!stopping) server.poll(10);
+    });
+    auto wait_for_pushes = [&server](uint64_t num) {
+        for (size_t ii=0; ii<500 && server.getNumPushes() < num; ++ii) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        return server.getNumPushes();
+    };
+
+    LatencyAggregatorClient clients[3];
+    for (size_t ii=0; ii<3; ++ii) {
+        CHK_TRUE( clients[ii].connect(push_path) );
+        CHK_EQ(1, clients[ii].push(procs[ii]));
+    }
+    CHK_EQ(3, wait_for_pushes(3));
+    // Only the samples since the previous push.
+    procs[0].addLatency(" ## req", 5000);
+    CHK_EQ(1, clients[0].push(procs[0]));
+    CHK_Z( clients[1].push(procs[1]) );
+    CHK_EQ(4, wait_for_pushes(4));
+    // In chunks.
+    LatencyAggregatorClient many_client;
+    CHK_TRUE( many_client.connect(push_path) );
+    size_t num_chunks = many_client.push(many);
+    CHK_GT(num_chunks, 1);
+    CHK_EQ(4 + num_chunks, wait_for_pushes(4 + num_chunks));
+
+    std::string response;
+    CHK_TRUE( LatencyAggregator::query(query_path, "snapshot", response) );
+    LatencySnapshot merged;
+    CHK_TRUE( merged.deserialize(response) );
+    CHK_EQ(2001, merged.getNumStats());
+    CHK_EQ(all.getNumCalls(" ## req") + 1, merged.find(" ## req")->numCalls);
+    CHK_EQ(5000, merged.find(" ## req")->maxLatency);
+
+    CHK_TRUE( LatencyAggregator::query(query_path, "json flat", response) );
+    CHK_TRUE( response.find("\"path\": \" ## req\"") != std::string::npos );
+    CHK_TRUE( LatencyAggregator::query(query_path, "default", response) );
+    CHK_TRUE( response.find("req") != std::string::npos );
+
+    // A client that never sends its request delays neither the pushes
+    // nor the other requests.
+    int stalled = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, query_path.c_str());
+    CHK_Z( connect(stalled, (struct sockaddr*)&addr, sizeof(addr)) );
+    TestSuite::sleep_ms(50);
+    auto stalled_start = std::chrono::steady_clock::now();
+    procs[2].addLatency(" ## req", 1);
+    CHK_EQ(1, clients[2].push(procs[2]));
+    CHK_EQ(5 + num_chunks, wait_for_pushes(5 + num_chunks));
+    CHK_TRUE( LatencyAggregator::query(query_path, "snapshot", response) );
+    CHK_TRUE( merged.deserialize(response) );
+    CHK_EQ(all.getNumCalls(" ## req") + 2, merged.find(" ## req")->numCalls);
+    uint64_t stalled_ms =
+        std::chrono::duration_cast<std::chrono::milliseconds>
+        ( std::chrono::steady_clock::now() - stalled_start ).count();
+    CHK_SM(stalled_ms, (uint64_t)1000);
+    ::close(stalled);
+
+    stopping = true;
+    server_thread.join();
+    server.close();
+    unlink(push_path.c_str());
+    unlink(query_path.c_str());
+    CHK_FALSE( LatencyAggregator::query(query_path, "default", response) );
+
+    TestSuite::Msg msg_stream;
+    msg_stream << agg.dump(LatencyAggregator::DEFAULT,
+                           LatencyCollectorDumpOptions(), 100) << std::endl;
+    return 0;
+}
+
+int history_test() {
+    std::string path = "./latency_test_history";
+    unlink(path.c_str());
+
+    // Small ring, to wrap around several times.
+    const size_t CAPACITY = 8192;
+    LatencyCollector lat;
+    std::vector<LatencySnapshot> intervals;
+    {
+        LatencyHistoryWriter writer;
+        CHK_TRUE( writer.open(path, CAPACITY) );
+        LatencySnapshot prev = LatencySnapshot::take(lat);
+        for (size_t ii=0; ii<50; ++ii) {
+            for (size_t jj=0; jj<100; ++jj) {
+                lat.addLatency(" ## req", (ii + 1) * 100 + jj);
+            }
+            lat.addLatency(" ## other", ii + 1);
+            LatencySnapshot cur = LatencySnapshot::take(lat);
+            LatencySnapshot interval = cur;
+            interval -= prev;
+            prev = cur;
+            CHK_TRUE( writer.append(interval, 1000) );
+            intervals.push_back(interval);
+        }
+        CHK_EQ(50, (int)writer.getNumRecords());
+
+        // Larger than the ring.
+        LatencyCollector huge;
+        for (size_t ii=0; ii<500; ++ii) {
+            huge.addLatency("stat_" + std::to_string(ii), 10);
+        }
+        CHK_FALSE( writer.append(LatencySnapshot::take(huge), 1000) );
+        CHK_EQ(1, (int)writer.getNumDropped());
+        // Not closed, as if the process crashed.
+        LatencyHistoryReader reader;
+        CHK_TRUE( reader.load(path) );
+        CHK_GT(reader.getRecords().size(), 0);
+    }
+
+    LatencyHistoryReader reader;
+    CHK_TRUE( reader.load(path) );
+    const std::vector<LatencyHistoryRecord>& records = reader.getRecords();
+    // Only the latest intervals are left, in order.
+    CHK_GT(records.size(), 1);
+    CHK_SM(records.size(), 50);
+    CHK_EQ(49, (int)records.back().seq);
+    for (size_t ii=0; ii<records.size(); ++ii) {
+        const LatencyHistoryRecord& rec = records[ii];
+        const LatencySnapshot& expected = intervals[rec.seq];
+        CHK_EQ(rec.seq, records.back().seq - (records.size() - 1 - ii));
+        CHK_EQ(1000, (int)rec.intervalMs);
+        CHK_EQ(expected.getTimestamp(), rec.stats.getTimestamp());
+        CHK_EQ(expected.serialize(), rec.stats.serialize());
+        const LatencySnapshotStat* stat = rec.stats.find(" ## req");
+        CHK_NONNULL(stat);
+        CHK_EQ(100, (int)stat->numCalls);
+        CHK_EQ(expected.find(" ## req")->p99, stat->p99);
+    }
+    auto series = reader.getSeries(" ## req");
+    CHK_EQ(records.size(), series.size());
+    CHK_SM(series.front().second->p50, series.back().second->p50);
+
+    // Torn write of the latest record.
+    size_t num_valid = records.size();
+    uint64_t last_seq = records.back().seq;
+    {
+        std::string data;
+        FILE* fp = fopen(path.c_str(), "rb");
+        char buf[4096];
+        size_t len = 0;
+        while ( (len = fread(buf, 1, sizeof(buf), fp)) > 0 ) {
+            data.append(buf, len);
+        }
+        fclose(fp);
+        // Find the header of the latest record, and break its payload.
+        const uint8_t* ring = (const uint8_t*)data.data()
+                              + LatencyHistoryFormat::FILE_HEADER_SIZE;
+        size_t pos = 0;
+        for (; pos < CAPACITY; pos += LatencyHistoryFormat::ALIGN) {
+            LatencyHistoryFormat::RecordHeader rec;
+            if ( LatencyHistoryWriter::checkRecord(ring, CAPACITY, pos, rec) &&
+                 rec.seq == last_seq ) {
+                break;
+            }
+        }
+        CHK_SM(pos, CAPACITY);
+        size_t offset = LatencyHistoryFormat::FILE_HEADER_SIZE + pos
+                        + LatencyHistoryFormat::RECORD_HEADER_SIZE + 10;
+        fp = fopen(path.c_str(), "r+b");
+        fseek(fp, offset, SEEK_SET);
+        fputc(data[offset] ^ 0xff, fp);
+        fclose(fp);
+    }
+    CHK_TRUE( reader.load(path) );
+    CHK_EQ(num_valid - 1, reader.getRecords().size());
+    CHK_EQ(1, (int)reader.getNumCorrupted());
+    CHK_EQ(last_seq - 1, reader.getRecords().back().seq);
+
+    // Reopen: continue after the latest valid record.
+    {
+        LatencyHistoryWriter writer;
+        CHK_TRUE( writer.open(path, CAPACITY) );
+        CHK_TRUE( writer.append(intervals[0], 500) );
+        writer.close();
+    }
+    CHK_TRUE( reader.load(path) );
+    CHK_EQ(last_seq, reader.getRecords().back().seq);
+    CHK_EQ(500, (int)reader.getRecords().back().intervalMs);
+
+    // Different capacity: initialized.
+    {
+        LatencyHistoryWriter writer;
+        CHK_TRUE( writer.open(path, CAPACITY * 2) );
+        writer.start(lat, 10);
+        lat.addLatency(" ## req", 123);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        lat.addLatency(" ## req", 456);
+        writer.stop();
+        CHK_TRUE( writer.sync() );
+    }
+    CHK_TRUE( reader.load(path) );
+    CHK_GT(reader.getRecords().size(), 0);
+    CHK_EQ(0, (int)reader.getRecords().front().seq);
+    uint64_t num_calls = 0;
+    for (auto& entry: reader.getSeries(" ## req")) {
+        num_calls += entry.second->numCalls;
+    }
+    CHK_EQ(2, (int)num_calls);
+
+    // Not a history file.
+    CHK_FALSE( reader.load("./latency_test_not_exist") );
+    unlink(path.c_str());
+    return 0;
+}
+
 int main(int argc, char** argv) {
     TestSuite test(argc, argv);;
 
     test.options.printTestMessage = true;
     test.doTest("multi thread test", MT_basic_insert_test);
     test.doTest("function latency macro test", latency_macro_test);
+    test.doTest("label test", label_test);
+    test.doTest("async span test", async_span_test);
+    test.doTest("policy test", policy_test);
+    test.doTest("self overhead test", self_overhead_test);
+    test.doTest("health test", health_test);
+    test.doTest("ddsketch test", ddsketch_test);
+    test.doTest("compact histogram test", compact_histogram_test);
+    test.doTest( "per-cpu histogram test",
+                 percpu_histogram_test,
+                 TestRange<int>( { PerCpuHistogram::RSEQ,
+                                   PerCpuHistogram::SCHED_GETCPU,
+                                   PerCpuHistogram::THREAD_HASH } ) );
+    test.doTest("numa histogram test", numa_histogram_test);
+    test.doTest("exemplar test", exemplar_test);
+    test.doTest("slow scope test", slow_scope_test);
+    test.doTest("histogram simd test", histogram_simd_test);
+    test.doTest("batch test", batch_test);
+    test.doTest("aggregate index test", aggregate_index_test);
+    test.doTest("call path test", call_path_test);
+    test.doTest("memory bound test", memory_bound_test);
+    test.doTest("thread lifecycle test", thread_lifecycle_test);
+    test.doTest("thread breakdown test", thread_breakdown_test);
+    test.doTest("snapshot diff test", snapshot_diff_test);
+    test.doTest("snapshot merge test", snapshot_merge_test);
+    test.doTest("statsd exporter test", statsd_exporter_test);
+    test.doTest("aggregator test", aggregator_test);
+    test.doTest("history test", history_test);
 
     return 0;
 }
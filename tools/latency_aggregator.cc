@@ -0,0 +1,100 @@
+#include "latency_aggregator.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+
+// Merge the stats pushed by the local processes (see
+// `LatencyAggregatorClient`), and serve the merged dump:
+//
+//   $ latency_aggregator /tmp/latency.sock &
+//   $ latency_aggregator /tmp/latency.sock --dump json
+//
+// Pushes are received at the given path, and dump requests at the path
+// followed by ".query".
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_signal(int) {
+    stop_requested = 1;
+}
+
+static void usage(const char* prog) {
+    printf("Usage: %s SOCKET [options]\n"
+           "  --bucket-ms N    length of each bucket of the window "
+               "(default: 10000)\n"
+           "  --buckets N      number of buckets in the window "
+               "(default: 6)\n"
+           "  --dump FORMAT    print the dump of the running aggregator "
+               "and exit,\n"
+           "                   FORMAT is default, json, or snapshot\n"
+           "  --flat           show call paths as they are, "
+               "instead of a tree\n",
+           prog);
+}
+
+int main(int argc, char** argv) {
+    std::string path;
+    std::string request;
+    bool flat = false;
+    LatencyAggregatorOptions opt;
+    for (int ii = 1; ii < argc; ++ii) {
+        std::string arg = argv[ii];
+        bool has_next = (ii + 1 < argc);
+        if (arg == "--bucket-ms" && has_next) {
+            opt.bucket_ms = strtoull(argv[++ii], nullptr, 10);
+        } else if (arg == "--buckets" && has_next) {
+            opt.num_buckets = atoi(argv[++ii]);
+        } else if (arg == "--dump" && has_next) {
+            request = argv[++ii];
+            LatencyAggregator::Format format;
+            if (!LatencyAggregator::parseFormat(request, format)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--flat") {
+            flat = true;
+        } else if (!arg.empty() && arg[0] != '-' && path.empty()) {
+            path = arg;
+        } else {
+            usage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+    if (path.empty() || !opt.bucket_ms || !opt.num_buckets) {
+        usage(argv[0]);
+        return 1;
+    }
+    std::string query_path = path + ".query";
+
+    if (!request.empty()) {
+        std::string response;
+        if (flat) request += " flat";
+        if (!LatencyAggregator::query(query_path, request, response)) {
+            fprintf(stderr, "failed to query %s\n", query_path.c_str());
+            return 1;
+        }
+        fwrite(response.data(), 1, response.size(), stdout);
+        return 0;
+    }
+
+    LatencyAggregator aggregator(opt);
+    if (!aggregator.listen(path, query_path)) {
+        fprintf(stderr, "failed to listen on %s\n", path.c_str());
+        return 1;
+    }
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+    while (!stop_requested) aggregator.poll(500);
+
+    aggregator.close();
+    unlink(path.c_str());
+    unlink(query_path.c_str());
+    fprintf(stderr, "%llu pushes merged, %llu malformed\n",
+            (unsigned long long)aggregator.getNumPushes(),
+            (unsigned long long)aggregator.getNumMalformed());
+    return 0;
+}
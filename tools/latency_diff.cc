@@ -0,0 +1,88 @@
+#include "latency_diff.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
+
+// Compare two saved snapshots (see `LatencySnapshot::save()`), e.g.,
+// before and after a deploy:
+//
+//   $ latency_diff before.snap after.snap --sort p99 --top 20
+//
+// Exit code is 2 if `--check` is given and there is any regression.
+
+static void usage(const char* prog) {
+    printf("Usage: %s BEFORE AFTER [options]\n"
+           "  --sort METRIC   calls, total, p50, p99 (default), or p99.9\n"
+           "  --tree          show call paths under their callers\n"
+           "  --top N         show the largest N changes only\n"
+           "  --alpha P       significance level (default: 0.01)\n"
+           "  --regressions   show regressions only\n"
+           "  --check         exit with 2 if there is any regression\n",
+           prog);
+}
+
+static bool parse_metric(const std::string& str,
+                         LatencyStatDiff::Metric& dst) {
+    if (str == "calls") dst = LatencyStatDiff::CALLS;
+    else if (str == "total") dst = LatencyStatDiff::TOTAL;
+    else if (str == "p50") dst = LatencyStatDiff::P50;
+    else if (str == "p99") dst = LatencyStatDiff::P99;
+    else if (str == "p99.9") dst = LatencyStatDiff::P999;
+    else return false;
+    return true;
+}
+
+int main(int argc, char** argv) {
+    std::string files[2];
+    size_t num_files = 0;
+    LatencyDiffOptions opt;
+    bool check = false;
+    for (int ii = 1; ii < argc; ++ii) {
+        std::string arg = argv[ii];
+        bool has_next = (ii + 1 < argc);
+        if (arg == "--sort" && has_next) {
+            if (!parse_metric(argv[++ii], opt.sort_by)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--tree") {
+            opt.view_type = LatencyCollectorDumpOptions::TREE;
+        } else if (arg == "--top" && has_next) {
+            opt.top = atoi(argv[++ii]);
+        } else if (arg == "--alpha" && has_next) {
+            opt.significance_level = atof(argv[++ii]);
+        } else if (arg == "--regressions") {
+            opt.regressions_only = true;
+        } else if (arg == "--check") {
+            check = true;
+        } else if (arg[0] != '-' && num_files < 2) {
+            files[num_files++] = arg;
+        } else {
+            usage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+    if (num_files != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    LatencySnapshot snapshots[2];
+    for (size_t ii = 0; ii < 2; ++ii) {
+        if (!snapshots[ii].load(files[ii])) {
+            printf("failed to load %s\n", files[ii].c_str());
+            return 1;
+        }
+    }
+
+    LatencySnapshotDiff diff(snapshots[0], snapshots[1]);
+    printf("%s", diff.dump(opt).c_str());
+
+    if ( check &&
+         !diff.getRegressions(opt.sort_by, opt.significance_level).empty() ) {
+        return 2;
+    }
+    return 0;
+}
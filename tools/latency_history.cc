@@ -0,0 +1,115 @@
+#include "latency_history.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <string>
+#include <vector>
+
+// Show the per-interval percentiles in a history file (see
+// `LatencyHistoryWriter`), e.g., left by a crashed process:
+//
+//   $ latency_history app.hist --name "RPC" --last 60
+//
+// Records being written at the crash fail the checksum, and are skipped.
+
+static void usage(const char* prog) {
+    printf("Usage: %s FILE [options]\n"
+           "  --name NAME  show the stat of the given name or leaf "
+               "function only\n"
+           "  --last N     show the latest N intervals only\n"
+           "  --csv        print as CSV\n"
+           "--name can be given multiple times.\n",
+           prog);
+}
+
+static bool match(const LatencySnapshotStat& stat,
+                  const std::vector<std::string>& names) {
+    if (names.empty()) return true;
+    std::string leaf = stat.getLeaf();
+    for (const std::string& name: names) {
+        if (stat.name == name || leaf == name) return true;
+    }
+    return false;
+}
+
+// Local time of the given timestamp in microseconds.
+static std::string format_time(uint64_t us) {
+    time_t sec = us / 1000000;
+    struct tm tm_buf;
+    localtime_r(&sec, &tm_buf);
+    char buf[64];
+    size_t len = strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &tm_buf);
+    snprintf(buf + len, sizeof(buf) - len, ".%03d",
+             (int)(us / 1000 % 1000));
+    return buf;
+}
+
+int main(int argc, char** argv) {
+    std::string file;
+    std::vector<std::string> names;
+    size_t last = 0;
+    bool csv = false;
+    for (int ii = 1; ii < argc; ++ii) {
+        std::string arg = argv[ii];
+        bool has_next = (ii + 1 < argc);
+        if (arg == "--name" && has_next) {
+            names.push_back(argv[++ii]);
+        } else if (arg == "--last" && has_next) {
+            last = atoi(argv[++ii]);
+        } else if (arg == "--csv") {
+            csv = true;
+        } else if (!arg.empty() && arg[0] != '-' && file.empty()) {
+            file = arg;
+        } else {
+            usage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+    if (file.empty()) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    LatencyHistoryReader reader;
+    if (!reader.load(file)) {
+        printf("failed to load %s\n", file.c_str());
+        return 1;
+    }
+    const std::vector<LatencyHistoryRecord>& records = reader.getRecords();
+    size_t begin = (last && last < records.size())
+                   ? records.size() - last : 0;
+
+    if (csv) {
+        printf("time,interval_ms,name,calls,avg,p50,p99,p99.9,max\n");
+    } else {
+        printf("%-23s %8s  %-40s %10s %8s %8s %8s %8s %8s\n",
+               "TIME", "INTERVAL", "STAT NAME", "CALLS",
+               "AVG", "P50", "P99", "P99.9", "MAX");
+    }
+    for (size_t ii = begin; ii < records.size(); ++ii) {
+        const LatencyHistoryRecord& rec = records[ii];
+        std::string time_str = format_time(rec.stats.getTimestamp());
+        for (auto& entry: rec.stats.getStats()) {
+            const LatencySnapshotStat& stat = entry.second;
+            if (!match(stat, names)) continue;
+            uint64_t avg = (stat.numCalls)
+                           ? stat.totalTime / stat.numCalls : 0;
+            const char* fmt = (csv)
+                ? "%s,%lu,\"%s\",%lu,%lu,%lu,%lu,%lu,%lu\n"
+                : "%-23s %8lu  %-40s %10lu %8lu %8lu %8lu %8lu %8lu\n";
+            printf(fmt, time_str.c_str(), (unsigned long)rec.intervalMs,
+                   stat.name.c_str(), (unsigned long)stat.numCalls,
+                   (unsigned long)avg, (unsigned long)stat.p50,
+                   (unsigned long)stat.p99, (unsigned long)stat.p999,
+                   (unsigned long)stat.maxLatency);
+        }
+    }
+
+    if (reader.getNumCorrupted()) {
+        fprintf(stderr, "%zu corrupted record(s) skipped\n",
+                reader.getNumCorrupted());
+    }
+    return 0;
+}
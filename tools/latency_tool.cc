@@ -0,0 +1,212 @@
+#include "latency_dump.h"
+#include "latency_dump_json.h"
+#include "latency_snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Merge, filter, and render saved snapshots (see `LatencySnapshot::save()`),
+// e.g., of all hosts, or of each hour of a day:
+//
+//   $ latency_tool host*.snap --prefix "RPC" --max-depth 2 --flat
+//   $ latency_tool hour_*.snap --format snapshot -o day.snap
+//
+// Each file is read stat by stat, and only the stats passing the filters
+// are kept, so the memory is bounded by the merged result. Files are
+// merged in parallel, and then the partial results are merged together.
+
+static void usage(const char* prog) {
+    printf("Usage: %s FILE... [options]\n"
+           "  --name NAME      keep the stat of the given name or leaf "
+               "function\n"
+           "  --prefix PREFIX  keep the stats whose name or leaf function "
+               "starts with PREFIX\n"
+           "  --max-depth N    drop the call paths deeper than N levels\n"
+           "  --format FORMAT  default (default), json, or snapshot\n"
+           "  --flat           show call paths as they are, "
+               "instead of a tree\n"
+           "  --sort KEY       name (default), total, calls, or avg\n"
+           "  --threads N      number of merging threads "
+               "(default: number of cores)\n"
+           "  -o FILE          write to FILE instead of stdout\n"
+           "--name and --prefix can be given multiple times.\n",
+           prog);
+}
+
+struct StatFilter {
+    StatFilter() : max_depth(0) {}
+
+    bool match(const LatencySnapshotStat& stat) const {
+        size_t depth = stat.getNumStacks();
+        if (max_depth && depth > max_depth) return false;
+        if (names.empty() && prefixes.empty()) return true;
+
+        std::string leaf = stat.getLeaf();
+        for (const std::string& name: names) {
+            if (stat.name == name || leaf == name) return true;
+        }
+        for (const std::string& prefix: prefixes) {
+            if ( stat.name.compare(0, prefix.size(), prefix) == 0 ||
+                 leaf.compare(0, prefix.size(), prefix) == 0 ) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<std::string> names;
+    std::vector<std::string> prefixes;
+    // 0: no limit.
+    size_t max_depth;
+};
+
+// Merge the files of `files` that this worker picks up into `dst`.
+static void merge_worker(const std::vector<std::string>& files,
+                         const StatFilter& filter,
+                         std::atomic<size_t>& next_file,
+                         LatencySnapshot& dst,
+                         std::vector<std::string>& errors,
+                         std::mutex& errors_lock)
+{
+    LatencySnapshotReader reader;
+    LatencySnapshotStat stat;
+    size_t idx = 0;
+    while ( (idx = next_file.fetch_add(1)) < files.size() ) {
+        const std::string& path = files[idx];
+        bool ok = reader.open(path);
+        if (ok) {
+            dst.setTimestamp( std::max(dst.getTimestamp(),
+                                       reader.getTimestamp()) );
+            while (reader.next(stat)) {
+                if (filter.match(stat)) dst.merge(stat);
+            }
+            ok = !reader.hasError();
+        }
+        if (!ok) {
+            std::lock_guard<std::mutex> l(errors_lock);
+            errors.push_back(path);
+        }
+    }
+}
+
+static bool write_output(const std::string& path, const std::string& data) {
+    FILE* fp = (path.empty()) ? stdout : fopen(path.c_str(), "wb");
+    if (!fp) return false;
+    bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+    if (fp != stdout) ok = (fclose(fp) == 0) && ok;
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> files;
+    StatFilter filter;
+    std::string format = "default";
+    std::string output;
+    LatencyCollectorDumpOptions opt;
+    size_t num_threads = std::thread::hardware_concurrency();
+    for (int ii = 1; ii < argc; ++ii) {
+        std::string arg = argv[ii];
+        bool has_next = (ii + 1 < argc);
+        if (arg == "--name" && has_next) {
+            filter.names.push_back(argv[++ii]);
+        } else if (arg == "--prefix" && has_next) {
+            filter.prefixes.push_back(argv[++ii]);
+        } else if (arg == "--max-depth" && has_next) {
+            filter.max_depth = atoi(argv[++ii]);
+        } else if (arg == "--format" && has_next) {
+            format = argv[++ii];
+        } else if (arg == "--flat") {
+            opt.view_type = LatencyCollectorDumpOptions::FLAT;
+        } else if (arg == "--sort" && has_next) {
+            std::string key = argv[++ii];
+            if (key == "name") {
+                opt.sort_by = LatencyCollectorDumpOptions::NAME;
+            } else if (key == "total") {
+                opt.sort_by = LatencyCollectorDumpOptions::TOTAL_TIME;
+            } else if (key == "calls") {
+                opt.sort_by = LatencyCollectorDumpOptions::NUM_CALLS;
+            } else if (key == "avg") {
+                opt.sort_by = LatencyCollectorDumpOptions::AVG_LATENCY;
+            } else {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--threads" && has_next) {
+            num_threads = atoi(argv[++ii]);
+        } else if (arg == "-o" && has_next) {
+            output = argv[++ii];
+        } else if (!arg.empty() && arg[0] != '-') {
+            files.push_back(arg);
+        } else {
+            usage(argv[0]);
+            return arg == "--help" ? 0 : 1;
+        }
+    }
+    if ( files.empty() ||
+         (format != "default" && format != "json" && format != "snapshot") ) {
+        usage(argv[0]);
+        return 1;
+    }
+    num_threads = std::max((size_t)1, std::min(num_threads, files.size()));
+
+    // Each worker merges into its own snapshot.
+    std::vector<LatencySnapshot> partials(num_threads);
+    std::vector<std::string> errors;
+    std::mutex errors_lock;
+    std::atomic<size_t> next_file(0);
+    std::vector<std::thread> workers;
+    for (size_t ii = 0; ii < num_threads; ++ii) {
+        workers.push_back( std::thread( merge_worker,
+                                        std::cref(files),
+                                        std::cref(filter),
+                                        std::ref(next_file),
+                                        std::ref(partials[ii]),
+                                        std::ref(errors),
+                                        std::ref(errors_lock) ) );
+    }
+    for (std::thread& worker: workers) worker.join();
+
+    if (!errors.empty()) {
+        for (const std::string& path: errors) {
+            fprintf(stderr, "failed to load %s\n", path.c_str());
+        }
+        return 1;
+    }
+
+    LatencySnapshot& merged = partials[0];
+    for (size_t ii = 1; ii < partials.size(); ++ii) {
+        merged.merge(partials[ii]);
+        // Release as soon as merged.
+        partials[ii] = LatencySnapshot();
+    }
+
+    std::string result;
+    if (format == "snapshot") {
+        result = merged.serialize();
+    } else {
+        LatencyCollectorT<LatencySingleThreadPolicy> lat;
+        merged.restore(lat);
+        if (format == "json") {
+            LatencyDumpJsonImplT<Histogram> dump_inst;
+            result = lat.dump(&dump_inst, opt);
+        } else {
+            LatencyDumpDefaultImplT<Histogram> dump_inst;
+            result = lat.dump(&dump_inst, opt);
+        }
+    }
+
+    if (!write_output(output, result)) {
+        fprintf(stderr, "failed to write %s\n", output.c_str());
+        return 1;
+    }
+    return 0;
+}